@@ -1,5 +1,6 @@
 #include "esp_camera.h"
 #include <WiFi.h>
+#include <LittleFS.h>
 
 //
 // WARNING!!! PSRAM IC required for UXGA resolution and high JPEG quality
@@ -22,10 +23,25 @@
 const char* ssid = "Tes123wifi";
 const char* password = "txcn6914";
 
+// ===========================================
+// Gateway for push-mode uplink, "" to disable
+// ===========================================
+const char* gateway_host = "";
+const uint16_t gateway_port = 9000;
+
+// =====================================================
+// UDP listener for a copy of the serial log, "" for none
+// =====================================================
+const char* log_host = "";
+const uint16_t log_port = 9001;
+
 const byte ledPins[4] = {32, 33, 14, 12};
 const byte buzzerPin = 13;
 
-void startCameraServer();
+void startCameraServer(int fb_count);
+void startFrameUplink(const char *host, uint16_t port);
+void startAlertLog(const char *dir);
+void startLogForward(const char *host, uint16_t port);
 void setupLedFlash(int pin);
 
 void setup() {
@@ -59,26 +75,28 @@ void setup() {
   config.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
   config.fb_location = CAMERA_FB_IN_PSRAM;
   config.jpeg_quality = 12;
-  config.fb_count = 1;
+  // The frame broker keeps the newest frame until the next one arrives, so
+  // the driver needs a second buffer to capture into
+  config.fb_count = 2;
   
   // if PSRAM IC present, init with UXGA resolution and higher JPEG quality
   //                      for larger pre-allocated frame buffer.
   if(config.pixel_format == PIXFORMAT_JPEG){
     if(psramFound()){
       config.jpeg_quality = 10;
-      config.fb_count = 2;
+      // One buffer each for the frame broker's newest frame, a consumer
+      // still sending the previous one, and the driver
+      config.fb_count = 3;
       config.grab_mode = CAMERA_GRAB_LATEST;
     } else {
-      // Limit the frame size when PSRAM is not available
-      config.frame_size = FRAMESIZE_SVGA;
+      // Limit the frame size when PSRAM is not available, two VGA JPEG
+      // buffers fit in DRAM where two SVGA ones crowd out the heap
+      config.frame_size = FRAMESIZE_VGA;
       config.fb_location = CAMERA_FB_IN_DRAM;
     }
   } else {
     // Best option for face detection/recognition
     config.frame_size = FRAMESIZE_240X240;
-#if CONFIG_IDF_TARGET_ESP32S3
-    config.fb_count = 2;
-#endif
   }
 
 #if defined(CAMERA_MODEL_ESP_EYE)
@@ -133,7 +151,22 @@ void setup() {
   Serial.println("");
   Serial.println("WiFi connected");
 
-  startCameraServer();
+  // Wall clock for the alert log, records before the first sync carry
+  // time since boot
+  configTime(0, 0, "pool.ntp.org");
+
+  startCameraServer(config.fb_count);
+  if (log_host[0]) {
+    startLogForward(log_host, log_port);
+  }
+  if (LittleFS.begin(true)) {
+    startAlertLog("/littlefs/log");
+  } else {
+    Serial.println("LittleFS mount failed, alert log disabled");
+  }
+  if (gateway_host[0]) {
+    startFrameUplink(gateway_host, gateway_port);
+  }
 
   Serial.print("Camera Ready! Use 'http://");
   Serial.print(WiFi.localIP());
@@ -0,0 +1,121 @@
+#include <string.h>
+#include "alert.h"
+
+static const char *posture_labels[POSTURE_MAX] = {"BDR", "DDK", "TDR"};
+
+posture_t posture_from_label(const char *label)
+{
+    for (int i = 0; i < POSTURE_MAX; i++) {
+        if (!strncmp(label, posture_labels[i], 3)) {
+            return (posture_t)i;
+        }
+    }
+    return POSTURE_NONE;
+}
+
+const char *posture_label(posture_t posture)
+{
+    if (posture < 0 || posture >= POSTURE_MAX) {
+        return "non";
+    }
+    return posture_labels[posture];
+}
+
+void alert_init(alert_state_t *a)
+{
+    memset(a, 0, sizeof(alert_state_t));
+    a->posture = POSTURE_NONE;
+}
+
+static void alert_reset(alert_state_t *a)
+{
+    a->lying_since = 0;
+    a->timer = 0;
+    a->leds = 0;
+    a->buzzer = false;
+    a->buzzer_until = 0;
+    a->buzzer_fired = false;
+}
+
+bool alert_classify(alert_state_t *a, posture_t posture, uint8_t confidence, int64_t frame_time)
+{
+    if (frame_time < a->last_frame) {
+        if (frame_time <= a->boundary) {
+            return false;
+        }
+        if (posture != a->posture) {
+            a->boundary = frame_time;
+        } else if (frame_time < a->posture_from) {
+            // Unless motion or the buzzer restarted it, lying began with the posture
+            if (a->lying_since == a->posture_from) {
+                a->lying_since = frame_time;
+            }
+            a->posture_from = frame_time;
+        }
+        return false;
+    }
+    int64_t prev_frame = a->last_frame;
+    a->last_frame = frame_time;
+    a->confidence = confidence;
+    if (posture == a->posture) {
+        return false;
+    }
+
+    a->posture = posture;
+    a->posture_from = frame_time;
+    a->boundary = prev_frame;
+    alert_reset(a);
+    if (posture == POSTURE_TDR) {
+        a->lying_since = frame_time;
+    }
+    return true;
+}
+
+void alert_motion(alert_state_t *a, uint32_t motion, int64_t frame_time)
+{
+    a->motion = motion;
+    if (a->posture != POSTURE_TDR || motion < ALERT_MOTION_MIN || frame_time <= a->lying_since) {
+        return;
+    }
+    // Still moving, so not the "lying without movement" case yet
+    alert_reset(a);
+    a->lying_since = frame_time;
+}
+
+void alert_tick(alert_state_t *a, int64_t now)
+{
+    if (a->buzzer && now >= a->buzzer_until) {
+        a->buzzer = false;
+    }
+    if (a->posture != POSTURE_TDR || !a->lying_since) {
+        return;
+    }
+
+    int64_t steps = (now - a->lying_since) / ALERT_STEP_US;
+    if (steps < 0) {
+        steps = 0;
+    } else if (steps > ALERT_TIMER_MAX) {
+        steps = ALERT_TIMER_MAX;
+    }
+    uint8_t timer = (uint8_t)steps;
+    a->timer = timer;
+
+    uint8_t leds = 0;
+    for (int i = 0; i < ALERT_LED_COUNT; i++) {
+        if (timer >= (i + 1) * (ALERT_TIMER_MAX / ALERT_LED_COUNT)) {
+            leds |= 1 << i;
+        }
+    }
+    // All LEDs stay lit while the buzzer sounds
+    a->leds = a->buzzer ? (1 << ALERT_LED_COUNT) - 1 : leds;
+
+    if (timer == ALERT_TIMER_MAX && !a->buzzer_fired) {
+        // Sound once per lying period, then start counting again
+        a->buzzer_fired = true;
+        a->buzzer = true;
+        a->buzzer_until = now + ALERT_BUZZER_US;
+        a->alert_time = now;
+        a->lying_since = now;
+        a->timer = 0;
+    }
+}
@@ -0,0 +1,61 @@
+// Inactivity alert state machine.
+//
+// Pure logic with no Arduino or ESP-IDF dependencies. All times are in
+// microseconds on the esp_timer_get_time() clock, which is also the clock
+// camera_fb_t::timestamp is taken from, so the same code runs on a host
+// build driven by a simulated clock.
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ALERT_STEP_US      1000000 // one timer step per second of lying
+#define ALERT_TIMER_MAX    16      // steps until the buzzer fires
+#define ALERT_LED_COUNT    4       // one LED lights every ALERT_TIMER_MAX / ALERT_LED_COUNT steps
+#define ALERT_BUZZER_US    3000000 // buzzer on-time
+#define ALERT_TICK_US      100000  // period the firmware drives alert_tick() at
+#define ALERT_MOTION_MIN   100     // motion_energy() score that counts as moving
+
+typedef enum {
+    POSTURE_NONE = -1,
+    POSTURE_BDR = 0, // berdiri (standing)
+    POSTURE_DDK,     // duduk (sitting)
+    POSTURE_TDR,     // tidur (lying)
+    POSTURE_MAX
+} posture_t;
+
+typedef struct
+{
+    posture_t posture;
+    int64_t last_frame;   // timestamp of the newest applied classification
+    int64_t posture_from; // earliest frame known to show the current posture
+    int64_t boundary;     // newest frame known to show a different posture before it
+    int64_t lying_since;  // start of the current lying period, 0 when not lying
+    int64_t buzzer_until; // buzzer switches off at this time
+    int64_t alert_time;   // when the buzzer last fired, 0 if never
+    uint32_t motion;      // newest motion_energy() score
+    uint8_t confidence;   // confidence of the newest applied classification, 0..255
+    uint8_t timer;        // whole steps spent lying, 0..ALERT_TIMER_MAX
+    uint8_t leds;         // bit i set = LED i on
+    bool buzzer;          // buzzer output
+    bool buzzer_fired;    // latched until the posture changes
+} alert_state_t;
+
+posture_t posture_from_label(const char *label);
+const char *posture_label(posture_t posture);
+
+void alert_init(alert_state_t *a);
+
+// Apply a classification for the frame captured at frame_time. Returns true
+// if the posture changed. Results may arrive out of order when the gateway
+// keeps several frames in flight. A late result never overrides a newer one,
+// but one that shows the current posture earlier than known moves the start
+// of the posture, and of the lying period, back to it.
+bool alert_classify(alert_state_t *a, posture_t posture, uint8_t confidence, int64_t frame_time);
+
+// Report the motion score measured on the frame captured at frame_time.
+// Movement while lying restarts the lying period.
+void alert_motion(alert_state_t *a, uint32_t motion, int64_t frame_time);
+
+// Advance timer, LEDs and buzzer to time now. Never blocks.
+void alert_tick(alert_state_t *a, int64_t now);
@@ -0,0 +1,421 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "alert_log.h"
+
+#define LOG_INDEX_MAGIC 0x58494C41 // "ALIX"
+
+static_assert(sizeof(log_record_t) == 16, "log records are 16 bytes on disk");
+
+// Sealed segment index file: header then LOG_SEGMENT_BLOCKS ranges
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count; // records in the segment
+    uint32_t crc;   // CRC-32 of the ranges
+} log_index_header_t;
+
+static const log_range_t range_empty = {INT64_MAX, INT64_MIN};
+
+static uint8_t crc8(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static uint32_t crc32(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+static uint8_t record_crc(const log_record_t *r)
+{
+    return crc8((const uint8_t *)r, offsetof(log_record_t, crc));
+}
+
+static void range_add(log_range_t *range, int64_t t)
+{
+    range->min = t < range->min ? t : range->min;
+    range->max = t > range->max ? t : range->max;
+}
+
+static bool range_overlaps(const log_range_t *range, int64_t from, int64_t to)
+{
+    return range->min < to && range->max >= from;
+}
+
+static void seg_path(const alert_log_t *l, uint32_t seg, const char *ext, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%08x.%s", l->dir, (unsigned)seg, ext);
+}
+
+static bool index_load(const alert_log_t *l, uint32_t seg, log_range_t *index, uint32_t *count)
+{
+    char path[LOG_DIR_MAX + 16];
+    seg_path(l, seg, "idx", path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    log_index_header_t h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && fread(index, sizeof(log_range_t), LOG_SEGMENT_BLOCKS, f) ==
+              LOG_SEGMENT_BLOCKS;
+    fclose(f);
+    ok = ok && h.magic == LOG_INDEX_MAGIC && h.count <= LOG_SEGMENT_RECORDS &&
+         h.crc == crc32((const uint8_t *)index, LOG_SEGMENT_BLOCKS * sizeof(log_range_t));
+    if (ok) {
+        *count = h.count;
+    }
+    return ok;
+}
+
+static bool index_write(const alert_log_t *l, uint32_t seg, const log_range_t *index, uint32_t count)
+{
+    char path[LOG_DIR_MAX + 16];
+    seg_path(l, seg, "idx", path, sizeof(path));
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        return false;
+    }
+    log_index_header_t h = {LOG_INDEX_MAGIC, count,
+                            crc32((const uint8_t *)index, LOG_SEGMENT_BLOCKS * sizeof(log_range_t))};
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(index, sizeof(log_range_t), LOG_SEGMENT_BLOCKS, f) == LOG_SEGMENT_BLOCKS;
+    ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+    return fclose(f) == 0 && ok;
+}
+
+// Records of a segment file up to the first torn or corrupt one. Returns
+// the number of good ones, *dropped counts the 16-byte slots after them.
+static uint32_t segment_scan(const alert_log_t *l, uint32_t seg, log_range_t *index, uint32_t *dropped)
+{
+    for (int b = 0; b < LOG_SEGMENT_BLOCKS; b++) {
+        index[b] = range_empty;
+    }
+    *dropped = 0;
+    char path[LOG_DIR_MAX + 16];
+    seg_path(l, seg, "log", path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    uint32_t count = 0;
+    log_record_t r;
+    size_t n;
+    bool good = true;
+    while ((n = fread(&r, 1, sizeof(r), f)) > 0) {
+        if (good && n == sizeof(r) && r.crc == record_crc(&r) && count < LOG_SEGMENT_RECORDS) {
+            range_add(&index[count / LOG_BLOCK_RECORDS], r.time_us);
+            count++;
+        } else {
+            good = false;
+            (*dropped)++;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+static void seg_summary(alert_log_t *l, uint32_t seg, const log_range_t *index, uint32_t count)
+{
+    log_range_t range = range_empty;
+    for (uint32_t b = 0; b * LOG_BLOCK_RECORDS < count; b++) {
+        range_add(&range, index[b].min);
+        range_add(&range, index[b].max);
+    }
+    l->seg_range[seg % LOG_SEGMENTS_MAX] = range;
+    l->seg_count[seg % LOG_SEGMENTS_MAX] = count;
+}
+
+static bool segment_open(alert_log_t *l)
+{
+    char path[LOG_DIR_MAX + 16];
+    seg_path(l, l->active_seg, "log", path, sizeof(path));
+    l->active = fopen(path, "ab");
+    return l->active != NULL;
+}
+
+static void segment_delete(alert_log_t *l, uint32_t seg)
+{
+    char path[LOG_DIR_MAX + 16];
+    seg_path(l, seg, "log", path, sizeof(path));
+    remove(path);
+    seg_path(l, seg, "idx", path, sizeof(path));
+    remove(path);
+}
+
+// Seal the active segment with its index and start the next one
+static bool segment_rotate(alert_log_t *l)
+{
+    if (l->active) {
+        fclose(l->active);
+        l->active = NULL;
+    }
+    if (!index_write(l, l->active_seg, l->active_index, l->active_count)) {
+        return false;
+    }
+    seg_summary(l, l->active_seg, l->active_index, l->active_count);
+    l->active_seg++;
+    l->active_count = 0;
+    for (int b = 0; b < LOG_SEGMENT_BLOCKS; b++) {
+        l->active_index[b] = range_empty;
+    }
+    while (l->active_seg - l->first_seg >= LOG_SEGMENTS_MAX) {
+        segment_delete(l, l->first_seg++);
+    }
+    seg_summary(l, l->active_seg, l->active_index, 0);
+    return segment_open(l);
+}
+
+static uint16_t boot_next(const alert_log_t *l)
+{
+    char path[LOG_DIR_MAX + 8];
+    snprintf(path, sizeof(path), "%s/boot", l->dir);
+    uint16_t boot = 0;
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        if (fread(&boot, sizeof(boot), 1, f) != 1) {
+            boot = 0;
+        }
+        fclose(f);
+    }
+    boot++;
+    f = fopen(path, "wb");
+    if (f) {
+        fwrite(&boot, sizeof(boot), 1, f);
+        fclose(f);
+    }
+    return boot;
+}
+
+bool alert_log_open(alert_log_t *l, const char *dir)
+{
+    memset(l, 0, sizeof(alert_log_t));
+    strncpy(l->dir, dir, sizeof(l->dir) - 1);
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        return false;
+    }
+    bool any = false;
+    uint32_t first = 0, last = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        char *end;
+        unsigned long seg = strtoul(e->d_name, &end, 16);
+        if (end != e->d_name + 8 || strcmp(end, ".log")) {
+            continue;
+        }
+        first = !any || seg < first ? seg : first;
+        last = !any || seg > last ? seg : last;
+        any = true;
+    }
+    closedir(d);
+    l->boot = boot_next(l);
+
+    // Keep the newest LOG_SEGMENTS_MAX, each sealed one with a valid index
+    while (last - first >= LOG_SEGMENTS_MAX) {
+        segment_delete(l, first++);
+    }
+    l->first_seg = first;
+    l->active_seg = last;
+    log_range_t index[LOG_SEGMENT_BLOCKS];
+    for (uint32_t seg = first; seg < last; seg++) {
+        uint32_t count, dropped;
+        if (!index_load(l, seg, index, &count)) {
+            count = segment_scan(l, seg, index, &dropped);
+            index_write(l, seg, index, count);
+        }
+        seg_summary(l, seg, index, count);
+    }
+
+    // The newest one may have been cut short mid-write
+    uint32_t dropped;
+    l->active_count = segment_scan(l, last, l->active_index, &dropped);
+    l->recovered = dropped;
+    seg_summary(l, last, l->active_index, l->active_count);
+    if (dropped || l->active_count + LOG_BATCH_RECORDS > LOG_SEGMENT_RECORDS) {
+        return segment_rotate(l);
+    }
+    return segment_open(l);
+}
+
+void alert_log_close(alert_log_t *l)
+{
+    alert_log_flush(l);
+    if (l->active) {
+        fclose(l->active);
+        l->active = NULL;
+    }
+}
+
+bool alert_log_append(alert_log_t *l, log_record_t *r)
+{
+    r->boot = l->boot;
+    r->crc = record_crc(r);
+    if (l->batch_count == LOG_BATCH_RECORDS) {
+        // The caller didn't flush, drop the oldest queued record
+        memmove(l->batch, l->batch + 1, sizeof(log_record_t) * (LOG_BATCH_RECORDS - 1));
+        l->batch_count--;
+    }
+    l->batch[l->batch_count++] = *r;
+    return l->batch_count == LOG_BATCH_RECORDS;
+}
+
+bool alert_log_flush(alert_log_t *l)
+{
+    if (!l->batch_count) {
+        return true;
+    }
+    if (!l->active) {
+        return false;
+    }
+    size_t n = l->batch_count;
+    bool ok = fwrite(l->batch, sizeof(log_record_t), n, l->active) == n;
+    ok = fflush(l->active) == 0 && fsync(fileno(l->active)) == 0 && ok;
+    if (!ok) {
+        // Whatever part landed is dropped as corrupt on the next open
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        range_add(&l->active_index[(l->active_count + i) / LOG_BLOCK_RECORDS], l->batch[i].time_us);
+    }
+    l->active_count += n;
+    l->batch_count = 0;
+    l->flushes++;
+    l->bytes_written += n * sizeof(log_record_t);
+    seg_summary(l, l->active_seg, l->active_index, l->active_count);
+    if (l->active_count + LOG_BATCH_RECORDS > LOG_SEGMENT_RECORDS) {
+        return segment_rotate(l);
+    }
+    return true;
+}
+
+void alert_log_query_begin(const alert_log_t *l, alert_log_query_t *q, int64_t from, int64_t to)
+{
+    q->from = from;
+    q->to = to;
+    q->seg = l->first_seg;
+    q->record = 0;
+    q->loaded_seg = UINT32_MAX;
+    q->count = 0;
+    q->done = false;
+}
+
+static size_t match(const alert_log_query_t *q, const log_record_t *in, size_t n, log_record_t *out)
+{
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (in[i].time_us >= q->from && in[i].time_us < q->to && in[i].crc == record_crc(&in[i])) {
+            out[m++] = in[i];
+        }
+    }
+    return m;
+}
+
+size_t alert_log_query_next(const alert_log_t *l, alert_log_query_t *q, log_record_t *out, size_t max)
+{
+    size_t found = 0;
+    FILE *f = NULL;
+    uint32_t f_seg = UINT32_MAX;
+    while (!q->done && !found && max) {
+        if (q->seg < l->first_seg) {
+            // Rotated away since the last call
+            q->seg = l->first_seg;
+            q->record = 0;
+        }
+        bool active = q->seg == l->active_seg;
+        const log_range_t *index;
+        uint32_t count;
+        if (active) {
+            index = l->active_index;
+            count = l->active_count;
+        } else {
+            if (q->loaded_seg != q->seg) {
+                bool summary = range_overlaps(&l->seg_range[q->seg % LOG_SEGMENTS_MAX], q->from, q->to);
+                if (!summary || !index_load(l, q->seg, q->index, &q->count)) {
+                    q->seg++;
+                    q->record = 0;
+                    continue;
+                }
+                q->loaded_seg = q->seg;
+            }
+            index = q->index;
+            count = q->count;
+        }
+
+        if (q->record >= count) {
+            if (!active) {
+                q->seg++;
+                q->record = 0;
+                continue;
+            }
+            // Past the written records: the queued batch, then the end
+            uint32_t i = q->record - count;
+            if (i < l->batch_count) {
+                size_t n = l->batch_count - i < max ? l->batch_count - i : max;
+                found = match(q, l->batch + i, n, out);
+                q->record += n;
+            } else {
+                q->done = true;
+            }
+            continue;
+        }
+
+        uint32_t block = q->record / LOG_BLOCK_RECORDS;
+        uint32_t block_end = (block + 1) * LOG_BLOCK_RECORDS;
+        block_end = block_end < count ? block_end : count;
+        if (!range_overlaps(&index[block], q->from, q->to)) {
+            q->record = block_end;
+            continue;
+        }
+        if (f_seg != q->seg) {
+            if (f) {
+                fclose(f);
+            }
+            char path[LOG_DIR_MAX + 16];
+            seg_path(l, q->seg, "log", path, sizeof(path));
+            f = fopen(path, "rb");
+            f_seg = q->seg;
+        }
+        // Read into out and keep the matches in place
+        size_t n = block_end - q->record < max ? block_end - q->record : max;
+        if (!f || fseek(f, (long)q->record * sizeof(log_record_t), SEEK_SET) ||
+            fread(out, sizeof(log_record_t), n, f) != n) {
+            q->record = block_end;
+            continue;
+        }
+        found = match(q, out, n, out);
+        q->record += n;
+    }
+    if (f) {
+        fclose(f);
+    }
+    return found;
+}
+
+uint32_t alert_log_disk_bytes(const alert_log_t *l)
+{
+    uint32_t bytes = 0;
+    for (uint32_t seg = l->first_seg; seg <= l->active_seg; seg++) {
+        bytes += l->seg_count[seg % LOG_SEGMENTS_MAX] * sizeof(log_record_t);
+        if (seg != l->active_seg) {
+            bytes += sizeof(log_index_header_t) + LOG_SEGMENT_BLOCKS * sizeof(log_range_t);
+        }
+    }
+    return bytes;
+}
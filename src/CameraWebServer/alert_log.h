@@ -0,0 +1,107 @@
+// Append-only log of alert state changes on the flash filesystem.
+//
+// No Arduino or ESP-IDF dependencies: the firmware mounts LittleFS into the
+// VFS and this code uses plain stdio on a directory, so the host build runs
+// it against a local one. Records are fixed-size with a CRC each. They are
+// batched in RAM and written LOG_BATCH_RECORDS at a time to limit flash
+// wear, into numbered segment files of LOG_SEGMENT_RECORDS. A full segment
+// is sealed with an index file holding the time range of every block of
+// LOG_BLOCK_RECORDS, so time-range queries read only the blocks that
+// overlap. The oldest segments are deleted past LOG_SEGMENTS_MAX.
+//
+// After power loss the newest segment is scanned on open: records up to
+// the first torn or corrupt one are kept and the segment is sealed there,
+// appends continue in a new one. At most the unwritten batch is lost.
+//
+// Not thread safe, callers serialise every call.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define LOG_BATCH_RECORDS   32   // records written per flush
+#define LOG_BLOCK_RECORDS   64   // records per index entry
+#define LOG_SEGMENT_BLOCKS  64
+#define LOG_SEGMENT_RECORDS (LOG_BLOCK_RECORDS * LOG_SEGMENT_BLOCKS)
+#define LOG_SEGMENTS_MAX    16   // 64 KiB each
+#define LOG_DIR_MAX         48
+
+#define LOG_FLAG_LYING      0x01
+#define LOG_FLAG_BUZZER     0x02
+#define LOG_FLAG_FIRED      0x04 // buzzer fired during this lying period
+#define LOG_FLAG_LOCAL      0x08 // posture from the on-device classifier
+
+#define LOG_POSTURE_NONE    0xFF
+
+typedef struct __attribute__((packed))
+{
+    int64_t time_us; // wall clock, time since boot until it is set
+    uint16_t boot;   // incremented every alert_log_open()
+    uint16_t motion; // motion_energy() score, saturated
+    uint8_t posture; // posture_t, LOG_POSTURE_NONE for none
+    uint8_t timer;
+    uint8_t flags;   // LOG_FLAG_*
+    uint8_t crc;     // CRC-8 of the bytes before it
+} log_record_t;
+
+typedef struct
+{
+    int64_t min;
+    int64_t max;
+} log_range_t;
+
+typedef struct
+{
+    char dir[LOG_DIR_MAX];
+    uint16_t boot;
+    uint32_t first_seg; // oldest segment on disk
+    uint32_t active_seg;
+    FILE *active;
+    uint32_t active_count;                    // records written to the active segment
+    log_range_t active_index[LOG_SEGMENT_BLOCKS];
+    log_range_t seg_range[LOG_SEGMENTS_MAX];  // by segment number % LOG_SEGMENTS_MAX
+    uint32_t seg_count[LOG_SEGMENTS_MAX];
+    log_record_t batch[LOG_BATCH_RECORDS];    // queued after the active segment's records
+    uint32_t batch_count;
+    uint32_t flushes;
+    uint32_t bytes_written;
+    uint32_t recovered;                       // corrupt records dropped by the last open
+} alert_log_t;
+
+typedef struct
+{
+    int64_t from; // inclusive
+    int64_t to;   // exclusive
+    uint32_t seg;
+    uint32_t record;                          // next record in seg
+    uint32_t loaded_seg;                      // sealed segment index holds, UINT32_MAX for none
+    uint32_t count;
+    log_range_t index[LOG_SEGMENT_BLOCKS];
+    bool done;
+} alert_log_query_t;
+
+// Open or create the log in dir, which must exist. Recovers after power loss.
+bool alert_log_open(alert_log_t *l, const char *dir);
+
+void alert_log_close(alert_log_t *l);
+
+// Fill in the boot number and CRC and queue the record. Returns true when
+// the batch is full and should be flushed.
+bool alert_log_append(alert_log_t *l, log_record_t *r);
+
+// Write the queued records. A segment is sealed once it can't take another
+// full batch, so a batch never spans two.
+bool alert_log_flush(alert_log_t *l);
+
+void alert_log_query_begin(const alert_log_t *l, alert_log_query_t *q, int64_t from, int64_t to);
+
+// Next records with from <= time_us < to in log order, at most max, 0 at
+// the end. Only blocks whose index range overlaps are read, a chunk at a
+// time, so memory use doesn't grow with the log. The log may be appended
+// to between calls.
+size_t alert_log_query_next(const alert_log_t *l, alert_log_query_t *q, log_record_t *out, size_t max);
+
+// Bytes the log takes on disk
+uint32_t alert_log_disk_bytes(const alert_log_t *l);
@@ -3,20 +3,44 @@
 #include "esp_timer.h"
 #include "esp_camera.h"
 #include "img_converters.h"
+#include "esp_jpg_decode.h"
 #include "fb_gfx.h"
 #include "esp32-hal-ledc.h"
 #include "sdkconfig.h"
 #include "camera_index.h"
+#include "esp_heap_caps.h"
+#include "lwip/sockets.h"
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "freertos/semphr.h"
+#include "alert.h"
+#include "alert_log.h"
+#include "buf_pool.h"
+#include "burst.h"
+#include "cnn.h"
+#include "event_ring.h"
+#include "frame_broker.h"
+#include "frame_hash.h"
+#include "img_resize.h"
+#include "jpeg_enc.h"
+#include "metrics.h"
+#include "motion.h"
+#include "protocol.h"
+#include "push.h"
+#include "query.h"
+#include "rate_ctl.h"
+#include "sampler.h"
+#include "serial_log.h"
+#include "status_cache.h"
+#include "trace.h"
+#include "uplink.h"
 
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
 #include "esp32-hal-log.h"
 #endif
 
 // Global variables
-static char current_status[4] = "non";
-static uint8_t timer = 0;
 static bool gpio_initialized = false;
-static bool buzzer_active = false;
 
 // GPIO pins
 //const gpio_num_t led_pins[4] = {GPIO_NUM_32, GPIO_NUM_14, GPIO_NUM_33, GPIO_NUM_12};
@@ -29,12 +53,14 @@ typedef struct
 {
     httpd_req_t *req;
     size_t len;
+    int64_t send_us; // time spent in httpd_resp_send_chunk
 } jpg_chunking_t;
 
 #define PART_BOUNDARY "123456789000000000000987654321"
 static const char *_STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
 static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\n\r\n";
+static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\nX-Sequence: %u\r\n"
+                                   "X-Quality: %u\r\nX-Framesize: %u\r\nX-Interval: %u\r\n\r\n";
 
 httpd_handle_t stream_httpd = NULL;
 httpd_handle_t camera_httpd = NULL;
@@ -48,17 +74,16 @@ typedef struct
     int *values; //array to be filled with values
 } ra_filter_t;
 
+#define RA_FILTER_SAMPLES 20
+
 static ra_filter_t ra_filter;
+static int ra_filter_values[RA_FILTER_SAMPLES];
 
-static ra_filter_t *ra_filter_init(ra_filter_t *filter, size_t sample_size)
+static ra_filter_t *ra_filter_init(ra_filter_t *filter, int *values, size_t sample_size)
 {
     memset(filter, 0, sizeof(ra_filter_t));
 
-    filter->values = (int *)malloc(sample_size * sizeof(int));
-    if (!filter->values)
-    {
-        return NULL;
-    }
+    filter->values = values;
     memset(filter->values, 0, sample_size * sizeof(int));
 
     filter->size = sample_size;
@@ -85,6 +110,501 @@ static int ra_filter_run(ra_filter_t *filter, int value)
 }
 #endif
 
+// Alert engine state. classify_handler feeds it, a periodic esp_timer
+// advances it and drives the LEDs and buzzer, so no HTTP handler waits on it.
+// The sampling schedule follows it and shares its lock.
+static alert_state_t alert_state;
+static sampler_t sampler;
+static portMUX_TYPE alert_mux = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t alert_timer = NULL;
+static int64_t last_capture_time = 0;
+
+// Latency traces of recent frames and alerts. Guarded by alert_mux like
+// last_capture_time.
+static trace_log_t traces;
+
+// Frames recently handed out, so a result can name its frame by sequence
+// number. Apart from the traces, whose ring burst and local classifier
+// results also fill. Guarded by alert_mux.
+#define SERVED_FRAMES 16
+
+typedef struct
+{
+    uint32_t seq;
+    int64_t frame_time;
+} served_frame_t;
+
+static served_frame_t served_frames[SERVED_FRAMES];
+static size_t served_next = 0;
+
+// Last word from the gateway, a result or a /cycle poll without one, and
+// whether the newest applied result came from the local classifier.
+// Guarded by alert_mux.
+static int64_t gateway_result_at = 0;
+static bool result_local = false;
+
+// Burst capture, see the burst section further down. Classifications and
+// motion ask for a burst under alert_mux and wake burst_task once they have
+// left it; the burst itself is guarded by burst_lock.
+static bool burst_pending = false;
+static burst_reason_t burst_pending_reason = BURST_POSTURE;
+static int64_t burst_pending_at = 0;
+static SemaphoreHandle_t burst_wake = NULL;
+static SemaphoreHandle_t burst_lock = NULL;
+static burst_t burst;
+
+// WebSocket subscribers, see the push section further down. Whatever may
+// have changed something they are told about wakes ws_task.
+static SemaphoreHandle_t ws_wake = NULL;
+static uint8_t ws_count = 0;
+
+// State changes the alert timer saw, waiting for the log task. Guarded by
+// alert_mux, log_pending_on is set once the log is open.
+#define LOG_PENDING 16
+
+static log_record_t log_pending[LOG_PENDING];
+static size_t log_pending_count = 0;
+static uint32_t log_pending_dropped = 0;
+static bool log_pending_on = false;
+static bool log_urgent = false; // the buzzer fired, write it out now
+static alert_state_t log_seen;  // state of the last record queued
+static uint8_t alert_leds_out = 0;
+static bool alert_buzzer_out = false;
+
+static int64_t fb_time_us(const camera_fb_t *fb)
+{
+    return (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+}
+
+static alert_state_t alert_snapshot(void)
+{
+    alert_state_t snapshot;
+    portENTER_CRITICAL(&alert_mux);
+    snapshot = alert_state;
+    portEXIT_CRITICAL(&alert_mux);
+    return snapshot;
+}
+
+// When the gateway should classify the next frame, also the uplink's
+// uplink_schedule_cb_t
+static int64_t sample_deadline(void)
+{
+    portENTER_CRITICAL(&alert_mux);
+    int64_t deadline = sampler_deadline(&sampler);
+    portEXIT_CRITICAL(&alert_mux);
+    return deadline;
+}
+
+// Ask burst_task for a burst, called with alert_mux held. True if the task
+// needs waking once the lock is released.
+static bool burst_request(burst_reason_t reason, int64_t now)
+{
+    if (!burst_wake || burst_pending) {
+        return false;
+    }
+    burst_pending = true;
+    burst_pending_reason = reason;
+    burst_pending_at = now;
+    return true;
+}
+
+// X-Burst: "id,frames" while a recorded burst waits to be pulled. value
+// must outlive the response.
+static void burst_header(httpd_req_t *req, char *value, size_t len)
+{
+    if (!burst_lock) {
+        return;
+    }
+    xSemaphoreTake(burst_lock, portMAX_DELAY);
+    bool waiting = burst.state == BURST_READY && !burst.pulled;
+    if (waiting) {
+        snprintf(value, len, "%u,%u", burst.id, (unsigned)burst.ring.count);
+    }
+    xSemaphoreGive(burst_lock);
+    if (waiting) {
+        httpd_resp_set_hdr(req, "X-Burst", value);
+    }
+}
+
+// Wake ws_task to look for changes. The unlocked read of ws_count can only
+// miss a subscriber joining right now, and ws_join wakes ws_task itself.
+static void ws_notify(void)
+{
+    if (ws_wake && ws_count) {
+        xSemaphoreGive(ws_wake);
+    }
+}
+
+static uint32_t sample_due_ms(void)
+{
+    int64_t left = sample_deadline() - esp_timer_get_time();
+    return left > 0 ? (uint32_t)(left / 1000) : 0;
+}
+
+static void alert_outputs_update(const alert_state_t *a)
+{
+    // Only called from the esp_timer task, so the output shadow needs no lock
+    if (a->leds != alert_leds_out) {
+        for (int i = 0; i < ALERT_LED_COUNT; i++) {
+            digitalWrite(ledPins[i], (a->leds >> i) & 1 ? HIGH : LOW);
+        }
+        if (!alert_leds_out) {
+            int64_t now = esp_timer_get_time();
+            portENTER_CRITICAL(&alert_mux);
+            trace_leds_on(&traces, now);
+            portEXIT_CRITICAL(&alert_mux);
+        }
+        alert_leds_out = a->leds;
+    }
+    if (a->buzzer != alert_buzzer_out) {
+        digitalWrite(buzzerPin, a->buzzer ? HIGH : LOW);
+        if (a->buzzer) {
+            int64_t now = esp_timer_get_time();
+            int64_t stages[TRACE_ALERT_STAGES];
+            portENTER_CRITICAL(&alert_mux);
+            const trace_alert_t *traced = trace_actuated(&traces, now);
+            if (traced) {
+                trace_alert_stages(traced, stages);
+            }
+            portEXIT_CRITICAL(&alert_mux);
+            if (traced) {
+                metrics_observe(METRIC_ALERT_DELAY, stages[TRACE_ALERT_TOTAL] - stages[TRACE_ALERT_HOLD]);
+            }
+        }
+        slog(SLOG_BUZZER, a->buzzer ? "On" : "Off");
+        alert_buzzer_out = a->buzzer;
+    }
+}
+
+// Queue a log record when the posture, timer or buzzer changed since the
+// last one. Classifications change the posture between ticks, so compare
+// with what was logged rather than with the previous tick. Called with
+// alert_mux held.
+static void alert_log_change(const alert_state_t *a)
+{
+    const alert_state_t *prev = &log_seen;
+    if (!log_pending_on ||
+        (a->posture == prev->posture && a->timer == prev->timer && a->buzzer == prev->buzzer)) {
+        return;
+    }
+    if (log_pending_count == LOG_PENDING) {
+        log_pending_dropped++;
+        return;
+    }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    log_record_t *r = &log_pending[log_pending_count++];
+    r->time_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    r->motion = a->motion > UINT16_MAX ? UINT16_MAX : a->motion;
+    r->posture = a->posture == POSTURE_NONE ? LOG_POSTURE_NONE : a->posture;
+    r->timer = a->timer;
+    r->flags = (a->lying_since ? LOG_FLAG_LYING : 0) | (a->buzzer ? LOG_FLAG_BUZZER : 0) |
+               (a->buzzer_fired ? LOG_FLAG_FIRED : 0) | (result_local ? LOG_FLAG_LOCAL : 0);
+    log_urgent |= a->buzzer && !prev->buzzer;
+    log_seen = *a;
+}
+
+static void alert_timer_cb(void *arg)
+{
+    // What subscribers were last woken for, only touched here
+    static push_state_t pushed;
+
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&alert_mux);
+    alert_tick(&alert_state, now);
+    if (alert_state.alert_time == now) {
+        trace_fired(&traces, now);
+    }
+    trace_lying(&traces, alert_state.lying_since);
+    alert_state_t snapshot = alert_state;
+    alert_log_change(&snapshot);
+    push_state_t state;
+    push_state_from(&state, &snapshot, result_local);
+    portEXIT_CRITICAL(&alert_mux);
+    alert_outputs_update(&snapshot);
+    if (push_state_changed(&pushed, &state)) {
+        pushed = state;
+        ws_notify();
+    }
+}
+
+static esp_err_t alert_start(void)
+{
+    alert_init(&alert_state);
+    sampler_init(&sampler);
+    trace_init(&traces);
+
+    esp_timer_create_args_t args = {};
+    args.callback = alert_timer_cb;
+    args.name = "alert";
+    esp_err_t err = esp_timer_create(&args, &alert_timer);
+    if (err == ESP_OK) {
+        err = esp_timer_start_periodic(alert_timer, ALERT_TICK_US);
+    }
+    return err;
+}
+
+#define CAPTURE_TIMEOUT_MS 2000 // longest a handler waits for a fresh frame
+
+#define MODEL_INPUT_W      224 // ResNet101 input geometry used by resweb.py
+#define MODEL_INPUT_H      224
+#define MODEL_JPEG_QUALITY 90
+
+typedef enum {
+    CAPTURE_FRAME,        // the frame as captured
+    CAPTURE_MODEL_JPEG,   // resized to the model input, as JPEG
+    CAPTURE_MODEL_TENSOR, // resized to the model input, raw H x W x 3 uint8 RGB
+} capture_mode_t;
+
+typedef struct
+{
+    capture_mode_t mode;
+    bool center_crop; // crop to a centred square instead of squashing the whole frame
+    bool hash;        // send X-Frame-Hash
+    bool conditional; // answer 304 if the frame is within threshold bits of since
+    uint64_t since;
+    int threshold;
+} capture_opts_t;
+
+// Buffer pool (buf_pool.h) for the buffers that come and go with requests,
+// stream sessions and frame size changes, carved at boot so weeks of them
+// can't fragment the heap. The JPEG and frame classes are in PSRAM and
+// left out on boards without it. What the pool can't serve comes from the
+// heap as before, and counts as a pool failure on /metrics.
+#define POOL_REQUEST_SIZE  (4 * 1024)   // JSON bodies, trace copies, the RGB565 encoder
+#define POOL_REQUEST_COUNT 6
+#define POOL_JPEG_SIZE     (96 * 1024)  // compressed frames
+#define POOL_JPEG_COUNT    6            // BROADCAST_FRAMES and two stream sessions
+#define POOL_FRAME_SIZE    (256 * 1024) // decoded and resized frames, VGA at 1/2 as RGB888
+#define POOL_FRAME_COUNT   3
+
+static buf_pool_t pool;
+static portMUX_TYPE pool_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void pool_start(void)
+{
+    static const struct
+    {
+        const char *name;
+        size_t size;
+        uint32_t count;
+        uint32_t caps;
+    } classes[] = {
+        {"request", POOL_REQUEST_SIZE, POOL_REQUEST_COUNT, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT},
+        {"jpeg", POOL_JPEG_SIZE, POOL_JPEG_COUNT, MALLOC_CAP_SPIRAM},
+        {"frame", POOL_FRAME_SIZE, POOL_FRAME_COUNT, MALLOC_CAP_SPIRAM},
+    };
+    buf_pool_init(&pool);
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        size_t len = buf_pool_arena_size(classes[i].size, classes[i].count);
+        uint8_t *arena = (uint8_t *)heap_caps_malloc(len, classes[i].caps);
+        if (!arena || !buf_pool_add(&pool, classes[i].name, arena, classes[i].size, classes[i].count)) {
+            log_w("No %s buffer pool, its buffers come from the heap", classes[i].name);
+            heap_caps_free(arena);
+        }
+    }
+}
+
+// A buffer of at least len bytes, its size in *cap if cap isn't NULL.
+// Heap buffers get a quarter more, so one that grows with the frames
+// isn't replaced for every frame.
+static void *buf_alloc(size_t len, size_t *cap)
+{
+    portENTER_CRITICAL(&pool_mux);
+    void *buf = buf_pool_alloc(&pool, len, cap);
+    portEXIT_CRITICAL(&pool_mux);
+    if (!buf) {
+        len += len / 4;
+        buf = heap_caps_malloc(len, MALLOC_CAP_SPIRAM);
+        if (!buf) {
+            buf = malloc(len);
+        }
+        if (cap) {
+            *cap = buf ? len : 0;
+        }
+    }
+    return buf;
+}
+
+static void buf_free(void *buf)
+{
+    if (!buf) {
+        return;
+    }
+    portENTER_CRITICAL(&pool_mux);
+    bool pooled = buf_pool_owns(&pool, buf);
+    if (pooled) {
+        buf_pool_free(&pool, buf);
+    }
+    portEXIT_CRITICAL(&pool_mux);
+    if (!pooled) {
+        heap_caps_free(buf);
+    }
+}
+
+// Grow *buf to hold len bytes
+static bool scratch_reserve(uint8_t **buf, size_t *cap, size_t len)
+{
+    if (len <= *cap) {
+        return true;
+    }
+    buf_free(*buf);
+    *buf = (uint8_t *)buf_alloc(len, cap);
+    return *buf != NULL;
+}
+
+typedef struct
+{
+    const uint8_t *src;
+    size_t src_len;
+    uint8_t *out;
+    size_t out_len;
+    int width;
+    int height;
+} jpg_rgb_decoder_t;
+
+static size_t jpg_rgb_read(void *arg, size_t index, uint8_t *buf, size_t len)
+{
+    jpg_rgb_decoder_t *d = (jpg_rgb_decoder_t *)arg;
+    if (index + len > d->src_len) {
+        len = d->src_len - index;
+    }
+    if (buf) {
+        memcpy(buf, d->src + index, len);
+    }
+    return len;
+}
+
+static bool jpg_rgb_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+    jpg_rgb_decoder_t *d = (jpg_rgb_decoder_t *)arg;
+    if (!data) {
+        // Start and end of the image, w and h are the output size
+        if (!x && !y && w && h) {
+            d->width = w;
+            d->height = h;
+            return (size_t)w * h * 3 <= d->out_len;
+        }
+        return true;
+    }
+    for (int row = 0; row < h; row++) {
+        memcpy(d->out + ((size_t)(y + row) * d->width + x) * 3, data + (size_t)row * w * 3, (size_t)w * 3);
+    }
+    return true;
+}
+
+// Decode a JPEG frame to tightly packed R,G,B at 1/2^scale size
+static bool jpg_decode_rgb888(camera_fb_t *fb, jpg_scale_t scale, uint8_t *out, size_t out_len, int *width, int *height)
+{
+    jpg_rgb_decoder_t d = {fb->buf, fb->len, out, out_len, 0, 0};
+    if (esp_jpg_decode(fb->len, scale, jpg_rgb_read, jpg_rgb_write, &d) != ESP_OK) {
+        return false;
+    }
+    *width = d.width;
+    *height = d.height;
+    return true;
+}
+
+// Coarsest decoder scale that keeps the frame at least min_w x min_h
+static jpg_scale_t jpg_scale_for(camera_fb_t *fb, int min_w, int min_h)
+{
+    int scale = JPG_SCALE_8X;
+    while (scale > JPG_SCALE_NONE && ((int)(fb->width >> scale) < min_w || (int)(fb->height >> scale) < min_h)) {
+        scale--;
+    }
+    return (jpg_scale_t)scale;
+}
+
+// Motion analysis. The capture task reduces published frames to a grayscale
+// grid and compares each with the previous analysed one, the score feeds the
+// alert engine. Rate limited to keep the capture task at the sensor frame rate.
+#define MOTION_INTERVAL_US 200000
+
+static uint8_t motion_prev[MOTION_GRID_SIZE];
+static bool motion_have_prev = false;
+static int64_t motion_last_frame = 0;
+static uint8_t *motion_scratch = NULL;
+static size_t motion_scratch_len = 0;
+
+// frame_hash() of the newest analysed frame, so a conditional capture of
+// that frame needn't decode it again, and its capture time for the frame
+// events. Guarded by alert_mux.
+static uint32_t motion_hash_seq = 0;
+static uint64_t motion_hash = 0;
+static int64_t motion_hash_time = 0;
+
+// Region of interest for the RGB565 encoder: the grid cells that changed at
+// the last analysis that saw motion, and when. Someone lying still is the
+// subject too, so the region holds for ROI_HOLD_US; after that the whole
+// frame is encoded at full quality again. Guarded by alert_mux.
+#define ROI_HOLD_US            10000000
+#define ROI_MARGIN             1  // grid cells around the changed ones
+#define ROI_BACKGROUND_QUALITY 30 // encoder quality outside the region
+
+static img_rect_t motion_roi;
+static int64_t motion_roi_time = 0;
+
+// Decodes into *scratch, which must belong to the calling task
+static bool motion_grid_from_fb(camera_fb_t *fb, uint8_t *grid, uint8_t **scratch, size_t *scratch_len)
+{
+    if (fb->format == PIXFORMAT_RGB565) {
+        return motion_grid_rgb565(fb->buf, fb->width, fb->height, grid);
+    }
+    if (fb->format == PIXFORMAT_GRAYSCALE) {
+        return motion_grid_gray(fb->buf, fb->width, fb->height, grid);
+    }
+    if (fb->format != PIXFORMAT_JPEG) {
+        return false;
+    }
+
+    // Decode at the coarsest scale that still covers the grid
+    jpg_scale_t scale = jpg_scale_for(fb, MOTION_GRID_W, MOTION_GRID_H);
+    size_t len = (size_t)(fb->width >> scale) * (fb->height >> scale) * 3;
+    int w, h;
+    return scratch_reserve(scratch, scratch_len, len) && jpg_decode_rgb888(fb, scale, *scratch, *scratch_len, &w, &h) &&
+           motion_grid_rgb888(*scratch, w, h, grid);
+}
+
+// broker_frame_cb_t, runs in the capture task
+static void motion_on_frame(camera_fb_t *fb, uint32_t seq)
+{
+    int64_t frame_time = fb_time_us(fb);
+    if (frame_time - motion_last_frame < MOTION_INTERVAL_US) {
+        return;
+    }
+
+    uint8_t grid[MOTION_GRID_SIZE];
+    if (!motion_grid_from_fb(fb, grid, &motion_scratch, &motion_scratch_len)) {
+        log_e("Motion analysis failed");
+        return;
+    }
+    uint32_t score = motion_have_prev ? motion_energy(motion_prev, grid) : 0;
+    img_rect_t roi;
+    bool moved = score && motion_bounds(motion_prev, grid, &roi.x, &roi.y, &roi.w, &roi.h);
+    memcpy(motion_prev, grid, sizeof(motion_prev));
+    motion_have_prev = true;
+    motion_last_frame = frame_time;
+    uint64_t hash = frame_hash(grid);
+
+    portENTER_CRITICAL(&alert_mux);
+    motion_hash_seq = seq;
+    motion_hash = hash;
+    motion_hash_time = frame_time;
+    if (moved) {
+        motion_roi = roi;
+        motion_roi_time = frame_time;
+    }
+    alert_motion(&alert_state, score, frame_time);
+    trace_lying(&traces, alert_state.lying_since);
+    sampler_motion(&sampler, score, frame_time);
+    bool wake = score >= BURST_MOTION_MIN && burst_request(BURST_MOTION, frame_time);
+    portEXIT_CRITICAL(&alert_mux);
+    if (wake) {
+        xSemaphoreGive(burst_wake);
+    }
+    ws_notify();
+}
+
 static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_t len)
 {
     jpg_chunking_t *j = (jpg_chunking_t *)arg;
@@ -92,106 +612,834 @@ static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_
     {
         j->len = 0;
     }
+    int64_t start = esp_timer_get_time();
     if (httpd_resp_send_chunk(j->req, (const char *)data, len) != ESP_OK)
     {
         return 0;
     }
+    j->send_us += esp_timer_get_time() - start;
     j->len += len;
     return len;
 }
 
-static esp_err_t capture_handler(httpd_req_t *req)
+// The motion region in fb's pixels, false when there is none to keep sharp
+static bool roi_for(camera_fb_t *fb, img_rect_t *roi)
+{
+    portENTER_CRITICAL(&alert_mux);
+    img_rect_t cells = motion_roi;
+    bool held = motion_roi_time && fb_time_us(fb) - motion_roi_time < ROI_HOLD_US;
+    portEXIT_CRITICAL(&alert_mux);
+    if (!held) {
+        return false;
+    }
+    int x0 = cells.x > ROI_MARGIN ? cells.x - ROI_MARGIN : 0;
+    int y0 = cells.y > ROI_MARGIN ? cells.y - ROI_MARGIN : 0;
+    int x1 = cells.x + cells.w + ROI_MARGIN < MOTION_GRID_W ? cells.x + cells.w + ROI_MARGIN : MOTION_GRID_W;
+    int y1 = cells.y + cells.h + ROI_MARGIN < MOTION_GRID_H ? cells.y + cells.h + ROI_MARGIN : MOTION_GRID_H;
+    roi->x = x0 * fb->width / MOTION_GRID_W;
+    roi->y = y0 * fb->height / MOTION_GRID_H;
+    roi->w = x1 * fb->width / MOTION_GRID_W - roi->x;
+    roi->h = y1 * fb->height / MOTION_GRID_H - roi->y;
+    return true;
+}
+
+// Streaming RGB565 encoder for a task that compresses frames. Allocated on
+// the first non-JPEG frame, so JPEG sensors don't pay for its tables.
+static jpeg_enc_t *jpeg_enc_new(void)
+{
+    jpeg_enc_t *enc = (jpeg_enc_t *)buf_alloc(sizeof(jpeg_enc_t), NULL);
+    if (enc) {
+        jpeg_enc_init(enc);
+    } else {
+        log_e("No memory for the JPEG encoder");
+    }
+    return enc;
+}
+
+// Compress a non-JPEG frame into cb. RGB565 goes through enc, which belongs
+// to the calling task, with the motion region at quality and the rest
+// coarser; other formats, or no encoder, through frame2jpg_cb().
+static bool fb_encode(jpeg_enc_t *enc, camera_fb_t *fb, uint8_t quality, jpg_out_cb cb, void *arg)
+{
+    if (!enc || fb->format != PIXFORMAT_RGB565) {
+        return frame2jpg_cb(fb, quality, cb, arg);
+    }
+    img_rect_t roi;
+    bool has_roi = roi_for(fb, &roi);
+    jpeg_enc_set_quality(enc, quality, ROI_BACKGROUND_QUALITY);
+    return jpeg_enc_rgb565(enc, fb->buf, fb->width, fb->height, has_roi ? &roi : NULL, cb, arg);
+}
+
+// jpg_out_cb collecting a JPEG in a buffer kept from frame to frame, for
+// senders that need the length before the data
+typedef struct
+{
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+} jpg_buffer_t;
+
+#define JPG_BUFFER_MIN (16 * 1024)
+
+static size_t jpg_encode_buffer(void *arg, size_t index, const void *data, size_t len)
+{
+    jpg_buffer_t *b = (jpg_buffer_t *)arg;
+    if (!index) {
+        b->len = 0;
+    }
+    if (b->len + len > b->cap) {
+        size_t cap;
+        uint8_t *buf = (uint8_t *)buf_alloc(b->len + len > JPG_BUFFER_MIN ? b->len + len : JPG_BUFFER_MIN, &cap);
+        if (!buf) {
+            return 0;
+        }
+        memcpy(buf, b->buf, b->len);
+        buf_free(b->buf);
+        b->buf = buf;
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+    return len;
+}
+
+// Scratch for model input, only touched from camera_httpd handlers, which
+// the server runs one at a time
+static uint8_t *model_decode = NULL;
+static size_t model_decode_len = 0;
+static uint8_t *model_input = NULL;
+static size_t model_input_len = 0;
+
+// frame_hash() of a frame, from the motion analysis if it has seen the
+// frame, else decoded here. Only called from camera_httpd handlers, like
+// the model scratch it decodes into.
+static bool frame_hash_of(camera_fb_t *fb, uint32_t seq, uint64_t *hash)
+{
+    portENTER_CRITICAL(&alert_mux);
+    bool cached = seq && seq == motion_hash_seq;
+    *hash = motion_hash;
+    portEXIT_CRITICAL(&alert_mux);
+    if (cached) {
+        return true;
+    }
+    uint8_t grid[MOTION_GRID_SIZE];
+    if (!motion_grid_from_fb(fb, grid, &model_decode, &model_decode_len)) {
+        return false;
+    }
+    *hash = frame_hash(grid);
+    return true;
+}
+
+// mode=model|tensor, crop=center and since=HASH[&threshold=N] from a query
+// string. since without a valid hash only asks for X-Frame-Hash.
+static void parse_capture_opts(const char *query, capture_opts_t *opts)
+{
+    char value[FRAME_HASH_HEX + 2];
+    opts->mode = CAPTURE_FRAME;
+    opts->center_crop = false;
+    opts->hash = false;
+    opts->conditional = false;
+    opts->since = 0;
+    opts->threshold = FRAME_HASH_SIMILAR;
+    if (httpd_query_key_value(query, "mode", value, sizeof(value)) == ESP_OK) {
+        if (!strcmp(value, "model")) {
+            opts->mode = CAPTURE_MODEL_JPEG;
+        } else if (!strcmp(value, "tensor")) {
+            opts->mode = CAPTURE_MODEL_TENSOR;
+        }
+    }
+    if (httpd_query_key_value(query, "crop", value, sizeof(value)) == ESP_OK) {
+        opts->center_crop = !strcmp(value, "center");
+    }
+    esp_err_t since = httpd_query_key_value(query, "since", value, sizeof(value));
+    if (since == ESP_OK || since == ESP_ERR_HTTPD_RESULT_TRUNC) {
+        opts->hash = true;
+        opts->conditional = since == ESP_OK && frame_hash_parse(value, &opts->since);
+    }
+    if (httpd_query_key_value(query, "threshold", value, sizeof(value)) == ESP_OK) {
+        opts->threshold = atoi(value);
+    }
+}
+
+// Crop and resize fb to MODEL_INPUT_W x MODEL_INPUT_H RGB888 in model_input.
+// bgr selects the byte order expected by the esp32-camera JPEG encoder.
+static bool model_input_from_fb(camera_fb_t *fb, bool center_crop, bool bgr)
+{
+    if (!scratch_reserve(&model_input, &model_input_len, MODEL_INPUT_W * MODEL_INPUT_H * 3)) {
+        return false;
+    }
+
+    const uint8_t *src = fb->buf;
+    int w = fb->width;
+    int h = fb->height;
+    if (fb->format == PIXFORMAT_JPEG) {
+        // Let the decoder do the coarse downscale, never below the model input
+        jpg_scale_t scale = jpg_scale_for(fb, MODEL_INPUT_W, MODEL_INPUT_H);
+        size_t len = (size_t)(fb->width >> scale) * (fb->height >> scale) * 3;
+        if (!scratch_reserve(&model_decode, &model_decode_len, len) ||
+            !jpg_decode_rgb888(fb, scale, model_decode, model_decode_len, &w, &h)) {
+            return false;
+        }
+        src = model_decode;
+    } else if (fb->format != PIXFORMAT_RGB565) {
+        return false;
+    }
+
+    img_rect_t crop = center_crop ? img_crop_center_square(w, h) : img_crop_full(w, h);
+    if (fb->format == PIXFORMAT_JPEG) {
+        img_resize_rgb888(src, w, h, crop, model_input, MODEL_INPUT_W, MODEL_INPUT_H, bgr);
+    } else {
+        img_resize_rgb565(src, w, h, crop, model_input, MODEL_INPUT_W, MODEL_INPUT_H, bgr);
+    }
+    return true;
+}
+
+// Send fb as the body of req, with the headers shared by /capture and
+// /cycle, or 304 with only the headers if opts makes it conditional and its
+// hash is close enough. Does not release fb.
+static esp_err_t send_capture(httpd_req_t *req, camera_fb_t *fb, uint32_t seq, const capture_opts_t *opts)
 {
-    camera_fb_t *fb = NULL;
     esp_err_t res = ESP_OK;
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
     int64_t fr_start = esp_timer_get_time();
 #endif
 
-    fb = esp_camera_fb_get();
-    if (!fb)
-    {
-        log_e("Camera capture failed");
-        httpd_resp_send_500(req);
-        return ESP_FAIL;
-    }
-
-    httpd_resp_set_type(req, "image/jpeg");
-    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
 
     char ts[32];
     snprintf(ts, 32, "%ld.%06ld", fb->timestamp.tv_sec, fb->timestamp.tv_usec);
     httpd_resp_set_hdr(req, "X-Timestamp", (const char *)ts);
 
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-        size_t fb_len = 0;
-#endif
-        if (fb->format == PIXFORMAT_JPEG)
+    char sequence[12];
+    snprintf(sequence, sizeof(sequence), "%u", seq);
+    httpd_resp_set_hdr(req, "X-Sequence", sequence);
+
+    char motion[12];
+    snprintf(motion, sizeof(motion), "%u", alert_snapshot().motion);
+    httpd_resp_set_hdr(req, "X-Motion", motion);
+
+    char next_sample[12];
+    snprintf(next_sample, sizeof(next_sample), "%u", sample_due_ms());
+    httpd_resp_set_hdr(req, "X-Next-Sample", next_sample);
+
+    char burst_value[24];
+    burst_header(req, burst_value, sizeof(burst_value));
+
+    char hash_hex[FRAME_HASH_HEX + 1];
+    char distance[4];
+    bool unchanged = false;
+    uint64_t hash;
+    if (opts->hash && frame_hash_of(fb, seq, &hash)) {
+        frame_hash_format(hash, hash_hex);
+        httpd_resp_set_hdr(req, "X-Frame-Hash", hash_hex);
+        if (opts->conditional) {
+            int d = frame_hash_distance(hash, opts->since);
+            snprintf(distance, sizeof(distance), "%d", d);
+            httpd_resp_set_hdr(req, "X-Hash-Distance", distance);
+            unchanged = d <= opts->threshold;
+        }
+    }
+
+    // The next classification posted is for this frame
+    portENTER_CRITICAL(&alert_mux);
+    last_capture_time = fb_time_us(fb);
+    served_frames[served_next].seq = seq;
+    served_frames[served_next].frame_time = last_capture_time;
+    served_next = (served_next + 1) % SERVED_FRAMES;
+    portEXIT_CRITICAL(&alert_mux);
+
+    if (unchanged) {
+        // The client reuses its result for the frame it hashed
+        httpd_resp_set_status(req, "304 Not Modified");
+        res = httpd_resp_send(req, NULL, 0);
+        if (res == ESP_OK) {
+            metrics_add(METRIC_FRAMES_UNCHANGED, 1);
+            int64_t sent = esp_timer_get_time();
+            portENTER_CRITICAL(&alert_mux);
+            trace_sent(&traces, seq, fb_time_us(fb), sent);
+            portEXIT_CRITICAL(&alert_mux);
+        }
+        return res;
+    }
+
+    size_t out_len = 0;
+    // Encoders stream into the socket, so their send time is split out of
+    // the conversion time by jpg_encode_stream
+    int64_t start = esp_timer_get_time();
+    int64_t send_us = 0;
+    if (opts->mode != CAPTURE_FRAME)
+    {
+        bool tensor = opts->mode == CAPTURE_MODEL_TENSOR;
+        if (!model_input_from_fb(fb, opts->center_crop, !tensor))
         {
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-            fb_len = fb->len;
-#endif
-            res = httpd_resp_send(req, (const char *)fb->buf, fb->len);
+            log_e("Model input conversion failed");
+            httpd_resp_send_500(req);
+            return ESP_FAIL;
+        }
+        if (tensor)
+        {
+            // H x W x 3 uint8, R,G,B
+            out_len = MODEL_INPUT_W * MODEL_INPUT_H * 3;
+            httpd_resp_set_type(req, "application/octet-stream");
+            httpd_resp_set_hdr(req, "X-Tensor-Shape", "224,224,3");
+            int64_t send_start = esp_timer_get_time();
+            res = httpd_resp_send(req, (const char *)model_input, out_len);
+            send_us = esp_timer_get_time() - send_start;
         }
         else
         {
-            jpg_chunking_t jchunk = {req, 0};
-            res = frame2jpg_cb(fb, 80, jpg_encode_stream, &jchunk) ? ESP_OK : ESP_FAIL;
+            httpd_resp_set_type(req, "image/jpeg");
+            httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+            jpg_chunking_t jchunk = {req, 0, 0};
+            res = fmt2jpg_cb(model_input, MODEL_INPUT_W * MODEL_INPUT_H * 3, MODEL_INPUT_W, MODEL_INPUT_H,
+                             PIXFORMAT_RGB888, MODEL_JPEG_QUALITY, jpg_encode_stream, &jchunk) ? ESP_OK : ESP_FAIL;
             httpd_resp_send_chunk(req, NULL, 0);
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-            fb_len = jchunk.len;
-#endif
+            out_len = jchunk.len;
+            send_us = jchunk.send_us;
+        }
+        metrics_observe(METRIC_CONVERT, esp_timer_get_time() - start - send_us);
+    }
+    else if (fb->format == PIXFORMAT_JPEG)
+    {
+        httpd_resp_set_type(req, "image/jpeg");
+        httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+        out_len = fb->len;
+        res = httpd_resp_send(req, (const char *)fb->buf, fb->len);
+        send_us = esp_timer_get_time() - start;
+    }
+    else
+    {
+        httpd_resp_set_type(req, "image/jpeg");
+        httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+        // Only camera_httpd handlers use the encoder, one at a time
+        static jpeg_enc_t *capture_enc = NULL;
+        if (!capture_enc && fb->format == PIXFORMAT_RGB565) {
+            capture_enc = jpeg_enc_new();
         }
-        esp_camera_fb_return(fb);
+        jpg_chunking_t jchunk = {req, 0, 0};
+        res = fb_encode(capture_enc, fb, 80, jpg_encode_stream, &jchunk) ? ESP_OK : ESP_FAIL;
+        httpd_resp_send_chunk(req, NULL, 0);
+        out_len = jchunk.len;
+        send_us = jchunk.send_us;
+        metrics_observe(METRIC_CONVERT, esp_timer_get_time() - start - send_us);
+    }
+    metrics_observe(METRIC_SEND, send_us);
+    if (res == ESP_OK)
+    {
+        metrics_add(METRIC_FRAMES_SENT, 1);
+        metrics_add(METRIC_BYTES_SENT, out_len);
+        int64_t sent = esp_timer_get_time();
+        portENTER_CRITICAL(&alert_mux);
+        trace_sent(&traces, seq, fb_time_us(fb), sent);
+        portEXIT_CRITICAL(&alert_mux);
+    }
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-        int64_t fr_end = esp_timer_get_time();
+    int64_t fr_end = esp_timer_get_time();
 #endif
-        log_i("JPG: %uB %ums", (uint32_t)(fb_len), (uint32_t)((fr_end - fr_start) / 1000));
-        return res;
+    slog_i(SLOG_CAPTURE, opts->mode == CAPTURE_FRAME ? "JPG" : "MODEL", (uint32_t)(out_len), (uint32_t)((fr_end - fr_start) / 1000));
+    return res;
 }
 
-static esp_err_t stream_handler(httpd_req_t *req)
+// GET /capture[?after=N][&mode=model|tensor][&crop=center][&since=HASH[&threshold=N]]:
+// the newest frame, or with after the first frame whose sequence number is
+// greater than N. An N past the newest frame comes from before a reboot
+// and gets the newest frame. mode=model resizes it to the model input as JPEG,
+// mode=tensor sends the resized pixels raw. since asks for the frame's
+// X-Frame-Hash; given the hash of the frame last classified, the answer is
+// 304 when the scene is within threshold bits of it (FRAME_HASH_SIMILAR by
+// default), and the client keeps its result.
+static esp_err_t capture_handler(httpd_req_t *req)
 {
-    camera_fb_t *fb = NULL;
-    struct timeval _timestamp;
-    esp_err_t res = ESP_OK;
-    size_t _jpg_buf_len = 0;
-    uint8_t *_jpg_buf = NULL;
-    char *part_buf[128];
-
-    static int64_t last_frame = 0;
-    if (!last_frame)
-    {
-        last_frame = esp_timer_get_time();
+    uint32_t after = 0;
+    capture_opts_t opts = {};
+    char query[128];
+    char value[12];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "after", value, sizeof(value)) == ESP_OK) {
+            after = strtoul(value, NULL, 10);
+        }
+        parse_capture_opts(query, &opts);
+    }
+    if (after > broker_latest_seq()) {
+        after = 0;
     }
 
-    res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-    if (res != ESP_OK)
+    uint32_t seq = 0;
+    int64_t wait_start = esp_timer_get_time();
+    camera_fb_t *fb = broker_acquire(after, CAPTURE_TIMEOUT_MS, &seq);
+    metrics_observe(METRIC_FRAME_WAIT, esp_timer_get_time() - wait_start);
+    if (!fb)
     {
-        return res;
+        log_e("Camera capture failed");
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
     }
 
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    httpd_resp_set_hdr(req, "X-Framerate", "60");
+    esp_err_t res = send_capture(req, fb, seq, &opts);
+    broker_release(fb);
+    return res;
+}
 
-    while (true)
-    {
-        fb = esp_camera_fb_get();
-        if (!fb)
-        {
-            log_e("Camera capture failed");
-            res = ESP_FAIL;
+// Stream levels for the rate controller, from the sensor settings the
+// stream starts with down to small, heavily compressed frames. Each level
+// alternately raises the JPEG quality value (more compression) or moves to
+// the next smaller frame size. The levels set the sensor that /capture,
+// /cycle and the motion analysis read too, so frame sizes stop at the
+// smallest that still covers the model input.
+#define STREAM_LEVELS_MAX   10
+#define STREAM_QUALITY_STEP 8
+#define STREAM_QUALITY_MAX  40
+
+typedef struct
+{
+    framesize_t framesize;
+    uint8_t quality; // sensor scale, 0..63, lower is better
+} stream_level_t;
+
+static const framesize_t stream_sizes[] = {
+    FRAMESIZE_UXGA, FRAMESIZE_SXGA, FRAMESIZE_XGA, FRAMESIZE_SVGA, FRAMESIZE_VGA,
+    FRAMESIZE_CIF, FRAMESIZE_QVGA,
+};
+
+static void status_note_jpeg(sensor_t *s);
+
+// Frame sizes can only change on JPEG sensors, other formats are
+// compressed by fb_encode() and only step the quality
+static int stream_levels_build(sensor_t *s, bool resize, stream_level_t *levels)
+{
+    stream_level_t l = {(framesize_t)s->status.framesize, (uint8_t)s->status.quality};
+    int n = 0;
+    levels[n++] = l;
+    while (n < STREAM_LEVELS_MAX) {
+        bool smaller = false;
+        if (resize && (n % 2 == 0 || l.quality >= STREAM_QUALITY_MAX)) {
+            for (size_t i = 0; i < sizeof(stream_sizes) / sizeof(stream_sizes[0]); i++) {
+                const resolution_info_t *r = &resolution[stream_sizes[i]];
+                if (r->width < resolution[l.framesize].width && r->width >= MODEL_INPUT_W &&
+                    r->height >= MODEL_INPUT_H) {
+                    l.framesize = stream_sizes[i];
+                    smaller = true;
+                    break;
+                }
+            }
         }
-        else
-        {
-            _timestamp.tv_sec = fb->timestamp.tv_sec;
-            _timestamp.tv_usec = fb->timestamp.tv_usec;
+        if (!smaller) {
+            if (l.quality >= STREAM_QUALITY_MAX) {
+                break;
+            }
+            l.quality = l.quality + STREAM_QUALITY_STEP > STREAM_QUALITY_MAX ? STREAM_QUALITY_MAX : l.quality + STREAM_QUALITY_STEP;
+        }
+        levels[n++] = l;
+    }
+    return n;
+}
+
+// fb_encode() quality for a sensor quality value, 10 maps to 80
+static uint8_t stream_encode_quality(uint8_t quality)
+{
+    return quality >= 45 ? 10 : 100 - 2 * quality;
+}
+
+static void stream_apply_level(sensor_t *s, const stream_level_t *l)
+{
+    if (s->status.framesize != l->framesize) {
+        s->set_framesize(s, l->framesize);
+    }
+    if (s->status.quality != l->quality) {
+        s->set_quality(s, l->quality);
+    }
+    status_note_jpeg(s);
+}
+
+// Broadcast stream. /stream hands its socket to one task that takes each
+// new frame from the broker, encodes it once when the sensor isn't JPEG,
+// and writes it to every viewer with non-blocking sends, so viewers don't
+// hold a stream_httpd worker each. A viewer whose socket is still full
+// finishes the frame it is on and then skips to the newest one; the
+// others don't wait for it. Frames being sent live in a few PSRAM copies
+// so the broker's slots go straight back to the camera. Viewers take all
+// but one of stream_httpd's sockets; the last one is for an ?adapt session
+// or for turning the next viewer away with a 503.
+#define STREAM_MAX_SOCKETS   7 // stream_httpd max_open_sockets, the httpd default
+#define BROADCAST_VIEWERS    (STREAM_MAX_SOCKETS - 1)
+#define BROADCAST_FRAMES     4  // newest plus ones slow viewers are still sending
+#define BROADCAST_POLL_MS    10 // longest a blocked viewer waits for its socket to be rechecked
+#define BROADCAST_TASK_CORE  1
+#define BROADCAST_TASK_PRIO  4
+#define BROADCAST_TASK_STACK 4096
+
+typedef struct
+{
+    char head[256]; // boundary and part headers
+    size_t head_len;
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    uint32_t seq;
+    uint8_t refs; // viewers in the middle of sending it
+} broadcast_frame_t;
+
+typedef struct
+{
+    int fd; // -1 when the slot is free
+    broadcast_frame_t *frame; // being sent, NULL between frames
+    size_t sent; // bytes of head and buf
+    uint32_t seq; // last frame started
+} broadcast_viewer_t;
+
+// Viewers, refs and broadcast_newest are guarded by broadcast_lock
+static SemaphoreHandle_t broadcast_lock = NULL;
+static SemaphoreHandle_t broadcast_wake = NULL;
+static broadcast_viewer_t broadcast_viewers[BROADCAST_VIEWERS];
+static broadcast_frame_t broadcast_frames[BROADCAST_FRAMES];
+static broadcast_frame_t *broadcast_newest = NULL;
+static uint8_t broadcast_count = 0;
+static bool broadcast_ok = false; // the task runs, else every viewer gets a session
+
+static void broadcast_drop(broadcast_viewer_t *v)
+{
+    if (v->frame) {
+        v->frame->refs--;
+        v->frame = NULL;
+    }
+    v->fd = -1;
+    broadcast_count--;
+    metrics_set(METRIC_STREAM_VIEWERS, broadcast_count);
+}
+
+// stream_httpd close_fn: forget the viewer before its descriptor can be reused
+static void broadcast_close_fn(httpd_handle_t hd, int sockfd)
+{
+    xSemaphoreTake(broadcast_lock, portMAX_DELAY);
+    for (int i = 0; i < BROADCAST_VIEWERS; i++) {
+        if (broadcast_viewers[i].fd == sockfd) {
+            broadcast_drop(&broadcast_viewers[i]);
+        }
+    }
+    xSemaphoreGive(broadcast_lock);
+    close(sockfd);
+}
+
+// Write as much as the socket takes without blocking. Returns false when
+// the viewer is blocked or gone.
+static bool broadcast_send(broadcast_viewer_t *v)
+{
+    while (true) {
+        if (!v->frame) {
+            broadcast_frame_t *f = broadcast_newest;
+            if (!f || f->seq == v->seq) {
+                return true;
+            }
+            if (v->seq && f->seq > v->seq + 1) {
+                metrics_add(METRIC_FRAMES_DROPPED, f->seq - v->seq - 1);
+            }
+            f->refs++;
+            v->frame = f;
+            v->sent = 0;
+            v->seq = f->seq;
+        }
+        broadcast_frame_t *f = v->frame;
+        const char *data;
+        size_t len;
+        if (v->sent < f->head_len) {
+            data = f->head + v->sent;
+            len = f->head_len - v->sent;
+        } else {
+            data = (const char *)f->buf + v->sent - f->head_len;
+            len = f->head_len + f->len - v->sent;
+        }
+        int n = httpd_socket_send(stream_httpd, v->fd, data, len, MSG_DONTWAIT);
+        if (n == HTTPD_SOCK_ERR_TIMEOUT) {
+            return false;
+        }
+        if (n <= 0) {
+            log_e("Send frame failed");
+            httpd_sess_trigger_close(stream_httpd, v->fd);
+            broadcast_drop(v);
+            return false;
+        }
+        v->sent += n;
+        if (v->sent == f->head_len + f->len) {
+            metrics_add(METRIC_FRAMES_SENT, 1);
+            metrics_add(METRIC_BYTES_SENT, f->len);
+            f->refs--;
+            v->frame = NULL;
+        }
+    }
+}
+
+// Copy or encode fb into a frame nobody is sending. NULL if every copy is
+// still in use or the frame can't be stored.
+static broadcast_frame_t *broadcast_store(camera_fb_t *fb, uint32_t seq)
+{
+    broadcast_frame_t *f = NULL;
+    xSemaphoreTake(broadcast_lock, portMAX_DELAY);
+    for (int i = 0; i < BROADCAST_FRAMES && !f; i++) {
+        if (!broadcast_frames[i].refs && &broadcast_frames[i] != broadcast_newest) {
+            f = &broadcast_frames[i];
+        }
+    }
+    xSemaphoreGive(broadcast_lock);
+    if (!f) {
+        return NULL;
+    }
+
+    // Only this task fills frames and a free one has no readers, so the
+    // copy runs without the lock
+    sensor_t *s = esp_camera_sensor_get();
+    uint8_t *jpg = fb->buf;
+    size_t jpg_len = fb->len;
+    if (fb->format != PIXFORMAT_JPEG) {
+        // Compressed straight into the frame's buffer
+        static jpeg_enc_t *broadcast_enc = NULL;
+        if (!broadcast_enc && fb->format == PIXFORMAT_RGB565) {
+            broadcast_enc = jpeg_enc_new();
+        }
+        jpg_buffer_t out = {f->buf, 0, f->cap};
+        int64_t convert_start = esp_timer_get_time();
+        bool converted = fb_encode(broadcast_enc, fb, stream_encode_quality(s->status.quality), jpg_encode_buffer, &out);
+        metrics_observe(METRIC_CONVERT, esp_timer_get_time() - convert_start);
+        f->buf = out.buf;
+        f->cap = out.cap;
+        if (!converted) {
+            log_e("JPEG compression failed");
+            return NULL;
+        }
+        jpg = f->buf;
+        jpg_len = out.len;
+    }
+    if (f->cap < jpg_len) {
+        buf_free(f->buf);
+        f->buf = (uint8_t *)buf_alloc(jpg_len, &f->cap);
+    }
+    bool stored = f->buf != NULL;
+    if (stored) {
+        if (jpg != f->buf) {
+            memcpy(f->buf, jpg, jpg_len);
+        }
+        f->len = jpg_len;
+        f->seq = seq;
+        size_t hlen = strlen(_STREAM_BOUNDARY);
+        memcpy(f->head, _STREAM_BOUNDARY, hlen);
+        hlen += snprintf(f->head + hlen, sizeof(f->head) - hlen, _STREAM_PART, (unsigned)jpg_len,
+                         (int)fb->timestamp.tv_sec, (int)fb->timestamp.tv_usec, seq, s->status.quality,
+                         s->status.framesize, 0u);
+        f->head_len = hlen;
+    } else {
+        f->cap = 0;
+        log_e("No memory for a broadcast frame");
+    }
+    return stored ? f : NULL;
+}
+
+static void broadcast_task(void *arg)
+{
+    uint32_t seq = 0;
+    while (true) {
+        // Sockets of viewers stuck in the middle of a frame
+        fd_set blocked;
+        FD_ZERO(&blocked);
+        int max_fd = -1;
+        xSemaphoreTake(broadcast_lock, portMAX_DELAY);
+        uint8_t viewers = broadcast_count;
+        for (int i = 0; i < BROADCAST_VIEWERS; i++) {
+            broadcast_viewer_t *v = &broadcast_viewers[i];
+            if (v->fd >= 0 && v->frame) {
+                FD_SET(v->fd, &blocked);
+                max_fd = v->fd > max_fd ? v->fd : max_fd;
+            }
+        }
+        xSemaphoreGive(broadcast_lock);
+        if (!viewers) {
+            xSemaphoreTake(broadcast_wake, portMAX_DELAY);
+            continue;
+        }
+
+        camera_fb_t *fb;
+        uint32_t fb_seq = 0;
+        if (max_fd >= 0) {
+            // Wake for whichever comes first, a socket draining or a frame
+            struct timeval tv = {0, BROADCAST_POLL_MS * 1000};
+            select(max_fd + 1, NULL, &blocked, NULL, &tv);
+            fb = broker_acquire(seq, 0, &fb_seq);
+        } else {
+            int64_t wait_start = esp_timer_get_time();
+            fb = broker_acquire(seq, CAPTURE_TIMEOUT_MS, &fb_seq);
+            metrics_observe(METRIC_FRAME_WAIT, esp_timer_get_time() - wait_start);
+        }
+        broadcast_frame_t *fresh = NULL;
+        if (fb) {
+            seq = fb_seq;
+            fresh = broadcast_store(fb, fb_seq);
+            broker_release(fb);
+        }
+
+        int64_t send_start = esp_timer_get_time();
+        xSemaphoreTake(broadcast_lock, portMAX_DELAY);
+        if (fresh) {
+            broadcast_newest = fresh;
+        }
+        for (int i = 0; i < BROADCAST_VIEWERS; i++) {
+            if (broadcast_viewers[i].fd >= 0) {
+                broadcast_send(&broadcast_viewers[i]);
+            }
+        }
+        xSemaphoreGive(broadcast_lock);
+        if (fresh) {
+            metrics_observe(METRIC_SEND, esp_timer_get_time() - send_start);
+        }
+    }
+}
+
+static esp_err_t broadcast_start(void)
+{
+    for (int i = 0; i < BROADCAST_VIEWERS; i++) {
+        broadcast_viewers[i].fd = -1;
+    }
+    broadcast_lock = xSemaphoreCreateMutex();
+    broadcast_wake = xSemaphoreCreateBinary();
+    if (!broadcast_lock || !broadcast_wake ||
+        xTaskCreatePinnedToCore(broadcast_task, "broadcast", BROADCAST_TASK_STACK, NULL, BROADCAST_TASK_PRIO, NULL,
+                                BROADCAST_TASK_CORE) != pdPASS) {
+        return ESP_FAIL;
+    }
+    broadcast_ok = true;
+    return ESP_OK;
+}
+
+// Send the response head on the handler's thread, then leave the socket to
+// broadcast_task. The response has no length and no chunking, it ends when
+// the connection closes.
+static esp_err_t broadcast_join(httpd_req_t *req)
+{
+    int fd = httpd_req_to_sockfd(req);
+    xSemaphoreTake(broadcast_lock, portMAX_DELAY);
+    broadcast_viewer_t *v = NULL;
+    for (int i = 0; i < BROADCAST_VIEWERS && !v; i++) {
+        if (broadcast_viewers[i].fd < 0) {
+            v = &broadcast_viewers[i];
+        }
+    }
+    xSemaphoreGive(broadcast_lock);
+    if (!v) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_send(req, "Too many viewers", HTTPD_RESP_USE_STRLEN);
+        return ESP_FAIL;
+    }
+
+    char head[192];
+    int len = snprintf(head, sizeof(head),
+                       "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nAccess-Control-Allow-Origin: *\r\n"
+                       "X-Framerate: 25\r\nCache-Control: no-store\r\n\r\n",
+                       _STREAM_CONTENT_TYPE);
+    for (int sent = 0; sent < len;) {
+        int n = httpd_send(req, head + sent, len - sent);
+        if (n <= 0) {
+            return ESP_FAIL;
+        }
+        sent += n;
+    }
+
+    // Only handlers of this server add viewers, one at a time, so the slot
+    // found above is still free
+    xSemaphoreTake(broadcast_lock, portMAX_DELAY);
+    v->fd = fd;
+    v->frame = NULL;
+    v->seq = 0;
+    if (!broadcast_count) {
+        broadcast_newest = NULL; // stale, nobody watched it
+    }
+    broadcast_count++;
+    metrics_set(METRIC_STREAM_VIEWERS, broadcast_count);
+    xSemaphoreGive(broadcast_lock);
+    xSemaphoreGive(broadcast_wake);
+    return ESP_OK;
+}
+
+static esp_err_t stream_handler(httpd_req_t *req)
+{
+    camera_fb_t *fb = NULL;
+    struct timeval _timestamp;
+    esp_err_t res = ESP_OK;
+    size_t _jpg_buf_len = 0;
+    uint8_t *_jpg_buf = NULL;
+    char part_buf[256];
+    uint32_t seq = 0;
+
+    // Viewers join the broadcast unless they ask for a session of their
+    // own on a stream_httpd worker: ?adapt=1 with the rate controller
+    // stepping the sensor settings, ?adapt=0 at the starting settings.
+    // Without the broadcast task every viewer gets an ?adapt=0 session.
+    char query[32];
+    char value[8];
+    bool adapt = false;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "adapt", value, sizeof(value)) == ESP_OK) {
+        adapt = atoi(value) != 0;
+    } else if (broadcast_ok) {
+        return broadcast_join(req);
+    }
+
+    sensor_t *s = esp_camera_sensor_get();
+    bool jpeg = s->pixformat == PIXFORMAT_JPEG;
+    stream_level_t levels[STREAM_LEVELS_MAX];
+    int level_count = adapt ? stream_levels_build(s, jpeg, levels) : 1;
+    if (!adapt) {
+        levels[0].framesize = (framesize_t)s->status.framesize;
+        levels[0].quality = s->status.quality;
+    }
+    rate_ctl_t rate;
+    rate_ctl_init(&rate, RATE_TARGET_US, adapt ? RATE_MIN_INTERVAL_US : 0, 0, level_count - 1);
+
+    static int64_t last_frame = 0;
+    if (!last_frame)
+    {
+        last_frame = esp_timer_get_time();
+    }
+
+    res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
+    if (res != ESP_OK)
+    {
+        return res;
+    }
+
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "X-Framerate", "25");
+
+    // Other formats are compressed into a buffer kept for the session
+    jpeg_enc_t *enc = s->pixformat == PIXFORMAT_RGB565 ? jpeg_enc_new() : NULL;
+    jpg_buffer_t out = {};
+
+    while (true)
+    {
+        const stream_level_t *level = &levels[rate.level];
+        // Each part is a frame this viewer hasn't seen yet
+        uint32_t prev_seq = seq;
+        int64_t wait_start = esp_timer_get_time();
+        fb = broker_acquire(seq, CAPTURE_TIMEOUT_MS, &seq);
+        metrics_observe(METRIC_FRAME_WAIT, esp_timer_get_time() - wait_start);
+        if (!fb)
+        {
+            log_e("Camera capture failed");
+            res = ESP_FAIL;
+        }
+        else
+        {
+            if (prev_seq && seq > prev_seq + 1)
+            {
+                metrics_add(METRIC_FRAMES_DROPPED, seq - prev_seq - 1);
+            }
+            _timestamp.tv_sec = fb->timestamp.tv_sec;
+            _timestamp.tv_usec = fb->timestamp.tv_usec;
             if (fb->format != PIXFORMAT_JPEG)
             {
-                bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-                esp_camera_fb_return(fb);
+                int64_t convert_start = esp_timer_get_time();
+                bool jpeg_converted = fb_encode(enc, fb, stream_encode_quality(level->quality), jpg_encode_buffer, &out);
+                metrics_observe(METRIC_CONVERT, esp_timer_get_time() - convert_start);
+                broker_release(fb);
                 fb = NULL;
+                _jpg_buf = out.buf;
+                _jpg_buf_len = out.len;
                 if (!jpeg_converted)
                 {
                     log_e("JPEG compression failed");
@@ -204,343 +1452,1987 @@ static esp_err_t stream_handler(httpd_req_t *req)
                 _jpg_buf = fb->buf;
             }
         }
-        if (res == ESP_OK)
-        {
-            res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+        int64_t send_start = esp_timer_get_time();
+        if (res == ESP_OK)
+        {
+            res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+        }
+        if (res == ESP_OK)
+        {
+            size_t hlen = snprintf(part_buf, sizeof(part_buf), _STREAM_PART, _jpg_buf_len, _timestamp.tv_sec, _timestamp.tv_usec, seq,
+                                   level->quality, level->framesize, (uint32_t)(rate.interval_us / 1000));
+            res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
+        }
+        if (res == ESP_OK)
+        {
+            res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
+        }
+        int64_t send_end = esp_timer_get_time();
+        if (res == ESP_OK)
+        {
+            metrics_observe(METRIC_SEND, send_end - send_start);
+            metrics_add(METRIC_FRAMES_SENT, 1);
+            metrics_add(METRIC_BYTES_SENT, _jpg_buf_len);
+            if (rate_ctl_frame(&rate, _jpg_buf_len, send_end - send_start))
+            {
+                level = &levels[rate.level];
+                if (jpeg)
+                {
+                    stream_apply_level(s, level);
+                }
+                slog_i(SLOG_STREAM_LEVEL,
+                       rate.level, level->framesize, level->quality,
+                       (uint32_t)((send_end - send_start) / 1000), rate.rate / 1000);
+            }
+        }
+        if (fb)
+        {
+            broker_release(fb);
+            fb = NULL;
+        }
+        _jpg_buf = NULL;
+        if (res != ESP_OK)
+        {
+            log_e("Send frame failed");
+            break;
+        }
+        int64_t fr_end = esp_timer_get_time();
+
+        int64_t frame_time = fr_end - last_frame;
+        frame_time /= 1000;
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+        uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
+        // Frame rates in tenths, the log ring takes no floats
+        uint32_t fps10 = frame_time ? 10000 / (uint32_t)frame_time : 0;
+        uint32_t avg_fps10 = avg_frame_time ? 10000 / avg_frame_time : 0;
+#endif
+        slog_i(SLOG_MJPG,
+               (uint32_t)(_jpg_buf_len),
+               (uint32_t)frame_time, fps10 / 10, fps10 % 10,
+               avg_frame_time, avg_fps10 / 10, avg_fps10 % 10
+        );
+
+        int64_t delay = rate_ctl_delay(&rate, esp_timer_get_time() - send_start);
+        if (delay >= 1000)
+        {
+            vTaskDelay(pdMS_TO_TICKS(delay / 1000));
+        }
+    }
+
+    buf_free(out.buf);
+    buf_free(enc);
+
+    // Hand the sensor back as found, unless /control changed it meanwhile
+    const stream_level_t *level = &levels[rate.level];
+    if (jpeg && rate.level != 0 && s->status.framesize == level->framesize && s->status.quality == level->quality)
+    {
+        stream_apply_level(s, &levels[0]);
+    }
+    return res;
+}
+
+// Sensor state served by /status. Reading it costs dozens of SCCB
+// transactions on OV3660/OV5640, so it is read once at startup and again
+// only after a command changes the sensor.
+static status_cache_t status_cache;
+static SemaphoreHandle_t status_lock = NULL;
+
+static void status_reg(sensor_t *s, uint16_t reg, uint32_t mask)
+{
+    char name[8];
+    snprintf(name, sizeof(name), "0x%x", reg);
+    status_cache_set(&status_cache, name, s->get_reg(s, reg, mask));
+}
+
+static void status_refresh(void)
+{
+    sensor_t *s = esp_camera_sensor_get();
+
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    if(s->id.PID == OV5640_PID || s->id.PID == OV3660_PID){
+        for(int reg = 0x3400; reg < 0x3406; reg+=2){
+            status_reg(s, reg, 0xFFF);//12 bit
+        }
+        status_reg(s, 0x3406, 0xFF);
+
+        status_reg(s, 0x3500, 0xFFFF0);//16 bit
+        status_reg(s, 0x3503, 0xFF);
+        status_reg(s, 0x350a, 0x3FF);//10 bit
+        status_reg(s, 0x350c, 0xFFFF);//16 bit
+
+        for(int reg = 0x5480; reg <= 0x5490; reg++){
+            status_reg(s, reg, 0xFF);
+        }
+
+        for(int reg = 0x5380; reg <= 0x538b; reg++){
+            status_reg(s, reg, 0xFF);
+        }
+
+        for(int reg = 0x5580; reg < 0x558a; reg++){
+            status_reg(s, reg, 0xFF);
+        }
+        status_reg(s, 0x558a, 0x1FF);//9 bit
+    } else if(s->id.PID == OV2640_PID){
+        status_reg(s, 0xd3, 0xFF);
+        status_reg(s, 0x111, 0xFF);
+        status_reg(s, 0x132, 0xFF);
+    }
+
+    status_cache_set(&status_cache, "xclk", s->xclk_freq_hz / 1000000);
+    status_cache_set(&status_cache, "pixformat", s->pixformat);
+    status_cache_set(&status_cache, "framesize", s->status.framesize);
+    status_cache_set(&status_cache, "quality", s->status.quality);
+    status_cache_set(&status_cache, "brightness", s->status.brightness);
+    status_cache_set(&status_cache, "contrast", s->status.contrast);
+    status_cache_set(&status_cache, "saturation", s->status.saturation);
+    status_cache_set(&status_cache, "sharpness", s->status.sharpness);
+    status_cache_set(&status_cache, "special_effect", s->status.special_effect);
+    status_cache_set(&status_cache, "wb_mode", s->status.wb_mode);
+    status_cache_set(&status_cache, "awb", s->status.awb);
+    status_cache_set(&status_cache, "awb_gain", s->status.awb_gain);
+    status_cache_set(&status_cache, "aec", s->status.aec);
+    status_cache_set(&status_cache, "aec2", s->status.aec2);
+    status_cache_set(&status_cache, "ae_level", s->status.ae_level);
+    status_cache_set(&status_cache, "aec_value", s->status.aec_value);
+    status_cache_set(&status_cache, "agc", s->status.agc);
+    status_cache_set(&status_cache, "agc_gain", s->status.agc_gain);
+    status_cache_set(&status_cache, "gainceiling", s->status.gainceiling);
+    status_cache_set(&status_cache, "bpc", s->status.bpc);
+    status_cache_set(&status_cache, "wpc", s->status.wpc);
+    status_cache_set(&status_cache, "raw_gma", s->status.raw_gma);
+    status_cache_set(&status_cache, "lenc", s->status.lenc);
+    status_cache_set(&status_cache, "hmirror", s->status.hmirror);
+    status_cache_set(&status_cache, "dcw", s->status.dcw);
+    status_cache_set(&status_cache, "colorbar", s->status.colorbar);
+    status_cache_set(&status_cache, "led_intensity", -1);
+    status_cache_commit(&status_cache);
+    xSemaphoreGive(status_lock);
+    ws_notify();
+}
+
+// Cheap update after the stream changes the JPEG settings, without the
+// register reads of a full refresh
+static void status_note_jpeg(sensor_t *s)
+{
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    status_cache_set(&status_cache, "framesize", s->status.framesize);
+    status_cache_set(&status_cache, "quality", s->status.quality);
+    status_cache_commit(&status_cache);
+    xSemaphoreGive(status_lock);
+    ws_notify();
+}
+
+static void status_start(void)
+{
+    status_lock = xSemaphoreCreateMutex();
+    // Random first version, so an ETag or since from before a reboot never
+    // matches the new state
+    status_cache_init(&status_cache, esp_random() >> 1);
+    status_refresh();
+}
+
+#define CONTROL_QUERY_MAX 256 // longest /control query string
+#define CONTROL_BATCH_MAX 24  // controls one request can set
+
+#define CONTROL_JPEG_ONLY 0x01 // ignored on other pixel formats
+#define CONTROL_FIRST     0x02 // applied before the rest of a batch
+
+typedef struct
+{
+    const char *name;
+    int (*set)(sensor_t *s, int val);
+    int16_t min;
+    int16_t max;
+    uint8_t flags;
+} control_t;
+
+// Sensor setters behind one signature for the control table
+#define CONTROL_SETTER(name, call)                  \
+    static int control_##name(sensor_t *s, int val) \
+    {                                               \
+        return call;                                \
+    }
+
+CONTROL_SETTER(ae_level, s->set_ae_level(s, val))
+CONTROL_SETTER(aec, s->set_exposure_ctrl(s, val))
+CONTROL_SETTER(aec2, s->set_aec2(s, val))
+CONTROL_SETTER(aec_value, s->set_aec_value(s, val))
+CONTROL_SETTER(agc, s->set_gain_ctrl(s, val))
+CONTROL_SETTER(agc_gain, s->set_agc_gain(s, val))
+CONTROL_SETTER(awb, s->set_whitebal(s, val))
+CONTROL_SETTER(awb_gain, s->set_awb_gain(s, val))
+CONTROL_SETTER(bpc, s->set_bpc(s, val))
+CONTROL_SETTER(brightness, s->set_brightness(s, val))
+CONTROL_SETTER(colorbar, s->set_colorbar(s, val))
+CONTROL_SETTER(contrast, s->set_contrast(s, val))
+CONTROL_SETTER(dcw, s->set_dcw(s, val))
+CONTROL_SETTER(framesize, s->set_framesize(s, (framesize_t)val))
+CONTROL_SETTER(gainceiling, s->set_gainceiling(s, (gainceiling_t)val))
+CONTROL_SETTER(hmirror, s->set_hmirror(s, val))
+CONTROL_SETTER(lenc, s->set_lenc(s, val))
+CONTROL_SETTER(quality, s->set_quality(s, val))
+CONTROL_SETTER(raw_gma, s->set_raw_gma(s, val))
+CONTROL_SETTER(saturation, s->set_saturation(s, val))
+CONTROL_SETTER(special_effect, s->set_special_effect(s, val))
+CONTROL_SETTER(vflip, s->set_vflip(s, val))
+CONTROL_SETTER(wb_mode, s->set_wb_mode(s, val))
+CONTROL_SETTER(wpc, s->set_wpc(s, val))
+
+// Sorted by name for control_find(), which the static_assert below checks.
+// Ranges are the ones esp32-camera documents for its sensor_t setters.
+static constexpr control_t controls[] = {
+    {"ae_level", control_ae_level, -2, 2, 0},
+    {"aec", control_aec, 0, 1, 0},
+    {"aec2", control_aec2, 0, 1, 0},
+    {"aec_value", control_aec_value, 0, 1200, 0},
+    {"agc", control_agc, 0, 1, 0},
+    {"agc_gain", control_agc_gain, 0, 30, 0},
+    {"awb", control_awb, 0, 1, 0},
+    {"awb_gain", control_awb_gain, 0, 1, 0},
+    {"bpc", control_bpc, 0, 1, 0},
+    {"brightness", control_brightness, -2, 2, 0},
+    {"colorbar", control_colorbar, 0, 1, 0},
+    {"contrast", control_contrast, -2, 2, 0},
+    {"dcw", control_dcw, 0, 1, 0},
+    {"framesize", control_framesize, 0, FRAMESIZE_INVALID - 1, CONTROL_JPEG_ONLY | CONTROL_FIRST},
+    {"gainceiling", control_gainceiling, 0, GAINCEILING_128X, 0},
+    {"hmirror", control_hmirror, 0, 1, 0},
+    {"lenc", control_lenc, 0, 1, 0},
+    {"quality", control_quality, 0, 63, 0},
+    {"raw_gma", control_raw_gma, 0, 1, 0},
+    {"saturation", control_saturation, -2, 2, 0},
+    {"special_effect", control_special_effect, 0, 6, 0},
+    {"vflip", control_vflip, 0, 1, 0},
+    {"wb_mode", control_wb_mode, 0, 4, 0},
+    {"wpc", control_wpc, 0, 1, 0},
+};
+
+#define CONTROL_COUNT (sizeof(controls) / sizeof(controls[0]))
+
+static constexpr bool control_name_less(const char *a, const char *b)
+{
+    return *a != *b ? (unsigned char)*a < (unsigned char)*b : *a && control_name_less(a + 1, b + 1);
+}
+
+static constexpr bool controls_sorted(size_t i)
+{
+    return i + 1 >= CONTROL_COUNT || (control_name_less(controls[i].name, controls[i + 1].name) && controls_sorted(i + 1));
+}
+
+static_assert(controls_sorted(0), "controls[] must be sorted by name");
+
+static const control_t *control_find(const char *name, size_t len)
+{
+    size_t lo = 0;
+    size_t hi = CONTROL_COUNT;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = strncmp(controls[mid].name, name, len);
+        if (!cmp && controls[mid].name[len]) {
+            cmp = 1;
+        }
+        if (!cmp) {
+            return &controls[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    const control_t *control;
+    int val;
+} control_set_t;
+
+static esp_err_t control_bad_request(httpd_req_t *req, const char *what, const query_pair_t *pair)
+{
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%s: %.*s", what, (int)pair->key_len, pair->key);
+    httpd_resp_set_status(req, "400 Bad Request");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_send(req, msg, HTTPD_RESP_USE_STRLEN);
+    return ESP_FAIL;
+}
+
+// Check the pairs of a /control query against the control table into
+// batch. Returns NULL, or what is wrong with *bad. The single-control form
+// var=NAME&val=N is taken too.
+static const char *control_parse(const char *query, control_set_t *batch, size_t *count, query_pair_t *bad)
+{
+    query_pair_t pairs[CONTROL_BATCH_MAX];
+    size_t n = 0;
+    query_pair_t pair;
+    query_pair_t var = {};
+    query_pair_t val = {};
+    const char *cursor = query;
+    while (query_next(&cursor, &pair)) {
+        if (query_key_is(&pair, "var")) {
+            var = pair;
+        } else if (query_key_is(&pair, "val")) {
+            val = pair;
+        } else if (n == CONTROL_BATCH_MAX) {
+            *bad = pair;
+            return "Too many controls";
+        } else {
+            pairs[n++] = pair;
+        }
+    }
+    if (var.key && val.key) {
+        // The single-control form the web UI uses
+        pair.key = var.value;
+        pair.key_len = var.value_len;
+        pair.value = val.value;
+        pair.value_len = val.value_len;
+        pairs[0] = pair;
+        n = 1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        batch[i].control = control_find(pairs[i].key, pairs[i].key_len);
+        if (!batch[i].control) {
+            log_i("Unknown command: %.*s", (int)pairs[i].key_len, pairs[i].key);
+            *bad = pairs[i];
+            return "Unknown control";
+        }
+        if (!query_int(&pairs[i], &batch[i].val) || batch[i].val < batch[i].control->min ||
+            batch[i].val > batch[i].control->max) {
+            *bad = pairs[i];
+            return "Value out of range";
+        }
+    }
+    *count = n;
+    return NULL;
+}
+
+// Apply a checked batch, framesize first since it reprograms the sensor
+// window. False if a setter failed.
+static bool control_apply(const control_set_t *batch, size_t count)
+{
+    sensor_t *s = esp_camera_sensor_get();
+    int res = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < count; i++) {
+            const control_t *c = batch[i].control;
+            if (((c->flags & CONTROL_FIRST) != 0) != (pass == 0) ||
+                ((c->flags & CONTROL_JPEG_ONLY) && s->pixformat != PIXFORMAT_JPEG)) {
+                continue;
+            }
+            slog_i(SLOG_CONTROL, c->name, batch[i].val);
+            if (c->set(s, batch[i].val) < 0) {
+                res = -1;
+            }
+        }
+    }
+    // Even a partly failed batch may have changed the sensor
+    status_refresh();
+    return res == 0;
+}
+
+// GET /control?var=NAME&val=N sets one control, /control?NAME=N&NAME=N...
+// sets several in one batch. Every name and value is checked before any is
+// applied. The query is parsed in place on the stack.
+static esp_err_t cmd_handler(httpd_req_t *req)
+{
+    char query[CONTROL_QUERY_MAX];
+    esp_err_t err = httpd_req_get_url_query_str(req, query, sizeof(query));
+    if (err == ESP_ERR_HTTPD_RESULT_TRUNC) {
+        httpd_resp_set_status(req, "414 URI Too Long");
+        httpd_resp_send(req, "Too many controls", HTTPD_RESP_USE_STRLEN);
+        return ESP_FAIL;
+    }
+    if (err != ESP_OK) {
+        httpd_resp_send_404(req);
+        return ESP_FAIL;
+    }
+
+    control_set_t batch[CONTROL_BATCH_MAX];
+    size_t count = 0;
+    query_pair_t bad;
+    const char *what = control_parse(query, batch, &count, &bad);
+    if (what) {
+        return control_bad_request(req, what, &bad);
+    }
+    if (!count) {
+        httpd_resp_send_404(req);
+        return ESP_FAIL;
+    }
+    if (!control_apply(batch, count)) {
+        return httpd_resp_send_500(req);
+    }
+
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, NULL, 0);
+}
+
+// GET /status[?since=N][&refresh=1]: the sensor state as JSON with its
+// version, which is also the ETag. since=N sends only the fields changed
+// after version N, refresh=1 rereads the sensor first. A matching
+// If-None-Match gets 304.
+static esp_err_t status_handler(httpd_req_t *req)
+{
+    uint32_t since = 0;
+    char query[32];
+    char value[12];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "since", value, sizeof(value)) == ESP_OK) {
+            since = strtoul(value, NULL, 10);
+        }
+        if (httpd_query_key_value(query, "refresh", value, sizeof(value)) == ESP_OK && atoi(value)) {
+            status_refresh();
+        }
+    }
+
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    uint32_t version = status_cache.version;
+    char etag[16];
+    snprintf(etag, sizeof(etag), "\"%u\"", version);
+
+    char match[16];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK && !strcmp(match, etag)) {
+        xSemaphoreGive(status_lock);
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_set_hdr(req, "ETag", etag);
+        httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    size_t len = status_cache_json(&status_cache, since, NULL, 0);
+    char *json = (char *)buf_alloc(len + 1, NULL);
+    if (json) {
+        status_cache_json(&status_cache, since, json, len + 1);
+    }
+    xSemaphoreGive(status_lock);
+    if (!json) {
+        return httpd_resp_send_500(req);
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    esp_err_t res = httpd_resp_send(req, json, len);
+    buf_free(json);
+    return res;
+}
+
+static bool metrics_send_chunk(void *arg, const char *data, size_t len)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)arg, data, len) == ESP_OK;
+}
+
+// GET /metrics: counters and latency histograms in the Prometheus text format,
+// then the buffer pool's use and failures
+static esp_err_t metrics_handler(httpd_req_t *req)
+{
+    metrics_set(METRIC_HEAP_FREE, heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    metrics_set(METRIC_HEAP_MIN_FREE, heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    metrics_set(METRIC_PSRAM_FREE, heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    metrics_set(METRIC_HEAP_LARGEST_FREE, heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+    metrics_set(METRIC_PSRAM_LARGEST_FREE, heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+    metrics_set(METRIC_UPTIME, esp_timer_get_time() / 1000000);
+    buf_pool_t pool_now;
+    portENTER_CRITICAL(&pool_mux);
+    pool_now = pool;
+    portEXIT_CRITICAL(&pool_mux);
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    if (!metrics_render(metrics_send_chunk, req) || !buf_pool_render(&pool_now, metrics_send_chunk, req)) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+// GET /trace: per-alert latency breakdown, from the capture of the frame
+// the lying period started with to the buzzer, and the stages of recent
+// frames, as trace_render() JSON. Times in microseconds.
+static esp_err_t trace_handler(httpd_req_t *req)
+{
+    // Rendering sends, so render from a copy
+    trace_log_t *copy = (trace_log_t *)buf_alloc(sizeof(trace_log_t), NULL);
+    if (!copy) {
+        return httpd_resp_send_500(req);
+    }
+    portENTER_CRITICAL(&alert_mux);
+    *copy = traces;
+    portEXIT_CRITICAL(&alert_mux);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    bool ok = trace_render(copy, metrics_send_chunk, req);
+    buf_free(copy);
+    if (!ok) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t index_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "text/html");
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    sensor_t *s = esp_camera_sensor_get();
+    if (s != NULL) {
+        return httpd_resp_send(req, (const char *)index_ov2640_html_gz, index_ov2640_html_gz_len);
+    } else {
+        log_e("Camera sensor not found");
+        return httpd_resp_send_500(req);
+    }
+}
+
+#define CLASSIFY_MAX_AGE_US 10000000 // results for frames older than this are dropped, covers a pulled burst
+
+typedef enum {
+    RESULT_APPLIED, // newest result so far
+    RESULT_LATE,    // a result for a newer frame came first, see alert_classify()
+    RESULT_STALE,   // too old, from the future or for an unknown frame, dropped
+} result_outcome_t;
+
+static const char *result_outcome_names[] = {"applied", "late", "stale"};
+
+// Capture time of a frame served recently, 0 if it is not remembered
+static int64_t served_frame_time(uint32_t seq)
+{
+    int64_t frame_time = 0;
+    portENTER_CRITICAL(&alert_mux);
+    for (size_t i = 0; i < SERVED_FRAMES; i++) {
+        if (served_frames[i].frame_time && served_frames[i].seq == seq) {
+            frame_time = served_frames[i].frame_time;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&alert_mux);
+    return frame_time;
+}
+
+// X-Gateway-Trace: "started,decoded,inferred", see trace_gateway_t
+static bool parse_gateway_trace(httpd_req_t *req, trace_gateway_t *trace)
+{
+    char value[40];
+    unsigned started, decoded, inferred;
+    if (httpd_req_get_hdr_value_str(req, "X-Gateway-Trace", value, sizeof(value)) != ESP_OK ||
+        sscanf(value, "%u,%u,%u", &started, &decoded, &inferred) != 3) {
+        return false;
+    }
+    trace->started_us = started;
+    trace->decoded_us = decoded;
+    trace->inferred_us = inferred;
+    return true;
+}
+
+// gateway holds the gateway's stage times for the trace, NULL if it sent
+// none. local marks results from the on-device classifier, which don't
+// count as the gateway being alive.
+static result_outcome_t apply_classification(posture_t posture, uint8_t confidence, int64_t frame_time,
+                                             const trace_gateway_t *gateway = NULL, bool local = false)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&alert_mux);
+    if (!local) {
+        gateway_result_at = now;
+    }
+    if (!frame_time) {
+        // Legacy clients don't say which frame they classified, assume the last one served
+        frame_time = last_capture_time ? last_capture_time : now;
+    }
+    if (frame_time > now || now - frame_time > CLASSIFY_MAX_AGE_US) {
+        portEXIT_CRITICAL(&alert_mux);
+        metrics_add(METRIC_RESULTS_STALE, 1);
+        return RESULT_STALE;
+    }
+    bool late = frame_time < alert_state.last_frame;
+    posture_t before = alert_state.posture;
+    bool changed = alert_classify(&alert_state, posture, confidence, frame_time);
+    if (!late) {
+        result_local = local;
+    }
+    trace_result(&traces, frame_time, now, esp_timer_get_time(), posture, gateway, local);
+    trace_lying(&traces, alert_state.lying_since);
+    sampler_classified(&sampler, &alert_state, frame_time);
+    bool wake = changed && !late && burst_posture_trigger(before, posture) && burst_request(BURST_POSTURE, now);
+    portEXIT_CRITICAL(&alert_mux);
+    if (wake) {
+        xSemaphoreGive(burst_wake);
+    }
+    metrics_add(METRIC_CLASSIFICATIONS, 1);
+    if (late) {
+        metrics_add(METRIC_RESULTS_LATE, 1);
+    }
+    metrics_observe(METRIC_CLASSIFY_TO_ALERT, now - frame_time);
+
+    if (changed) {
+        slog(SLOG_CLASSIFICATION, posture_label(posture));
+    }
+    return late ? RESULT_LATE : RESULT_APPLIED;
+}
+
+// Result from /cycle or the uplink
+static void apply_cycle_result(const cycle_result_t *result, const trace_gateway_t *gateway)
+{
+    if (result->class_id == CYCLE_NO_RESULT) {
+        // A schedule poll answered 204 carries no result, but the gateway
+        // is still there and the local classifier needn't take over
+        portENTER_CRITICAL(&alert_mux);
+        gateway_result_at = esp_timer_get_time();
+        portEXIT_CRITICAL(&alert_mux);
+        return;
+    }
+    posture_t posture = result->class_id < POSTURE_MAX ? (posture_t)result->class_id : POSTURE_NONE;
+    apply_classification(posture, result->confidence, result->frame_time, gateway);
+}
+
+// A frame went out over the uplink
+static void uplink_frame_sent(uint32_t seq, int64_t frame_time, int64_t sent)
+{
+    portENTER_CRITICAL(&alert_mux);
+    trace_sent(&traces, seq, frame_time, sent);
+    portEXIT_CRITICAL(&alert_mux);
+}
+
+// On-device fallback classifier, built when export_posture_model.py has
+// written CameraWebServer/posture_model.h. While the gateway hasn't sent a
+// result or polled for LOCAL_FALLBACK_US, a low priority task classifies frames itself on
+// the gateway's sampling schedule. Weights stay in flash, the activation
+// arena goes to PSRAM.
+#if __has_include("posture_model.h")
+#include "posture_model.h"
+
+#define LOCAL_FALLBACK_US  10000000 // gateway silence before classifying locally
+#define LOCAL_POLL_MS      250      // longest the task sleeps between schedule checks
+#define LOCAL_TASK_CORE    0        // away from the capture task
+#define LOCAL_TASK_PRIO    2        // below the capture task and the uplink
+#define LOCAL_TASK_STACK   4096
+
+static_assert(LOCAL_FALLBACK_US > SAMPLE_MAX_US, "a gateway polling on the slowest schedule must not look silent");
+
+// Only touched by local_task
+static int8_t *local_arena = NULL;
+static uint8_t *local_decode = NULL;
+static size_t local_decode_len = 0;
+static uint8_t *local_input = NULL;
+static size_t local_input_len = 0;
+
+// Decode and resize fb to the model input in local_input, R,G,B
+static bool local_input_from_fb(camera_fb_t *fb)
+{
+    const cnn_model_t *m = &posture_model;
+    if (!scratch_reserve(&local_input, &local_input_len, (size_t)m->in_w * m->in_h * 3)) {
+        return false;
+    }
+    int w = fb->width;
+    int h = fb->height;
+    if (fb->format == PIXFORMAT_JPEG) {
+        jpg_scale_t scale = jpg_scale_for(fb, m->in_w, m->in_h);
+        size_t len = (size_t)(fb->width >> scale) * (fb->height >> scale) * 3;
+        if (!scratch_reserve(&local_decode, &local_decode_len, len) ||
+            !jpg_decode_rgb888(fb, scale, local_decode, local_decode_len, &w, &h)) {
+            return false;
+        }
+        img_resize_rgb888(local_decode, w, h, img_crop_full(w, h), local_input, m->in_w, m->in_h, false);
+    } else if (fb->format == PIXFORMAT_RGB565) {
+        img_resize_rgb565(fb->buf, w, h, img_crop_full(w, h), local_input, m->in_w, m->in_h, false);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void local_classify(camera_fb_t *fb)
+{
+    int64_t start = esp_timer_get_time();
+    int8_t logits[POSTURE_MAX];
+    if (!local_input_from_fb(fb) ||
+        !cnn_run(&posture_model, local_input, local_arena, cnn_arena_size(&posture_model), logits)) {
+        log_e("Local classification failed");
+        return;
+    }
+    metrics_observe(METRIC_LOCAL_INFERENCE, esp_timer_get_time() - start);
+    uint8_t confidence;
+    int posture = cnn_argmax(&posture_model, logits, POSTURE_MAX, &confidence);
+    apply_classification((posture_t)posture, confidence, fb_time_us(fb), NULL, true);
+}
+
+static void local_task(void *arg)
+{
+    uint32_t seq = 0;
+    while (true) {
+        int64_t now = esp_timer_get_time();
+        portENTER_CRITICAL(&alert_mux);
+        int64_t silent = now - gateway_result_at;
+        int64_t due = sampler_deadline(&sampler) - now;
+        portEXIT_CRITICAL(&alert_mux);
+        if (silent < LOCAL_FALLBACK_US || due > 0) {
+            int64_t wait_ms = silent < LOCAL_FALLBACK_US ? (LOCAL_FALLBACK_US - silent) / 1000 : due / 1000;
+            vTaskDelay(pdMS_TO_TICKS(wait_ms < LOCAL_POLL_MS ? wait_ms + 1 : LOCAL_POLL_MS));
+            continue;
+        }
+        camera_fb_t *fb = broker_acquire(seq, CAPTURE_TIMEOUT_MS, &seq);
+        if (fb) {
+            local_classify(fb);
+            broker_release(fb);
+        }
+    }
+}
+
+static void local_start(void)
+{
+    size_t len = cnn_arena_size(&posture_model);
+    if (!len) {
+        log_e("Local classifier model is malformed");
+        return;
+    }
+    local_arena = (int8_t *)heap_caps_malloc(len, MALLOC_CAP_SPIRAM);
+    if (!local_arena) {
+        local_arena = (int8_t *)malloc(len);
+    }
+    if (!local_arena) {
+        log_e("No memory for the local classifier");
+        return;
+    }
+    // The gateway gets LOCAL_FALLBACK_US from boot to show up
+    portENTER_CRITICAL(&alert_mux);
+    gateway_result_at = esp_timer_get_time();
+    portEXIT_CRITICAL(&alert_mux);
+    if (xTaskCreatePinnedToCore(local_task, "local_cnn", LOCAL_TASK_STACK, NULL, LOCAL_TASK_PRIO, NULL,
+                                LOCAL_TASK_CORE) != pdPASS) {
+        log_e("Local classifier task start failed");
+    }
+}
+#else
+static void local_start(void)
+{
+}
+#endif
+
+// X-Timestamp is "<sec>.<usec>" with six digits of microseconds
+static int64_t parse_frame_time(const char *text)
+{
+    char *end;
+    int64_t frame_time = strtoll(text, &end, 10) * 1000000;
+    if (*end == '.') {
+        int64_t scale = 100000;
+        for (const char *p = end + 1; *p >= '0' && *p <= '9' && scale; p++, scale /= 10) {
+            frame_time += (*p - '0') * scale;
+        }
+    }
+    return frame_time;
+}
+
+static int cycle_result_cmp(const void *a, const void *b)
+{
+    int64_t ta = ((const cycle_result_t *)a)->frame_time;
+    int64_t tb = ((const cycle_result_t *)b)->frame_time;
+    return ta < tb ? -1 : ta > tb;
+}
+
+#define CLASSIFY_BATCH_MAX 32 // a whole burst in one batch
+
+static_assert(CLASSIFY_BATCH_MAX >= BURST_FRAMES, "a burst must fit one /classify batch");
+
+// A batch of results, applied oldest frame first so results that crossed
+// in flight land in capture order
+static esp_err_t classify_batch(httpd_req_t *req)
+{
+    cycle_result_t results[CLASSIFY_BATCH_MAX];
+    size_t len = req->content_len;
+    if (!len || len % sizeof(cycle_result_t) || len > sizeof(results)) {
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, "Expected 1 to 32 cycle_result_t", HTTPD_RESP_USE_STRLEN);
+        return ESP_FAIL;
+    }
+    size_t got = 0;
+    while (got < len) {
+        int ret = httpd_req_recv(req, (char *)results + got, len - got);
+        if (ret <= 0) {
+            return ESP_FAIL;
+        }
+        got += ret;
+    }
+    size_t count = len / sizeof(cycle_result_t);
+    qsort(results, count, sizeof(cycle_result_t), cycle_result_cmp);
+
+    unsigned outcomes[3] = {0, 0, 0};
+    for (size_t i = 0; i < count; i++) {
+        if (results[i].class_id == CYCLE_NO_RESULT) {
+            continue;
+        }
+        // 0 would mean "the last frame served", which is only right for a single result
+        if (!results[i].frame_time || results[i].class_id >= POSTURE_MAX) {
+            outcomes[RESULT_STALE]++;
+            metrics_add(METRIC_RESULTS_STALE, 1);
+            continue;
+        }
+        outcomes[apply_classification((posture_t)results[i].class_id, results[i].confidence, results[i].frame_time)]++;
+    }
+
+    alert_state_t a = alert_snapshot();
+    char json[128];
+    int n = snprintf(json, sizeof(json), "{\"applied\":%u,\"late\":%u,\"stale\":%u,\"status\":\"%s\",\"timer\":%u}",
+                     outcomes[RESULT_APPLIED], outcomes[RESULT_LATE], outcomes[RESULT_STALE],
+                     posture_label(a.posture), a.timer);
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, json, n);
+}
+
+// Classification results. The form body
+//   status=TDR[&timestamp=<sec>.<usec>|&seq=N][&confidence=0..255]
+// names the frame by its X-Timestamp or X-Sequence header; without either
+// the result is taken for the last frame served. An application/octet-stream
+// body is a batch of cycle_result_t instead. A single result may carry the
+// gateway's stage times in X-Gateway-Trace.
+static esp_err_t classify_handler(httpd_req_t *req) {
+    char type[32];
+    if (httpd_req_get_hdr_value_str(req, "Content-Type", type, sizeof(type)) == ESP_OK &&
+        !strcmp(type, "application/octet-stream")) {
+        return classify_batch(req);
+    }
+
+    char buf[100];
+    int ret = httpd_req_recv(req, buf, sizeof(buf) - 1);
+    if (ret <= 0) {
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, "Bad Request", HTTPD_RESP_USE_STRLEN);
+        return ESP_FAIL;
+    }
+    buf[ret] = '\0';
+
+    // Extract status parameter from the form-encoded body
+    char status[8];
+    if (httpd_query_key_value(buf, "status", status, sizeof(status)) != ESP_OK) {
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, "Missing 'status' parameter", HTTPD_RESP_USE_STRLEN);
+        return ESP_FAIL;
+    }
+
+    char value[24];
+    int64_t frame_time = 0;
+    bool unknown = false;
+    if (httpd_query_key_value(buf, "timestamp", value, sizeof(value)) == ESP_OK) {
+        frame_time = parse_frame_time(value);
+        unknown = !frame_time;
+    } else if (httpd_query_key_value(buf, "seq", value, sizeof(value)) == ESP_OK) {
+        frame_time = served_frame_time(strtoul(value, NULL, 10));
+        unknown = !frame_time;
+    }
+    uint8_t confidence = 255;
+    if (httpd_query_key_value(buf, "confidence", value, sizeof(value)) == ESP_OK) {
+        confidence = atoi(value);
+    }
+
+    result_outcome_t outcome = RESULT_STALE;
+    if (unknown) {
+        metrics_add(METRIC_RESULTS_STALE, 1);
+    } else {
+        trace_gateway_t trace;
+        bool traced = parse_gateway_trace(req, &trace);
+        outcome = apply_classification(posture_from_label(status), confidence, frame_time, traced ? &trace : NULL);
+    }
+
+    httpd_resp_set_hdr(req, "X-Result", result_outcome_names[outcome]);
+    httpd_resp_send(req, "Classification received", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+#define CYCLE_SCHEDULE_SLACK_MS 50 // a frame this close to its deadline is sent right away
+
+// One round trip per inference cycle: apply the result for the previous
+// frame, then answer with the next frame and the resulting alert state.
+// Takes the same mode, crop and since options as /capture, and
+// X-Gateway-Trace like /classify. With ?schedule=1 the
+// frame is only sent once the sampling schedule wants one; before that the
+// answer is 204 with X-Next-Sample, the milliseconds left to wait. An
+// unchanged frame is 304 like on /capture, and the gateway sends its
+// previous result back for it with the next request.
+static esp_err_t cycle_handler(httpd_req_t *req)
+{
+    capture_opts_t opts = {};
+    bool schedule = false;
+    char query[128];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        parse_capture_opts(query, &opts);
+        char value[4];
+        if (httpd_query_key_value(query, "schedule", value, sizeof(value)) == ESP_OK) {
+            schedule = atoi(value) != 0;
+        }
+    }
+
+    cycle_result_t result;
+    if (req->content_len != sizeof(result) ||
+        httpd_req_recv(req, (char *)&result, sizeof(result)) != sizeof(result)) {
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, "Expected a 12 byte cycle_result_t body", HTTPD_RESP_USE_STRLEN);
+        return ESP_FAIL;
+    }
+
+    trace_gateway_t trace;
+    apply_cycle_result(&result, parse_gateway_trace(req, &trace) ? &trace : NULL);
+
+    alert_state_t a = alert_snapshot();
+    char alert[32];
+    snprintf(alert, sizeof(alert), "%s,%u,%u,%u", posture_label(a.posture), a.timer, a.leds, a.buzzer);
+    httpd_resp_set_hdr(req, "X-Alert", alert);
+
+    uint32_t due_ms = sample_due_ms();
+    if (schedule && due_ms > CYCLE_SCHEDULE_SLACK_MS) {
+        char burst_value[24];
+        burst_header(req, burst_value, sizeof(burst_value));
+        char next_sample[12];
+        snprintf(next_sample, sizeof(next_sample), "%u", due_ms);
+        httpd_resp_set_hdr(req, "X-Next-Sample", next_sample);
+        httpd_resp_set_status(req, "204 No Content");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    // Never hand the gateway a frame it has already classified
+    static uint32_t cycle_seq = 0;
+    uint32_t seq = 0;
+    int64_t wait_start = esp_timer_get_time();
+    camera_fb_t *fb = broker_acquire(cycle_seq, CAPTURE_TIMEOUT_MS, &seq);
+    metrics_observe(METRIC_FRAME_WAIT, esp_timer_get_time() - wait_start);
+    if (!fb) {
+        log_e("Camera capture failed");
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    cycle_seq = seq;
+
+    esp_err_t res = send_capture(req, fb, seq, &opts);
+    broker_release(fb);
+    return res;
+}
+
+// Alert clips. A low priority task copies a few frames a second into a live
+// ring covering the last EVENT_PRE_US; when the buzzer fires, those frames
+// and the next EVENT_POST_US go into an event slot that /event serves. One
+// PSRAM arena holds every ring and index, allocated once at start, so the
+// memory used is fixed. The task takes broker references like any reader,
+// so the capture task and /stream never wait on the copies.
+#define EVENT_PRE_US         10000000 // kept before the alert
+#define EVENT_POST_US        5000000  // recorded after it
+#define EVENT_FRAME_US       250000   // one frame recorded per interval
+#define EVENT_RING_BYTES     (512 * 1024)
+#define EVENT_SLOT_BYTES     (640 * 1024)
+#define EVENT_SLOTS          2
+#define EVENT_INDEX_FRAMES   ((EVENT_PRE_US + EVENT_POST_US) / EVENT_FRAME_US + 8)
+#define EVENT_TASK_CORE      0
+#define EVENT_TASK_PRIO      2
+#define EVENT_TASK_STACK     4096
+#define EVENT_ARENA_BYTES    (EVENT_RING_BYTES + EVENT_SLOTS * EVENT_SLOT_BYTES + \
+                              (EVENT_SLOTS + 1) * EVENT_INDEX_FRAMES * sizeof(event_frame_t))
+
+typedef enum {
+    EVENT_EMPTY,
+    EVENT_RECORDING, // alert seen, post-alert frames still coming
+    EVENT_READY,     // frozen, safe to read without the lock
+} event_state_t;
+
+static const char *event_state_names[] = {"empty", "recording", "ready"};
+
+typedef struct
+{
+    event_ring_t ring;
+    event_state_t state;
+    uint32_t id;
+    int64_t alert_time;
+    uint8_t readers; // downloads in progress, the slot is not reused while set
+} event_slot_t;
+
+// Everything below is guarded by event_lock
+static SemaphoreHandle_t event_lock = NULL;
+static event_ring_t event_live;
+static event_slot_t event_slots[EVENT_SLOTS];
+static uint32_t event_next_id = 1;
+static uint32_t event_dropped = 0; // alerts with no free slot
+
+// Slot for a new event: an empty one, else the oldest nobody is reading
+static event_slot_t *event_slot_claim(void)
+{
+    event_slot_t *claim = NULL;
+    for (int i = 0; i < EVENT_SLOTS; i++) {
+        event_slot_t *s = &event_slots[i];
+        if (s->state == EVENT_EMPTY) {
+            return s;
+        }
+        if (s->state == EVENT_READY && !s->readers && (!claim || s->id < claim->id)) {
+            claim = s;
+        }
+    }
+    return claim;
+}
+
+static void event_begin(int64_t alert_time)
+{
+    event_slot_t *s = event_slot_claim();
+    if (!s) {
+        event_dropped++;
+        log_e("No free event slot, alert clip dropped");
+        return;
+    }
+    event_ring_clear(&s->ring);
+    s->state = EVENT_RECORDING;
+    s->id = event_next_id++;
+    s->alert_time = alert_time;
+    for (size_t i = 0; i < event_live.count; i++) {
+        const event_frame_t *f = event_ring_at(&event_live, i);
+        if (f->frame_time >= alert_time - EVENT_PRE_US) {
+            event_ring_push(&s->ring, event_ring_data(&event_live, f), f->len, f->frame_time, f->seq, false);
+        }
+    }
+}
+
+static void event_record(camera_fb_t *fb, uint32_t seq)
+{
+    int64_t frame_time = fb_time_us(fb);
+    event_ring_push(&event_live, fb->buf, fb->len, frame_time, seq, true);
+    event_ring_trim(&event_live, frame_time - EVENT_PRE_US);
+    for (int i = 0; i < EVENT_SLOTS; i++) {
+        event_slot_t *s = &event_slots[i];
+        if (s->state != EVENT_RECORDING) {
+            continue;
+        }
+        if (frame_time > s->alert_time + EVENT_POST_US) {
+            s->state = EVENT_READY;
+            log_i("Event %u ready, %u frames", s->id, (unsigned)s->ring.count);
+        } else if (!event_ring_push(&s->ring, fb->buf, fb->len, frame_time, seq, false)) {
+            // Full, keep what is there
+            s->state = EVENT_READY;
+            log_i("Event %u full, %u frames", s->id, (unsigned)s->ring.count);
+        }
+    }
+}
+
+static void event_task(void *arg)
+{
+    uint32_t seq = 0;
+    int64_t seen_alert = alert_snapshot().alert_time;
+    while (true) {
+        int64_t start = esp_timer_get_time();
+        camera_fb_t *fb = broker_acquire(seq, CAPTURE_TIMEOUT_MS, &seq);
+        if (!fb) {
+            continue;
+        }
+        int64_t alert_time = alert_snapshot().alert_time;
+        xSemaphoreTake(event_lock, portMAX_DELAY);
+        if (alert_time != seen_alert) {
+            seen_alert = alert_time;
+            event_begin(alert_time);
+        }
+        // Only JPEG frames are small enough to keep
+        if (fb->format == PIXFORMAT_JPEG) {
+            event_record(fb, seq);
+        }
+        xSemaphoreGive(event_lock);
+        broker_release(fb);
+
+        int64_t left = EVENT_FRAME_US - (esp_timer_get_time() - start);
+        if (left > 0) {
+            vTaskDelay(pdMS_TO_TICKS(left / 1000));
+        }
+    }
+}
+
+static void event_start(void)
+{
+    uint8_t *arena = (uint8_t *)heap_caps_malloc(EVENT_ARENA_BYTES, MALLOC_CAP_SPIRAM);
+    if (!arena) {
+        // Too large for internal RAM, no clips without PSRAM
+        log_e("No PSRAM for alert clips");
+        return;
+    }
+    event_frame_t *index = (event_frame_t *)(arena + EVENT_RING_BYTES + EVENT_SLOTS * EVENT_SLOT_BYTES);
+    event_ring_init(&event_live, arena, EVENT_RING_BYTES, index, EVENT_INDEX_FRAMES);
+    for (int i = 0; i < EVENT_SLOTS; i++) {
+        event_ring_init(&event_slots[i].ring, arena + EVENT_RING_BYTES + i * EVENT_SLOT_BYTES, EVENT_SLOT_BYTES,
+                        index + (i + 1) * EVENT_INDEX_FRAMES, EVENT_INDEX_FRAMES);
+    }
+    event_lock = xSemaphoreCreateMutex();
+    metrics_set(METRIC_EVENT_ARENA, EVENT_ARENA_BYTES);
+    if (!event_lock || xTaskCreatePinnedToCore(event_task, "event", EVENT_TASK_STACK, NULL, EVENT_TASK_PRIO, NULL,
+                                               EVENT_TASK_CORE) != pdPASS) {
+        log_e("Event task start failed");
+    }
+}
+
+static int64_t event_span_us(const event_ring_t *r)
+{
+    return r->count ? event_ring_at(r, r->count - 1)->frame_time - event_ring_at(r, 0)->frame_time : 0;
+}
+
+// Memory use and the clips held, as JSON
+static esp_err_t event_list(httpd_req_t *req)
+{
+    char json[512];
+    xSemaphoreTake(event_lock, portMAX_DELAY);
+    int len = snprintf(json, sizeof(json),
+                       "{\"arena\":%u,\"ring\":{\"capacity\":%u,\"bytes\":%u,\"frames\":%u,\"span_ms\":%u},"
+                       "\"dropped\":%u,\"events\":[",
+                       (unsigned)EVENT_ARENA_BYTES, (unsigned)event_live.size, (unsigned)event_live.used,
+                       (unsigned)event_live.count, (unsigned)(event_span_us(&event_live) / 1000), event_dropped);
+    bool first = true;
+    for (int i = 0; i < EVENT_SLOTS; i++) {
+        const event_slot_t *s = &event_slots[i];
+        if (s->state == EVENT_EMPTY) {
+            continue;
+        }
+        len += snprintf(json + len, sizeof(json) - len,
+                        "%s{\"id\":%u,\"state\":\"%s\",\"alert_time\":%lld.%06lld,\"capacity\":%u,\"bytes\":%u,"
+                        "\"frames\":%u,\"span_ms\":%u}",
+                        first ? "" : ",", s->id, event_state_names[s->state], (long long)(s->alert_time / 1000000),
+                        (long long)(s->alert_time % 1000000), (unsigned)s->ring.size, (unsigned)s->ring.used,
+                        (unsigned)s->ring.count, (unsigned)(event_span_us(&s->ring) / 1000));
+        first = false;
+    }
+    xSemaphoreGive(event_lock);
+    len += snprintf(json + len, sizeof(json) - len, "]}");
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, json, len);
+}
+
+#define EVENT_BOUNDARY "event-frame-boundary"
+
+// The frames of a frozen ring as raw MJPEG (the JPEGs back to back) or as
+// the parts of a multipart/mixed bundle with the capture time of every
+// frame, then the end of the response
+static esp_err_t event_send_frames(httpd_req_t *req, const event_ring_t *r, bool mjpeg)
+{
+    esp_err_t res = ESP_OK;
+    char part[160];
+    for (size_t i = 0; i < r->count && res == ESP_OK; i++) {
+        const event_frame_t *f = event_ring_at(r, i);
+        if (!mjpeg) {
+            int len = snprintf(part, sizeof(part),
+                               "--" EVENT_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n"
+                               "X-Timestamp: %lld.%06lld\r\nX-Sequence: %u\r\n\r\n",
+                               (unsigned)f->len, (long long)(f->frame_time / 1000000),
+                               (long long)(f->frame_time % 1000000), f->seq);
+            res = httpd_resp_send_chunk(req, part, len);
+        }
+        if (res == ESP_OK) {
+            res = httpd_resp_send_chunk(req, (const char *)event_ring_data(r, f), f->len);
+        }
+        if (res == ESP_OK && !mjpeg) {
+            res = httpd_resp_send_chunk(req, "\r\n", 2);
+        }
+    }
+    if (res == ESP_OK && !mjpeg) {
+        res = httpd_resp_send_chunk(req, "--" EVENT_BOUNDARY "--\r\n", HTTPD_RESP_USE_STRLEN);
+    }
+    if (res == ESP_OK) {
+        res = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return res;
+}
+
+// One clip, as raw MJPEG or as a multipart/mixed bundle
+static esp_err_t event_download(httpd_req_t *req, uint32_t id, bool mjpeg)
+{
+    event_slot_t *s = NULL;
+    xSemaphoreTake(event_lock, portMAX_DELAY);
+    for (int i = 0; i < EVENT_SLOTS; i++) {
+        if (event_slots[i].state != EVENT_EMPTY && event_slots[i].id == id) {
+            s = &event_slots[i];
+        }
+    }
+    event_state_t state = s ? s->state : EVENT_EMPTY;
+    if (state == EVENT_READY) {
+        s->readers++;
+    }
+    xSemaphoreGive(event_lock);
+
+    if (state == EVENT_EMPTY) {
+        return httpd_resp_send_404(req);
+    }
+    if (state == EVENT_RECORDING) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "5");
+        return httpd_resp_send(req, "Still recording", HTTPD_RESP_USE_STRLEN);
+    }
+
+    char disposition[64];
+    snprintf(disposition, sizeof(disposition), "attachment; filename=\"event-%u.%s\"", id, mjpeg ? "mjpeg" : "multipart");
+    httpd_resp_set_type(req, mjpeg ? "video/x-motion-jpeg" : "multipart/mixed;boundary=" EVENT_BOUNDARY);
+    httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    char alert_time[32];
+    snprintf(alert_time, sizeof(alert_time), "%lld.%06lld", (long long)(s->alert_time / 1000000),
+             (long long)(s->alert_time % 1000000));
+    httpd_resp_set_hdr(req, "X-Alert-Time", alert_time);
+
+    // A ready slot doesn't change while readers is set
+    esp_err_t res = event_send_frames(req, &s->ring, mjpeg);
+
+    xSemaphoreTake(event_lock, portMAX_DELAY);
+    s->readers--;
+    xSemaphoreGive(event_lock);
+    return res;
+}
+
+// /event lists the clips, /event?id=N[&format=mjpeg|multipart] downloads one
+static esp_err_t event_handler(httpd_req_t *req)
+{
+    if (!event_lock) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, "Alert clips unavailable", HTTPD_RESP_USE_STRLEN);
+    }
+    char query[64];
+    char value[16];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+        httpd_query_key_value(query, "id", value, sizeof(value)) != ESP_OK) {
+        return event_list(req);
+    }
+    uint32_t id = strtoul(value, NULL, 10);
+    bool mjpeg = httpd_query_key_value(query, "format", value, sizeof(value)) == ESP_OK && !strcmp(value, "mjpeg");
+    return event_download(req, id, mjpeg);
+}
+
+// Burst capture, see burst.h. A classification moving towards lying, or a
+// motion spike, wakes burst_task, which lowers the sensor to BURST_FRAMESIZE
+// and keeps BURST_FRAME_US spaced broker frames for BURST_US in one
+// preallocated PSRAM buffer, then puts the frame size back. /capture and
+// /cycle announce a recorded burst with X-Burst until a client pulls it
+// from /burst, which a gateway classifies as one batch. QVGA still covers
+// the model input, so the smaller frames cost no accuracy.
+#define BURST_BYTES      (512 * 1024)
+#define BURST_FRAMESIZE  FRAMESIZE_QVGA
+#define BURST_TASK_CORE  0
+#define BURST_TASK_PRIO  3 // above the clip and local classifier tasks, it has a deadline
+#define BURST_TASK_STACK 4096
+
+static void burst_record(void)
+{
+    sensor_t *s = esp_camera_sensor_get();
+    framesize_t restore = (framesize_t)s->status.framesize;
+    bool lowered = resolution[restore].width > resolution[BURST_FRAMESIZE].width;
+    if (lowered) {
+        s->set_framesize(s, BURST_FRAMESIZE);
+        status_note_jpeg(s);
+    }
+
+    uint32_t seq = 0;
+    bool done = false;
+    while (!done) {
+        camera_fb_t *fb = broker_acquire(seq, CAPTURE_TIMEOUT_MS, &seq);
+        xSemaphoreTake(burst_lock, portMAX_DELAY);
+        if (fb) {
+            bool reduced = fb->format == PIXFORMAT_JPEG && fb->width <= resolution[BURST_FRAMESIZE].width;
+            done = burst_frame(&burst, fb->buf, fb->len, fb_time_us(fb), seq, reduced);
+        }
+        done = done || burst_expire(&burst, esp_timer_get_time());
+        xSemaphoreGive(burst_lock);
+        if (fb) {
+            broker_release(fb);
+        }
+    }
+
+    // Unless the stream or /control picked another size meanwhile
+    if (lowered && s->status.framesize == BURST_FRAMESIZE) {
+        s->set_framesize(s, restore);
+        status_note_jpeg(s);
+    }
+    xSemaphoreTake(burst_lock, portMAX_DELAY);
+    log_i("Burst %u (%s): %u frames, %u bytes, entry %u ms", burst.id, burst_reason_names[burst.reason],
+          (unsigned)burst.ring.count, (unsigned)burst.ring.used,
+          burst.started ? (unsigned)((burst.started - burst.triggered) / 1000) : 0);
+    xSemaphoreGive(burst_lock);
+}
+
+static void burst_task(void *arg)
+{
+    while (true) {
+        xSemaphoreTake(burst_wake, portMAX_DELAY);
+        portENTER_CRITICAL(&alert_mux);
+        burst_reason_t reason = burst_pending_reason;
+        int64_t at = burst_pending_at;
+        burst_pending = false;
+        portEXIT_CRITICAL(&alert_mux);
+
+        xSemaphoreTake(burst_lock, portMAX_DELAY);
+        bool started = burst_trigger(&burst, reason, at);
+        xSemaphoreGive(burst_lock);
+        if (started) {
+            burst_record();
+        }
+    }
+}
+
+static void burst_start(void)
+{
+    // Only JPEG frames are small enough to keep
+    sensor_t *s = esp_camera_sensor_get();
+    if (s->pixformat != PIXFORMAT_JPEG) {
+        return;
+    }
+    uint8_t *buf = (uint8_t *)heap_caps_malloc(BURST_BYTES + BURST_FRAMES * sizeof(event_frame_t), MALLOC_CAP_SPIRAM);
+    if (!buf) {
+        log_e("No PSRAM for burst capture");
+        return;
+    }
+    burst_init(&burst, buf, BURST_BYTES, (event_frame_t *)(buf + BURST_BYTES), BURST_FRAMES);
+    burst_lock = xSemaphoreCreateMutex();
+    SemaphoreHandle_t wake = xSemaphoreCreateBinary();
+    if (!burst_lock || !wake ||
+        xTaskCreatePinnedToCore(burst_task, "burst", BURST_TASK_STACK, NULL, BURST_TASK_PRIO, NULL,
+                                BURST_TASK_CORE) != pdPASS) {
+        log_e("Burst task start failed");
+        return;
+    }
+    // Requests start once the task can take them
+    portENTER_CRITICAL(&alert_mux);
+    burst_wake = wake;
+    portEXIT_CRITICAL(&alert_mux);
+}
+
+// Memory use and the newest burst, as JSON
+static esp_err_t burst_status(httpd_req_t *req)
+{
+    char json[384];
+    xSemaphoreTake(burst_lock, portMAX_DELAY);
+    const burst_t *b = &burst;
+    uint32_t fps = burst_fps100(b);
+    int len = snprintf(json, sizeof(json),
+                       "{\"capacity\":%u,\"index\":%u,\"state\":\"%s\",\"id\":%u,\"reason\":\"%s\",\"bytes\":%u,"
+                       "\"frames\":%u,\"entry_ms\":%d,\"span_ms\":%u,\"fps\":%u.%02u,\"pulled\":%s,"
+                       "\"refused\":%u,\"skipped\":%u,\"abandoned\":%u}",
+                       (unsigned)b->ring.size, (unsigned)b->ring.index_len, burst_state_names[b->state], b->id,
+                       burst_reason_names[b->reason], (unsigned)b->ring.used, (unsigned)b->ring.count,
+                       b->started ? (int)((b->started - b->triggered) / 1000) : -1,
+                       (unsigned)(event_span_us(&b->ring) / 1000), fps / 100, fps % 100,
+                       b->pulled ? "true" : "false", b->refused, b->skipped, b->abandoned);
+    xSemaphoreGive(burst_lock);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, json, len);
+}
+
+// /burst reports the newest burst, /burst?id=N[&format=mjpeg|multipart]
+// downloads it once it is recorded
+static esp_err_t burst_handler(httpd_req_t *req)
+{
+    if (!burst_lock) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, "Burst capture unavailable", HTTPD_RESP_USE_STRLEN);
+    }
+    char query[64];
+    char value[16];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+        httpd_query_key_value(query, "id", value, sizeof(value)) != ESP_OK) {
+        return burst_status(req);
+    }
+    uint32_t id = strtoul(value, NULL, 10);
+    bool mjpeg = httpd_query_key_value(query, "format", value, sizeof(value)) == ESP_OK && !strcmp(value, "mjpeg");
+
+    xSemaphoreTake(burst_lock, portMAX_DELAY);
+    burst_state_t state = burst.id == id ? burst.state : BURST_IDLE;
+    burst_reason_t reason = burst.reason;
+    if (state == BURST_READY) {
+        burst.readers++;
+    }
+    xSemaphoreGive(burst_lock);
+
+    if (state == BURST_IDLE) {
+        return httpd_resp_send_404(req);
+    }
+    if (state == BURST_RECORDING) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "1");
+        return httpd_resp_send(req, "Still recording", HTTPD_RESP_USE_STRLEN);
+    }
+
+    char disposition[64];
+    snprintf(disposition, sizeof(disposition), "attachment; filename=\"burst-%u.%s\"", id, mjpeg ? "mjpeg" : "multipart");
+    httpd_resp_set_type(req, mjpeg ? "video/x-motion-jpeg" : "multipart/mixed;boundary=" EVENT_BOUNDARY);
+    httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "X-Burst-Reason", burst_reason_names[reason]);
+
+    // A ready burst doesn't change while readers is set
+    esp_err_t res = event_send_frames(req, &burst.ring, mjpeg);
+
+    xSemaphoreTake(burst_lock, portMAX_DELAY);
+    burst.readers--;
+    if (res == ESP_OK) {
+        burst.pulled = true;
+    }
+    xSemaphoreGive(burst_lock);
+    return res;
+}
+
+// Alert log on flash, see alert_log.h. The log task moves the records the
+// alert timer queued into the log's batch and writes batches out when full,
+// every LOG_FLUSH_US, or right away when the buzzer fires.
+#define LOG_FLUSH_US     60000000 // longest a record waits in RAM
+#define LOG_POLL_MS      200
+#define LOG_TASK_CORE    0
+#define LOG_TASK_PRIO    1
+#define LOG_TASK_STACK   4096
+#define LOG_QUERY_CHUNK  LOG_BLOCK_RECORDS
+
+static alert_log_t alert_log;
+static SemaphoreHandle_t log_lock = NULL; // alert_log, queries and writes
+
+static void log_task(void *arg)
+{
+    int64_t last_flush = esp_timer_get_time();
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(LOG_POLL_MS));
+        log_record_t records[LOG_PENDING];
+        portENTER_CRITICAL(&alert_mux);
+        size_t n = log_pending_count;
+        memcpy(records, log_pending, n * sizeof(log_record_t));
+        log_pending_count = 0;
+        bool urgent = log_urgent;
+        log_urgent = false;
+        portEXIT_CRITICAL(&alert_mux);
+
+        int64_t now = esp_timer_get_time();
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        bool full = false;
+        for (size_t i = 0; i < n; i++) {
+            full |= alert_log_append(&alert_log, &records[i]);
+            if (full) {
+                alert_log_flush(&alert_log);
+                full = false;
+                last_flush = now;
+            }
+        }
+        if (alert_log.batch_count && (urgent || now - last_flush >= LOG_FLUSH_US)) {
+            if (!alert_log_flush(&alert_log)) {
+                log_e("Alert log write failed");
+            }
+            last_flush = now;
         }
-        if (res == ESP_OK)
-        {
-            size_t hlen = snprintf((char *)part_buf, 128, _STREAM_PART, _jpg_buf_len, _timestamp.tv_sec, _timestamp.tv_usec);
-            res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
+        xSemaphoreGive(log_lock);
+    }
+}
+
+// "<sec>[.<usec>]" as in X-Timestamp, false if it is not a number
+static bool parse_log_time(const char *text, int64_t *out)
+{
+    char *end;
+    int64_t t = strtoll(text, &end, 10);
+    if (end == text) {
+        return false;
+    }
+    t *= 1000000;
+    if (*end == '.') {
+        int64_t scale = 100000;
+        for (const char *p = end + 1; *p >= '0' && *p <= '9' && scale; p++, scale /= 10) {
+            t += (text[0] == '-' ? -1 : 1) * (*p - '0') * scale;
         }
-        if (res == ESP_OK)
-        {
-            res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
+    }
+    *out = t;
+    return true;
+}
+
+// /log[?from=T][&to=T][&format=csv|bin] streams the records with
+// from <= time < to, T in seconds as in X-Timestamp. CSV by default, bin is
+// the 16-byte records as stored.
+static esp_err_t log_handler(httpd_req_t *req)
+{
+    if (!log_lock) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, "Alert log unavailable", HTTPD_RESP_USE_STRLEN);
+    }
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+    bool binary = false;
+    char query[96];
+    char value[24];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if ((httpd_query_key_value(query, "from", value, sizeof(value)) == ESP_OK && !parse_log_time(value, &from)) ||
+            (httpd_query_key_value(query, "to", value, sizeof(value)) == ESP_OK && !parse_log_time(value, &to))) {
+            httpd_resp_set_status(req, "400 Bad Request");
+            return httpd_resp_send(req, "Bad from or to", HTTPD_RESP_USE_STRLEN);
         }
-        if (fb)
-        {
-            esp_camera_fb_return(fb);
-            fb = NULL;
-            _jpg_buf = NULL;
+        binary = httpd_query_key_value(query, "format", value, sizeof(value)) == ESP_OK && !strcmp(value, "bin");
+    }
+
+    // Handlers run one at a time, so the cursor and buffers can be static
+    static alert_log_query_t q;
+    static log_record_t records[LOG_QUERY_CHUNK];
+    static char csv[LOG_QUERY_CHUNK * 64];
+
+    char stats[48];
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    alert_log_query_begin(&alert_log, &q, from, to);
+    snprintf(stats, sizeof(stats), "%u", alert_log_disk_bytes(&alert_log));
+    xSemaphoreGive(log_lock);
+    httpd_resp_set_type(req, binary ? "application/octet-stream" : "text/csv");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "X-Log-Bytes", stats);
+
+    esp_err_t res = ESP_OK;
+    if (!binary) {
+        res = httpd_resp_send_chunk(req, "time,boot,posture,timer,flags,motion\n", HTTPD_RESP_USE_STRLEN);
+    }
+    while (res == ESP_OK) {
+        // Hold the lock only while reading, not while sending
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        size_t n = alert_log_query_next(&alert_log, &q, records, LOG_QUERY_CHUNK);
+        xSemaphoreGive(log_lock);
+        if (!n) {
+            break;
         }
-        else if (_jpg_buf)
-        {
-            free(_jpg_buf);
-            _jpg_buf = NULL;
+        if (binary) {
+            res = httpd_resp_send_chunk(req, (const char *)records, n * sizeof(log_record_t));
+            continue;
         }
-        if (res != ESP_OK)
-        {
-            log_e("Send frame failed");
-            break;
+        int len = 0;
+        for (size_t i = 0; i < n; i++) {
+            const log_record_t *r = &records[i];
+            lldiv_t t = lldiv(r->time_us, 1000000);
+            len += snprintf(csv + len, sizeof(csv) - len, "%lld.%06lld,%u,%s,%u,%u,%u\n", t.quot, llabs(t.rem),
+                            r->boot, r->posture == LOG_POSTURE_NONE ? "none" : posture_label((posture_t)r->posture),
+                            r->timer, r->flags, r->motion);
         }
-        int64_t fr_end = esp_timer_get_time();
-
-        int64_t frame_time = fr_end - last_frame;
-        frame_time /= 1000;
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-        uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
-#endif
-        log_i("MJPG: %uB %ums (%.1ffps), AVG: %ums (%.1ffps)"
-                 ,
-                 (uint32_t)(_jpg_buf_len),
-                 (uint32_t)frame_time, 1000.0 / (uint32_t)frame_time,
-                 avg_frame_time, 1000.0 / avg_frame_time
-        );
+        res = httpd_resp_send_chunk(req, csv, len);
+    }
+    if (res == ESP_OK) {
+        res = httpd_resp_send_chunk(req, NULL, 0);
     }
     return res;
 }
 
-static esp_err_t parse_get(httpd_req_t *req, char **obuf)
+// WebSocket push channel (push.h). A subscriber holds one socket to /ws,
+// gets an event the moment the posture, timer, LEDs, buzzer or sensor
+// settings change, an alert fires or, if it asks, a frame is analysed, and
+// sends its commands over the same socket. The alert timer, motion analysis
+// and status cache only wake ws_task, which works out what changed and fans
+// it out. Commands are applied on the handler's thread, which queues their
+// replies for ws_task too, up to WS_REPLIES a subscriber hasn't been sent
+// before it is closed. Only ws_task writes to subscribers, so frames never
+// interleave, and it writes without ws_lock held, so a subscriber that stops
+// reading never holds up camera_httpd. Its socket gives up after
+// WS_SEND_TIMEOUT_MS and it is dropped, so it holds up the other
+// subscribers' events no longer than that.
+#define WS_CLIENTS     4 // of camera_httpd's 7 sockets, the rest stay for requests
+#define WS_REPLIES     8   // command replies waiting per subscriber
+#define WS_REPLY_MAX   192 // longest reply, push_reply_json() makes at most 170
+#define WS_SEND_TIMEOUT_MS 500 // instead of camera_httpd's send_wait_timeout
+#define WS_TASK_CORE   0
+#define WS_TASK_PRIO   2
+#define WS_TASK_STACK  4096
+
+#define WS_SEND_STATE  0x01 // the whole state
+#define WS_SEND_STATUS 0x02 // the status fields changed since status_since
+
+typedef struct
+{
+    int fd;                // -1 when the slot is free
+    uint8_t topics;        // push_topic_t bits
+    uint8_t pending;       // WS_SEND_* bits ws_task hasn't sent yet
+    uint32_t status_since; // status version the subscriber has
+    uint8_t reply_head;    // oldest waiting reply
+    uint8_t reply_count;
+    uint8_t reply_len[WS_REPLIES];
+    char replies[WS_REPLIES][WS_REPLY_MAX];
+} ws_client_t;
+
+static SemaphoreHandle_t ws_lock = NULL; // ws_clients, never held while sending
+static ws_client_t ws_clients[WS_CLIENTS];
+
+static void ws_drop(ws_client_t *c)
 {
-    char *buf = NULL;
-    size_t buf_len = 0;
+    c->fd = -1;
+    ws_count--;
+    metrics_set(METRIC_WS_CLIENTS, ws_count);
+}
 
-    buf_len = httpd_req_get_url_query_len(req) + 1;
-    if (buf_len > 1) {
-        buf = (char *)malloc(buf_len);
-        if (!buf) {
-            httpd_resp_send_500(req);
-            return ESP_FAIL;
+// camera_httpd close_fn: forget the subscriber before its descriptor can be
+// reused
+static void ws_close_fn(httpd_handle_t hd, int sockfd)
+{
+    xSemaphoreTake(ws_lock, portMAX_DELAY);
+    for (int i = 0; i < WS_CLIENTS; i++) {
+        if (ws_clients[i].fd == sockfd) {
+            ws_drop(&ws_clients[i]);
         }
-        if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK) {
-            *obuf = buf;
-            return ESP_OK;
+    }
+    xSemaphoreGive(ws_lock);
+    close(sockfd);
+}
+
+static ws_client_t *ws_find(int fd)
+{
+    for (int i = 0; i < WS_CLIENTS; i++) {
+        if (ws_clients[i].fd == fd) {
+            return &ws_clients[i];
         }
-        free(buf);
     }
-    httpd_resp_send_404(req);
-    return ESP_FAIL;
+    return NULL;
 }
 
-static esp_err_t cmd_handler(httpd_req_t *req)
+// Send one text frame from ws_task, closing the subscriber if its socket
+// failed. Blocks for as long as the socket does, so never with ws_lock held.
+static bool ws_send(int fd, const char *text, size_t len)
 {
-    char *buf = NULL;
-    char variable[32];
-    char value[32];
+    httpd_ws_frame_t frame = {};
+    frame.final = true;
+    frame.type = HTTPD_WS_TYPE_TEXT;
+    frame.payload = (uint8_t *)text;
+    frame.len = len;
+    if (httpd_ws_send_frame_async(camera_httpd, fd, &frame) != ESP_OK) {
+        log_e("Send event failed");
+        httpd_sess_trigger_close(camera_httpd, fd);
+        xSemaphoreTake(ws_lock, portMAX_DELAY);
+        ws_client_t *c = ws_find(fd);
+        if (c) {
+            ws_drop(c);
+        }
+        xSemaphoreGive(ws_lock);
+        return false;
+    }
+    metrics_add(METRIC_WS_EVENTS, 1);
+    return true;
+}
 
-    if (parse_get(req, &buf) != ESP_OK) {
-        return ESP_FAIL;
+// Send text to every subscriber of topic
+static void ws_publish(push_topic_t topic, const char *text, int len)
+{
+    if (len <= 0 || len >= PUSH_EVENT_MAX) {
+        return;
     }
-    if (httpd_query_key_value(buf, "var", variable, sizeof(variable)) != ESP_OK ||
-        httpd_query_key_value(buf, "val", value, sizeof(value)) != ESP_OK) {
-        free(buf);
-        httpd_resp_send_404(req);
-        return ESP_FAIL;
+    int fds[WS_CLIENTS];
+    int count = 0;
+    xSemaphoreTake(ws_lock, portMAX_DELAY);
+    for (int i = 0; i < WS_CLIENTS; i++) {
+        if (ws_clients[i].fd >= 0 && (ws_clients[i].topics & topic)) {
+            fds[count++] = ws_clients[i].fd;
+        }
     }
-    free(buf);
-
-    int val = atoi(value);
-    log_i("%s = %d", variable, val);
-    sensor_t *s = esp_camera_sensor_get();
-    int res = 0;
-
-    if (!strcmp(variable, "framesize")) {
-        if (s->pixformat == PIXFORMAT_JPEG) {
-            res = s->set_framesize(s, (framesize_t)val);
-        }
-    }
-    else if (!strcmp(variable, "quality"))
-        res = s->set_quality(s, val);
-    else if (!strcmp(variable, "contrast"))
-        res = s->set_contrast(s, val);
-    else if (!strcmp(variable, "brightness"))
-        res = s->set_brightness(s, val);
-    else if (!strcmp(variable, "saturation"))
-        res = s->set_saturation(s, val);
-    // else if (!strcmp(variable, "gainceiling"))
-    //     res = s->set_gainceiling(s, (gainceiling_t)val);
-    // else if (!strcmp(variable, "colorbar"))
-    //     res = s->set_colorbar(s, val);
-    // else if (!strcmp(variable, "awb"))
-    //     res = s->set_whitebal(s, val);
-    // else if (!strcmp(variable, "agc"))
-    //     res = s->set_gain_ctrl(s, val);
-    // else if (!strcmp(variable, "aec"))
-    //     res = s->set_exposure_ctrl(s, val);
-    // else if (!strcmp(variable, "hmirror"))
-    //     res = s->set_hmirror(s, val);
-    // else if (!strcmp(variable, "vflip"))
-    //     res = s->set_vflip(s, val);
-    // else if (!strcmp(variable, "awb_gain"))
-    //     res = s->set_awb_gain(s, val);
-    // else if (!strcmp(variable, "agc_gain"))
-    //     res = s->set_agc_gain(s, val);
-    // else if (!strcmp(variable, "aec_value"))
-    //     res = s->set_aec_value(s, val);
-    // else if (!strcmp(variable, "aec2"))
-    //     res = s->set_aec2(s, val);
-    // else if (!strcmp(variable, "dcw"))
-    //     res = s->set_dcw(s, val);
-    // else if (!strcmp(variable, "bpc"))
-    //     res = s->set_bpc(s, val);
-    // else if (!strcmp(variable, "wpc"))
-    //     res = s->set_wpc(s, val);
-    // else if (!strcmp(variable, "raw_gma"))
-    //     res = s->set_raw_gma(s, val);
-    // else if (!strcmp(variable, "lenc"))
-    //     res = s->set_lenc(s, val);
-    // else if (!strcmp(variable, "special_effect"))
-    //     res = s->set_special_effect(s, val);
-    // else if (!strcmp(variable, "wb_mode"))
-    //     res = s->set_wb_mode(s, val);
-    // else if (!strcmp(variable, "ae_level"))
-    //     res = s->set_ae_level(s, val);
-    else {
-        log_i("Unknown command: %s", variable);
-        res = -1;
-    }
-
-    if (res < 0) {
-        return httpd_resp_send_500(req);
+    xSemaphoreGive(ws_lock);
+    for (int i = 0; i < count; i++) {
+        ws_send(fds[i], text, len);
     }
+}
 
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    return httpd_resp_send(req, NULL, 0);
+static void ws_state_now(push_state_t *state, alert_state_t *a)
+{
+    portENTER_CRITICAL(&alert_mux);
+    *a = alert_state;
+    push_state_from(state, a, result_local);
+    portEXIT_CRITICAL(&alert_mux);
 }
 
-static int print_reg(char * p, sensor_t * s, uint16_t reg, uint32_t mask){
-    return sprintf(p, "\"0x%x\":%u,", reg, s->get_reg(s, reg, mask));
+static bool ws_send_state(int fd)
+{
+    push_state_t state;
+    alert_state_t a;
+    ws_state_now(&state, &a);
+    char event[PUSH_EVENT_MAX];
+    int len = push_state_json(&state, event, sizeof(event));
+    return ws_send(fd, event, len);
 }
 
-static esp_err_t status_handler(httpd_req_t *req)
+// Send the status fields changed since version *since, nothing if that is
+// current, and move *since to the version sent. False if the socket failed.
+static bool ws_send_status(int fd, uint32_t *since)
 {
-    static char json_response[1024];
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    uint32_t version = status_cache.version;
+    if (version == *since) {
+        xSemaphoreGive(status_lock);
+        return true;
+    }
+    size_t len = push_status_json(&status_cache, *since, NULL, 0);
+    char *json = (char *)buf_alloc(len + 1, NULL);
+    if (json) {
+        push_status_json(&status_cache, *since, json, len + 1);
+    }
+    xSemaphoreGive(status_lock);
+    if (!json) {
+        log_e("No memory for a status event");
+        return true;
+    }
+    bool sent = ws_send(fd, json, len);
+    buf_free(json);
+    if (sent) {
+        *since = version;
+    }
+    return sent;
+}
 
-    sensor_t *s = esp_camera_sensor_get();
-    char *p = json_response;
-    *p++ = '{';
+// Send one subscriber what it is due: the state and status it asked for or
+// joined without, status changes if it follows them, then command replies
+static void ws_serve(ws_client_t *c)
+{
+    xSemaphoreTake(ws_lock, portMAX_DELAY);
+    int fd = c->fd;
+    uint8_t pending = c->pending;
+    bool status = (pending & WS_SEND_STATUS) || (c->topics & PUSH_TOPIC_STATUS);
+    uint32_t since = c->status_since;
+    c->pending = 0;
+    xSemaphoreGive(ws_lock);
+    if (fd < 0) {
+        return;
+    }
 
-    if(s->id.PID == OV5640_PID || s->id.PID == OV3660_PID){
-        for(int reg = 0x3400; reg < 0x3406; reg+=2){
-            p+=print_reg(p, s, reg, 0xFFF);//12 bit
+    if ((pending & WS_SEND_STATE) && !ws_send_state(fd)) {
+        return;
+    }
+    if (status) {
+        uint32_t version = since;
+        if (!ws_send_status(fd, &version)) {
+            return;
         }
-        p+=print_reg(p, s, 0x3406, 0xFF);
-
-        p+=print_reg(p, s, 0x3500, 0xFFFF0);//16 bit
-        p+=print_reg(p, s, 0x3503, 0xFF);
-        p+=print_reg(p, s, 0x350a, 0x3FF);//10 bit
-        p+=print_reg(p, s, 0x350c, 0xFFFF);//16 bit
-
-        for(int reg = 0x5480; reg <= 0x5490; reg++){
-            p+=print_reg(p, s, reg, 0xFF);
+        xSemaphoreTake(ws_lock, portMAX_DELAY);
+        // Unless a command asked for another version meanwhile
+        if (c->fd == fd && c->status_since == since) {
+            c->status_since = version;
         }
-
-        for(int reg = 0x5380; reg <= 0x538b; reg++){
-            p+=print_reg(p, s, reg, 0xFF);
+        xSemaphoreGive(ws_lock);
+    }
+    // A command queued meanwhile has its event sent first, on the next pass
+    char reply[WS_REPLY_MAX];
+    while (true) {
+        xSemaphoreTake(ws_lock, portMAX_DELAY);
+        int len = 0;
+        if (c->fd == fd && c->reply_count && !c->pending) {
+            len = c->reply_len[c->reply_head];
+            memcpy(reply, c->replies[c->reply_head], len);
+            c->reply_head = (c->reply_head + 1) % WS_REPLIES;
+            c->reply_count--;
         }
-
-        for(int reg = 0x5580; reg < 0x558a; reg++){
-            p+=print_reg(p, s, reg, 0xFF);
+        xSemaphoreGive(ws_lock);
+        if (!len || !ws_send(fd, reply, len)) {
+            return;
         }
-        p+=print_reg(p, s, 0x558a, 0x1FF);//9 bit
-    } else if(s->id.PID == OV2640_PID){
-        p+=print_reg(p, s, 0xd3, 0xFF);
-        p+=print_reg(p, s, 0x111, 0xFF);
-        p+=print_reg(p, s, 0x132, 0xFF);
-    }
-
-    p += sprintf(p, "\"xclk\":%u,", s->xclk_freq_hz / 1000000);
-    p += sprintf(p, "\"pixformat\":%u,", s->pixformat);
-    p += sprintf(p, "\"framesize\":%u,", s->status.framesize);
-    p += sprintf(p, "\"quality\":%u,", s->status.quality);
-    p += sprintf(p, "\"brightness\":%d,", s->status.brightness);
-    p += sprintf(p, "\"contrast\":%d,", s->status.contrast);
-    p += sprintf(p, "\"saturation\":%d,", s->status.saturation);
-    p += sprintf(p, "\"sharpness\":%d,", s->status.sharpness);
-    p += sprintf(p, "\"special_effect\":%u,", s->status.special_effect);
-    p += sprintf(p, "\"wb_mode\":%u,", s->status.wb_mode);
-    p += sprintf(p, "\"awb\":%u,", s->status.awb);
-    p += sprintf(p, "\"awb_gain\":%u,", s->status.awb_gain);
-    p += sprintf(p, "\"aec\":%u,", s->status.aec);
-    p += sprintf(p, "\"aec2\":%u,", s->status.aec2);
-    p += sprintf(p, "\"ae_level\":%d,", s->status.ae_level);
-    p += sprintf(p, "\"aec_value\":%u,", s->status.aec_value);
-    p += sprintf(p, "\"agc\":%u,", s->status.agc);
-    p += sprintf(p, "\"agc_gain\":%u,", s->status.agc_gain);
-    p += sprintf(p, "\"gainceiling\":%u,", s->status.gainceiling);
-    p += sprintf(p, "\"bpc\":%u,", s->status.bpc);
-    p += sprintf(p, "\"wpc\":%u,", s->status.wpc);
-    p += sprintf(p, "\"raw_gma\":%u,", s->status.raw_gma);
-    p += sprintf(p, "\"lenc\":%u,", s->status.lenc);
-    p += sprintf(p, "\"hmirror\":%u,", s->status.hmirror);
-    p += sprintf(p, "\"dcw\":%u,", s->status.dcw);
-    p += sprintf(p, "\"colorbar\":%u", s->status.colorbar);
-    p += sprintf(p, ",\"led_intensity\":%d", -1);
-    *p++ = '}';
-    *p++ = 0;
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    return httpd_resp_send(req, json_response, strlen(json_response));
+    }
 }
 
-static esp_err_t index_handler(httpd_req_t *req)
+static void ws_task(void *arg)
 {
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
-    sensor_t *s = esp_camera_sensor_get();
-    if (s != NULL) {
-        return httpd_resp_send(req, (const char *)index_ov2640_html_gz, index_ov2640_html_gz_len);
-    } else {
-        log_e("Camera sensor not found");
-        return httpd_resp_send_500(req);
+    push_state_t published;
+    alert_state_t a;
+    ws_state_now(&published, &a);
+    int64_t alert_seen = a.alert_time;
+    uint32_t frame_seen = 0;
+    char event[PUSH_EVENT_MAX];
+    while (true) {
+        xSemaphoreTake(ws_wake, portMAX_DELAY);
+        // Subscribers' own requests first, so one that just joined has the
+        // whole state before the changes to it
+        for (int i = 0; i < WS_CLIENTS; i++) {
+            ws_serve(&ws_clients[i]);
+        }
+
+        push_state_t state;
+        ws_state_now(&state, &a);
+        portENTER_CRITICAL(&alert_mux);
+        uint32_t frame_seq = motion_hash_seq;
+        int64_t frame_time = motion_hash_time;
+        uint64_t hash = motion_hash;
+        portEXIT_CRITICAL(&alert_mux);
+        if (push_state_changed(&published, &state)) {
+            ws_publish(PUSH_TOPIC_STATE, event, push_state_json(&state, event, sizeof(event)));
+            published = state;
+        }
+        if (a.alert_time != alert_seen) {
+            ws_publish(PUSH_TOPIC_ALERT, event, push_alert_json(&a, event, sizeof(event)));
+            alert_seen = a.alert_time;
+        }
+        if (frame_seq != frame_seen) {
+            ws_publish(PUSH_TOPIC_FRAME, event,
+                       push_frame_json(frame_seq, frame_time, state.motion, hash, event, sizeof(event)));
+            frame_seen = frame_seq;
+        }
     }
 }
 
-static esp_err_t classify_handler(httpd_req_t *req) {
-    char buf[100];
-    int ret = httpd_req_recv(req, buf, sizeof(buf));
-    if (ret <= 0) {
-        httpd_resp_set_status(req, "400 Bad Request");
-        httpd_resp_send(req, "Bad Request", HTTPD_RESP_USE_STRLEN);
-        return ESP_FAIL;
+static esp_err_t ws_start(void)
+{
+    for (int i = 0; i < WS_CLIENTS; i++) {
+        ws_clients[i].fd = -1;
     }
-
-    // Extract status parameter
-    char *status = strstr(buf, "status=");
-    if (!status) {
-        httpd_resp_set_status(req, "400 Bad Request");
-        httpd_resp_send(req, "Missing 'status' parameter", HTTPD_RESP_USE_STRLEN);
+    ws_lock = xSemaphoreCreateMutex();
+    ws_wake = xSemaphoreCreateBinary();
+    if (!ws_lock || !ws_wake ||
+        xTaskCreatePinnedToCore(ws_task, "ws", WS_TASK_STACK, NULL, WS_TASK_PRIO, NULL, WS_TASK_CORE) != pdPASS) {
         return ESP_FAIL;
     }
-    status += 7; // Skip "status=" to get the actual value
-
-    // Update the current status if it has changed
-    if (strcmp(status, current_status) != 0) {
-        strncpy(current_status, status, sizeof(current_status) - 1);
-        current_status[sizeof(current_status) - 1] = '\0';
-
-        // Reset timer and buzzer state
-        timer = 0;
-        buzzer_active = false;
-
-        // Turn off all LEDs
-        for (int i = 0; i < 4; i++) {
-            digitalWrite(ledPins[i], LOW);
-        }
+    return ESP_OK;
+}
 
-        Serial.print("Updated classification status: ");
-        Serial.println(current_status);
+// After the handshake: take a slot and have ws_task send what a poller
+// would have fetched first, the state and the whole status
+static esp_err_t ws_join(httpd_req_t *req)
+{
+    int fd = httpd_req_to_sockfd(req);
+    xSemaphoreTake(ws_lock, portMAX_DELAY);
+    ws_client_t *c = ws_find(-1);
+    if (c) {
+        c->fd = fd;
+        c->topics = PUSH_TOPICS_DEFAULT;
+        c->pending = WS_SEND_STATE | WS_SEND_STATUS;
+        c->status_since = 0;
+        c->reply_head = 0;
+        c->reply_count = 0;
+        ws_count++;
+        metrics_set(METRIC_WS_CLIENTS, ws_count);
     }
-
-    httpd_resp_send(req, "Classification received", HTTPD_RESP_USE_STRLEN);
+    xSemaphoreGive(ws_lock);
+    if (!c) {
+        log_w("Too many WebSocket subscribers");
+        return ESP_FAIL;
+    }
+    struct timeval tv = {0, WS_SEND_TIMEOUT_MS * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    xSemaphoreGive(ws_wake);
     return ESP_OK;
 }
 
-static esp_err_t timer_handler(httpd_req_t *req) {
-    // Initialize GPIOs if not already done
-    Serial.print("Status: ");
-    Serial.println(current_status);
-    Serial.println(sizeof(current_status)/sizeof(char));
-        for (int i = 0; i < 4; i++) {
-
-            digitalWrite(ledPins[i], LOW); // Start LEDs OFF
+// Apply a command and queue its reply. False if the subscriber has
+// WS_REPLIES replies it hasn't been sent yet, it isn't reading them.
+static bool ws_command(int fd, const char *text)
+{
+    push_command_t cmd;
+    char error[64];
+    const char *what = NULL;
+    uint32_t since = 0;
+    uint8_t topics = PUSH_TOPICS_DEFAULT;
+    query_pair_t pair;
+    const char *cursor;
+
+    if (!push_parse(text, &cmd)) {
+        cmd.name = "";
+        cmd.name_len = 0;
+        cmd.has_id = false;
+        cmd.cmd = PUSH_CMD_UNKNOWN;
+        what = "Expected cmd=NAME";
+    }
+    cursor = cmd.args;
+    switch (cmd.cmd) {
+    case PUSH_CMD_STATE:
+        break;
+    case PUSH_CMD_STATUS:
+        while (query_next(&cursor, &pair)) {
+            int value;
+            if (query_key_is(&pair, "since") && query_int(&pair, &value)) {
+                since = (uint32_t)value;
+            }
         }
-        digitalWrite(buzzerPin, LOW); // Start buzzer OFF
-    
-    // Handle the "sleeping" status
-    if (strcmp(current_status, "TDR") == 0) {
-        if (timer < 16) {
-            timer++; // Increment the timer
-            Serial.print("Timer ON :");
-            Serial.println(timer);
-            Serial.print("status :");
-            Serial.println(current_status);
-        }
-
-        // Update LEDs based on the timer
-        for (int i = 0; i < 4; i++) {
-            if (timer >= (i + 1) * 4) {
-                digitalWrite(ledPins[i], HIGH); // Turn on LED
+        break;
+    case PUSH_CMD_CONTROL: {
+        // Applied before taking ws_lock, rereading the sensor takes a while
+        control_set_t batch[CONTROL_BATCH_MAX];
+        size_t count = 0;
+        query_pair_t bad;
+        const char *problem = control_parse(cmd.args, batch, &count, &bad);
+        if (problem) {
+            snprintf(error, sizeof(error), "%s: %.*s", problem, (int)bad.key_len, bad.key);
+            what = error;
+        } else if (!count) {
+            what = "No controls";
+        } else if (!control_apply(batch, count)) {
+            what = "A control failed";
+        }
+        break;
+    }
+    case PUSH_CMD_SUBSCRIBE:
+        topics = 0;
+        while (query_next(&cursor, &pair)) {
+            if (query_key_is(&pair, "topics") && !push_topics(&pair, &topics)) {
+                what = "Unknown topic";
             }
         }
-
-        // Trigger the buzzer when the timer reaches 16
-        if (timer == 16 && !buzzer_active) {
-            buzzer_active = true;
-            Serial.println("Buzzer On");
-            digitalWrite(buzzerPin, HIGH); // Turn on buzzer
-            delay(3000); // Penundaan 3 detik
-            digitalWrite(buzzerPin, 0); // Turn off buzzer
-            Serial.println("Buzzer Off");
-            Serial.println("Timer Reset!!");
-            timer = 0;
+        break;
+    default:
+        if (!what) {
+            what = "Unknown command";
         }
-    } else {
-        // Reset everything if the status is not "sleeping"
-        timer = 0;
-        buzzer_active = false;
-        for (int i = 0; i < 4; i++) {
-            digitalWrite(ledPins[i], LOW); // Turn off LEDs
+        break;
+    }
+    char reply[WS_REPLY_MAX];
+    int len = push_reply_json(&cmd, what, reply, sizeof(reply));
+
+    bool reading = true;
+    xSemaphoreTake(ws_lock, portMAX_DELAY);
+    ws_client_t *c = ws_find(fd);
+    if (c && !what) {
+        if (cmd.cmd == PUSH_CMD_STATE) {
+            c->pending |= WS_SEND_STATE;
+        } else if (cmd.cmd == PUSH_CMD_STATUS) {
+            c->status_since = since;
+            c->pending |= WS_SEND_STATUS;
+        } else if (cmd.cmd == PUSH_CMD_SUBSCRIBE) {
+            c->topics = topics;
+        }
+    }
+    if (c && len > 0 && len < (int)sizeof(reply)) {
+        if (c->reply_count < WS_REPLIES) {
+            int tail = (c->reply_head + c->reply_count++) % WS_REPLIES;
+            memcpy(c->replies[tail], reply, len);
+            c->reply_len[tail] = len;
+        } else {
+            reading = false;
         }
-        Serial.println("Human not sleep!!");
     }
+    xSemaphoreGive(ws_lock);
+    xSemaphoreGive(ws_wake);
+    return reading;
+}
 
+// GET /ws: the WebSocket push channel, see push.h for its events and
+// commands. Runs once for the handshake, then once per frame received.
+// Commands are text frames shorter than PUSH_COMMAND_MAX, anything else
+// closes the socket.
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+    int fd = httpd_req_to_sockfd(req);
+    if (httpd_ws_get_fd_info(camera_httpd, fd) != HTTPD_WS_CLIENT_WEBSOCKET) {
+        httpd_resp_set_status(req, "426 Upgrade Required");
+        httpd_resp_set_hdr(req, "Upgrade", "websocket");
+        return httpd_resp_send(req, "WebSocket only", HTTPD_RESP_USE_STRLEN);
+    }
+    if (req->method == HTTP_GET) {
+        return ws_join(req);
+    }
 
-    // Respond to the HTTP request
-    httpd_resp_send(req, "Timer handler executed", HTTPD_RESP_USE_STRLEN);
+    httpd_ws_frame_t frame = {};
+    esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (frame.type != HTTPD_WS_TYPE_TEXT || frame.len >= PUSH_COMMAND_MAX) {
+        log_w("Closing a subscriber that sent a %u byte frame of type %d", (unsigned)frame.len, frame.type);
+        return ESP_FAIL;
+    }
+    char text[PUSH_COMMAND_MAX];
+    frame.payload = (uint8_t *)text;
+    err = httpd_ws_recv_frame(req, &frame, sizeof(text) - 1);
+    if (err != ESP_OK) {
+        return err;
+    }
+    text[frame.len] = '\0';
+    if (!ws_command(fd, text)) {
+        log_w("Closing a subscriber that doesn't read its replies");
+        return ESP_FAIL;
+    }
     return ESP_OK;
 }
 
+static esp_err_t timer_handler(httpd_req_t *req) {
+    // Report only: the alert engine advances on its own timer
+    alert_state_t a = alert_snapshot();
+
+    portENTER_CRITICAL(&alert_mux);
+    bool local = result_local;
+    portEXIT_CRITICAL(&alert_mux);
+
+    char json[192];
+    int len = snprintf(json, sizeof(json), "{\"status\":\"%s\",\"confidence\":%u,\"motion\":%u,\"timer\":%u,\"leds\":%u,\"buzzer\":%u,\"next_sample\":%u,\"source\":\"%s\"}",
+                       posture_label(a.posture), a.confidence, a.motion, a.timer, a.leds, a.buzzer, sample_due_ms(),
+                       local ? "local" : "gateway");
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, json, len);
+}
+
 static esp_err_t test_led_handler(httpd_req_t *req)
 {
     for(int i = 0; i < 5; i++){
@@ -697,8 +3589,12 @@ static esp_err_t classify_handler(httpd_req_t *req)
 }
 */
 
-void startCameraServer()
+void startCameraServer(int fb_count)
 {
+    if (slog_start() != ESP_OK) {
+        log_e("Serial log task start failed");
+    }
+
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.max_uri_handlers = 16;
 
@@ -709,7 +3605,7 @@ void startCameraServer()
         .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
         ,
-        .is_websocket = true,
+        .is_websocket = false,
         .handle_ws_control_frames = false,
         .supported_subprotocol = NULL
 #endif
@@ -722,7 +3618,7 @@ void startCameraServer()
         .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
         ,
-        .is_websocket = true,
+        .is_websocket = false,
         .handle_ws_control_frames = false,
         .supported_subprotocol = NULL
 #endif
@@ -735,7 +3631,7 @@ void startCameraServer()
         .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
         ,
-        .is_websocket = true,
+        .is_websocket = false,
         .handle_ws_control_frames = false,
         .supported_subprotocol = NULL
 #endif
@@ -748,7 +3644,7 @@ void startCameraServer()
         .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
         ,
-        .is_websocket = true,
+        .is_websocket = false,
         .handle_ws_control_frames = false,
         .supported_subprotocol = NULL
 #endif
@@ -761,7 +3657,46 @@ void startCameraServer()
         .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
         ,
-        .is_websocket = true,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL
+#endif
+    };
+
+    httpd_uri_t cycle_uri = {
+        .uri = "/cycle",
+        .method = HTTP_POST,
+        .handler = cycle_handler,
+        .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+        ,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL
+#endif
+    };
+
+    httpd_uri_t metrics_uri = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = metrics_handler,
+        .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+        ,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL
+#endif
+    };
+
+    httpd_uri_t trace_uri = {
+        .uri = "/trace",
+        .method = HTTP_GET,
+        .handler = trace_handler,
+        .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+        ,
+        .is_websocket = false,
         .handle_ws_control_frames = false,
         .supported_subprotocol = NULL
 #endif
@@ -774,7 +3709,7 @@ void startCameraServer()
         .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
         ,
-        .is_websocket = true,
+        .is_websocket = false,
         .handle_ws_control_frames = false,
         .supported_subprotocol = NULL
 #endif
@@ -784,6 +3719,54 @@ void startCameraServer()
         .method = HTTP_GET,
         .handler = timer_handler,
         .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+        ,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL
+#endif
+    };
+    httpd_uri_t log_uri = {
+        .uri = "/log",
+        .method = HTTP_GET,
+        .handler = log_handler,
+        .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+        ,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL
+#endif
+    };
+    httpd_uri_t event_uri = {
+        .uri = "/event",
+        .method = HTTP_GET,
+        .handler = event_handler,
+        .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+        ,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL
+#endif
+    };
+    httpd_uri_t burst_uri = {
+        .uri = "/burst",
+        .method = HTTP_GET,
+        .handler = burst_handler,
+        .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+        ,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL
+#endif
+    };
+    httpd_uri_t ws_uri = {
+        .uri = "/ws",
+        .method = HTTP_GET,
+        .handler = ws_handler,
+        .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
         ,
         .is_websocket = true,
@@ -798,7 +3781,7 @@ void startCameraServer()
         .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
         ,
-        .is_websocket = true,
+        .is_websocket = false,
         .handle_ws_control_frames = false,
         .supported_subprotocol = NULL
 #endif
@@ -810,7 +3793,7 @@ void startCameraServer()
         .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
         ,
-        .is_websocket = true,
+        .is_websocket = false,
         .handle_ws_control_frames = false,
         .supported_subprotocol = NULL
 #endif
@@ -842,9 +3825,28 @@ void startCameraServer()
 #endif
     };   
 */
-    ra_filter_init(&ra_filter, 20);
+    ra_filter_init(&ra_filter, ra_filter_values, RA_FILTER_SAMPLES);
+    pool_start();
+    esp_err_t broker_err = broker_start(fb_count, motion_on_frame);
+    if (broker_err == ESP_ERR_INVALID_ARG) {
+        log_e("Capture needs fb_count >= %d, got %d", BROKER_FB_MIN, fb_count);
+    } else if (broker_err != ESP_OK) {
+        log_e("Capture task start failed");
+    }
+    if (alert_start() != ESP_OK) {
+        log_e("Alert timer start failed");
+    }
+    local_start();
+    event_start();
+    status_start();
+    burst_start();
+    bool ws_ok = ws_start() == ESP_OK;
+    if (!ws_ok) {
+        log_e("WebSocket task start failed");
+    }
 
     log_i("Starting web server on port: '%d'", config.server_port);
+    config.close_fn = ws_ok ? ws_close_fn : NULL;
     if (httpd_start(&camera_httpd, &config) == ESP_OK)
     {
         httpd_register_uri_handler(camera_httpd, &index_uri);
@@ -852,7 +3854,16 @@ void startCameraServer()
         httpd_register_uri_handler(camera_httpd, &status_uri);
         httpd_register_uri_handler(camera_httpd, &capture_uri);
         httpd_register_uri_handler(camera_httpd, &classify_uri);
+        httpd_register_uri_handler(camera_httpd, &cycle_uri);
+        httpd_register_uri_handler(camera_httpd, &metrics_uri);
+        httpd_register_uri_handler(camera_httpd, &trace_uri);
         httpd_register_uri_handler(camera_httpd, &timer_uri);
+        httpd_register_uri_handler(camera_httpd, &event_uri);
+        httpd_register_uri_handler(camera_httpd, &burst_uri);
+        httpd_register_uri_handler(camera_httpd, &log_uri);
+        if (ws_ok) {
+            httpd_register_uri_handler(camera_httpd, &ws_uri);
+        }
         //httpd_register_uri_handler(camera_httpd, &buzzer_uri);
         httpd_register_uri_handler(camera_httpd, &led_uri);
         httpd_register_uri_handler(camera_httpd, &buzzer_uri);
@@ -860,9 +3871,52 @@ void startCameraServer()
 
     config.server_port += 1;
     config.ctrl_port += 1;
+    config.max_open_sockets = STREAM_MAX_SOCKETS;
+    if (broadcast_start() == ESP_OK) {
+        config.close_fn = broadcast_close_fn;
+    } else {
+        log_e("Broadcast task start failed, streaming a session per viewer");
+    }
     log_i("Starting stream server on port: '%d'", config.server_port);
     if (httpd_start(&stream_httpd, &config) == ESP_OK)
     {
         httpd_register_uri_handler(stream_httpd, &stream_uri);
     }
 }
+
+void startFrameUplink(const char *host, uint16_t port)
+{
+    log_i("Starting frame uplink to %s:%u", host, port);
+    if (uplink_start(host, port, apply_cycle_result, uplink_frame_sent, sample_deadline) != ESP_OK) {
+        log_e("Uplink task start failed");
+    }
+}
+
+void startLogForward(const char *host, uint16_t port)
+{
+    log_i("Forwarding the serial log to %s:%u", host, port);
+    slog_forward(host, port);
+}
+
+void startAlertLog(const char *dir)
+{
+    mkdir(dir, 0755);
+    if (!alert_log_open(&alert_log, dir)) {
+        log_e("Alert log in %s unavailable", dir);
+        return;
+    }
+    if (alert_log.recovered) {
+        log_i("Alert log recovered, %u torn records dropped", alert_log.recovered);
+    }
+    log_lock = xSemaphoreCreateMutex();
+    if (!log_lock || xTaskCreatePinnedToCore(log_task, "alert_log", LOG_TASK_STACK, NULL, LOG_TASK_PRIO, NULL,
+                                             LOG_TASK_CORE) != pdPASS) {
+        log_e("Alert log task start failed");
+        return;
+    }
+    portENTER_CRITICAL(&alert_mux);
+    log_seen = alert_state;
+    log_seen.posture = POSTURE_MAX; // log the state at boot
+    log_pending_on = true;
+    portEXIT_CRITICAL(&alert_mux);
+}
@@ -0,0 +1,187 @@
+#include <string.h>
+#include "buf_pool.h"
+
+static size_t round_size(size_t size)
+{
+    return (size + BUF_POOL_ALIGN - 1) & ~(size_t)(BUF_POOL_ALIGN - 1);
+}
+
+void buf_pool_init(buf_pool_t *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+size_t buf_pool_arena_size(size_t size, uint32_t count)
+{
+    return round_size(size) * count;
+}
+
+bool buf_pool_add(buf_pool_t *p, const char *name, uint8_t *arena, size_t size, uint32_t count)
+{
+    size = round_size(size);
+    if (p->class_count == BUF_POOL_CLASSES || !arena || !size || !count || count > BUF_POOL_BLOCKS ||
+        (p->class_count && p->classes[p->class_count - 1].size >= size)) {
+        return false;
+    }
+    buf_pool_class_t *c = &p->classes[p->class_count++];
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    c->base = arena;
+    c->size = size;
+    c->count = count;
+    return true;
+}
+
+// Lowest free block of c, -1 if none
+static int first_free(const buf_pool_class_t *c)
+{
+    uint64_t free_mask = ~c->used_mask;
+    if (c->count < 64) {
+        free_mask &= ((uint64_t)1 << c->count) - 1;
+    }
+    return free_mask ? __builtin_ctzll(free_mask) : -1;
+}
+
+void *buf_pool_alloc(buf_pool_t *p, size_t len, size_t *cap)
+{
+    int fit = 0;
+    while (fit < p->class_count && p->classes[fit].size < len) {
+        fit++;
+    }
+    if (fit == p->class_count) {
+        p->oversize++;
+        return NULL;
+    }
+    for (int i = fit; i < p->class_count; i++) {
+        buf_pool_class_t *c = &p->classes[i];
+        int b = first_free(c);
+        if (b < 0) {
+            continue;
+        }
+        c->used_mask |= (uint64_t)1 << b;
+        c->used++;
+        c->allocs++;
+        if (c->used > c->high_water) {
+            c->high_water = c->used;
+        }
+        if (i != fit) {
+            p->classes[fit].spilled++;
+        }
+        if (cap) {
+            *cap = c->size;
+        }
+        return c->base + (size_t)b * c->size;
+    }
+    p->classes[fit].failed++;
+    return NULL;
+}
+
+static buf_pool_class_t *class_of(const buf_pool_t *p, const void *ptr)
+{
+    const uint8_t *u = (const uint8_t *)ptr;
+    for (int i = 0; i < p->class_count; i++) {
+        const buf_pool_class_t *c = &p->classes[i];
+        if (u >= c->base && u < c->base + c->size * c->count) {
+            return (buf_pool_class_t *)c;
+        }
+    }
+    return NULL;
+}
+
+bool buf_pool_owns(const buf_pool_t *p, const void *ptr)
+{
+    return class_of(p, ptr) != NULL;
+}
+
+bool buf_pool_free(buf_pool_t *p, void *ptr)
+{
+    buf_pool_class_t *c = class_of(p, ptr);
+    if (!c) {
+        p->bad_frees++;
+        return false;
+    }
+    size_t offset = (uint8_t *)ptr - c->base;
+    uint64_t bit = (uint64_t)1 << (offset / c->size);
+    if (offset % c->size || !(c->used_mask & bit)) {
+        p->bad_frees++;
+        return false;
+    }
+    c->used_mask &= ~bit;
+    c->used--;
+    return true;
+}
+
+size_t buf_pool_largest_free(const buf_pool_t *p)
+{
+    for (int i = p->class_count - 1; i >= 0; i--) {
+        if (p->classes[i].used < p->classes[i].count) {
+            return p->classes[i].size;
+        }
+    }
+    return 0;
+}
+
+typedef struct
+{
+    const char *name;
+    const char *help;
+    const char *type;
+} pool_family_t;
+
+// Per-class families, in the order pool_value() knows them
+static const pool_family_t class_families[] = {
+    {"camera_pool_block_bytes", "Size of each block of a pool class", "gauge"},
+    {"camera_pool_blocks", "Blocks carved for a pool class at boot", "gauge"},
+    {"camera_pool_blocks_used", "Blocks of a pool class in use", "gauge"},
+    {"camera_pool_blocks_high_water", "Most blocks of a pool class in use at once", "gauge"},
+    {"camera_pool_allocs_total", "Blocks handed out by a pool class", "counter"},
+    {"camera_pool_spills_total", "Requests served by a larger class because this one was used up", "counter"},
+    {"camera_pool_failures_total", "Requests that fit a pool class and found no free block", "counter"},
+};
+
+static unsigned pool_value(const buf_pool_class_t *c, int family)
+{
+    switch (family) {
+    case 0:
+        return c->size;
+    case 1:
+        return c->count;
+    case 2:
+        return c->used;
+    case 3:
+        return c->high_water;
+    case 4:
+        return c->allocs;
+    case 5:
+        return c->spilled;
+    default:
+        return c->failed;
+    }
+}
+
+static void out_family(text_out_t *o, const char *name, const char *help, const char *type)
+{
+    text_out_printf(o, "# HELP %s %s\n", name, help);
+    text_out_printf(o, "# TYPE %s %s\n", name, type);
+}
+
+bool buf_pool_render(const buf_pool_t *p, text_write_cb write, void *arg)
+{
+    text_out_t o;
+    text_out_init(&o, write, arg);
+
+    for (size_t f = 0; f < sizeof(class_families) / sizeof(class_families[0]); f++) {
+        const pool_family_t *d = &class_families[f];
+        out_family(&o, d->name, d->help, d->type);
+        for (int i = 0; i < p->class_count; i++) {
+            text_out_printf(&o, "%s{class=\"%s\"} %u\n", d->name, p->classes[i].name, pool_value(&p->classes[i], f));
+        }
+    }
+    out_family(&o, "camera_pool_largest_free_bytes", "Largest free pool block", "gauge");
+    text_out_printf(&o, "camera_pool_largest_free_bytes %u\n", (unsigned)buf_pool_largest_free(p));
+    out_family(&o, "camera_pool_oversize_total", "Requests larger than every pool class", "counter");
+    text_out_printf(&o, "camera_pool_oversize_total %u\n", (unsigned)p->oversize);
+    out_family(&o, "camera_pool_bad_frees_total", "Frees of pointers that weren't an allocated pool block", "counter");
+    text_out_printf(&o, "camera_pool_bad_frees_total %u\n", (unsigned)p->bad_frees);
+    return text_out_flush(&o);
+}
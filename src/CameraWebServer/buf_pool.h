@@ -0,0 +1,70 @@
+// Fixed-size-class buffer pool.
+//
+// Each class is one arena carved at boot into equal blocks, so buffers
+// that come and go with requests, stream sessions and frame size changes
+// never split the heap: after weeks of uptime the largest free block is
+// what it was at boot. A request takes a block of the smallest class that
+// fits it, or of a larger class when that one is used up. Blocks are
+// tracked in a bitmap, which also catches double and foreign frees.
+//
+// Not thread safe, callers hold their own lock. No Arduino or ESP-IDF
+// dependencies.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "text_out.h"
+
+#define BUF_POOL_CLASSES 4
+#define BUF_POOL_BLOCKS  64 // per class, the bitmap width
+#define BUF_POOL_ALIGN   16 // block size granularity
+
+typedef struct
+{
+    const char *name;
+    uint8_t *base;
+    size_t size;         // of each block
+    uint32_t count;
+    uint64_t used_mask;
+    uint32_t used;
+    uint32_t high_water; // most blocks in use at once
+    uint32_t allocs;
+    uint32_t spilled;    // requests that fit here but took a larger class's block
+    uint32_t failed;     // requests that fit here and found no free block in any class
+} buf_pool_class_t;
+
+typedef struct
+{
+    buf_pool_class_t classes[BUF_POOL_CLASSES];
+    int class_count;
+    uint32_t oversize;   // requests larger than every class
+    uint32_t bad_frees;  // pointers freed that weren't an allocated block
+} buf_pool_t;
+
+void buf_pool_init(buf_pool_t *p);
+
+// Add count blocks of size bytes, rounded up to BUF_POOL_ALIGN, from arena,
+// which must hold count times the rounded size. Classes go in increasing
+// size. False if the class doesn't fit the pool's limits.
+bool buf_pool_add(buf_pool_t *p, const char *name, uint8_t *arena, size_t size, uint32_t count);
+
+// Bytes an arena for buf_pool_add() needs
+size_t buf_pool_arena_size(size_t size, uint32_t count);
+
+// A block of at least len bytes, its size in *cap if cap isn't NULL. NULL
+// if none is free; the failure is counted against the class that fits.
+void *buf_pool_alloc(buf_pool_t *p, size_t len, size_t *cap);
+
+// Whether ptr lies in one of the arenas
+bool buf_pool_owns(const buf_pool_t *p, const void *ptr);
+
+// Return a block. False, and counted, if ptr isn't an allocated block.
+bool buf_pool_free(buf_pool_t *p, void *ptr);
+
+// Size of the largest block that is free, 0 if none
+size_t buf_pool_largest_free(const buf_pool_t *p);
+
+// Per-class blocks, use, high-water mark and failures in the Prometheus
+// text format, as /metrics appends them. Returns false if the writer failed.
+bool buf_pool_render(const buf_pool_t *p, text_write_cb write, void *arg);
@@ -0,0 +1,122 @@
+#include "burst.h"
+
+const char *const burst_reason_names[] = {"posture", "motion"};
+const char *const burst_state_names[] = {"idle", "recording", "ready"};
+
+void burst_init(burst_t *b, uint8_t *buf, size_t size, event_frame_t *index, size_t index_len)
+{
+    event_ring_init(&b->ring, buf, size, index, index_len);
+    b->state = BURST_IDLE;
+    b->reason = BURST_POSTURE;
+    b->id = 0;
+    b->triggered = 0;
+    b->started = 0;
+    b->ended = 0;
+    b->next_frame = 0;
+    b->quiet_until = 0;
+    b->readers = 0;
+    b->pulled = false;
+    b->refused = 0;
+    b->skipped = 0;
+    b->abandoned = 0;
+}
+
+bool burst_posture_trigger(posture_t before, posture_t after)
+{
+    return before != POSTURE_NONE && after != POSTURE_NONE && after > before;
+}
+
+bool burst_trigger(burst_t *b, burst_reason_t reason, int64_t now)
+{
+    if (b->state == BURST_RECORDING || now < b->quiet_until || (b->state == BURST_READY && b->readers)) {
+        b->refused++;
+        return false;
+    }
+    event_ring_clear(&b->ring);
+    b->state = BURST_RECORDING;
+    b->reason = reason;
+    b->id++;
+    b->triggered = now;
+    b->started = 0;
+    b->ended = 0;
+    b->next_frame = now;
+    b->pulled = false;
+    return true;
+}
+
+static void burst_end(burst_t *b, int64_t at)
+{
+    b->ended = at;
+    b->quiet_until = at + BURST_COOLDOWN_US;
+    if (b->ring.count) {
+        b->state = BURST_READY;
+    } else {
+        b->state = BURST_IDLE;
+        b->abandoned++;
+    }
+}
+
+bool burst_frame(burst_t *b, const uint8_t *data, size_t len, int64_t frame_time, uint32_t seq, bool reduced)
+{
+    if (b->state != BURST_RECORDING || frame_time < b->triggered) {
+        return false;
+    }
+    if (!b->started) {
+        if (frame_time > b->triggered + BURST_ENTRY_MAX_US) {
+            burst_end(b, frame_time);
+            return true;
+        }
+        if (!reduced) {
+            b->skipped++;
+            return false;
+        }
+    } else if (frame_time >= b->started + BURST_US) {
+        burst_end(b, frame_time);
+        return true;
+    }
+    if (!reduced) {
+        // Something else changed the resolution back, keep recording what fits
+        b->skipped++;
+        return false;
+    }
+    if (frame_time < b->next_frame) {
+        return false;
+    }
+    if (!event_ring_push(&b->ring, data, len, frame_time, seq, false)) {
+        // Full, keep what is there
+        burst_end(b, frame_time);
+        return true;
+    }
+    if (!b->started) {
+        b->started = frame_time;
+    }
+    // On a grid from the first frame, so a sensor slightly faster than
+    // BURST_FRAME_US still averages one frame per interval
+    b->next_frame += BURST_FRAME_US;
+    if (b->next_frame <= frame_time) {
+        b->next_frame = frame_time + BURST_FRAME_US;
+    }
+    return false;
+}
+
+bool burst_expire(burst_t *b, int64_t now)
+{
+    if (b->state != BURST_RECORDING) {
+        return false;
+    }
+    int64_t deadline = b->started ? b->started + BURST_US + BURST_FRAME_US : b->triggered + BURST_ENTRY_MAX_US;
+    if (now <= deadline) {
+        return false;
+    }
+    burst_end(b, now);
+    return true;
+}
+
+uint32_t burst_fps100(const burst_t *b)
+{
+    if (b->ring.count < 2) {
+        return 0;
+    }
+    int64_t span = event_ring_at(&b->ring, b->ring.count - 1)->frame_time - event_ring_at(&b->ring, 0)->frame_time;
+    return span > 0 ? (uint32_t)((int64_t)(b->ring.count - 1) * 100000000 / span) : 0;
+}
@@ -0,0 +1,76 @@
+// Burst capture: a few seconds of frames at a high rate after a sudden
+// posture change or a motion spike, for the gateway to classify as a batch.
+//
+// Pure logic with no Arduino or ESP-IDF dependencies, times in microseconds
+// on the esp_timer_get_time() clock. Frames go into a frozen event_ring_t
+// over caller memory, so a burst never allocates and ends early rather than
+// outgrow it. The caller lowers the sensor resolution when it triggers a
+// burst; frames still at the old size are passed over, and if none at the
+// reduced size arrives within BURST_ENTRY_MAX_US the burst is given up.
+//
+// Not thread safe, callers serialise every call.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "alert.h"
+#include "event_ring.h"
+
+#define BURST_US           3000000  // recorded after the first frame
+#define BURST_FRAME_US     100000   // one frame kept per interval, 10 fps
+#define BURST_ENTRY_MAX_US 1000000  // trigger to the first reduced frame, else given up
+#define BURST_COOLDOWN_US  10000000 // end of a burst to the next trigger accepted
+#define BURST_MOTION_MIN   (4 * ALERT_MOTION_MIN) // motion_energy() score that triggers one
+#define BURST_FRAMES       (BURST_US / BURST_FRAME_US + 2) // index entries a burst can use
+
+typedef enum {
+    BURST_POSTURE, // classification moved towards lying
+    BURST_MOTION,  // motion spike
+} burst_reason_t;
+
+typedef enum {
+    BURST_IDLE,
+    BURST_RECORDING,
+    BURST_READY, // frozen, safe to read without the lock
+} burst_state_t;
+
+extern const char *const burst_reason_names[];
+extern const char *const burst_state_names[];
+
+typedef struct
+{
+    event_ring_t ring;
+    burst_state_t state;
+    burst_reason_t reason;
+    uint32_t id;          // of the newest burst, 0 before the first
+    int64_t triggered;    // trigger accepted
+    int64_t started;      // capture time of the first frame kept, 0 until then
+    int64_t ended;        // capture time it ended at
+    int64_t next_frame;   // keep the first frame captured at or after this
+    int64_t quiet_until;  // triggers before this are refused
+    uint8_t readers;      // downloads in progress, a ready burst is not replaced while set
+    bool pulled;          // downloaded whole at least once
+    uint32_t refused;     // triggers refused: recording, cooling down or being read
+    uint32_t skipped;     // frames passed over at the old resolution
+    uint32_t abandoned;   // bursts given up without a frame
+} burst_t;
+
+void burst_init(burst_t *b, uint8_t *buf, size_t size, event_frame_t *index, size_t index_len);
+
+// Whether a posture change from before to after triggers a burst: away from
+// a known posture towards lying, BDR before DDK before TDR
+bool burst_posture_trigger(posture_t before, posture_t after);
+
+// Start a burst at now. False if it was refused.
+bool burst_trigger(burst_t *b, burst_reason_t reason, int64_t now);
+
+// Offer a frame. reduced says it is at the burst resolution. Returns true
+// when this frame ended the burst, kept or not.
+bool burst_frame(burst_t *b, const uint8_t *data, size_t len, int64_t frame_time, uint32_t seq, bool reduced);
+
+// End a burst the camera stopped feeding. Returns true if it ended at now.
+bool burst_expire(burst_t *b, int64_t now);
+
+// Achieved frames per second of a ready burst, times 100
+uint32_t burst_fps100(const burst_t *b);
@@ -0,0 +1,262 @@
+#include <math.h>
+#include <string.h>
+#include "cnn.h"
+
+typedef struct
+{
+    int w;
+    int h;
+    int c;
+} cnn_shape_t;
+
+static inline int8_t clamp_int8(int32_t v, int32_t lo)
+{
+    return (int8_t)(v < lo ? lo : v > 127 ? 127 : v);
+}
+
+static inline int32_t out_min(const cnn_layer_t *l)
+{
+    return l->relu ? l->out_zp : -128;
+}
+
+// Every channel's shift keeps cnn_rescale() defined
+static bool shifts_valid(const cnn_layer_t *l, int channels)
+{
+    for (int c = 0; c < channels; c++) {
+        if (l->shift[c] < CNN_SHIFT_MIN || l->shift[c] > CNN_SHIFT_MAX) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Output geometry of a layer, false for an unknown op or a rescale shift
+// out of range
+static bool layer_shape(const cnn_layer_t *l, cnn_shape_t in, cnn_shape_t *out)
+{
+    switch (l->op) {
+    case CNN_CONV:
+    case CNN_DEPTHWISE:
+        if (!l->stride || !(l->kernel & 1)) {
+            return false;
+        }
+        out->w = (in.w + l->stride - 1) / l->stride;
+        out->h = (in.h + l->stride - 1) / l->stride;
+        out->c = l->op == CNN_CONV ? l->out_c : in.c;
+        return shifts_valid(l, out->c);
+    case CNN_MAXPOOL:
+        *out = {in.w / 2, in.h / 2, in.c};
+        return out->w > 0 && out->h > 0;
+    case CNN_AVGPOOL:
+        *out = {1, 1, in.c};
+        return true;
+    case CNN_DENSE:
+        *out = {1, 1, l->out_c};
+        return in.w == 1 && in.h == 1 && shifts_valid(l, out->c);
+    }
+    return false;
+}
+
+static void conv(const cnn_layer_t *l, cnn_shape_t in, cnn_shape_t out, const int8_t *src, int8_t *dst)
+{
+    const int k = l->kernel;
+    const int pad = k / 2;
+    const int32_t lo = out_min(l);
+    for (int oy = 0; oy < out.h; oy++) {
+        for (int ox = 0; ox < out.w; ox++) {
+            int y0 = oy * l->stride - pad;
+            int x0 = ox * l->stride - pad;
+            // Taps in the padding add (in_zp - in_zp) * w = 0, so skip them
+            int ky0 = y0 < 0 ? -y0 : 0;
+            int ky1 = y0 + k > in.h ? in.h - y0 : k;
+            int kx0 = x0 < 0 ? -x0 : 0;
+            int kx1 = x0 + k > in.w ? in.w - x0 : k;
+            for (int oc = 0; oc < out.c; oc++) {
+                const int8_t *w = l->weights + (size_t)oc * k * k * in.c;
+                int32_t acc = l->bias[oc];
+                for (int ky = ky0; ky < ky1; ky++) {
+                    const int8_t *row = src + ((size_t)(y0 + ky) * in.w + x0) * in.c;
+                    for (int kx = kx0; kx < kx1; kx++) {
+                        const int8_t *px = row + kx * in.c;
+                        const int8_t *wk = w + (ky * k + kx) * in.c;
+                        for (int ic = 0; ic < in.c; ic++) {
+                            acc += (px[ic] - l->in_zp) * wk[ic];
+                        }
+                    }
+                }
+                *dst++ = clamp_int8(cnn_rescale(acc, l->mult[oc], l->shift[oc]) + l->out_zp, lo);
+            }
+        }
+    }
+}
+
+static void depthwise(const cnn_layer_t *l, cnn_shape_t in, cnn_shape_t out, const int8_t *src, int8_t *dst,
+                      int32_t *acc)
+{
+    const int k = l->kernel;
+    const int pad = k / 2;
+    const int32_t lo = out_min(l);
+    for (int oy = 0; oy < out.h; oy++) {
+        for (int ox = 0; ox < out.w; ox++) {
+            int y0 = oy * l->stride - pad;
+            int x0 = ox * l->stride - pad;
+            int ky0 = y0 < 0 ? -y0 : 0;
+            int ky1 = y0 + k > in.h ? in.h - y0 : k;
+            int kx0 = x0 < 0 ? -x0 : 0;
+            int kx1 = x0 + k > in.w ? in.w - x0 : k;
+            // Channels innermost so both the pixel and the weights are read
+            // in order
+            memcpy(acc, l->bias, in.c * sizeof(int32_t));
+            for (int ky = ky0; ky < ky1; ky++) {
+                for (int kx = kx0; kx < kx1; kx++) {
+                    const int8_t *px = src + ((size_t)(y0 + ky) * in.w + x0 + kx) * in.c;
+                    const int8_t *wk = l->weights + (ky * k + kx) * in.c;
+                    for (int c = 0; c < in.c; c++) {
+                        acc[c] += (px[c] - l->in_zp) * wk[c];
+                    }
+                }
+            }
+            for (int c = 0; c < in.c; c++) {
+                *dst++ = clamp_int8(cnn_rescale(acc[c], l->mult[c], l->shift[c]) + l->out_zp, lo);
+            }
+        }
+    }
+}
+
+// Max and average pooling keep the scale and zero point of their input
+static void maxpool(cnn_shape_t in, cnn_shape_t out, const int8_t *src, int8_t *dst)
+{
+    for (int oy = 0; oy < out.h; oy++) {
+        for (int ox = 0; ox < out.w; ox++) {
+            const int8_t *a = src + ((size_t)(oy * 2) * in.w + ox * 2) * in.c;
+            const int8_t *b = a + (size_t)in.w * in.c;
+            for (int c = 0; c < in.c; c++) {
+                int8_t m = a[c];
+                m = a[in.c + c] > m ? a[in.c + c] : m;
+                m = b[c] > m ? b[c] : m;
+                m = b[in.c + c] > m ? b[in.c + c] : m;
+                *dst++ = m;
+            }
+        }
+    }
+}
+
+static void avgpool(cnn_shape_t in, const int8_t *src, int8_t *dst, int32_t *acc)
+{
+    int32_t n = in.w * in.h;
+    memset(acc, 0, in.c * sizeof(int32_t));
+    for (int32_t i = 0; i < n; i++) {
+        for (int c = 0; c < in.c; c++) {
+            acc[c] += *src++;
+        }
+    }
+    for (int c = 0; c < in.c; c++) {
+        // Round half away from zero
+        int32_t s = acc[c];
+        dst[c] = clamp_int8(s >= 0 ? (s + n / 2) / n : -((-s + n / 2) / n), -128);
+    }
+}
+
+static void dense(const cnn_layer_t *l, cnn_shape_t in, cnn_shape_t out, const int8_t *src, int8_t *dst)
+{
+    const int32_t lo = out_min(l);
+    for (int oc = 0; oc < out.c; oc++) {
+        const int8_t *w = l->weights + (size_t)oc * in.c;
+        int32_t acc = l->bias[oc];
+        for (int ic = 0; ic < in.c; ic++) {
+            acc += (src[ic] - l->in_zp) * w[ic];
+        }
+        dst[oc] = clamp_int8(cnn_rescale(acc, l->mult[oc], l->shift[oc]) + l->out_zp, lo);
+    }
+}
+
+// Arena layout: two activation buffers then the int32 channel scratch
+static bool arena_layout(const cnn_model_t *model, size_t *act, size_t *scratch)
+{
+    cnn_shape_t s = {model->in_w, model->in_h, model->in_c};
+    *act = (size_t)s.w * s.h * s.c;
+    *scratch = s.c;
+    for (int i = 0; i < model->layer_count; i++) {
+        if (!layer_shape(&model->layers[i], s, &s)) {
+            return false;
+        }
+        size_t n = (size_t)s.w * s.h * s.c;
+        *act = n > *act ? n : *act;
+        *scratch = (size_t)s.c > *scratch ? s.c : *scratch;
+    }
+    *act = (*act + 3) & ~(size_t)3;
+    return model->layer_count > 0;
+}
+
+size_t cnn_arena_size(const cnn_model_t *model)
+{
+    size_t act, scratch;
+    if (!arena_layout(model, &act, &scratch)) {
+        return 0;
+    }
+    return 2 * act + scratch * sizeof(int32_t);
+}
+
+bool cnn_run(const cnn_model_t *model, const uint8_t *rgb, int8_t *arena, size_t arena_len, int8_t *logits)
+{
+    size_t act, scratch;
+    if (!arena_layout(model, &act, &scratch) || arena_len < 2 * act + scratch * sizeof(int32_t)) {
+        return false;
+    }
+    int8_t *src = arena;
+    int8_t *dst = arena + act;
+    int32_t *acc = (int32_t *)(arena + 2 * act);
+
+    cnn_shape_t in = {model->in_w, model->in_h, model->in_c};
+    size_t n = (size_t)in.w * in.h * in.c;
+    for (size_t i = 0; i < n; i++) {
+        src[i] = (int8_t)(rgb[i] - 128);
+    }
+
+    for (int i = 0; i < model->layer_count; i++) {
+        const cnn_layer_t *l = &model->layers[i];
+        cnn_shape_t out;
+        layer_shape(l, in, &out);
+        switch (l->op) {
+        case CNN_CONV:
+            conv(l, in, out, src, dst);
+            break;
+        case CNN_DEPTHWISE:
+            depthwise(l, in, out, src, dst, acc);
+            break;
+        case CNN_MAXPOOL:
+            maxpool(in, out, src, dst);
+            break;
+        case CNN_AVGPOOL:
+            avgpool(in, src, dst, acc);
+            break;
+        case CNN_DENSE:
+            dense(l, in, out, src, dst);
+            break;
+        }
+        int8_t *t = src;
+        src = dst;
+        dst = t;
+        in = out;
+    }
+    memcpy(logits, src, in.c);
+    return true;
+}
+
+int cnn_argmax(const cnn_model_t *model, const int8_t *logits, int count, uint8_t *confidence)
+{
+    int best = 0;
+    for (int i = 1; i < count; i++) {
+        if (logits[i] > logits[best]) {
+            best = i;
+        }
+    }
+    float sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += expf((logits[i] - logits[best]) * model->out_scale);
+    }
+    if (confidence) {
+        *confidence = (uint8_t)lroundf(255 / sum);
+    }
+    return best;
+}
@@ -0,0 +1,75 @@
+// Int8 CNN inference kernels for the on-device posture classifier.
+//
+// Pure fixed-point code with no Arduino or ESP-IDF dependencies, so the
+// same kernels run on a host for benchmarking. Quantization follows the
+// usual int8 scheme: activations are HWC int8 with a zero point, weights
+// are symmetric per output channel, biases int32, and each layer rescales
+// its int32 accumulators with a Q31 multiplier and shift. Weights and the
+// layer table are const so they stay in flash; activations ping-pong
+// between two halves of a caller-supplied arena (PSRAM on the board).
+// export_posture_model.py produces the model and mirrors this arithmetic.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    CNN_CONV,      // k x k convolution, "same" padding
+    CNN_DEPTHWISE, // k x k depthwise convolution, "same" padding
+    CNN_MAXPOOL,   // 2 x 2 max pooling, stride 2
+    CNN_AVGPOOL,   // global average pooling to 1 x 1
+    CNN_DENSE,     // fully connected, on a 1 x 1 map
+} cnn_op_t;
+
+typedef struct
+{
+    uint8_t op;          // cnn_op_t
+    uint8_t kernel;      // CNN_CONV, CNN_DEPTHWISE
+    uint8_t stride;      // CNN_CONV, CNN_DEPTHWISE
+    uint8_t relu;        // clamp the output at zero
+    uint16_t out_c;      // CNN_CONV, CNN_DENSE; other ops keep the channels
+    int8_t in_zp;        // zero point of the input activation
+    int8_t out_zp;       // zero point of the output activation
+    const int8_t *weights; // conv [out_c][k][k][in_c], depthwise [k][k][c], dense [out_c][in_c]
+    const int32_t *bias;   // per output channel, at scale in_scale * weight_scale
+    const int32_t *mult;   // per output channel Q31 multiplier of the rescale
+    const int8_t *shift;   // per output channel right shift of the rescale
+} cnn_layer_t;
+
+typedef struct
+{
+    int in_w;               // input geometry, uint8 RGB
+    int in_h;
+    int in_c;
+    const cnn_layer_t *layers;
+    int layer_count;        // the last one produces one logit per class
+    float out_scale;        // scale of the logits, for the confidence
+    int8_t out_zp;
+} cnn_model_t;
+
+// Bytes of arena cnn_run() needs for this model
+size_t cnn_arena_size(const cnn_model_t *model);
+
+// Run the model on a uint8 R,G,B image of the input geometry. Pixels enter
+// as p - 128, the exporter folds the input normalization into the first
+// layer. logits receives one int8 value per class. False if the arena is
+// too small or the model malformed, a rescale shift outside
+// CNN_SHIFT_MIN..CNN_SHIFT_MAX included; cnn_arena_size() is 0 for those.
+bool cnn_run(const cnn_model_t *model, const uint8_t *rgb, int8_t *arena, size_t arena_len, int8_t *logits);
+
+// Index of the largest logit and its softmax probability, 0..255
+int cnn_argmax(const cnn_model_t *model, const int8_t *logits, int count, uint8_t *confidence);
+
+// Rescale shifts whose total of 31 + shift is a valid int64 shift, 1 to 63
+#define CNN_SHIFT_MIN (-30)
+#define CNN_SHIFT_MAX 32
+
+// (acc * mult) >> (31 + shift), rounded, as the exporter computes it.
+// shift must be within CNN_SHIFT_MIN..CNN_SHIFT_MAX.
+static inline int32_t cnn_rescale(int32_t acc, int32_t mult, int8_t shift)
+{
+    int total = 31 + shift;
+    int64_t prod = (int64_t)acc * mult;
+    return (int32_t)((prod + ((int64_t)1 << (total - 1))) >> total);
+}
@@ -0,0 +1,84 @@
+#include <string.h>
+#include "event_ring.h"
+
+void event_ring_init(event_ring_t *r, uint8_t *buf, size_t size, event_frame_t *index, size_t index_len)
+{
+    r->buf = buf;
+    r->size = size;
+    r->index = index;
+    r->index_len = index_len;
+    event_ring_clear(r);
+}
+
+void event_ring_clear(event_ring_t *r)
+{
+    r->first = 0;
+    r->count = 0;
+    r->head = 0;
+    r->used = 0;
+}
+
+static void drop_oldest(event_ring_t *r)
+{
+    r->used -= r->index[r->first].len;
+    r->first = (r->first + 1) % r->index_len;
+    r->count--;
+    if (!r->count) {
+        r->head = 0;
+    }
+}
+
+// Offset a frame of len bytes can go to without touching stored frames,
+// or -1. Frames sit in push order from the oldest's offset, wrapping to 0
+// when the end of the buffer can't hold the next one.
+static long free_offset(const event_ring_t *r, size_t len)
+{
+    if (!r->count) {
+        return len <= r->size ? 0 : -1;
+    }
+    size_t tail = r->index[r->first].offset;
+    if (r->head > tail) {
+        if (len <= r->size - r->head) {
+            return r->head;
+        }
+        return len <= tail ? 0 : -1;
+    }
+    // Wrapped: the free space runs from head to the oldest frame
+    return len <= tail - r->head ? (long)r->head : -1;
+}
+
+bool event_ring_push(event_ring_t *r, const uint8_t *data, size_t len, int64_t frame_time, uint32_t seq, bool evict)
+{
+    if (!len || len > r->size || !r->index_len) {
+        return false;
+    }
+    long offset;
+    while ((offset = free_offset(r, len)) < 0 || r->count == r->index_len) {
+        if (!evict) {
+            return false;
+        }
+        drop_oldest(r);
+    }
+    memcpy(r->buf + offset, data, len);
+    event_frame_t *f = &r->index[(r->first + r->count) % r->index_len];
+    f->offset = offset;
+    f->len = len;
+    f->seq = seq;
+    f->frame_time = frame_time;
+    r->count++;
+    r->head = offset + len;
+    r->used += len;
+    return true;
+}
+
+void event_ring_trim(event_ring_t *r, int64_t frame_time)
+{
+    while (r->count && r->index[r->first].frame_time < frame_time) {
+        drop_oldest(r);
+    }
+}
+
+const event_frame_t *event_ring_at(const event_ring_t *r, size_t i)
+{
+    return &r->index[(r->first + i) % r->index_len];
+}
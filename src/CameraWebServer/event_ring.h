@@ -0,0 +1,53 @@
+// Byte ring of JPEG frames for alert clips.
+//
+// Pure logic with no Arduino or ESP-IDF dependencies. Frames are copied
+// whole into a caller-supplied buffer, each one contiguous, with a
+// caller-supplied index array of their offsets, so a ring never allocates
+// and its memory is exactly what it was given. A live ring evicts its
+// oldest frames to make room; a frozen one (an event clip) refuses frames
+// that don't fit instead.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    uint32_t offset;
+    uint32_t len;
+    uint32_t seq;
+    int64_t frame_time;
+} event_frame_t;
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t size;
+    event_frame_t *index;
+    size_t index_len;
+    size_t first; // index slot of the oldest frame
+    size_t count;
+    size_t head;  // where the next frame goes if it fits
+    size_t used;  // bytes held by frames
+} event_ring_t;
+
+void event_ring_init(event_ring_t *r, uint8_t *buf, size_t size, event_frame_t *index, size_t index_len);
+
+// Drop every frame
+void event_ring_clear(event_ring_t *r);
+
+// Copy a frame in. With evict the oldest frames make room for it, without
+// it a frame that doesn't fit is refused. False if it was not stored.
+bool event_ring_push(event_ring_t *r, const uint8_t *data, size_t len, int64_t frame_time, uint32_t seq, bool evict);
+
+// Drop frames captured before frame_time
+void event_ring_trim(event_ring_t *r, int64_t frame_time);
+
+// Frame i, oldest first, i < r->count
+const event_frame_t *event_ring_at(const event_ring_t *r, size_t i);
+
+static inline const uint8_t *event_ring_data(const event_ring_t *r, const event_frame_t *f)
+{
+    return r->buf + f->offset;
+}
@@ -0,0 +1,170 @@
+#include <Arduino.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "frame_broker.h"
+#include "metrics.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#endif
+
+#define BROKER_NEW_FRAME_BIT (1 << 0)
+
+typedef struct
+{
+    camera_fb_t *fb; // NULL when the slot is free
+    uint32_t seq;
+    uint32_t refs;   // the broker holds one on the newest frame
+} broker_slot_t;
+
+static broker_slot_t slots[BROKER_SLOTS];
+static broker_slot_t *latest = NULL;
+static uint32_t next_seq = 1;
+static SemaphoreHandle_t broker_lock = NULL;
+static EventGroupHandle_t broker_events = NULL;
+static broker_frame_cb_t frame_cb = NULL;
+
+// Drop one reference on slot, returns the frame to hand back to the driver
+// once nobody uses it. Call with broker_lock held.
+static camera_fb_t *slot_unref(broker_slot_t *slot)
+{
+    if (--slot->refs) {
+        return NULL;
+    }
+    camera_fb_t *fb = slot->fb;
+    slot->fb = NULL;
+    return fb;
+}
+
+static uint32_t broker_publish(camera_fb_t *fb)
+{
+    camera_fb_t *done = NULL;
+
+    xSemaphoreTake(broker_lock, portMAX_DELAY);
+    broker_slot_t *slot = NULL;
+    for (int i = 0; i < BROKER_SLOTS; i++) {
+        if (!slots[i].fb) {
+            slot = &slots[i];
+            break;
+        }
+    }
+    if (!slot) {
+        // More frames outstanding than slots, BROKER_SLOTS < fb_count
+        xSemaphoreGive(broker_lock);
+        esp_camera_fb_return(fb);
+        metrics_add(METRIC_FRAMES_DROPPED, 1);
+        return 0;
+    }
+    slot->fb = fb;
+    slot->seq = next_seq++;
+    slot->refs = 1;
+    if (latest) {
+        done = slot_unref(latest);
+    }
+    latest = slot;
+    uint32_t seq = slot->seq;
+    xSemaphoreGive(broker_lock);
+
+    if (done) {
+        esp_camera_fb_return(done);
+    }
+    // Wake every waiter, they re-check the sequence number under the lock
+    xEventGroupSetBits(broker_events, BROKER_NEW_FRAME_BIT);
+    xEventGroupClearBits(broker_events, BROKER_NEW_FRAME_BIT);
+    return seq;
+}
+
+static void broker_task(void *arg)
+{
+    while (true) {
+        int64_t start = esp_timer_get_time();
+        camera_fb_t *fb = esp_camera_fb_get();
+        metrics_observe(METRIC_FB_GET, esp_timer_get_time() - start);
+        if (!fb) {
+            metrics_add(METRIC_CAPTURE_FAILED, 1);
+            log_e("Camera capture failed");
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+        uint32_t seq = broker_publish(fb);
+        if (seq) {
+            metrics_add(METRIC_FRAMES_CAPTURED, 1);
+        }
+        // Only this task publishes, so fb cannot be recycled during the call
+        if (seq && frame_cb) {
+            frame_cb(fb, seq);
+        }
+    }
+}
+
+esp_err_t broker_start(int fb_count, broker_frame_cb_t on_frame)
+{
+    frame_cb = on_frame;
+    broker_lock = xSemaphoreCreateMutex();
+    broker_events = xEventGroupCreate();
+    if (!broker_lock || !broker_events) {
+        return ESP_ERR_NO_MEM;
+    }
+    // Without the task broker_acquire() times out, as with a dead camera
+    if (fb_count < BROKER_FB_MIN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (xTaskCreatePinnedToCore(broker_task, "capture", BROKER_TASK_STACK, NULL, BROKER_TASK_PRIO, NULL,
+                                BROKER_TASK_CORE) != pdPASS) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+camera_fb_t *broker_acquire(uint32_t after_seq, uint32_t timeout_ms, uint32_t *seq)
+{
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    while (true) {
+        xSemaphoreTake(broker_lock, portMAX_DELAY);
+        if (latest && latest->seq > after_seq) {
+            latest->refs++;
+            camera_fb_t *fb = latest->fb;
+            if (seq) {
+                *seq = latest->seq;
+            }
+            xSemaphoreGive(broker_lock);
+            return fb;
+        }
+        xSemaphoreGive(broker_lock);
+
+        int64_t left = deadline - esp_timer_get_time();
+        if (left <= 0) {
+            return NULL;
+        }
+        xEventGroupWaitBits(broker_events, BROKER_NEW_FRAME_BIT, pdFALSE, pdFALSE,
+                            pdMS_TO_TICKS(left / 1000) + 1);
+    }
+}
+
+void broker_release(camera_fb_t *fb)
+{
+    camera_fb_t *done = NULL;
+
+    xSemaphoreTake(broker_lock, portMAX_DELAY);
+    for (int i = 0; i < BROKER_SLOTS; i++) {
+        if (slots[i].fb == fb) {
+            done = slot_unref(&slots[i]);
+            break;
+        }
+    }
+    xSemaphoreGive(broker_lock);
+
+    if (done) {
+        esp_camera_fb_return(done);
+    }
+}
+
+uint32_t broker_latest_seq(void)
+{
+    xSemaphoreTake(broker_lock, portMAX_DELAY);
+    uint32_t seq = latest ? latest->seq : 0;
+    xSemaphoreGive(broker_lock);
+    return seq;
+}
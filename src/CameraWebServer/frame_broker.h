@@ -0,0 +1,36 @@
+// Frame broker: a single capture task owns esp_camera_fb_get() and publishes
+// every frame into a small set of reference-counted slots. HTTP handlers take
+// a zero-copy reference to the newest frame instead of grabbing their own.
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+
+#define BROKER_SLOTS        3     // at least the camera fb_count
+#define BROKER_FB_MIN       2     // the newest frame, and one for the driver to fill
+#define BROKER_TASK_CORE    1
+#define BROKER_TASK_PRIO    5
+#define BROKER_TASK_STACK   8192
+
+// Called from the capture task for every published frame. fb stays valid
+// for the duration of the call.
+typedef void (*broker_frame_cb_t)(camera_fb_t *fb, uint32_t seq);
+
+// fb_count is the camera's camera_config_t::fb_count. The broker holds the
+// newest frame until the next one is published, so with fewer than
+// BROKER_FB_MIN buffers the driver would never get one back;
+// ESP_ERR_INVALID_ARG then, and no capture task: every broker_acquire()
+// times out.
+esp_err_t broker_start(int fb_count, broker_frame_cb_t on_frame);
+
+// Reference the newest frame whose sequence number is greater than
+// after_seq, waiting up to timeout_ms for one to arrive. Sequence numbers
+// start at 1, so after_seq 0 means any frame. Returns NULL on timeout.
+camera_fb_t *broker_acquire(uint32_t after_seq, uint32_t timeout_ms, uint32_t *seq);
+
+// Drop a reference taken with broker_acquire()
+void broker_release(camera_fb_t *fb);
+
+// Sequence number of the newest published frame, 0 before the first one
+uint32_t broker_latest_seq(void);
@@ -0,0 +1,71 @@
+#include "frame_hash.h"
+#include "motion.h"
+
+static_assert(FRAME_HASH_COLS * FRAME_HASH_ROWS == 64, "the hash is one uint64_t");
+static_assert(MOTION_GRID_W > FRAME_HASH_COLS && MOTION_GRID_H >= FRAME_HASH_ROWS, "cells must cover the grid");
+
+uint64_t frame_hash(const uint8_t *grid)
+{
+    uint64_t hash = 0;
+    for (int row = 0; row < FRAME_HASH_ROWS; row++) {
+        int y0 = row * MOTION_GRID_H / FRAME_HASH_ROWS;
+        int y1 = (row + 1) * MOTION_GRID_H / FRAME_HASH_ROWS;
+        uint32_t prev = 0;
+        for (int col = 0; col <= FRAME_HASH_COLS; col++) {
+            int x0 = col * MOTION_GRID_W / (FRAME_HASH_COLS + 1);
+            int x1 = (col + 1) * MOTION_GRID_W / (FRAME_HASH_COLS + 1);
+            uint32_t sum = 0;
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    sum += grid[y * MOTION_GRID_W + x];
+                }
+            }
+            // Cells differ in size by a column at most, compare means
+            uint32_t mean = sum * 16 / ((y1 - y0) * (x1 - x0));
+            if (col) {
+                hash = hash << 1 | (prev > mean);
+            }
+            prev = mean;
+        }
+    }
+    return hash;
+}
+
+int frame_hash_distance(uint64_t a, uint64_t b)
+{
+    return __builtin_popcountll(a ^ b);
+}
+
+void frame_hash_format(uint64_t hash, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = FRAME_HASH_HEX - 1; i >= 0; i--) {
+        out[i] = digits[hash & 0xf];
+        hash >>= 4;
+    }
+    out[FRAME_HASH_HEX] = '\0';
+}
+
+bool frame_hash_parse(const char *text, uint64_t *hash)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < FRAME_HASH_HEX; i++) {
+        char c = text[i];
+        int digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        value = value << 4 | digit;
+    }
+    if (text[FRAME_HASH_HEX]) {
+        return false;
+    }
+    *hash = value;
+    return true;
+}
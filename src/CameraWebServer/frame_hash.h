@@ -0,0 +1,31 @@
+// Perceptual frame hash for conditional capture.
+//
+// Integer only and free of Arduino and ESP-IDF dependencies. A 64-bit
+// difference hash (dHash) of the motion grid (motion.h): the grid is
+// averaged down to 9 x 8 cells and each bit says whether a cell is brighter
+// than its right-hand neighbour. It follows the layout of the scene, not
+// its exact pixels, so JPEG noise and small lighting drift flip a few bits
+// while someone moving flips many. Frames whose hashes are within
+// FRAME_HASH_SIMILAR bits count as unchanged.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FRAME_HASH_COLS    8 // bits per row, from FRAME_HASH_COLS + 1 cells
+#define FRAME_HASH_ROWS    8
+#define FRAME_HASH_SIMILAR 6 // default distance, in bits, treated as the same scene
+#define FRAME_HASH_HEX     16
+
+// Hash of a MOTION_GRID_W x MOTION_GRID_H grayscale grid
+uint64_t frame_hash(const uint8_t *grid);
+
+// Bits that differ, 0..64
+int frame_hash_distance(uint64_t a, uint64_t b);
+
+// FRAME_HASH_HEX lowercase hex digits and a terminating NUL
+void frame_hash_format(uint64_t hash, char *out);
+
+// Exactly FRAME_HASH_HEX hex digits, false otherwise
+bool frame_hash_parse(const char *text, uint64_t *hash);
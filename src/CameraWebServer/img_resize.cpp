@@ -0,0 +1,100 @@
+#include "img_resize.h"
+
+img_rect_t img_crop_full(int width, int height)
+{
+    img_rect_t r = {0, 0, width, height};
+    return r;
+}
+
+img_rect_t img_crop_center_square(int width, int height)
+{
+    int side = width < height ? width : height;
+    img_rect_t r = {(width - side) / 2, (height - side) / 2, side, side};
+    return r;
+}
+
+// Source coordinate of the centre of destination pixel d, in 16.16 fixed
+// point, clamped to the valid sample range [0, size - 1]
+static inline int32_t src_coord(int d, int dst_size, int crop_pos, int crop_size, int src_size)
+{
+    int64_t c = (((int64_t)(2 * d + 1) * crop_size) << 15) / dst_size - (1 << 15) + ((int64_t)crop_pos << 16);
+    int64_t max = (int64_t)(src_size - 1) << 16;
+    return (int32_t)(c < 0 ? 0 : c > max ? max : c);
+}
+
+struct rgb888_px
+{
+    static const int bpp = 3;
+    static inline void unpack(const uint8_t *p, uint32_t *rgb)
+    {
+        rgb[0] = p[0];
+        rgb[1] = p[1];
+        rgb[2] = p[2];
+    }
+};
+
+struct rgb565_px
+{
+    static const int bpp = 2;
+    static inline void unpack(const uint8_t *p, uint32_t *rgb)
+    {
+        uint16_t px = (p[0] << 8) | p[1];
+        uint32_t r = px >> 11;
+        uint32_t g = (px >> 5) & 0x3F;
+        uint32_t b = px & 0x1F;
+        // Replicate the high bits so full scale maps to 255
+        rgb[0] = (r << 3) | (r >> 2);
+        rgb[1] = (g << 2) | (g >> 4);
+        rgb[2] = (b << 3) | (b >> 2);
+    }
+};
+
+template <typename PX>
+static void img_resize(const uint8_t *src, int src_w, int src_h, img_rect_t crop,
+                       uint8_t *dst, int dst_w, int dst_h, bool bgr)
+{
+    for (int dy = 0; dy < dst_h; dy++) {
+        int32_t fy = src_coord(dy, dst_h, crop.y, crop.h, src_h);
+        int y0 = fy >> 16;
+        int y1 = y0 + 1 < src_h ? y0 + 1 : y0;
+        uint32_t wy = (fy >> 8) & 0xFF;
+        const uint8_t *row0 = src + (size_t)y0 * src_w * PX::bpp;
+        const uint8_t *row1 = src + (size_t)y1 * src_w * PX::bpp;
+
+        for (int dx = 0; dx < dst_w; dx++) {
+            int32_t fx = src_coord(dx, dst_w, crop.x, crop.w, src_w);
+            int x0 = fx >> 16;
+            int x1 = x0 + 1 < src_w ? x0 + 1 : x0;
+            uint32_t wx = (fx >> 8) & 0xFF;
+
+            uint32_t p00[3], p01[3], p10[3], p11[3];
+            PX::unpack(row0 + x0 * PX::bpp, p00);
+            PX::unpack(row0 + x1 * PX::bpp, p01);
+            PX::unpack(row1 + x0 * PX::bpp, p10);
+            PX::unpack(row1 + x1 * PX::bpp, p11);
+
+            uint8_t out[3];
+            for (int c = 0; c < 3; c++) {
+                uint32_t top = p00[c] * (256 - wx) + p01[c] * wx;
+                uint32_t bottom = p10[c] * (256 - wx) + p11[c] * wx;
+                out[c] = (uint8_t)((top * (256 - wy) + bottom * wy + (1 << 15)) >> 16);
+            }
+            dst[0] = bgr ? out[2] : out[0];
+            dst[1] = out[1];
+            dst[2] = bgr ? out[0] : out[2];
+            dst += 3;
+        }
+    }
+}
+
+void img_resize_rgb888(const uint8_t *src, int src_w, int src_h, img_rect_t crop,
+                       uint8_t *dst, int dst_w, int dst_h, bool bgr)
+{
+    img_resize<rgb888_px>(src, src_w, src_h, crop, dst, dst_w, dst_h, bgr);
+}
+
+void img_resize_rgb565(const uint8_t *src, int src_w, int src_h, img_rect_t crop,
+                       uint8_t *dst, int dst_w, int dst_h, bool bgr)
+{
+    img_resize<rgb565_px>(src, src_w, src_h, crop, dst, dst_w, dst_h, bgr);
+}
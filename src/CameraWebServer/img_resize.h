@@ -0,0 +1,34 @@
+// Crop and resize kernels that turn camera frames into model input.
+//
+// Fixed-point bilinear sampling with no Arduino or ESP-IDF dependencies, so
+// the kernels build and can be benchmarked on a host.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    int x;
+    int y;
+    int w;
+    int h;
+} img_rect_t;
+
+// Whole image, the geometry transforms.Resize((224, 224)) sees
+img_rect_t img_crop_full(int width, int height);
+
+// Largest centred square
+img_rect_t img_crop_center_square(int width, int height);
+
+// Bilinear resize of crop into a dst_w x dst_h RGB888 image. bgr selects
+// the B,G,R byte order the esp32-camera converters use for PIXFORMAT_RGB888.
+
+// Source in R,G,B byte order, as decoded JPEG
+void img_resize_rgb888(const uint8_t *src, int src_w, int src_h, img_rect_t crop,
+                       uint8_t *dst, int dst_w, int dst_h, bool bgr);
+
+// Source in big-endian RGB565, as captured by the camera
+void img_resize_rgb565(const uint8_t *src, int src_w, int src_h, img_rect_t crop,
+                       uint8_t *dst, int dst_w, int dst_h, bool bgr);
@@ -0,0 +1,497 @@
+#include <string.h>
+#include "jpeg_enc.h"
+
+// Natural order index of each zigzag position
+static const uint8_t zigzag[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// ITU T.81 Annex K.1 tables, natural order
+static const uint8_t base_quant[2][64] = {
+    {
+        16, 11, 10, 16, 24,  40,  51,  61,
+        12, 12, 14, 19, 26,  58,  60,  55,
+        14, 13, 16, 24, 40,  57,  69,  56,
+        14, 17, 22, 29, 51,  87,  80,  62,
+        18, 22, 37, 56, 68,  109, 103, 77,
+        24, 35, 55, 64, 81,  104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101,
+        72, 92, 95, 98, 112, 100, 103, 99,
+    },
+    {
+        17, 18, 24, 47, 99, 99, 99, 99,
+        18, 21, 26, 66, 99, 99, 99, 99,
+        24, 26, 56, 99, 99, 99, 99, 99,
+        47, 66, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+    },
+};
+
+// Annex K.3 Huffman tables: code counts per length 1..16, then symbols
+static const uint8_t dc_bits[2][16] = {
+    {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0},
+    {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
+};
+
+static const uint8_t dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+static const uint8_t ac_bits[2][16] = {
+    {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d},
+    {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77},
+};
+
+static const uint8_t ac_vals[2][162] = {
+    {
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+        0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+        0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+        0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+        0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+        0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+        0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+        0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+        0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa,
+    },
+    {
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+        0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+        0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+        0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+        0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+        0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+        0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+        0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+        0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa,
+    },
+};
+
+#define RECIP_BITS 18
+
+// Annex C: canonical codes in order of length
+static void huff_codes(const uint8_t *bits, const uint8_t *vals, uint16_t *codes, uint8_t *lens)
+{
+    uint16_t code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        for (int i = 0; i < bits[len - 1]; i++) {
+            codes[vals[k]] = code++;
+            lens[vals[k]] = len;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+void jpeg_enc_init(jpeg_enc_t *e)
+{
+    memset(e, 0, sizeof(*e));
+    for (int t = 0; t < 2; t++) {
+        huff_codes(dc_bits[t], dc_vals, e->dc_code[t], e->dc_len[t]);
+        huff_codes(ac_bits[t], ac_vals[t], e->ac_code[t], e->ac_len[t]);
+    }
+}
+
+// libjpeg's jpeg_quality_scaling() and baseline limits
+static int quant_step(int base, uint8_t quality)
+{
+    int q = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    int scale = q < 50 ? 5000 / q : 200 - q * 2;
+    int step = (base * scale + 50) / 100;
+    return step < 1 ? 1 : step > 255 ? 255 : step;
+}
+
+void jpeg_enc_set_quality(jpeg_enc_t *e, uint8_t quality, uint8_t background)
+{
+    if (background > quality) {
+        background = quality;
+    }
+    if (e->quality == quality && e->background == background) {
+        return;
+    }
+    e->quality = quality;
+    e->background = background;
+    for (int t = 0; t < 2; t++) {
+        for (int i = 0; i < 64; i++) {
+            // The DCT output is 8 times the coefficient
+            int step = quant_step(base_quant[t][i], quality);
+            int bg_step = quant_step(base_quant[t][i], background);
+            e->recip[t][i] = ((1 << RECIP_BITS) + step * 4) / (step * 8);
+            e->bg_recip[t][i] = ((1 << RECIP_BITS) + bg_step * 4) / (bg_step * 8);
+            e->bg_ratio[t][i] = (bg_step * 256 + step / 2) / step;
+        }
+        for (int k = 0; k < 64; k++) {
+            e->quant[t][k] = quant_step(base_quant[t][zigzag[k]], quality);
+        }
+    }
+}
+
+static void flush(jpeg_enc_t *e)
+{
+    if (e->fill && !e->failed) {
+        e->failed = e->cb(e->arg, e->index, e->out, e->fill) != e->fill;
+        e->index += e->fill;
+    }
+    e->fill = 0;
+}
+
+static inline void put_byte(jpeg_enc_t *e, uint8_t b)
+{
+    e->out[e->fill++] = b;
+    if (e->fill == JPEG_ENC_CHUNK) {
+        flush(e);
+    }
+}
+
+static void put_u16(jpeg_enc_t *e, uint16_t v)
+{
+    put_byte(e, v >> 8);
+    put_byte(e, v & 0xFF);
+}
+
+static void write_headers(jpeg_enc_t *e, int width, int height)
+{
+    static const uint8_t jfif[] = {0xFF, 0xD8, 0xFF, 0xE0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+    for (size_t i = 0; i < sizeof(jfif); i++) {
+        put_byte(e, jfif[i]);
+    }
+
+    put_u16(e, 0xFFDB);
+    put_u16(e, 2 + 2 * 65);
+    for (int t = 0; t < 2; t++) {
+        put_byte(e, t);
+        for (int k = 0; k < 64; k++) {
+            put_byte(e, e->quant[t][k]);
+        }
+    }
+
+    // 4:2:0, luma on table 0, chroma on table 1
+    static const uint8_t components[] = {1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1};
+    put_u16(e, 0xFFC0);
+    put_u16(e, 8 + sizeof(components));
+    put_byte(e, 8);
+    put_u16(e, height);
+    put_u16(e, width);
+    put_byte(e, 3);
+    for (size_t i = 0; i < sizeof(components); i++) {
+        put_byte(e, components[i]);
+    }
+
+    put_u16(e, 0xFFC4);
+    put_u16(e, 2 + 4 * 17 + 2 * sizeof(dc_vals) + 2 * sizeof(ac_vals[0]));
+    for (int t = 0; t < 2; t++) {
+        put_byte(e, t);
+        for (int i = 0; i < 16; i++) {
+            put_byte(e, dc_bits[t][i]);
+        }
+        for (size_t i = 0; i < sizeof(dc_vals); i++) {
+            put_byte(e, dc_vals[i]);
+        }
+        put_byte(e, 0x10 | t);
+        for (int i = 0; i < 16; i++) {
+            put_byte(e, ac_bits[t][i]);
+        }
+        for (size_t i = 0; i < sizeof(ac_vals[t]); i++) {
+            put_byte(e, ac_vals[t][i]);
+        }
+    }
+
+    static const uint8_t sos[] = {0xFF, 0xDA, 0, 12, 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0};
+    for (size_t i = 0; i < sizeof(sos); i++) {
+        put_byte(e, sos[i]);
+    }
+}
+
+// libjpeg's jfdctint: the Loeffler, Ligtenberg and Moschytz DCT in 13-bit
+// fixed point. Works in place on level-shifted samples, leaves 8 times the
+// coefficients.
+#define CONST_BITS 13
+#define PASS1_BITS 2
+#define DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+static void fdct(int32_t *data)
+{
+    // Rows, scaled up by PASS1_BITS
+    for (int32_t *p = data; p < data + 64; p += 8) {
+        int32_t tmp0 = p[0] + p[7], tmp7 = p[0] - p[7];
+        int32_t tmp1 = p[1] + p[6], tmp6 = p[1] - p[6];
+        int32_t tmp2 = p[2] + p[5], tmp5 = p[2] - p[5];
+        int32_t tmp3 = p[3] + p[4], tmp4 = p[3] - p[4];
+
+        int32_t tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+        int32_t tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+        p[0] = (tmp10 + tmp11) << PASS1_BITS;
+        p[4] = (tmp10 - tmp11) << PASS1_BITS;
+        int32_t z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        p[2] = DESCALE(z1 + tmp13 * FIX_0_765366865, CONST_BITS - PASS1_BITS);
+        p[6] = DESCALE(z1 - tmp12 * FIX_1_847759065, CONST_BITS - PASS1_BITS);
+
+        z1 = tmp4 + tmp7;
+        int32_t z2 = tmp5 + tmp6, z3 = tmp4 + tmp6, z4 = tmp5 + tmp7;
+        int32_t z5 = (z3 + z4) * FIX_1_175875602;
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+        p[7] = DESCALE(tmp4 + z1 + z3, CONST_BITS - PASS1_BITS);
+        p[5] = DESCALE(tmp5 + z2 + z4, CONST_BITS - PASS1_BITS);
+        p[3] = DESCALE(tmp6 + z2 + z3, CONST_BITS - PASS1_BITS);
+        p[1] = DESCALE(tmp7 + z1 + z4, CONST_BITS - PASS1_BITS);
+    }
+
+    // Columns, the PASS1_BITS scaling removed
+    for (int32_t *p = data; p < data + 8; p++) {
+        int32_t tmp0 = p[0] + p[56], tmp7 = p[0] - p[56];
+        int32_t tmp1 = p[8] + p[48], tmp6 = p[8] - p[48];
+        int32_t tmp2 = p[16] + p[40], tmp5 = p[16] - p[40];
+        int32_t tmp3 = p[24] + p[32], tmp4 = p[24] - p[32];
+
+        int32_t tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+        int32_t tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+        p[0] = DESCALE(tmp10 + tmp11, PASS1_BITS);
+        p[32] = DESCALE(tmp10 - tmp11, PASS1_BITS);
+        int32_t z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        p[16] = DESCALE(z1 + tmp13 * FIX_0_765366865, CONST_BITS + PASS1_BITS);
+        p[48] = DESCALE(z1 - tmp12 * FIX_1_847759065, CONST_BITS + PASS1_BITS);
+
+        z1 = tmp4 + tmp7;
+        int32_t z2 = tmp5 + tmp6, z3 = tmp4 + tmp6, z4 = tmp5 + tmp7;
+        int32_t z5 = (z3 + z4) * FIX_1_175875602;
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+        p[56] = DESCALE(tmp4 + z1 + z3, CONST_BITS + PASS1_BITS);
+        p[40] = DESCALE(tmp5 + z2 + z4, CONST_BITS + PASS1_BITS);
+        p[24] = DESCALE(tmp6 + z2 + z3, CONST_BITS + PASS1_BITS);
+        p[8] = DESCALE(tmp7 + z1 + z4, CONST_BITS + PASS1_BITS);
+    }
+}
+
+static inline int bit_length(uint32_t v)
+{
+    return v ? 32 - __builtin_clz(v) : 0;
+}
+
+// Entropy-coded bits, with a 0 stuffed after every 0xFF. The state is
+// copied out of the encoder for a block at a time so it stays in
+// registers. Holds fewer than 8 bits between calls, so up to 16 more fit.
+typedef struct
+{
+    uint32_t bits;
+    int count;
+} bit_state_t;
+
+static inline void put_bits(jpeg_enc_t *e, bit_state_t *b, uint32_t code, int len)
+{
+    b->bits = (b->bits << len) | code;
+    b->count += len;
+    while (b->count >= 8) {
+        b->count -= 8;
+        uint8_t byte = (uint8_t)(b->bits >> b->count);
+        put_byte(e, byte);
+        if (byte == 0xFF) {
+            put_byte(e, 0);
+        }
+    }
+}
+
+// Transform, quantize and Huffman code one block of table t. The
+// background keeps the frame's DC step, a coarse DC would show as blocks.
+static void encode_block(jpeg_enc_t *e, int32_t *data, int t, bool background, int *last_dc)
+{
+    fdct(data);
+
+    int16_t zz[64];
+    const uint16_t *recip = e->recip[t];
+    uint32_t a = data[0] < 0 ? -data[0] : data[0];
+    uint32_t level = (a * recip[0] + (1 << (RECIP_BITS - 1))) >> RECIP_BITS;
+    zz[0] = data[0] < 0 ? -(int16_t)level : (int16_t)level;
+    if (background) {
+        const uint16_t *bg_recip = e->bg_recip[t];
+        const uint16_t *bg_ratio = e->bg_ratio[t];
+        for (int k = 1; k < 64; k++) {
+            int n = zigzag[k];
+            int32_t c = data[n];
+            a = c < 0 ? -c : c;
+            level = (a * bg_recip[n] + (1 << (RECIP_BITS - 1))) >> RECIP_BITS;
+            level = level ? (level * bg_ratio[n] + 128) >> 8 : 0;
+            level = level > 1023 ? 1023 : level; // baseline AC limit
+            zz[k] = c < 0 ? -(int16_t)level : (int16_t)level;
+        }
+    } else {
+        for (int k = 1; k < 64; k++) {
+            int n = zigzag[k];
+            int32_t c = data[n];
+            a = c < 0 ? -c : c;
+            level = (a * recip[n] + (1 << (RECIP_BITS - 1))) >> RECIP_BITS;
+            level = level > 1023 ? 1023 : level;
+            zz[k] = c < 0 ? -(int16_t)level : (int16_t)level;
+        }
+    }
+
+    // Values are sent as their magnitude category, then the low bits,
+    // one's complement for negatives
+    bit_state_t b = {e->bits, e->bit_count};
+    const uint16_t *ac_code = e->ac_code[t];
+    const uint8_t *ac_len = e->ac_len[t];
+    int diff = zz[0] - *last_dc;
+    *last_dc = zz[0];
+    int n = bit_length(diff < 0 ? -diff : diff);
+    put_bits(e, &b, e->dc_code[t][n], e->dc_len[t][n]);
+    if (n) {
+        put_bits(e, &b, (diff < 0 ? diff - 1 : diff) & ((1 << n) - 1), n);
+    }
+
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        int v = zz[k];
+        if (!v) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            put_bits(e, &b, ac_code[0xF0], ac_len[0xF0]);
+            run -= 16;
+        }
+        n = bit_length(v < 0 ? -v : v);
+        int sym = (run << 4) | n;
+        put_bits(e, &b, ac_code[sym], ac_len[sym]);
+        put_bits(e, &b, (v < 0 ? v - 1 : v) & ((1 << n) - 1), n);
+        run = 0;
+    }
+    if (run) {
+        put_bits(e, &b, ac_code[0], ac_len[0]);
+    }
+    e->bits = b.bits;
+    e->bit_count = b.count;
+}
+
+// BT.601 full range as JFIF has it, 16-bit fixed point. Chroma is taken
+// from the sum of each 2 x 2 quad, so its shift is 2 more.
+#define Y_R  19595
+#define Y_G  38470
+#define Y_B  7471
+#define CB_R -11059
+#define CB_G -21709
+#define CB_B 32768
+#define CR_R 32768
+#define CR_G -27439
+#define CR_B -5329
+
+static inline void unpack565(const uint8_t *p, int32_t *r, int32_t *g, int32_t *b)
+{
+    uint32_t px = (p[0] << 8) | p[1];
+    *r = (px >> 8) & 0xF8;
+    *g = (px >> 3) & 0xFC;
+    *b = (px << 3) & 0xF8;
+}
+
+static inline int32_t luma(int32_t r, int32_t g, int32_t b)
+{
+    return ((Y_R * r + Y_G * g + Y_B * b + 32768) >> 16) - 128;
+}
+
+// One 16 x 16 MCU as four level-shifted luma blocks, then Cb and Cr from
+// the 2 x 2 quads. Edge MCUs repeat the last column and row.
+static void load_mcu(const uint8_t *src, int width, int height, int mx, int my, int32_t blocks[6][64])
+{
+    uint16_t xs[16];
+    for (int x = 0; x < 16; x++) {
+        xs[x] = (mx + x < width ? mx + x : width - 1) * 2;
+    }
+    for (int y = 0; y < 16; y += 2) {
+        const uint8_t *row0 = src + (size_t)(my + y < height ? my + y : height - 1) * width * 2;
+        const uint8_t *row1 = src + (size_t)(my + y + 1 < height ? my + y + 1 : height - 1) * width * 2;
+        int32_t *yb = blocks[(y >> 3) * 2] + (y & 7) * 8;
+        int32_t *cb = blocks[4] + (y >> 1) * 8;
+        int32_t *cr = blocks[5] + (y >> 1) * 8;
+        for (int x = 0; x < 16; x += 2) {
+            int32_t r0, g0, b0, r1, g1, b1, r2, g2, b2, r3, g3, b3;
+            unpack565(row0 + xs[x], &r0, &g0, &b0);
+            unpack565(row0 + xs[x + 1], &r1, &g1, &b1);
+            unpack565(row1 + xs[x], &r2, &g2, &b2);
+            unpack565(row1 + xs[x + 1], &r3, &g3, &b3);
+            int32_t *o = yb + (x >> 3) * 64 + (x & 7);
+            o[0] = luma(r0, g0, b0);
+            o[1] = luma(r1, g1, b1);
+            o[8] = luma(r2, g2, b2);
+            o[9] = luma(r3, g3, b3);
+            int32_t rs = r0 + r1 + r2 + r3, gs = g0 + g1 + g2 + g3, bs = b0 + b1 + b2 + b3;
+            cb[x >> 1] = (CB_R * rs + CB_G * gs + CB_B * bs + (1 << 17)) >> 18;
+            cr[x >> 1] = (CR_R * rs + CR_G * gs + CR_B * bs + (1 << 17)) >> 18;
+        }
+    }
+}
+
+bool jpeg_enc_rgb565(jpeg_enc_t *e, const uint8_t *src, int width, int height, const img_rect_t *roi,
+                     jpeg_enc_out_cb cb, void *arg)
+{
+    if (width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF) {
+        return false;
+    }
+    if (!e->quality) {
+        jpeg_enc_set_quality(e, 80, 80);
+    }
+    e->cb = cb;
+    e->arg = arg;
+    e->index = 0;
+    e->fill = 0;
+    e->failed = false;
+    e->bits = 0;
+    e->bit_count = 0;
+    write_headers(e, width, height);
+
+    bool has_roi = roi && roi->w > 0 && roi->h > 0 && e->background < e->quality;
+    int dc[3] = {0, 0, 0};
+    int32_t blocks[6][64];
+    for (int my = 0; my < height && !e->failed; my += 16) {
+        bool roi_row = has_roi && my < roi->y + roi->h && my + 16 > roi->y;
+        for (int mx = 0; mx < width; mx += 16) {
+            load_mcu(src, width, height, mx, my, blocks);
+            bool background = has_roi && !(roi_row && mx < roi->x + roi->w && mx + 16 > roi->x);
+            for (int i = 0; i < 4; i++) {
+                encode_block(e, blocks[i], 0, background, &dc[0]);
+            }
+            encode_block(e, blocks[4], 1, background, &dc[1]);
+            encode_block(e, blocks[5], 1, background, &dc[2]);
+        }
+    }
+
+    // Pad the last byte with ones, then EOI
+    bit_state_t pad = {e->bits, e->bit_count};
+    put_bits(e, &pad, 0x7F, 7);
+    put_u16(e, 0xFFD9);
+    flush(e);
+    return !e->failed;
+}
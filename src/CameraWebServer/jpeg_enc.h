@@ -0,0 +1,62 @@
+// Streaming baseline JPEG encoder for RGB565 frames.
+//
+// Integer only and free of Arduino and ESP-IDF dependencies. Frames are
+// read one 16 x 16 MCU at a time straight from the frame buffer, converted
+// to YCbCr 4:2:0, transformed with the fixed-point LLM DCT libjpeg calls
+// islow and Huffman coded with the standard tables, so the output matches
+// what libjpeg makes at the same quality. Output goes to a callback in
+// JPEG_ENC_CHUNK pieces, nothing the size of the frame is allocated.
+//
+// Blocks outside a region of interest can be quantized at a lower quality.
+// A baseline JPEG has one table per component for the whole frame, so
+// those blocks are quantized with the coarser table and the result is
+// written in steps of the frame's table: the decoder needs nothing special,
+// and the coefficients the coarse table zeroes cost no bits.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "img_resize.h"
+
+#define JPEG_ENC_CHUNK 1024 // bytes handed to the callback at a time
+
+// Same as the esp32-camera jpg_out_cb: returns len if the bytes were taken
+typedef size_t (*jpeg_enc_out_cb)(void *arg, size_t index, const void *data, size_t len);
+
+typedef struct
+{
+    uint8_t quality;
+    uint8_t background;
+    uint8_t quant[2][64];      // luma, chroma, zigzag order as written to DQT
+    uint16_t recip[2][64];     // 2^18 / divisor of the DCT output
+    uint16_t bg_recip[2][64];  // same for the background quality
+    uint16_t bg_ratio[2][64];  // background step over frame step, 8.8 fixed point
+    uint16_t dc_code[2][12];
+    uint8_t dc_len[2][12];
+    uint16_t ac_code[2][256];
+    uint8_t ac_len[2][256];
+
+    // Output state of the frame being encoded
+    jpeg_enc_out_cb cb;
+    void *arg;
+    size_t index;  // bytes handed to cb so far
+    size_t fill;   // bytes in out
+    bool failed;
+    uint32_t bits; // pending bits, low bit_count of them
+    int bit_count;
+    uint8_t out[JPEG_ENC_CHUNK];
+} jpeg_enc_t;
+
+void jpeg_enc_init(jpeg_enc_t *e);
+
+// Quality 1..100 as libjpeg's jpeg_set_quality() takes it, inside the
+// region of interest and outside it. A background above quality is
+// lowered to it. Cheap to call per frame when nothing changed.
+void jpeg_enc_set_quality(jpeg_enc_t *e, uint8_t quality, uint8_t background);
+
+// Encode a big-endian RGB565 image. Blocks that overlap roi are kept at
+// the quality, the rest at the background quality; with roi NULL or empty
+// the whole frame is at the quality. False if the callback refused bytes.
+bool jpeg_enc_rgb565(jpeg_enc_t *e, const uint8_t *src, int width, int height, const img_rect_t *roi,
+                     jpeg_enc_out_cb cb, void *arg);
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <string.h>
+#include "log_ring.h"
+
+bool log_ring_init(log_ring_t *r, log_ring_cell_t *cells, size_t count)
+{
+    if (!count || (count & (count - 1))) {
+        return false;
+    }
+    r->cells = cells;
+    r->mask = count - 1;
+    for (size_t i = 0; i < count; i++) {
+        cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    r->head.store(0, std::memory_order_relaxed);
+    r->tail = 0;
+    r->dropped.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+bool log_ring_put(log_ring_t *r, int64_t time_us, uint16_t fmt, int nargs, const intptr_t *args)
+{
+    uint32_t pos = r->head.load(std::memory_order_relaxed);
+    log_ring_cell_t *cell;
+    while (true) {
+        cell = &r->cells[pos & r->mask];
+        int32_t diff = (int32_t)(cell->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            // The cell is free for this lap, claim the position
+            if (r->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The consumer hasn't read the cell from the previous lap
+            r->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            pos = r->head.load(std::memory_order_relaxed);
+        }
+    }
+    cell->rec.time_us = time_us;
+    cell->rec.fmt = fmt;
+    cell->rec.nargs = nargs < LOG_RING_ARGS ? nargs : LOG_RING_ARGS;
+    memcpy(cell->rec.args, args, cell->rec.nargs * sizeof(intptr_t));
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool log_ring_take(log_ring_t *r, log_ring_record_t *out)
+{
+    log_ring_cell_t *cell = &r->cells[r->tail & r->mask];
+    if ((int32_t)(cell->seq.load(std::memory_order_acquire) - (r->tail + 1)) < 0) {
+        return false;
+    }
+    *out = cell->rec;
+    // Free the cell for the producers' next lap
+    cell->seq.store(r->tail + r->mask + 1, std::memory_order_release);
+    r->tail++;
+    return true;
+}
+
+size_t log_ring_format(const char *fmt, const log_ring_record_t *rec, char *buf, size_t len)
+{
+    size_t out = 0;
+    int arg = 0;
+    if (!len) {
+        return 0;
+    }
+    while (*fmt && out + 1 < len) {
+        if (*fmt != '%') {
+            buf[out++] = *fmt++;
+            continue;
+        }
+        if (fmt[1] == '%') {
+            buf[out++] = '%';
+            fmt += 2;
+            continue;
+        }
+        // Copy one conversion spec and print it with its argument cast to
+        // the type it expects
+        char spec[16];
+        size_t n = strspn(fmt + 1, "-+ #0123456789.") + 1;
+        char conv = fmt[n];
+        if (!conv || n + 2 > sizeof(spec)) {
+            break;
+        }
+        memcpy(spec, fmt, n + 1);
+        spec[n + 1] = '\0';
+        fmt += n + 1;
+        intptr_t v = arg < rec->nargs ? rec->args[arg] : 0;
+        arg++;
+        int w;
+        switch (conv) {
+        case 'd':
+        case 'i':
+        case 'c':
+            w = snprintf(buf + out, len - out, spec, (int)v);
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+            w = snprintf(buf + out, len - out, spec, (unsigned)v);
+            break;
+        case 's':
+            w = snprintf(buf + out, len - out, spec, v ? (const char *)v : "(null)");
+            break;
+        default:
+            w = snprintf(buf + out, len - out, "%%%c", conv);
+            break;
+        }
+        if (w < 0) {
+            break;
+        }
+        out += (size_t)w < len - out ? (size_t)w : len - out - 1;
+    }
+    buf[out] = '\0';
+    return out;
+}
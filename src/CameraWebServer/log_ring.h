@@ -0,0 +1,55 @@
+// Lock-free multi-producer, single-consumer ring of binary log records.
+//
+// Pure logic with no Arduino or ESP-IDF dependencies. Producers store a
+// format id and up to LOG_RING_ARGS integer or static string arguments
+// instead of text, so logging costs a few atomic operations and never
+// blocks: when the ring is full the record is counted as dropped. The
+// single consumer formats records later with log_ring_format(). Each cell
+// carries a sequence number that says whose turn it is, the usual bounded
+// queue scheme, so producers only contend on one atomic index.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <atomic>
+
+#define LOG_RING_ARGS 6
+
+typedef struct
+{
+    int64_t time_us;
+    uint16_t fmt;
+    uint8_t nargs;
+    intptr_t args[LOG_RING_ARGS]; // %s arguments must point to static strings
+} log_ring_record_t;
+
+typedef struct
+{
+    std::atomic<uint32_t> seq;
+    log_ring_record_t rec;
+} log_ring_cell_t;
+
+typedef struct
+{
+    log_ring_cell_t *cells;
+    uint32_t mask;
+    std::atomic<uint32_t> head;    // next position producers claim
+    uint32_t tail;                 // next position the consumer reads
+    std::atomic<uint32_t> dropped; // records refused because the ring was full
+} log_ring_t;
+
+// count must be a power of two
+bool log_ring_init(log_ring_t *r, log_ring_cell_t *cells, size_t count);
+
+// Any thread. False and counted as dropped when the ring is full.
+bool log_ring_put(log_ring_t *r, int64_t time_us, uint16_t fmt, int nargs, const intptr_t *args);
+
+// Consumer only. False when the ring is empty.
+bool log_ring_take(log_ring_t *r, log_ring_record_t *out);
+
+// printf the record's arguments into fmt. Conversions d, i, u, x, X, c and
+// s with flags, width and precision are supported, each taking one
+// argument; missing arguments print as 0. Returns the length written,
+// truncated to len - 1.
+size_t log_ring_format(const char *fmt, const log_ring_record_t *rec, char *buf, size_t len);
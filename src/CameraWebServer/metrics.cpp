@@ -0,0 +1,127 @@
+#include <atomic>
+#include "metrics.h"
+
+typedef struct
+{
+    const char *name;
+    const char *help;
+} metric_desc_t;
+
+static const metric_desc_t counter_desc[METRIC_COUNTER_MAX] = {
+    {"camera_frames_captured_total", "Frames published by the capture task"},
+    {"camera_capture_failures_total", "Failed esp_camera_fb_get calls"},
+    {"camera_frames_dropped_total", "Frames a stream viewer skipped or no broker slot was free for"},
+    {"camera_frames_sent_total", "Frames sent to clients"},
+    {"camera_bytes_sent_total", "Frame payload bytes sent to clients"},
+    {"camera_frames_unchanged_total", "Frames answered as unchanged instead of sent"},
+    {"camera_classifications_total", "Classifications applied to the alert"},
+    {"camera_results_late_total", "Classification results that arrived after one for a newer frame"},
+    {"camera_results_stale_total", "Classification results dropped as too old or for an unknown frame"},
+    {"camera_log_dropped_total", "Serial log records dropped because the log ring was full"},
+    {"camera_ws_events_total", "Events and replies sent to WebSocket subscribers"},
+};
+
+static const metric_desc_t gauge_desc[METRIC_GAUGE_MAX] = {
+    {"camera_heap_free_bytes", "Free internal heap"},
+    {"camera_heap_min_free_bytes", "Lowest free internal heap since boot"},
+    {"camera_psram_free_bytes", "Free PSRAM"},
+    {"camera_heap_largest_free_bytes", "Largest free internal heap block"},
+    {"camera_psram_largest_free_bytes", "Largest free PSRAM block"},
+    {"camera_uptime_seconds", "Time since boot"},
+    {"camera_event_arena_bytes", "PSRAM reserved for alert clips"},
+    {"camera_stream_viewers", "Viewers on the broadcast stream"},
+    {"camera_ws_clients", "Subscribers on the WebSocket push channel"},
+};
+
+static const metric_desc_t hist_desc[METRIC_HIST_MAX] = {
+    {"camera_fb_get_seconds", "Time in esp_camera_fb_get"},
+    {"camera_frame_wait_seconds", "Time handlers wait for a frame"},
+    {"camera_convert_seconds", "Time spent encoding or resizing frames"},
+    {"camera_send_seconds", "Time spent writing frames to sockets"},
+    {"camera_classify_to_alert_seconds", "Frame capture to its classification reaching the alert"},
+    {"camera_local_inference_seconds", "Time the on-device classifier takes per frame"},
+    {"camera_alert_delay_seconds", "First lying frame captured to buzzer on, beyond the designed hold"},
+};
+
+// Upper bounds in microseconds, the last bucket is +Inf
+static const uint32_t bucket_us[METRIC_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000, 10000000,
+};
+
+typedef struct
+{
+    std::atomic<uint32_t> buckets[METRIC_BUCKETS];
+    // Wraps after 71 minutes of observed time, which Prometheus rate() takes
+    // for a counter reset. 32 bits keep the add lock-free on the ESP32,
+    // where 64-bit atomics go through a critical section.
+    std::atomic<uint32_t> sum_us;
+} metric_hist_data_t;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "metrics updates must not take a lock");
+
+static std::atomic<uint32_t> counters[METRIC_COUNTER_MAX];
+static std::atomic<uint32_t> gauges[METRIC_GAUGE_MAX];
+static metric_hist_data_t hists[METRIC_HIST_MAX];
+
+void metrics_add(metric_counter_t counter, uint32_t n)
+{
+    counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void metrics_set(metric_gauge_t gauge, uint32_t value)
+{
+    gauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+void metrics_observe(metric_hist_t hist, int64_t us)
+{
+    if (us < 0) {
+        us = 0;
+    }
+    int b = 0;
+    while (b < METRIC_BUCKETS - 1 && us > bucket_us[b]) {
+        b++;
+    }
+    hists[hist].buckets[b].fetch_add(1, std::memory_order_relaxed);
+    hists[hist].sum_us.fetch_add((uint32_t)us, std::memory_order_relaxed);
+}
+
+static void out_header(text_out_t *o, const metric_desc_t *d, const char *type)
+{
+    text_out_printf(o, "# HELP %s %s\n", d->name, d->help);
+    text_out_printf(o, "# TYPE %s %s\n", d->name, type);
+}
+
+bool metrics_render(text_write_cb write, void *arg)
+{
+    text_out_t o;
+    text_out_init(&o, write, arg);
+
+    for (int i = 0; i < METRIC_COUNTER_MAX; i++) {
+        out_header(&o, &counter_desc[i], "counter");
+        text_out_printf(&o, "%s %u\n", counter_desc[i].name, (unsigned)counters[i].load(std::memory_order_relaxed));
+    }
+    for (int i = 0; i < METRIC_GAUGE_MAX; i++) {
+        out_header(&o, &gauge_desc[i], "gauge");
+        text_out_printf(&o, "%s %u\n", gauge_desc[i].name, (unsigned)gauges[i].load(std::memory_order_relaxed));
+    }
+    for (int i = 0; i < METRIC_HIST_MAX; i++) {
+        const char *name = hist_desc[i].name;
+        out_header(&o, &hist_desc[i], "histogram");
+        // Buckets are stored per range, Prometheus wants them cumulative
+        uint32_t count = 0;
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            count += hists[i].buckets[b].load(std::memory_order_relaxed);
+            if (b < METRIC_BUCKETS - 1) {
+                text_out_printf(&o, "%s_bucket{le=\"%u.%06u\"} %u\n", name, (unsigned)(bucket_us[b] / 1000000),
+                         (unsigned)(bucket_us[b] % 1000000), (unsigned)count);
+            } else {
+                text_out_printf(&o, "%s_bucket{le=\"+Inf\"} %u\n", name, (unsigned)count);
+            }
+        }
+        uint32_t sum = hists[i].sum_us.load(std::memory_order_relaxed);
+        text_out_printf(&o, "%s_sum %u.%06u\n", name, (unsigned)(sum / 1000000), (unsigned)(sum % 1000000));
+        text_out_printf(&o, "%s_count %u\n", name, (unsigned)count);
+    }
+    return text_out_flush(&o);
+}
@@ -0,0 +1,59 @@
+// Always-on counters, gauges and fixed-bucket latency histograms, exported
+// in the Prometheus text format.
+//
+// Updates are single lock-free relaxed atomic adds, safe from any task and
+// cheap enough for every frame. No Arduino or ESP-IDF dependencies.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "text_out.h"
+
+typedef enum {
+    METRIC_FRAMES_CAPTURED,  // frames published by the capture task
+    METRIC_CAPTURE_FAILED,   // esp_camera_fb_get() returned NULL
+    METRIC_FRAMES_DROPPED,   // frames a stream viewer skipped or no broker slot was free for
+    METRIC_FRAMES_SENT,      // frames sent by /capture, /cycle, /stream and the uplink
+    METRIC_BYTES_SENT,       // frame payload bytes sent, wraps at 4 GiB
+    METRIC_FRAMES_UNCHANGED, // conditional /capture and /cycle answered 304 instead of a frame
+    METRIC_CLASSIFICATIONS,  // classifications applied to the alert
+    METRIC_RESULTS_LATE,     // results that arrived after one for a newer frame
+    METRIC_RESULTS_STALE,    // results dropped as too old or for an unknown frame
+    METRIC_LOG_DROPPED,      // serial log records dropped because the log ring was full
+    METRIC_WS_EVENTS,        // events and replies sent to /ws subscribers
+    METRIC_COUNTER_MAX
+} metric_counter_t;
+
+typedef enum {
+    METRIC_HEAP_FREE,
+    METRIC_HEAP_MIN_FREE,
+    METRIC_PSRAM_FREE,
+    METRIC_HEAP_LARGEST_FREE,  // largest internal block, what fragmentation eats
+    METRIC_PSRAM_LARGEST_FREE,
+    METRIC_UPTIME,
+    METRIC_EVENT_ARENA,
+    METRIC_STREAM_VIEWERS,
+    METRIC_WS_CLIENTS,
+    METRIC_GAUGE_MAX
+} metric_gauge_t;
+
+typedef enum {
+    METRIC_FB_GET,            // esp_camera_fb_get() in the capture task
+    METRIC_FRAME_WAIT,        // handler waiting for a frame from the broker
+    METRIC_CONVERT,           // JPEG encoding and model input resizing
+    METRIC_SEND,              // writing a frame to the socket
+    METRIC_CLASSIFY_TO_ALERT, // frame capture to its classification reaching the alert
+    METRIC_LOCAL_INFERENCE,   // resize and inference of the on-device classifier
+    METRIC_ALERT_DELAY,       // first lying frame captured to buzzer on, beyond the designed hold
+    METRIC_HIST_MAX
+} metric_hist_t;
+
+#define METRIC_BUCKETS 14 // upper bounds from 100 us to 10 s, plus +Inf
+
+void metrics_add(metric_counter_t counter, uint32_t n);
+void metrics_set(metric_gauge_t gauge, uint32_t value);
+void metrics_observe(metric_hist_t hist, int64_t us);
+
+// Render every metric. Returns false if the writer failed.
+bool metrics_render(text_write_cb write, void *arg);
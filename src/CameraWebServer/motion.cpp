@@ -0,0 +1,113 @@
+#include <string.h>
+#include "motion.h"
+
+// BT.601 weights in 8-bit fixed point
+static inline uint8_t luma(uint32_t r, uint32_t g, uint32_t b)
+{
+    return (uint8_t)((r * 77 + g * 150 + b * 29) >> 8);
+}
+
+static inline uint8_t gray_luma(const uint8_t *p)
+{
+    return p[0];
+}
+
+static inline uint8_t rgb565_luma(const uint8_t *p)
+{
+    uint16_t px = (p[0] << 8) | p[1];
+    return luma((px >> 11) << 3, ((px >> 5) & 0x3F) << 2, (px & 0x1F) << 3);
+}
+
+static inline uint8_t rgb888_luma(const uint8_t *p)
+{
+    return luma(p[0], p[1], p[2]);
+}
+
+// Rows are summed into per-cell accumulators, a grid row is emitted each time
+// the source row crosses into the next cell row.
+template <int BPP, uint8_t (*LUMA)(const uint8_t *)>
+static bool motion_grid(const uint8_t *src, int width, int height, uint8_t *grid)
+{
+    if (width < MOTION_GRID_W || height < MOTION_GRID_H) {
+        return false;
+    }
+
+    uint32_t acc[MOTION_GRID_W];
+    int y = 0;
+    for (int cy = 0; cy < MOTION_GRID_H; cy++) {
+        int y1 = (cy + 1) * height / MOTION_GRID_H;
+        int rows = y1 - y;
+        memset(acc, 0, sizeof(acc));
+        for (; y < y1; y++) {
+            const uint8_t *row = src + (size_t)y * width * BPP;
+            int x = 0;
+            for (int cx = 0; cx < MOTION_GRID_W; cx++) {
+                int x1 = (cx + 1) * width / MOTION_GRID_W;
+                uint32_t sum = 0;
+                for (; x < x1; x++) {
+                    sum += LUMA(row + x * BPP);
+                }
+                acc[cx] += sum;
+            }
+        }
+        int x = 0;
+        for (int cx = 0; cx < MOTION_GRID_W; cx++) {
+            int x1 = (cx + 1) * width / MOTION_GRID_W;
+            grid[cy * MOTION_GRID_W + cx] = (uint8_t)(acc[cx] / ((x1 - x) * rows));
+            x = x1;
+        }
+    }
+    return true;
+}
+
+bool motion_grid_rgb565(const uint8_t *src, int width, int height, uint8_t *grid)
+{
+    return motion_grid<2, rgb565_luma>(src, width, height, grid);
+}
+
+bool motion_grid_rgb888(const uint8_t *src, int width, int height, uint8_t *grid)
+{
+    return motion_grid<3, rgb888_luma>(src, width, height, grid);
+}
+
+bool motion_grid_gray(const uint8_t *src, int width, int height, uint8_t *grid)
+{
+    return motion_grid<1, gray_luma>(src, width, height, grid);
+}
+
+uint32_t motion_energy(const uint8_t *prev, const uint8_t *cur)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < MOTION_GRID_SIZE; i++) {
+        int d = (int)cur[i] - (int)prev[i];
+        d = d < 0 ? -d : d;
+        d -= MOTION_NOISE;
+        sum += d > 0 ? d : 0;
+    }
+    return sum * 100 / MOTION_GRID_SIZE;
+}
+
+bool motion_bounds(const uint8_t *prev, const uint8_t *cur, int *x, int *y, int *w, int *h)
+{
+    int x0 = MOTION_GRID_W, y0 = MOTION_GRID_H, x1 = -1, y1 = -1;
+    for (int cy = 0; cy < MOTION_GRID_H; cy++) {
+        for (int cx = 0; cx < MOTION_GRID_W; cx++) {
+            int i = cy * MOTION_GRID_W + cx;
+            int d = (int)cur[i] - (int)prev[i];
+            if (d > MOTION_NOISE || d < -MOTION_NOISE) {
+                x0 = cx < x0 ? cx : x0;
+                x1 = cx > x1 ? cx : x1;
+                y0 = cy < y0 ? cy : y0;
+                y1 = cy > y1 ? cy : y1;
+            }
+        }
+    }
+    if (x1 < 0) {
+        return false;
+    }
+    *x = x0;
+    *y = y0;
+    *w = x1 - x0 + 1;
+    *h = y1 - y0 + 1;
+    return true;
+}
@@ -0,0 +1,33 @@
+// Motion-energy kernel: downsample frames to a small grayscale grid and
+// measure how much consecutive grids differ.
+//
+// Integer only and free of Arduino and ESP-IDF dependencies so it builds
+// and can be benchmarked on a host.
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MOTION_GRID_W     32
+#define MOTION_GRID_H     24
+#define MOTION_GRID_SIZE  (MOTION_GRID_W * MOTION_GRID_H)
+#define MOTION_NOISE      6 // per-cell gray level change treated as sensor noise
+
+// Box-filter a big-endian RGB565 image, as captured by the camera, into a
+// MOTION_GRID_W x MOTION_GRID_H grayscale grid. The image must be at least
+// as large as the grid.
+bool motion_grid_rgb565(const uint8_t *src, int width, int height, uint8_t *grid);
+
+// Same for R,G,B byte order RGB888, as decoded JPEG
+bool motion_grid_rgb888(const uint8_t *src, int width, int height, uint8_t *grid);
+
+// Same for an 8-bit grayscale image
+bool motion_grid_gray(const uint8_t *src, int width, int height, uint8_t *grid);
+
+// Difference energy between two grids: 100 x the mean per-cell absolute
+// change above MOTION_NOISE. 0 for a static scene, 25500 at most.
+uint32_t motion_energy(const uint8_t *prev, const uint8_t *cur);
+
+// Bounding box, in grid cells, of the cells that changed by more than
+// MOTION_NOISE. False if none did.
+bool motion_bounds(const uint8_t *prev, const uint8_t *cur, int *x, int *y, int *w, int *h);
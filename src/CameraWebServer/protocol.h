@@ -0,0 +1,69 @@
+// Wire formats shared between the firmware and the gateway. All fields are
+// little-endian, which is the native order on both the ESP32 and x86.
+#pragma once
+
+#include <stdint.h>
+
+#define CYCLE_NO_RESULT 0xFF // class_id of the first request, before anything was classified
+
+// Body of a POST /cycle request: the gateway's result for the previous frame
+typedef struct __attribute__((packed))
+{
+    uint8_t class_id;   // posture_t
+    uint8_t confidence; // 0..255
+    uint16_t flags;     // reserved, 0
+    int64_t frame_time; // X-Timestamp of the classified frame, in microseconds
+} cycle_result_t;
+
+static_assert(sizeof(cycle_result_t) == 12, "cycle_result_t must match the gateway struct format '<BBHq'");
+
+// Gateway stage times for one result (trace.h), in microseconds after the
+// gateway had the whole frame, on the gateway's own clock. Sent as the
+// X-Gateway-Trace header "started,decoded,inferred" with /cycle and a single
+// /classify result, and over the uplink as UPLINK_MSG_TRACE just before the
+// UPLINK_MSG_RESULT it belongs to.
+typedef struct __attribute__((packed))
+{
+    uint32_t started_us;  // an inference thread took the frame
+    uint32_t decoded_us;  // decoded and resized to the model input
+    uint32_t inferred_us; // classified
+} trace_gateway_t;
+
+static_assert(sizeof(trace_gateway_t) == 12, "trace_gateway_t must match the gateway struct format '<III'");
+
+// Push-mode uplink (uplink.cpp). The device connects to the gateway and
+// sends one uplink_frame_t followed by len bytes of JPEG per frame. The
+// gateway answers on the same socket with uplink_reply_t messages.
+#define UPLINK_MAGIC     0x314B4E4C // "LNK1"
+#define UPLINK_FRAME_MAX (1024 * 1024) // above esp32-camera's largest JPEG buffer, 2560 x 1920 / 5
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t seq;       // frame broker sequence number
+    int64_t frame_time; // fb->timestamp in microseconds
+    int64_t send_time;  // device clock when the frame was sent
+    uint32_t len;       // at most UPLINK_FRAME_MAX
+} uplink_frame_t;
+
+static_assert(sizeof(uplink_frame_t) == 28, "uplink_frame_t must match the gateway struct format '<IIqqI'");
+
+typedef enum {
+    UPLINK_MSG_RESULT = 1, // result holds a classification
+    UPLINK_MSG_RATE = 2,   // interval_ms sets the frame interval
+    UPLINK_MSG_TRACE = 3,  // trace holds the gateway stage times of the next result
+} uplink_msg_type_t;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t type;          // uplink_msg_type_t
+    uint8_t reserved;
+    uint16_t interval_ms;
+    union {
+        cycle_result_t result;
+        trace_gateway_t trace;
+    };
+} uplink_reply_t;
+
+static_assert(sizeof(uplink_reply_t) == 16,
+              "uplink_reply_t must match the gateway struct format '<BBHBBHq', '<BBHIII' for UPLINK_MSG_TRACE");
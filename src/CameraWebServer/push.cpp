@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include "frame_hash.h"
+#include "push.h"
+
+const char *const push_cmd_names[] = {"state", "status", "control", "subscribe"};
+
+// In push_topic_t bit order
+static const char *const topic_names[] = {"state", "alert", "status", "frame"};
+
+#define TOPIC_COUNT (sizeof(topic_names) / sizeof(topic_names[0]))
+
+void push_state_from(push_state_t *s, const alert_state_t *a, bool local)
+{
+    s->posture = a->posture;
+    s->confidence = a->confidence;
+    s->motion = a->motion;
+    s->timer = a->timer;
+    s->leds = a->leds;
+    s->buzzer = a->buzzer;
+    s->local = local;
+}
+
+bool push_state_changed(const push_state_t *a, const push_state_t *b)
+{
+    return a->posture != b->posture || a->timer != b->timer || a->leds != b->leds || a->buzzer != b->buzzer ||
+           a->local != b->local;
+}
+
+int push_state_json(const push_state_t *s, char *buf, size_t len)
+{
+    return snprintf(buf, len,
+                    "{\"t\":\"state\",\"status\":\"%s\",\"confidence\":%u,\"motion\":%u,\"timer\":%u,\"leds\":%u,"
+                    "\"buzzer\":%u,\"source\":\"%s\"}",
+                    posture_label(s->posture), s->confidence, (unsigned)s->motion, s->timer, s->leds, s->buzzer,
+                    s->local ? "local" : "gateway");
+}
+
+int push_alert_json(const alert_state_t *a, char *buf, size_t len)
+{
+    // alert_tick() restarts the lying period as it fires, so the time it
+    // fired and the buzzer's on-time are what is left to tell
+    return snprintf(buf, len, "{\"t\":\"alert\",\"status\":\"%s\",\"time\":%lld.%06d,\"buzzer_ms\":%lld}",
+                    posture_label(a->posture), (long long)(a->alert_time / 1000000), (int)(a->alert_time % 1000000),
+                    (long long)((a->buzzer_until - a->alert_time) / 1000));
+}
+
+int push_frame_json(uint32_t seq, int64_t frame_time, uint32_t motion, uint64_t hash, char *buf, size_t len)
+{
+    char hex[FRAME_HASH_HEX + 1];
+    frame_hash_format(hash, hex);
+    return snprintf(buf, len, "{\"t\":\"frame\",\"seq\":%u,\"time\":%lld.%06d,\"motion\":%u,\"hash\":\"%s\"}",
+                    (unsigned)seq, (long long)(frame_time / 1000000), (int)(frame_time % 1000000), (unsigned)motion,
+                    hex);
+}
+
+size_t push_status_json(const status_cache_t *c, uint32_t since, char *buf, size_t len)
+{
+    // The tag takes the place of the "{" status_cache_json() starts with
+    static const char tag[] = "{\"t\":\"status\",";
+    const size_t tag_len = sizeof(tag) - 1;
+    size_t need = status_cache_json(c, since, NULL, 0) - 1 + tag_len;
+    if (len > need) {
+        status_cache_json(c, since, buf + tag_len - 1, len - (tag_len - 1));
+        memcpy(buf, tag, tag_len);
+    } else if (len) {
+        buf[0] = '\0';
+    }
+    return need;
+}
+
+int push_reply_json(const push_command_t *cmd, const char *error, char *buf, size_t len)
+{
+    char name[16];
+    char id[16] = "";
+    snprintf(name, sizeof(name), "%.*s", (int)cmd->name_len, cmd->name);
+    if (cmd->has_id) {
+        snprintf(id, sizeof(id), ",\"id\":%u", (unsigned)cmd->id);
+    }
+    if (!error) {
+        return snprintf(buf, len, "{\"t\":\"reply\",\"cmd\":\"%s\"%s,\"ok\":true}", name, id);
+    }
+
+    // Quotes, backslashes and control characters from the client would
+    // break the JSON, so they become '?'
+    char escaped[96];
+    size_t n = 0;
+    for (const char *p = error; *p && n + 1 < sizeof(escaped); p++) {
+        escaped[n++] = *p == '"' || *p == '\\' || (unsigned char)*p < 0x20 ? '?' : *p;
+    }
+    escaped[n] = '\0';
+    for (char *p = name; *p; p++) {
+        if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20) {
+            *p = '?';
+        }
+    }
+    return snprintf(buf, len, "{\"t\":\"reply\",\"cmd\":\"%s\"%s,\"ok\":false,\"error\":\"%s\"}", name, id, escaped);
+}
+
+bool push_parse(const char *text, push_command_t *cmd)
+{
+    const char *cursor = text;
+    query_pair_t pair;
+    if (!query_next(&cursor, &pair) || !query_key_is(&pair, "cmd")) {
+        return false;
+    }
+    cmd->name = pair.value;
+    cmd->name_len = pair.value_len;
+    cmd->cmd = PUSH_CMD_UNKNOWN;
+    for (int i = 0; i < PUSH_CMD_UNKNOWN; i++) {
+        if (strlen(push_cmd_names[i]) == pair.value_len && !strncmp(push_cmd_names[i], pair.value, pair.value_len)) {
+            cmd->cmd = (push_cmd_t)i;
+        }
+    }
+
+    cmd->has_id = false;
+    cmd->args = cursor;
+    int id;
+    if (query_next(&cursor, &pair) && query_key_is(&pair, "id") && query_int(&pair, &id) && id >= 0) {
+        cmd->id = id;
+        cmd->has_id = true;
+        cmd->args = cursor;
+    }
+    return true;
+}
+
+bool push_topics(const query_pair_t *pair, uint8_t *mask)
+{
+    uint8_t topics = 0;
+    const char *p = pair->value;
+    const char *end = pair->value + pair->value_len;
+    while (p < end) {
+        const char *comma = (const char *)memchr(p, ',', end - p);
+        size_t len = (comma ? comma : end) - p;
+        size_t i = 0;
+        while (i < TOPIC_COUNT && (strlen(topic_names[i]) != len || strncmp(topic_names[i], p, len))) {
+            i++;
+        }
+        if (i == TOPIC_COUNT) {
+            return false;
+        }
+        topics |= 1 << i;
+        p += len + 1;
+    }
+    *mask = topics;
+    return true;
+}
@@ -0,0 +1,96 @@
+// Events and commands of the /ws WebSocket channel.
+//
+// Subscribers get a small JSON text frame, tagged by "t", the moment what
+// it describes changes, instead of polling /timer and /status:
+//   {"t":"state","status":"TDR","confidence":230,"motion":12,"timer":3,"leds":7,"buzzer":0,"source":"gateway"}
+//   {"t":"alert","status":"TDR","time":S.US,"buzzer_ms":3000}
+//   {"t":"status","version":V,...}  /status fields changed since the version the client has
+//   {"t":"frame","seq":N,"time":S.US,"motion":M,"hash":"H"}  each analysed frame, if subscribed
+// Times are capture-clock seconds, as in X-Timestamp.
+//   {"t":"reply","cmd":"control","id":N,"ok":true}  or "ok":false,"error":"..."
+// Commands are text frames in query string form, the command first:
+//   cmd=state
+//   cmd=status[&since=V]
+//   cmd=control&NAME=N[&NAME=N...]  as /control takes them
+//   cmd=subscribe&topics=state,alert,status,frame
+// An id=N right after the command is echoed by its reply, which follows
+// the command's own event.
+//
+// Pure logic with no Arduino or ESP-IDF dependencies.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "alert.h"
+#include "query.h"
+#include "status_cache.h"
+
+#define PUSH_EVENT_MAX   224 // longest event other than status
+#define PUSH_COMMAND_MAX 256 // longest command taken, like a /control query
+
+typedef enum {
+    PUSH_TOPIC_STATE  = 0x01,
+    PUSH_TOPIC_ALERT  = 0x02,
+    PUSH_TOPIC_STATUS = 0x04,
+    PUSH_TOPIC_FRAME  = 0x08, // five events a second while the camera runs
+} push_topic_t;
+
+#define PUSH_TOPICS_DEFAULT (PUSH_TOPIC_STATE | PUSH_TOPIC_ALERT | PUSH_TOPIC_STATUS)
+
+typedef enum {
+    PUSH_CMD_STATE,
+    PUSH_CMD_STATUS,
+    PUSH_CMD_CONTROL,
+    PUSH_CMD_SUBSCRIBE,
+    PUSH_CMD_UNKNOWN,
+} push_cmd_t;
+
+extern const char *const push_cmd_names[];
+
+// What a state event carries
+typedef struct
+{
+    posture_t posture;
+    uint8_t confidence;
+    uint32_t motion;
+    uint8_t timer;
+    uint8_t leds;
+    bool buzzer;
+    bool local; // the newest result came from the on-device classifier
+} push_state_t;
+
+typedef struct
+{
+    push_cmd_t cmd;
+    const char *name; // as sent, for the reply
+    size_t name_len;
+    uint32_t id;
+    bool has_id;
+    const char *args; // the pairs after cmd and id, for the command to parse
+} push_command_t;
+
+void push_state_from(push_state_t *s, const alert_state_t *a, bool local);
+
+// Whether b differs from a in what subscribers are told about. Motion and
+// confidence change with every frame and result, so they ride along with
+// the other changes instead.
+bool push_state_changed(const push_state_t *a, const push_state_t *b);
+
+// The renderers behave like snprintf: return the length needed, write at
+// most len bytes
+int push_state_json(const push_state_t *s, char *buf, size_t len);
+int push_alert_json(const alert_state_t *a, char *buf, size_t len);
+int push_frame_json(uint32_t seq, int64_t frame_time, uint32_t motion, uint64_t hash, char *buf, size_t len);
+size_t push_status_json(const status_cache_t *c, uint32_t since, char *buf, size_t len);
+
+// Reply to cmd, ok when error is NULL. The error is escaped, it may quote
+// what the client sent.
+int push_reply_json(const push_command_t *cmd, const char *error, char *buf, size_t len);
+
+// Parse a command, pointing into text. False if it doesn't start with
+// cmd=; an unknown name parses as PUSH_CMD_UNKNOWN.
+bool push_parse(const char *text, push_command_t *cmd);
+
+// topics=state,alert,... into a push_topic_t mask. False on an unknown name.
+bool push_topics(const query_pair_t *pair, uint8_t *mask);
@@ -0,0 +1,66 @@
+#include <limits.h>
+#include <string.h>
+#include "query.h"
+
+bool query_next(const char **cursor, query_pair_t *pair)
+{
+    const char *p = *cursor;
+    while (*p == '&') {
+        p++;
+    }
+    if (!*p) {
+        *cursor = p;
+        return false;
+    }
+    const char *end = p + strcspn(p, "&");
+    const char *eq = (const char *)memchr(p, '=', end - p);
+    pair->key = p;
+    if (eq) {
+        pair->key_len = eq - p;
+        pair->value = eq + 1;
+        pair->value_len = end - (eq + 1);
+    } else {
+        pair->key_len = end - p;
+        pair->value = end;
+        pair->value_len = 0;
+    }
+    *cursor = end;
+    return true;
+}
+
+bool query_key_is(const query_pair_t *pair, const char *key)
+{
+    return strlen(key) == pair->key_len && !memcmp(pair->key, key, pair->key_len);
+}
+
+bool query_int(const query_pair_t *pair, int *out)
+{
+    const char *p = pair->value;
+    const char *end = p + pair->value_len;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if (p == end) {
+        return false;
+    }
+    long long value = 0;
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        value = value * 10 + (*p - '0');
+        if (value > (long long)INT_MAX + 1) {
+            return false;
+        }
+    }
+    if (negative) {
+        value = -value;
+    }
+    if (value > INT_MAX || value < INT_MIN) {
+        return false;
+    }
+    *out = (int)value;
+    return true;
+}
@@ -0,0 +1,30 @@
+// In-place query string parsing.
+//
+// Walks the key=value pairs of a query string without copying or
+// allocating: each pair points into the caller's buffer. No Arduino or
+// ESP-IDF dependencies. Keys and values are not URL-decoded, which is fine
+// for the control names and numbers this firmware takes.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    const char *key;
+    size_t key_len;
+    const char *value; // empty for a bare key
+    size_t value_len;
+} query_pair_t;
+
+// Read the pair at *cursor and advance past it. Empty pairs ("a=1&&b=2")
+// are skipped. Returns false at the end of the string.
+bool query_next(const char **cursor, query_pair_t *pair);
+
+// Whether the pair's key is the NUL-terminated key
+bool query_key_is(const query_pair_t *pair, const char *key);
+
+// Parse the value as a decimal int with optional sign. False if it is
+// empty, has other characters or overflows.
+bool query_int(const query_pair_t *pair, int *out);
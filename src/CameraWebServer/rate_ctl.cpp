@@ -0,0 +1,96 @@
+#include <string.h>
+#include "rate_ctl.h"
+
+void rate_ctl_init(rate_ctl_t *r, int64_t target_us, int64_t min_interval_us, uint8_t top, uint8_t bottom)
+{
+    memset(r, 0, sizeof(rate_ctl_t));
+    r->target_us = target_us;
+    r->min_interval_us = min_interval_us;
+    r->interval_us = min_interval_us;
+    r->level = top;
+    r->top = top;
+    r->bottom = bottom < top ? top : bottom;
+}
+
+// Frames get smaller first, then slower
+static bool rate_step_down(rate_ctl_t *r)
+{
+    if (r->level < r->bottom) {
+        r->level++;
+        return true;
+    }
+    r->interval_us = r->interval_us * 3 / 2;
+    if (r->interval_us > RATE_MAX_INTERVAL_US) {
+        r->interval_us = RATE_MAX_INTERVAL_US;
+    }
+    return false;
+}
+
+// Frames get faster first, then larger
+static bool rate_step_up(rate_ctl_t *r)
+{
+    if (r->interval_us > r->min_interval_us) {
+        r->interval_us = r->interval_us * 2 / 3;
+        if (r->interval_us < r->min_interval_us) {
+            r->interval_us = r->min_interval_us;
+        }
+        return false;
+    }
+    if (r->level > r->top) {
+        r->level--;
+        return true;
+    }
+    return false;
+}
+
+bool rate_ctl_frame(rate_ctl_t *r, uint32_t bytes, int64_t send_us)
+{
+    if (send_us < 1) {
+        send_us = 1;
+    }
+    int64_t rate = (int64_t)bytes * 1000000 / send_us;
+    if (rate > UINT32_MAX) {
+        rate = UINT32_MAX;
+    }
+    // Averages over about four frames, restarted after every step so the
+    // next decision only sees frames sent with the new settings
+    if (r->send_us) {
+        r->send_us = (r->send_us * 3 + send_us) / 4;
+        r->rate = (uint32_t)(((int64_t)r->rate * 3 + rate) / 4);
+    } else {
+        r->send_us = send_us;
+        r->rate = (uint32_t)rate;
+    }
+
+    bool changed = false;
+    if (r->send_us > r->target_us) {
+        r->under = 0;
+        if (++r->over < RATE_DOWN_FRAMES) {
+            return false;
+        }
+        changed = rate_step_down(r);
+    } else if (r->send_us < r->target_us / 2) {
+        r->over = 0;
+        if (++r->under < RATE_UP_FRAMES) {
+            return false;
+        }
+        if (r->level == r->top && r->interval_us == r->min_interval_us) {
+            r->under = 0;
+            return false;
+        }
+        changed = rate_step_up(r);
+    } else {
+        r->over = 0;
+        r->under = 0;
+        return false;
+    }
+    r->over = 0;
+    r->under = 0;
+    r->send_us = 0;
+    return changed;
+}
+
+int64_t rate_ctl_delay(const rate_ctl_t *r, int64_t elapsed_us)
+{
+    return elapsed_us < r->interval_us ? r->interval_us - elapsed_us : 0;
+}
@@ -0,0 +1,41 @@
+// Stream rate controller.
+//
+// Pure logic with no Arduino or ESP-IDF dependencies. The stream handler
+// feeds it the size of each frame and how long sending it blocked. When the
+// link cannot keep up, the socket buffer stays full and sends block, so the
+// send time is the queueing delay the viewer sees. The controller holds it
+// under a target by walking a ladder of levels (level 0 is the best quality
+// and largest frame, the caller maps levels to sensor settings) and by
+// pacing frames. It steps down quickly and back up slowly.
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RATE_TARGET_US       100000  // per-frame send time to hold
+#define RATE_MIN_INTERVAL_US 40000   // fastest pacing, 25 fps
+#define RATE_MAX_INTERVAL_US 2000000 // slowest pacing, 0.5 fps
+#define RATE_DOWN_FRAMES     3       // frames over target before stepping down
+#define RATE_UP_FRAMES       50      // frames under half the target before stepping up
+
+typedef struct
+{
+    int64_t target_us;       // send time to hold
+    int64_t min_interval_us; // pacing never goes faster than this
+    int64_t interval_us;     // current time between frame starts
+    int64_t send_us;         // moving average of the send time, 0 until measured
+    uint32_t rate;           // moving average of the throughput while sending, bytes/s
+    uint8_t level;           // current level, 0 is the best
+    uint8_t top;             // best level allowed
+    uint8_t bottom;          // worst level
+    uint8_t over;            // consecutive frames over the target
+    uint8_t under;           // consecutive frames under half the target
+} rate_ctl_t;
+
+void rate_ctl_init(rate_ctl_t *r, int64_t target_us, int64_t min_interval_us, uint8_t top, uint8_t bottom);
+
+// Account for one sent frame. Returns true when the level changed.
+bool rate_ctl_frame(rate_ctl_t *r, uint32_t bytes, int64_t send_us);
+
+// How long to wait before the next frame, elapsed_us after this one started
+int64_t rate_ctl_delay(const rate_ctl_t *r, int64_t elapsed_us);
@@ -0,0 +1,47 @@
+#include <string.h>
+#include "sampler.h"
+
+void sampler_init(sampler_t *s)
+{
+    memset(s, 0, sizeof(sampler_t));
+    s->posture = POSTURE_NONE;
+    s->interval_us = SAMPLE_BASE_US;
+}
+
+void sampler_classified(sampler_t *s, const alert_state_t *a, int64_t frame_time)
+{
+    if (frame_time < s->last_sample) {
+        return;
+    }
+    if (a->posture != s->posture) {
+        s->posture = a->posture;
+        s->posture_at = frame_time;
+    }
+    s->last_sample = frame_time;
+
+    if (frame_time - s->posture_at < SAMPLE_SETTLE_US) {
+        s->interval_us = SAMPLE_FAST_US;
+    } else if (a->posture == POSTURE_NONE) {
+        s->interval_us = SAMPLE_BASE_US;
+    } else {
+        // Every sample that confirms the posture doubles the wait
+        int64_t max = a->lying_since ? SAMPLE_LYING_US : SAMPLE_MAX_US;
+        s->interval_us = s->interval_us < SAMPLE_BASE_US ? SAMPLE_BASE_US : s->interval_us * 2;
+        if (s->interval_us > max) {
+            s->interval_us = max;
+        }
+    }
+    s->deadline = frame_time + s->interval_us;
+}
+
+void sampler_motion(sampler_t *s, uint32_t motion, int64_t frame_time)
+{
+    if (motion >= ALERT_MOTION_MIN && s->deadline > frame_time + SAMPLE_BASE_US) {
+        s->deadline = frame_time + SAMPLE_BASE_US;
+    }
+}
+
+int64_t sampler_deadline(const sampler_t *s)
+{
+    return s->deadline;
+}
@@ -0,0 +1,42 @@
+// Adaptive sampling schedule for the gateway.
+//
+// Pure logic with no Arduino or ESP-IDF dependencies, times in microseconds
+// on the esp_timer_get_time() clock. Decides when the gateway should
+// classify the next frame. Sampling is fast for a while after a posture
+// change, and while someone is lying it never slows past SAMPLE_LYING_US
+// (the alert timer is running and getting up must cancel it). Otherwise
+// every sample that confirms the posture doubles the wait, up to
+// SAMPLE_MAX_US. The device still checks every frame for motion, and motion
+// pulls the deadline in to SAMPLE_BASE_US, so lying down after a long still
+// period is not missed.
+#pragma once
+
+#include <stdint.h>
+#include "alert.h"
+
+#define SAMPLE_FAST_US   500000  // settling after a posture change
+#define SAMPLE_BASE_US   1000000 // the gateway's old fixed rate, and the longest wait after motion
+#define SAMPLE_LYING_US  2000000 // longest wait while the alert timer runs
+#define SAMPLE_MAX_US    8000000 // longest wait in a still scene
+#define SAMPLE_SETTLE_US 3000000 // sample fast this long after a posture change
+
+typedef struct
+{
+    posture_t posture;   // posture of the newest classified frame
+    int64_t posture_at;  // frame time of the last posture change
+    int64_t last_sample; // frame time of the newest classified frame, 0 before the first
+    int64_t interval_us; // current back-off
+    int64_t deadline;    // when the next frame should be classified
+} sampler_t;
+
+void sampler_init(sampler_t *s);
+
+// Account for a classified frame. Takes the alert state after the
+// classification was applied.
+void sampler_classified(sampler_t *s, const alert_state_t *a, int64_t frame_time);
+
+// Account for a motion_energy() score
+void sampler_motion(sampler_t *s, uint32_t motion, int64_t frame_time);
+
+// Time the next frame should be classified at; in the past means now
+int64_t sampler_deadline(const sampler_t *s);
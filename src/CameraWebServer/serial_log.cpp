@@ -0,0 +1,118 @@
+#include <Arduino.h>
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "log_ring.h"
+#include "metrics.h"
+#include "serial_log.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#endif
+
+typedef struct
+{
+    char level; // 'I' for lines that replace log_i(), 0 to print the text alone
+    const char *fmt;
+} slog_format_t;
+
+// In slog_fmt_t order
+static const slog_format_t slog_formats[SLOG_MAX] = {
+    {0, "Updated classification status: %s"},
+    {0, "Buzzer %s"},
+    {'I', "%s: %uB %ums"},
+    {'I', "%s = %d"},
+    {'I', "Stream level %u: framesize %u quality %u, %ums send, %ukB/s"},
+    {'I', "MJPG: %uB %ums (%u.%ufps), AVG: %ums (%u.%ufps)"},
+};
+
+static log_ring_cell_t slog_cells[SLOG_RING_RECORDS];
+static log_ring_t slog_ring;
+static bool slog_ready = false;
+
+static std::atomic<int> forward_sock(-1); // set once the address is filled in
+static struct sockaddr_in forward_addr;
+
+bool slog_put(slog_fmt_t fmt, int nargs, const intptr_t *args)
+{
+    if (!slog_ready) {
+        return false;
+    }
+    return log_ring_put(&slog_ring, esp_timer_get_time(), fmt, nargs, args);
+}
+
+uint32_t slog_dropped(void)
+{
+    return slog_ready ? slog_ring.dropped.load(std::memory_order_relaxed) : 0;
+}
+
+static void slog_write(const char *line, size_t len)
+{
+    Serial.write((const uint8_t *)line, len);
+    int sock = forward_sock.load(std::memory_order_acquire);
+    if (sock >= 0) {
+        sendto(sock, line, len, 0, (struct sockaddr *)&forward_addr, sizeof(forward_addr));
+    }
+}
+
+static void slog_task(void *arg)
+{
+    static char line[160];
+    uint32_t reported = 0;
+    log_ring_record_t rec;
+    while (true) {
+        while (log_ring_take(&slog_ring, &rec)) {
+            const slog_format_t *f = &slog_formats[rec.fmt];
+            size_t n = 0;
+            if (f->level) {
+                n = snprintf(line, sizeof(line), "[%6u][%c] ", (unsigned)(rec.time_us / 1000), f->level);
+            }
+            n += log_ring_format(f->fmt, &rec, line + n, sizeof(line) - n - 2);
+            line[n++] = '\r';
+            line[n++] = '\n';
+            slog_write(line, n);
+        }
+        uint32_t dropped = slog_dropped();
+        if (dropped != reported) {
+            metrics_add(METRIC_LOG_DROPPED, dropped - reported);
+            size_t n = snprintf(line, sizeof(line), "[W] Log ring full, %u lines dropped\r\n", (unsigned)(dropped - reported));
+            slog_write(line, n);
+            reported = dropped;
+        }
+        vTaskDelay(pdMS_TO_TICKS(SLOG_DRAIN_MS));
+    }
+}
+
+void slog_forward(const char *host, uint16_t port)
+{
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    char service[8];
+    snprintf(service, sizeof(service), "%u", port);
+
+    struct addrinfo *addr = NULL;
+    if (getaddrinfo(host, service, &hints, &addr) != 0 || !addr) {
+        log_e("Cannot resolve log host %s", host);
+        return;
+    }
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        freeaddrinfo(addr);
+        return;
+    }
+    memcpy(&forward_addr, addr->ai_addr, sizeof(forward_addr));
+    freeaddrinfo(addr);
+    forward_sock.store(sock, std::memory_order_release);
+}
+
+esp_err_t slog_start(void)
+{
+    log_ring_init(&slog_ring, slog_cells, SLOG_RING_RECORDS);
+    if (xTaskCreatePinnedToCore(slog_task, "slog", SLOG_TASK_STACK, NULL, SLOG_TASK_PRIO, NULL, SLOG_TASK_CORE) !=
+        pdPASS) {
+        return ESP_FAIL;
+    }
+    slog_ready = true;
+    return ESP_OK;
+}
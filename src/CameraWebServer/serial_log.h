@@ -0,0 +1,56 @@
+// Asynchronous serial log. Request handlers and the alert timer queue
+// binary records into a lock-free ring (log_ring.h) instead of printing at
+// 115200 baud on their own thread; a low priority task formats them and
+// writes them to Serial, and to a UDP listener when one is set.
+#pragma once
+
+#include <stdint.h>
+#include <type_traits>
+#include "esp_err.h"
+
+#define SLOG_RING_RECORDS 128 // power of two
+#define SLOG_DRAIN_MS     20
+#define SLOG_TASK_CORE    0
+#define SLOG_TASK_PRIO    1
+#define SLOG_TASK_STACK   3072
+
+typedef enum {
+    SLOG_CLASSIFICATION, // posture label
+    SLOG_BUZZER,         // "On" or "Off"
+    SLOG_CAPTURE,        // "JPG" or "MODEL", bytes, milliseconds
+    SLOG_CONTROL,        // control name, value
+    SLOG_STREAM_LEVEL,   // level, framesize, quality, send ms, kB/s
+    SLOG_MJPG,           // bytes, ms, fps and tenths, average ms, fps and tenths
+    SLOG_MAX
+} slog_fmt_t;
+
+esp_err_t slog_start(void);
+
+// Also send every line as a UDP datagram to host:port
+void slog_forward(const char *host, uint16_t port);
+
+// Queue a record, never blocks. False if the ring was full.
+bool slog_put(slog_fmt_t fmt, int nargs, const intptr_t *args);
+
+// Records dropped because the ring was full
+uint32_t slog_dropped(void);
+
+template <typename T> static inline intptr_t slog_arg(T v)
+{
+    static_assert(!std::is_floating_point<T>::value, "log integers or static strings");
+    return (intptr_t)v;
+}
+
+// slog(SLOG_BUZZER, "On"): integer arguments or static strings
+template <typename... T> static inline bool slog(slog_fmt_t fmt, T... args)
+{
+    const intptr_t a[] = {0, slog_arg(args)...};
+    return slog_put(fmt, sizeof...(args), a + 1);
+}
+
+// Like log_i(): compiled out below the info log level
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+#define slog_i(fmt, ...) slog(fmt, ##__VA_ARGS__)
+#else
+#define slog_i(fmt, ...) do {} while (0)
+#endif
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <string.h>
+#include "status_cache.h"
+
+void status_cache_init(status_cache_t *c, uint32_t base)
+{
+    memset(c, 0, sizeof(*c));
+    c->base = base;
+    c->version = base;
+}
+
+bool status_cache_set(status_cache_t *c, const char *name, int32_t value)
+{
+    for (int i = 0; i < c->count; i++) {
+        status_field_t *f = &c->fields[i];
+        if (!strcmp(f->name, name)) {
+            if (f->value != value) {
+                f->value = value;
+                f->version = c->version + 1;
+                c->dirty = true;
+            }
+            return true;
+        }
+    }
+    if (c->count == STATUS_FIELDS_MAX) {
+        return false;
+    }
+    status_field_t *f = &c->fields[c->count++];
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->value = value;
+    f->version = c->version + 1;
+    c->dirty = true;
+    return true;
+}
+
+uint32_t status_cache_commit(status_cache_t *c)
+{
+    if (c->dirty) {
+        c->version++;
+        c->dirty = false;
+    }
+    return c->version;
+}
+
+size_t status_cache_json(const status_cache_t *c, uint32_t since, char *buf, size_t len)
+{
+    if (since < c->base || since > c->version) {
+        since = 0;
+    }
+
+    size_t n = 0;
+    // Advance n by the full length even once buf is full, like snprintf
+#define STATUS_PUT(...) \
+    n += snprintf(n < len ? buf + n : NULL, n < len ? len - n : 0, __VA_ARGS__)
+
+    STATUS_PUT("{\"version\":%u", c->version);
+    for (int i = 0; i < c->count; i++) {
+        const status_field_t *f = &c->fields[i];
+        // Uncommitted changes carry version + 1 and are left out
+        if (f->version > since && f->version <= c->version) {
+            STATUS_PUT(",\"%s\":%d", f->name, f->value);
+        }
+    }
+    STATUS_PUT("}");
+#undef STATUS_PUT
+    return n;
+}
@@ -0,0 +1,46 @@
+// Versioned cache of the sensor state served by /status.
+//
+// Fields are set by name after each change, and every field remembers the
+// cache version in which it last changed. A client holding version N only
+// needs the fields changed since N. Pure logic with no Arduino or ESP-IDF
+// dependencies.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define STATUS_FIELDS_MAX  96
+#define STATUS_NAME_LEN    16
+
+typedef struct
+{
+    char name[STATUS_NAME_LEN];
+    int32_t value;
+    uint32_t version; // cache version the value last changed in
+} status_field_t;
+
+typedef struct
+{
+    status_field_t fields[STATUS_FIELDS_MAX];
+    int count;
+    uint32_t base;    // first version, older ones are from another cache
+    uint32_t version; // newest committed version
+    bool dirty;       // set since the last commit
+} status_cache_t;
+
+// Start at version base, e.g. a random number so versions from before a
+// reboot are not mistaken for current ones
+void status_cache_init(status_cache_t *c, uint32_t base);
+
+// Set a field, adding it if new. Changes become visible at the next commit.
+// Returns false when the cache is full.
+bool status_cache_set(status_cache_t *c, const char *name, int32_t value);
+
+// Publish the changes made since the last commit as a new version
+uint32_t status_cache_commit(status_cache_t *c);
+
+// Render {"version":V,...} with the fields changed after version since, or
+// all of them when since is not a version of this cache. Behaves like
+// snprintf: returns the length needed, writes at most len bytes.
+size_t status_cache_json(const status_cache_t *c, uint32_t since, char *buf, size_t len);
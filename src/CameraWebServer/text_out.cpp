@@ -0,0 +1,41 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "text_out.h"
+
+void text_out_init(text_out_t *o, text_write_cb write, void *arg)
+{
+    o->write = write;
+    o->arg = arg;
+    o->len = 0;
+    o->ok = true;
+}
+
+bool text_out_flush(text_out_t *o)
+{
+    if (o->ok && o->len) {
+        o->ok = o->write(o->arg, o->buf, o->len);
+    }
+    o->len = 0;
+    return o->ok;
+}
+
+void text_out_printf(text_out_t *o, const char *fmt, ...)
+{
+    char piece[TEXT_OUT_PIECE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(piece, sizeof(piece), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n >= sizeof(piece)) {
+        n = sizeof(piece) - 1;
+    }
+    if (o->len + n > sizeof(o->buf)) {
+        text_out_flush(o);
+    }
+    memcpy(o->buf + o->len, piece, n);
+    o->len += n;
+}
@@ -0,0 +1,33 @@
+// Buffered text output for the renderers behind /metrics and /trace.
+//
+// Formatted pieces collect in a small buffer that goes to the writer in
+// large pieces, so an HTTP response becomes a few chunks instead of one per
+// line. A piece longer than TEXT_OUT_PIECE is truncated. After the writer
+// fails, output is dropped. No Arduino or ESP-IDF dependencies.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TEXT_OUT_BUF   512
+#define TEXT_OUT_PIECE 160 // longest text one text_out_printf() call adds
+
+// Receives the rendered text in pieces. Returns false to stop rendering.
+typedef bool (*text_write_cb)(void *arg, const char *data, size_t len);
+
+typedef struct
+{
+    text_write_cb write;
+    void *arg;
+    char buf[TEXT_OUT_BUF];
+    size_t len;
+    bool ok;
+} text_out_t;
+
+void text_out_init(text_out_t *o, text_write_cb write, void *arg);
+void text_out_printf(text_out_t *o, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Hand over what is buffered. Returns false if the writer failed, now or
+// at any earlier flush.
+bool text_out_flush(text_out_t *o);
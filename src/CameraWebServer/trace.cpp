@@ -0,0 +1,224 @@
+#include <string.h>
+#include "alert.h"
+#include "trace.h"
+
+#define TRACE_HOLD_US ((int64_t)ALERT_TIMER_MAX * ALERT_STEP_US)
+
+const char *const trace_frame_stage_names[TRACE_FRAME_STAGES] = {
+    "send", "network", "batch", "decode", "infer", "apply", "detect",
+};
+
+const char *const trace_alert_stage_names[TRACE_ALERT_STAGES] = {
+    "detect", "leds", "hold", "tick", "actuate", "total",
+};
+
+void trace_init(trace_log_t *t)
+{
+    memset(t, 0, sizeof(trace_log_t));
+}
+
+// Newest first, so a frame sent twice finds its latest record
+static trace_frame_t *trace_find(trace_log_t *t, int64_t captured)
+{
+    for (uint32_t i = 1; i <= TRACE_FRAMES; i++) {
+        trace_frame_t *f = &t->frames[(t->next_frame - i) % TRACE_FRAMES];
+        if (f->captured == captured) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static trace_frame_t *trace_add(trace_log_t *t, uint32_t id, int64_t captured)
+{
+    trace_frame_t *f = &t->frames[t->next_frame++ % TRACE_FRAMES];
+    memset(f, 0, sizeof(trace_frame_t));
+    f->id = id;
+    f->captured = captured;
+    f->posture = POSTURE_NONE;
+    return f;
+}
+
+void trace_sent(trace_log_t *t, uint32_t id, int64_t captured, int64_t sent)
+{
+    if (!captured) {
+        return;
+    }
+    trace_frame_t *f = trace_find(t, captured);
+    if (f && f->result) {
+        // Served again after it was classified, a new round trip
+        f = NULL;
+    }
+    if (!f) {
+        f = trace_add(t, id, captured);
+    }
+    f->sent = sent;
+}
+
+void trace_result(trace_log_t *t, int64_t captured, int64_t result, int64_t applied, int8_t posture,
+                  const trace_gateway_t *gateway, bool local)
+{
+    if (!captured) {
+        return;
+    }
+    trace_frame_t *f = trace_find(t, captured);
+    if (!f) {
+        f = trace_add(t, 0, captured);
+    } else if (f->result) {
+        return; // the first result is the one that was timed
+    }
+    f->result = result;
+    f->applied = applied;
+    f->posture = posture;
+    f->local = local;
+    f->has_gateway = gateway != NULL;
+    if (gateway) {
+        f->gateway = *gateway;
+    }
+}
+
+void trace_lying(trace_log_t *t, int64_t lying_since)
+{
+    if (lying_since == t->current.lying_since) {
+        return;
+    }
+    memset(&t->current, 0, sizeof(trace_alert_t));
+    t->current.lying_since = lying_since;
+    t->current.frame.posture = POSTURE_NONE;
+    const trace_frame_t *f = lying_since ? trace_find(t, lying_since) : NULL;
+    if (f) {
+        t->current.frame = *f;
+    }
+}
+
+void trace_leds_on(trace_log_t *t, int64_t now)
+{
+    if (t->current.lying_since && !t->current.leds) {
+        t->current.leds = now;
+    }
+}
+
+void trace_fired(trace_log_t *t, int64_t fired)
+{
+    if (!t->current.lying_since) {
+        return;
+    }
+    t->current.fired = fired;
+    t->alerts[t->alert_count++ % TRACE_ALERTS] = t->current;
+    t->fired = true;
+}
+
+const trace_alert_t *trace_actuated(trace_log_t *t, int64_t now)
+{
+    if (!t->fired) {
+        return NULL;
+    }
+    trace_alert_t *a = &t->alerts[(t->alert_count - 1) % TRACE_ALERTS];
+    a->actuated = now;
+    t->fired = false;
+    return a;
+}
+
+void trace_frame_stages(const trace_frame_t *f, int64_t stages[TRACE_FRAME_STAGES])
+{
+    for (int i = 0; i < TRACE_FRAME_STAGES; i++) {
+        stages[i] = -1;
+    }
+    if (f->sent) {
+        stages[TRACE_STAGE_SEND] = f->sent - f->captured;
+    }
+    if (f->has_gateway) {
+        const trace_gateway_t *g = &f->gateway;
+        if (f->sent && f->result) {
+            stages[TRACE_STAGE_NETWORK] = f->result - f->sent - g->inferred_us;
+        }
+        stages[TRACE_STAGE_BATCH] = g->started_us;
+        stages[TRACE_STAGE_DECODE] = (int64_t)g->decoded_us - g->started_us;
+        stages[TRACE_STAGE_INFER] = (int64_t)g->inferred_us - g->decoded_us;
+    }
+    if (f->result) {
+        stages[TRACE_STAGE_APPLY] = f->applied - f->result;
+        stages[TRACE_STAGE_DETECT] = f->applied - f->captured;
+    }
+}
+
+void trace_alert_stages(const trace_alert_t *a, int64_t stages[TRACE_ALERT_STAGES])
+{
+    for (int i = 0; i < TRACE_ALERT_STAGES; i++) {
+        stages[i] = -1;
+    }
+    if (a->frame.captured && a->frame.result) {
+        stages[TRACE_ALERT_DETECT] = a->frame.applied - a->frame.captured;
+    }
+    if (a->leds) {
+        stages[TRACE_ALERT_LEDS] = a->leds - a->lying_since;
+    }
+    stages[TRACE_ALERT_HOLD] = TRACE_HOLD_US;
+    stages[TRACE_ALERT_TICK] = a->fired - a->lying_since - TRACE_HOLD_US;
+    if (a->actuated) {
+        stages[TRACE_ALERT_ACTUATE] = a->actuated - a->fired;
+        stages[TRACE_ALERT_TOTAL] = a->actuated - a->lying_since;
+    }
+}
+
+static void out_stages(text_out_t *o, const int64_t *stages, const char *const *names, int count)
+{
+    text_out_printf(o, "\"stages\":{");
+    for (int i = 0; i < count; i++) {
+        if (stages[i] < 0) {
+            text_out_printf(o, "%s\"%s\":null", i ? "," : "", names[i]);
+        } else {
+            text_out_printf(o, "%s\"%s\":%lld", i ? "," : "", names[i], (long long)stages[i]);
+        }
+    }
+    text_out_printf(o, "}");
+}
+
+static void out_frame(text_out_t *o, const trace_frame_t *f)
+{
+    int64_t stages[TRACE_FRAME_STAGES];
+    trace_frame_stages(f, stages);
+    text_out_printf(o, "{\"id\":%u,\"captured\":%lld,\"posture\":\"%s\",\"local\":%s,", (unsigned)f->id,
+             (long long)f->captured, posture_label((posture_t)f->posture), f->local ? "true" : "false");
+    out_stages(o, stages, trace_frame_stage_names, TRACE_FRAME_STAGES);
+    text_out_printf(o, "}");
+}
+
+bool trace_render(const trace_log_t *t, text_write_cb write, void *arg)
+{
+    text_out_t o;
+    text_out_init(&o, write, arg);
+
+    text_out_printf(&o, "{\"alerts\":[");
+    uint32_t alerts = t->alert_count < TRACE_ALERTS ? t->alert_count : TRACE_ALERTS;
+    for (uint32_t i = 1; i <= alerts; i++) {
+        const trace_alert_t *a = &t->alerts[(t->alert_count - i) % TRACE_ALERTS];
+        int64_t stages[TRACE_ALERT_STAGES];
+        trace_alert_stages(a, stages);
+        text_out_printf(&o, "%s{\"lying_since\":%lld,\"fired\":%lld,", i > 1 ? "," : "", (long long)a->lying_since,
+                 (long long)a->fired);
+        out_stages(&o, stages, trace_alert_stage_names, TRACE_ALERT_STAGES);
+        text_out_printf(&o, ",\"frame\":");
+        if (a->frame.captured) {
+            out_frame(&o, &a->frame);
+        } else {
+            text_out_printf(&o, "null");
+        }
+        text_out_printf(&o, "}");
+    }
+    text_out_printf(&o, "],\"frames\":[");
+    bool first = true;
+    for (uint32_t i = 1; i <= TRACE_FRAMES; i++) {
+        const trace_frame_t *f = &t->frames[(t->next_frame - i) % TRACE_FRAMES];
+        if (!f->captured) {
+            continue;
+        }
+        if (!first) {
+            text_out_printf(&o, ",");
+        }
+        out_frame(&o, f);
+        first = false;
+    }
+    text_out_printf(&o, "]}\n");
+    return text_out_flush(&o);
+}
@@ -0,0 +1,113 @@
+// End-to-end latency traces, from frame capture to the buzzer.
+//
+// No Arduino or ESP-IDF dependencies, times in microseconds on the
+// esp_timer_get_time() clock. A frame's trace id is its frame broker
+// sequence number, the X-Sequence header and uplink_frame_t::seq; results
+// name their frame by capture time, which finds the same record. The device
+// stamps capture, send, result and applied itself. The gateway reports its
+// stages as offsets from having the whole frame (trace_gateway_t), so the
+// two clocks need not agree: the network share of the round trip is what
+// the gateway doesn't account for.
+//
+// An alert keeps a copy of the trace of the frame its lying period started
+// with, taken when the period started, so busy /capture clients can't push
+// it out of the frame ring before the buzzer fires ALERT_TIMER_MAX steps
+// later.
+//
+// Not thread safe, callers serialise every call.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "text_out.h"
+#include "protocol.h"
+
+#define TRACE_FRAMES 32 // recent frames, a power of two
+#define TRACE_ALERTS 8  // recent alerts
+
+typedef struct
+{
+    uint32_t id;              // frame broker sequence number, 0 if not known
+    int64_t captured;         // fb->timestamp, end of the exposure
+    int64_t sent;             // last byte handed to the socket, 0 for the local classifier
+    int64_t result;           // classification back on the device, 0 until then
+    int64_t applied;          // alert state updated with it
+    trace_gateway_t gateway;  // valid if has_gateway
+    int8_t posture;           // posture_t of the result
+    bool has_gateway;
+    bool local;               // classified on the device
+} trace_frame_t;
+
+typedef enum {
+    TRACE_STAGE_SEND,    // capture to the last byte sent: broker wait, encoding, socket
+    TRACE_STAGE_NETWORK, // round trip to the gateway and back, minus the gateway's share
+    TRACE_STAGE_BATCH,   // gateway: waiting for a batch and an inference thread
+    TRACE_STAGE_DECODE,  // gateway: JPEG decode and resize
+    TRACE_STAGE_INFER,   // gateway: the rest of the classification
+    TRACE_STAGE_APPLY,   // result received to the alert state updated
+    TRACE_STAGE_DETECT,  // capture to applied, all of the above
+    TRACE_FRAME_STAGES
+} trace_frame_stage_t;
+
+typedef struct
+{
+    int64_t lying_since; // capture time the lying period counts from
+    int64_t leds;        // first LED switched on, 0 if not seen
+    int64_t fired;       // alert_tick() raised the buzzer
+    int64_t actuated;    // buzzer pin driven
+    trace_frame_t frame; // the frame lying_since came from, id 0 and captured 0 if not traced
+} trace_alert_t;
+
+typedef enum {
+    TRACE_ALERT_DETECT,  // first lying frame captured to applied
+    TRACE_ALERT_LEDS,    // capture to the first LED
+    TRACE_ALERT_HOLD,    // the designed ALERT_TIMER_MAX steps
+    TRACE_ALERT_TICK,    // buzzer raised past the end of the hold, alert timer granularity
+    TRACE_ALERT_ACTUATE, // raised to the pin driven
+    TRACE_ALERT_TOTAL,   // capture to buzzer
+    TRACE_ALERT_STAGES
+} trace_alert_stage_t;
+
+typedef struct
+{
+    trace_frame_t frames[TRACE_FRAMES];
+    uint32_t next_frame;
+    trace_alert_t alerts[TRACE_ALERTS];
+    uint32_t alert_count; // ever recorded, the newest is alerts[(alert_count - 1) % TRACE_ALERTS]
+    trace_alert_t current; // lying period in progress, lying_since 0 when there is none
+    bool fired;            // current fired, waiting for the buzzer pin
+} trace_log_t;
+
+extern const char *const trace_frame_stage_names[TRACE_FRAME_STAGES];
+extern const char *const trace_alert_stage_names[TRACE_ALERT_STAGES];
+
+void trace_init(trace_log_t *t);
+
+// A frame left the device for classification at sent
+void trace_sent(trace_log_t *t, uint32_t id, int64_t captured, int64_t sent);
+
+// A result for the frame captured at captured came back at result and was
+// applied at applied. gateway may be NULL. Frames that weren't sent, like
+// the local classifier's, get a record here.
+void trace_result(trace_log_t *t, int64_t captured, int64_t result, int64_t applied, int8_t posture,
+                  const trace_gateway_t *gateway, bool local);
+
+// Follow alert_state_t::lying_since after every change to the alert state.
+// A new value starts a new lying period, traced from its frame.
+void trace_lying(trace_log_t *t, int64_t lying_since);
+
+// Output actuation: the first LED, the buzzer raised by alert_tick() at
+// fired, and the buzzer pin driven at now. Recording the buzzer pin closes
+// the alert and returns it, NULL if no alert was waiting for it.
+void trace_leds_on(trace_log_t *t, int64_t now);
+void trace_fired(trace_log_t *t, int64_t fired);
+const trace_alert_t *trace_actuated(trace_log_t *t, int64_t now);
+
+// Stage durations, -1 where the stage wasn't seen
+void trace_frame_stages(const trace_frame_t *f, int64_t stages[TRACE_FRAME_STAGES]);
+void trace_alert_stages(const trace_alert_t *a, int64_t stages[TRACE_ALERT_STAGES]);
+
+// JSON with the recent alerts and frames, newest first, each with its
+// stages. Returns false if the writer failed.
+bool trace_render(const trace_log_t *t, text_write_cb write, void *arg);
@@ -0,0 +1,230 @@
+#include <Arduino.h>
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "img_converters.h"
+#include "frame_broker.h"
+#include "metrics.h"
+#include "uplink.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#endif
+
+static char uplink_host[64];
+static uint16_t uplink_port = 0;
+static uplink_result_cb_t result_cb = NULL;
+static uplink_sent_cb_t sent_cb = NULL;
+static uplink_schedule_cb_t schedule_cb = NULL;
+static uint32_t uplink_interval_ms = UPLINK_DEFAULT_INTERVAL_MS;
+static bool uplink_rate_set = false; // the gateway sent UPLINK_MSG_RATE
+static bool uplink_pending = false;  // a frame went out and its result hasn't come back
+static trace_gateway_t uplink_trace; // from UPLINK_MSG_TRACE, for the next result
+static bool uplink_trace_set = false;
+
+static int uplink_connect(void)
+{
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port[8];
+    snprintf(port, sizeof(port), "%u", uplink_port);
+
+    struct addrinfo *addr = NULL;
+    if (getaddrinfo(uplink_host, port, &hints, &addr) != 0 || !addr) {
+        return -1;
+    }
+    int sock = socket(addr->ai_family, addr->ai_socktype, 0);
+    if (sock < 0) {
+        freeaddrinfo(addr);
+        return -1;
+    }
+    if (connect(sock, addr->ai_addr, addr->ai_addrlen) != 0) {
+        close(sock);
+        freeaddrinfo(addr);
+        return -1;
+    }
+    freeaddrinfo(addr);
+
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = {UPLINK_SEND_TIMEOUT_MS / 1000, 0};
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return sock;
+}
+
+static bool send_all(int sock, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (len) {
+        int n = send(sock, p, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Returns false only if the connection failed
+static bool uplink_send_frame(int sock, camera_fb_t *fb, uint32_t seq)
+{
+    uint8_t *jpg_buf = fb->buf;
+    size_t jpg_len = fb->len;
+    if (fb->format != PIXFORMAT_JPEG) {
+        int64_t start = esp_timer_get_time();
+        bool converted = frame2jpg(fb, 80, &jpg_buf, &jpg_len);
+        metrics_observe(METRIC_CONVERT, esp_timer_get_time() - start);
+        if (!converted) {
+            log_e("JPEG compression failed");
+            return true;
+        }
+    }
+
+    uplink_frame_t hdr;
+    hdr.magic = UPLINK_MAGIC;
+    hdr.seq = seq;
+    hdr.frame_time = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    hdr.send_time = esp_timer_get_time();
+    hdr.len = jpg_len;
+    bool ok = send_all(sock, &hdr, sizeof(hdr)) && send_all(sock, jpg_buf, jpg_len);
+    if (ok) {
+        int64_t sent = esp_timer_get_time();
+        if (sent_cb) {
+            sent_cb(seq, hdr.frame_time, sent);
+        }
+        metrics_observe(METRIC_SEND, sent - hdr.send_time);
+        metrics_add(METRIC_FRAMES_SENT, 1);
+        metrics_add(METRIC_BYTES_SENT, jpg_len);
+    }
+
+    if (jpg_buf != fb->buf) {
+        free(jpg_buf);
+    }
+    return ok;
+}
+
+static void uplink_handle_reply(const uplink_reply_t *reply)
+{
+    if (reply->type == UPLINK_MSG_RESULT) {
+        uplink_pending = false;
+        if (result_cb) {
+            result_cb(&reply->result, uplink_trace_set ? &uplink_trace : NULL);
+        }
+        uplink_trace_set = false;
+    } else if (reply->type == UPLINK_MSG_TRACE) {
+        uplink_trace = reply->trace;
+        uplink_trace_set = true;
+    } else if (reply->type == UPLINK_MSG_RATE) {
+        uplink_interval_ms = reply->interval_ms < UPLINK_MIN_INTERVAL_MS ? UPLINK_MIN_INTERVAL_MS : reply->interval_ms;
+        uplink_rate_set = true;
+        log_i("Uplink interval %ums", uplink_interval_ms);
+    }
+}
+
+// Handle replies until the deadline. Replies may arrive split across reads,
+// fill carries the partial one over. Returns false when the connection is gone.
+static bool uplink_read_replies(int sock, int64_t until, uplink_reply_t *reply, size_t *fill)
+{
+    while (true) {
+        int64_t left = until - esp_timer_get_time();
+        if (left <= 0) {
+            return true;
+        }
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(sock, &rfds);
+        struct timeval tv = {(time_t)(left / 1000000), (suseconds_t)(left % 1000000)};
+        int r = select(sock + 1, &rfds, NULL, NULL, &tv);
+        if (r < 0) {
+            return false;
+        }
+        if (r == 0) {
+            return true;
+        }
+        int n = recv(sock, (uint8_t *)reply + *fill, sizeof(uplink_reply_t) - *fill, 0);
+        if (n <= 0) {
+            return false;
+        }
+        *fill += n;
+        if (*fill == sizeof(uplink_reply_t)) {
+            uplink_handle_reply(reply);
+            *fill = 0;
+        }
+    }
+}
+
+// With a schedule the gateway's rate is only a ceiling. The schedule only
+// moves once a result is in, so until then the fixed rate applies.
+static int64_t uplink_next_due(int64_t last_send)
+{
+    if (!schedule_cb || uplink_pending) {
+        return last_send + (int64_t)uplink_interval_ms * 1000;
+    }
+    uint32_t min_ms = uplink_rate_set ? uplink_interval_ms : UPLINK_MIN_INTERVAL_MS;
+    int64_t due = schedule_cb();
+    int64_t earliest = last_send + (int64_t)min_ms * 1000;
+    return due > earliest ? due : earliest;
+}
+
+static void uplink_task(void *arg)
+{
+    uint32_t seq = 0;
+    while (true) {
+        int sock = uplink_connect();
+        if (sock < 0) {
+            vTaskDelay(pdMS_TO_TICKS(UPLINK_RECONNECT_MS));
+            continue;
+        }
+        log_i("Uplink connected to %s:%u", uplink_host, uplink_port);
+
+        uplink_reply_t reply;
+        size_t fill = 0;
+        int64_t last_send = 0;
+        uplink_pending = false;
+        uplink_trace_set = false;
+        while (true) {
+            // The schedule can move while waiting, so recheck it now and then
+            int64_t now = esp_timer_get_time();
+            int64_t next_due = uplink_next_due(last_send);
+            if (next_due > now) {
+                int64_t poll = now + UPLINK_SCHEDULE_POLL_MS * 1000;
+                if (!uplink_read_replies(sock, next_due < poll ? next_due : poll, &reply, &fill)) {
+                    break;
+                }
+                continue;
+            }
+            camera_fb_t *fb = broker_acquire(seq, UPLINK_DEFAULT_INTERVAL_MS, &seq);
+            if (!fb) {
+                continue;
+            }
+            // Pace from the start of each send so the rate doesn't drift with the link
+            last_send = esp_timer_get_time();
+            bool ok = uplink_send_frame(sock, fb, seq);
+            uplink_pending = schedule_cb != NULL;
+            broker_release(fb);
+            if (!ok) {
+                break;
+            }
+        }
+
+        log_e("Uplink connection to %s:%u lost", uplink_host, uplink_port);
+        close(sock);
+        vTaskDelay(pdMS_TO_TICKS(UPLINK_RECONNECT_MS));
+    }
+}
+
+esp_err_t uplink_start(const char *host, uint16_t port, uplink_result_cb_t on_result, uplink_sent_cb_t on_sent,
+                       uplink_schedule_cb_t schedule)
+{
+    strncpy(uplink_host, host, sizeof(uplink_host) - 1);
+    uplink_host[sizeof(uplink_host) - 1] = '\0';
+    uplink_port = port;
+    result_cb = on_result;
+    sent_cb = on_sent;
+    schedule_cb = schedule;
+    if (xTaskCreate(uplink_task, "uplink", UPLINK_TASK_STACK, NULL, UPLINK_TASK_PRIO, NULL) != pdPASS) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,31 @@
+// Push-mode frame uplink: keeps one TCP connection to the gateway open,
+// sends frames from the frame broker over it and takes classification
+// results back on the same socket. Wire format in protocol.h. Frames go out
+// when the device's sampling schedule wants one, never faster than the rate
+// the gateway asked for.
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "protocol.h"
+
+#define UPLINK_DEFAULT_INTERVAL_MS 1000
+#define UPLINK_MIN_INTERVAL_MS     40
+#define UPLINK_SCHEDULE_POLL_MS    100 // how often a waiting uplink rechecks the schedule
+#define UPLINK_RECONNECT_MS        2000
+#define UPLINK_SEND_TIMEOUT_MS     5000
+#define UPLINK_TASK_PRIO           4
+#define UPLINK_TASK_STACK          4096
+
+// gateway is the UPLINK_MSG_TRACE that came just before the result, NULL if none
+typedef void (*uplink_result_cb_t)(const cycle_result_t *result, const trace_gateway_t *gateway);
+
+// A frame went out: its sequence number, capture time and when its last byte was sent
+typedef void (*uplink_sent_cb_t)(uint32_t seq, int64_t frame_time, int64_t sent);
+
+// esp_timer_get_time() the next frame is due at
+typedef int64_t (*uplink_schedule_cb_t)(void);
+
+// Without a schedule, frames go out at the gateway's rate, 1 Hz until it sets one
+esp_err_t uplink_start(const char *host, uint16_t port, uplink_result_cb_t on_result, uplink_sent_cb_t on_sent,
+                       uplink_schedule_cb_t schedule);
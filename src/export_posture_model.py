@@ -0,0 +1,336 @@
+import os
+import csv
+import math
+import random
+import argparse
+import torch
+from torch import nn
+from torch.nn import functional as F
+from PIL import Image
+from torchvision import transforms
+from torchvision.models import resnet101
+
+# Trains the small posture CNN the ESP32 falls back to when the gateway is
+# silent, quantizes it to int8 and writes CameraWebServer/posture_model.h for
+# the kernels in CameraWebServer/cnn.cpp. The quantized forward pass below
+# mirrors those kernels bit for bit, so the accuracy it reports is the one
+# the device gets.
+#
+# With --teacher the ResNet101 from the training notebook labels the dataset
+# first: the small net learns its answers and the labels are written to
+# --labels for host/sim/cnn_bench.cpp to measure agreement against.
+#
+#   python export_posture_model.py --dataset ../dataset --teacher resnet101_transfer_learning.pth
+
+CLASS_NAMES = ['BERDIRI', 'DUDUK', 'TIDUR']  # posture_t order in alert.h
+
+# Model input, the whole frame squashed like resweb.py does for the ResNet
+INPUT_W = 96
+INPUT_H = 96
+
+# Layer list, see cnn_op_t. Every conv is followed by a ReLU, the dense
+# layer produces the logits.
+ARCH = [
+    ('conv', 3, 2, 16),
+    ('maxpool',),
+    ('depthwise', 3, 1),
+    ('conv', 1, 1, 32),
+    ('depthwise', 3, 2),
+    ('conv', 1, 1, 64),
+    ('depthwise', 3, 2),
+    ('conv', 1, 1, 128),
+    ('avgpool',),
+    ('dense', len(CLASS_NAMES)),
+]
+
+OP_NAMES = {'conv': 'CNN_CONV', 'depthwise': 'CNN_DEPTHWISE', 'maxpool': 'CNN_MAXPOOL',
+            'avgpool': 'CNN_AVGPOOL', 'dense': 'CNN_DENSE'}
+
+# The device feeds pixels as p - 128 with zero point 0, so the float model
+# sees (p - 128) / 255 and zero padding is mid grey on both
+INPUT_SCALE = 1 / 255
+INPUT_OFFSET = 128 / 255
+
+class PostureNet(nn.Module):
+    def __init__(self):
+        super().__init__()
+        layers = []
+        channels = 3
+        for spec in ARCH:
+            if spec[0] == 'conv':
+                _, k, stride, out_c = spec
+                layers.append(nn.Conv2d(channels, out_c, k, stride, k // 2))
+                channels = out_c
+            elif spec[0] == 'depthwise':
+                _, k, stride = spec
+                layers.append(nn.Conv2d(channels, channels, k, stride, k // 2, groups=channels))
+            elif spec[0] == 'maxpool':
+                layers.append(nn.MaxPool2d(2))
+            elif spec[0] == 'avgpool':
+                layers.append(nn.AdaptiveAvgPool2d(1))
+            elif spec[0] == 'dense':
+                layers.append(nn.Flatten())
+                layers.append(nn.Linear(channels, spec[1]))
+        self.layers = nn.ModuleList(layers)
+
+    # Outputs of the layers in ARCH, ReLU applied after every conv
+    def forward_all(self, x):
+        outputs = []
+        for layer in self.layers:
+            x = layer(x)
+            if isinstance(layer, nn.Conv2d):
+                x = F.relu(x)
+            if not isinstance(layer, nn.Flatten):
+                outputs.append(x)
+        return outputs
+
+    def forward(self, x):
+        return self.forward_all(x)[-1]
+
+def list_dataset(root):
+    samples = []
+    for label, name in enumerate(CLASS_NAMES):
+        folder = os.path.join(root, name)
+        for file in sorted(os.listdir(folder)):
+            if file.lower().endswith('.jpg'):
+                samples.append((os.path.join(name, file), label))
+    return samples
+
+def teacher_labels(root, samples, weights):
+    model = resnet101(pretrained=False)
+    model.fc = nn.Linear(model.fc.in_features, len(CLASS_NAMES))
+    model.load_state_dict(torch.load(weights, map_location='cpu'))
+    model.eval()
+    transform = transforms.Compose([
+        transforms.Resize((224, 224)),
+        transforms.ToTensor(),
+        transforms.Normalize(mean=[0.485, 0.456, 0.406], std=[0.229, 0.224, 0.225])
+    ])
+    labelled = []
+    with torch.no_grad():
+        for path, _ in samples:
+            image = transform(Image.open(os.path.join(root, path)).convert('RGB'))
+            labelled.append((path, model(image.unsqueeze(0)).argmax(1).item()))
+    return labelled
+
+def load_images(root, samples, augment):
+    steps = [transforms.Resize((INPUT_H, INPUT_W))]
+    if augment:
+        steps += [transforms.RandomHorizontalFlip(), transforms.ColorJitter(0.3, 0.3, 0.2)]
+    steps += [transforms.ToTensor()]
+    transform = transforms.Compose(steps)
+    images = [Image.open(os.path.join(root, path)).convert('RGB') for path, _ in samples]
+    labels = torch.tensor([label for _, label in samples])
+    return lambda: (torch.stack([transform(image) - INPUT_OFFSET for image in images]), labels)
+
+def train(model, train_set, epochs):
+    optimizer = torch.optim.Adam(model.parameters(), lr=0.003)
+    scheduler = torch.optim.lr_scheduler.CosineAnnealingLR(optimizer, epochs)
+    for epoch in range(epochs):
+        images, labels = train_set()
+        order = torch.randperm(len(labels))
+        model.train()
+        total = 0
+        for i in range(0, len(order), 32):
+            batch = order[i:i + 32]
+            optimizer.zero_grad()
+            loss = F.cross_entropy(model(images[batch]), labels[batch])
+            loss.backward()
+            optimizer.step()
+            total += loss.item() * len(batch)
+        scheduler.step()
+        print(f'epoch {epoch + 1}/{epochs} loss {total / len(order):.3f}')
+
+# Scale and zero point covering [lo, hi] in int8, zero exactly representable
+def activation_qparams(lo, hi):
+    lo = min(lo, 0.0)
+    hi = max(hi, 0.0)
+    scale = max(hi - lo, 1e-8) / 255
+    zp = max(-128, min(127, round(-128 - lo / scale)))
+    return scale, zp
+
+# Q31 multiplier and right shift of cnn_rescale() for a real factor
+def quantize_multiplier(m):
+    if m <= 0:
+        return 0, 0
+    frac, exp = math.frexp(m)
+    mult = round(frac * (1 << 31))
+    if mult == 1 << 31:
+        mult //= 2
+        exp += 1
+    shift = -exp
+    if shift > 32:
+        return 0, 0
+    if shift < -30:
+        raise ValueError(f'rescale factor {m} is beyond what cnn_rescale() can shift')
+    return mult, shift
+
+def rescale(acc, mult, shift):
+    total = 31 + shift
+    half = torch.bitwise_left_shift(torch.ones_like(total), total - 1)
+    return torch.bitwise_right_shift(acc * mult + half, total)
+
+def quantize(model, calibration):
+    model.eval()
+    with torch.no_grad():
+        outputs = model.forward_all(calibration)
+    convs = [layer for layer in model.layers if isinstance(layer, (nn.Conv2d, nn.Linear))]
+
+    layers = []
+    in_scale, in_zp = INPUT_SCALE, 0
+    for spec, output in zip(ARCH, outputs):
+        op = spec[0]
+        layer = {'op': op, 'kernel': 0, 'stride': 0, 'relu': 0, 'out_c': 0, 'in_zp': in_zp}
+        if op in ('maxpool', 'avgpool'):
+            # Same scale in and out
+            layer['out_zp'] = in_zp
+            layers.append(layer)
+            continue
+
+        module = convs.pop(0)
+        weight = module.weight.detach()
+        out_scale, out_zp = activation_qparams(output.min().item(), output.max().item())
+        if op == 'depthwise':
+            # [c][1][k][k] to [k][k][c]
+            weight = weight[:, 0].permute(1, 2, 0)
+            channel_max = weight.abs().amax(dim=(0, 1))
+        elif op == 'conv':
+            # [out][in][k][k] to [out][k][k][in]
+            weight = weight.permute(0, 2, 3, 1)
+            channel_max = weight.abs().amax(dim=(1, 2, 3))
+        else:
+            channel_max = weight.abs().amax(dim=1)
+        w_scale = channel_max.clamp(min=1e-8) / 127
+        if op == 'depthwise':
+            q_weight = (weight / w_scale).round().clamp(-127, 127)
+        else:
+            q_weight = (weight / w_scale.view(-1, *[1] * (weight.dim() - 1))).round().clamp(-127, 127)
+        bias = (module.bias.detach() / (in_scale * w_scale)).round()
+        factors = [quantize_multiplier(in_scale * s / out_scale) for s in w_scale.tolist()]
+
+        layer.update({
+            'relu': 1 if op != 'dense' else 0,
+            'out_zp': out_zp,
+            'weights': q_weight.to(torch.int64),
+            'bias': bias.to(torch.int64),
+            'mult': torch.tensor([f[0] for f in factors], dtype=torch.int64),
+            'shift': torch.tensor([f[1] for f in factors], dtype=torch.int64),
+            'out_scale': out_scale,
+        })
+        if op in ('conv', 'depthwise'):
+            layer['kernel'] = spec[1]
+            layer['stride'] = spec[2]
+        if op in ('conv', 'dense'):
+            layer['out_c'] = weight.shape[0]
+        layers.append(layer)
+        in_scale, in_zp = out_scale, out_zp
+    return layers, in_scale, in_zp
+
+def clamp_out(x, layer):
+    return x.clamp(layer['out_zp'] if layer['relu'] else -128, 127)
+
+# cnn_run() in integer arithmetic, on a batch of NCHW uint8 images
+def run_int8(layers, pixels):
+    x = pixels.to(torch.int64) - 128
+    for layer in layers:
+        op = layer['op']
+        if op == 'maxpool':
+            x = F.max_pool2d(x.double(), 2).to(torch.int64)
+            continue
+        if op == 'avgpool':
+            n = x.shape[2] * x.shape[3]
+            s = x.sum(dim=(2, 3))
+            x = (torch.sign(s) * ((s.abs() + n // 2) // n)).clamp(-128, 127)
+            x = x.view(*x.shape, 1, 1)
+            continue
+        centred = (x - layer['in_zp']).double()
+        weight = layer['weights']
+        if op == 'conv':
+            w = weight.permute(0, 3, 1, 2).double()
+            acc = F.conv2d(centred, w, stride=layer['stride'], padding=layer['kernel'] // 2)
+        elif op == 'depthwise':
+            w = weight.permute(2, 0, 1).unsqueeze(1).double()
+            acc = F.conv2d(centred, w, stride=layer['stride'], padding=layer['kernel'] // 2, groups=w.shape[0])
+        else:
+            acc = F.linear(centred.flatten(1), weight.double()).view(x.shape[0], -1, 1, 1)
+        acc = acc.round().to(torch.int64) + layer['bias'].view(1, -1, 1, 1)
+        out = rescale(acc, layer['mult'].view(1, -1, 1, 1), layer['shift'].view(1, -1, 1, 1)) + layer['out_zp']
+        x = clamp_out(out, layer)
+    return x.flatten(1)
+
+def c_array(ctype, name, values):
+    values = [str(int(v)) for v in values]
+    lines = [', '.join(values[i:i + 16]) for i in range(0, len(values), 16)]
+    return f'static const {ctype} {name}[] = {{\n    ' + ',\n    '.join(lines) + '\n};\n'
+
+def write_header(path, layers, out_scale, out_zp, summary):
+    out = ['// Generated by export_posture_model.py, do not edit.\n',
+           f'// {summary}\n',
+           '#pragma once\n\n#include "cnn.h"\n\n']
+    for i, layer in enumerate(layers):
+        if 'weights' not in layer:
+            continue
+        out.append(c_array('int8_t', f'posture_w{i}', layer['weights'].flatten().tolist()))
+        out.append(c_array('int32_t', f'posture_b{i}', layer['bias'].tolist()))
+        out.append(c_array('int32_t', f'posture_m{i}', layer['mult'].tolist()))
+        out.append(c_array('int8_t', f'posture_s{i}', layer['shift'].tolist()))
+        out.append('\n')
+    out.append('static const cnn_layer_t posture_layers[] = {\n')
+    for i, layer in enumerate(layers):
+        params = 'NULL, NULL, NULL, NULL'
+        if 'weights' in layer:
+            params = f'posture_w{i}, posture_b{i}, posture_m{i}, posture_s{i}'
+        out.append(f"    {{{OP_NAMES[layer['op']]}, {layer['kernel']}, {layer['stride']}, {layer['relu']}, "
+                   f"{layer['out_c']}, {layer['in_zp']}, {layer['out_zp']}, {params}}},\n")
+    out.append('};\n\n')
+    out.append('static const cnn_model_t posture_model = {\n')
+    out.append(f'    {INPUT_W}, {INPUT_H}, 3, posture_layers, {len(layers)}, {out_scale!r}f, {out_zp},\n')
+    out.append('};\n')
+    with open(path, 'w') as f:
+        f.write(''.join(out))
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--dataset', default=os.path.join(here, '..', 'dataset'))
+    parser.add_argument('--teacher', help='ResNet101 state dict, label the dataset with it')
+    parser.add_argument('--labels', default=os.path.join(here, '..', 'dataset', 'resnet_labels.csv'))
+    parser.add_argument('--epochs', type=int, default=40)
+    parser.add_argument('--output', default=os.path.join(here, 'CameraWebServer', 'posture_model.h'))
+    args = parser.parse_args()
+
+    random.seed(0)
+    torch.manual_seed(0)
+    samples = list_dataset(args.dataset)
+    if args.teacher:
+        samples = teacher_labels(args.dataset, samples, args.teacher)
+        with open(args.labels, 'w', newline='') as f:
+            csv.writer(f).writerows((path, CLASS_NAMES[label]) for path, label in samples)
+        print(f'Wrote {len(samples)} teacher labels to {args.labels}')
+
+    # Every fifth frame is held out, frames are in capture order
+    train_samples = [s for i, s in enumerate(samples) if i % 5]
+    test_samples = [s for i, s in enumerate(samples) if not i % 5]
+    model = PostureNet()
+    train(model, load_images(args.dataset, train_samples, True), args.epochs)
+
+    calibration, _ = load_images(args.dataset, train_samples, False)()
+    layers, out_scale, out_zp = quantize(model, calibration)
+
+    test_images, test_labels = load_images(args.dataset, test_samples, False)()
+    with torch.no_grad():
+        float_pred = model(test_images).argmax(1)
+    pixels = ((test_images + INPUT_OFFSET) * 255).round()
+    int8_pred = run_int8(layers, pixels).argmax(1)
+    float_acc = (float_pred == test_labels).float().mean().item()
+    int8_acc = (int8_pred == test_labels).float().mean().item()
+    target = 'teacher' if args.teacher else 'directory'
+    summary = (f'{INPUT_W}x{INPUT_H} input, held-out agreement with {target} labels: '
+               f'float {float_acc:.3f}, int8 {int8_acc:.3f}')
+    print(summary)
+
+    write_header(args.output, layers, out_scale, out_zp, summary)
+    print(f'Wrote {args.output}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,44 @@
+// Inference backends for the gateway daemon (gateway.cpp). A backend
+// classifies a batch of JPEG frames, from any mix of cameras, in one call.
+// Each inference thread opens its own context, so classify() need not be
+// thread safe.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    const uint8_t *jpg;
+    size_t len;
+} gw_input_t;
+
+typedef struct
+{
+    uint8_t class_id;   // posture_t, CYCLE_NO_RESULT when the frame couldn't be classified
+    uint8_t confidence; // 0..255
+    uint32_t decode_us; // of the classification time, spent decoding and resizing, 0 if not measured
+} gw_output_t;
+
+typedef struct
+{
+    const char *name;
+    const char *help; // what the text after "name:" in --backend sets
+    // NULL on failure
+    void *(*open)(const char *arg);
+    // One output per input. False fails the whole batch.
+    bool (*classify)(void *ctx, const gw_input_t *in, size_t count, gw_output_t *out);
+    void (*close)(void *ctx);
+} gw_backend_t;
+
+// Deterministic stand-in: the class and confidence are a hash of the JPEG
+// bytes, so the same frame always gets the same answer, and an optional
+// sleep models a fixed cost per call plus a cost per frame.
+extern const gw_backend_t gw_backend_stub;
+
+// The on-device int8 classifier (cnn.h) run on the gateway's CPU. Only
+// available when export_posture_model.py has written posture_model.h.
+extern const gw_backend_t gw_backend_cnn;
+
+// By name, NULL if unknown or not built
+const gw_backend_t *gw_backend_find(const char *name);
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <time.h>
+#include "alert.h"
+#include "backend.h"
+#include "protocol.h"
+
+#if __has_include("posture_model.h")
+#include "cnn.h"
+#include "host.h"
+#include "img_resize.h"
+#include "posture_model.h"
+
+typedef struct
+{
+    int8_t *arena;
+    size_t arena_len;
+    uint8_t *input;
+} cnn_ctx_t;
+
+static int64_t mono_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *cnn_open(const char *arg)
+{
+    cnn_ctx_t *c = (cnn_ctx_t *)calloc(1, sizeof(cnn_ctx_t));
+    if (!c) {
+        return NULL;
+    }
+    c->arena_len = cnn_arena_size(&posture_model);
+    c->arena = (int8_t *)malloc(c->arena_len);
+    c->input = (uint8_t *)malloc((size_t)posture_model.in_w * posture_model.in_h * posture_model.in_c);
+    if (!c->arena || !c->input) {
+        free(c->arena);
+        free(c->input);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+// Same path as the device's local classifier: decode at the coarsest scale
+// that covers the model input, bilinear resize, int8 inference
+static bool cnn_classify_one(cnn_ctx_t *c, const gw_input_t *in, gw_output_t *out)
+{
+    const cnn_model_t *m = &posture_model;
+    int64_t start = mono_us();
+    int w, h;
+    uint8_t *rgb = NULL;
+    for (int scale = 8; scale >= 1 && !rgb; scale /= 2) {
+        rgb = host_jpeg_decode(in->jpg, in->len, scale, &w, &h);
+        if (rgb && scale > 1 && (w < m->in_w || h < m->in_h)) {
+            free(rgb);
+            rgb = NULL;
+        }
+    }
+    if (!rgb) {
+        return false;
+    }
+    img_resize_rgb888(rgb, w, h, img_crop_full(w, h), c->input, m->in_w, m->in_h, false);
+    free(rgb);
+    out->decode_us = mono_us() - start;
+    int8_t logits[POSTURE_MAX];
+    if (!cnn_run(m, c->input, c->arena, c->arena_len, logits)) {
+        return false;
+    }
+    out->class_id = cnn_argmax(m, logits, POSTURE_MAX, &out->confidence);
+    return true;
+}
+
+static bool cnn_classify(void *ctx, const gw_input_t *in, size_t count, gw_output_t *out)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (!cnn_classify_one((cnn_ctx_t *)ctx, &in[i], &out[i])) {
+            out[i].class_id = CYCLE_NO_RESULT;
+            out[i].confidence = 0;
+            out[i].decode_us = 0;
+        }
+    }
+    return true;
+}
+
+static void cnn_close(void *ctx)
+{
+    cnn_ctx_t *c = (cnn_ctx_t *)ctx;
+    free(c->arena);
+    free(c->input);
+    free(c);
+}
+
+const gw_backend_t gw_backend_cnn = {
+    "cnn",
+    "no argument, runs CameraWebServer/posture_model.h",
+    cnn_open,
+    cnn_classify,
+    cnn_close,
+};
+#else
+const gw_backend_t gw_backend_cnn = {"cnn", "not built, export posture_model.h first", NULL, NULL, NULL};
+#endif
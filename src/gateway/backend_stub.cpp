@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "alert.h"
+#include "backend.h"
+
+typedef struct
+{
+    uint32_t call_us; // per classify() call
+    uint32_t item_us; // per frame in it
+} stub_t;
+
+static void *stub_open(const char *arg)
+{
+    stub_t *s = (stub_t *)calloc(1, sizeof(stub_t));
+    if (s && arg && *arg && sscanf(arg, "%u,%u", &s->call_us, &s->item_us) < 1) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+static bool stub_classify(void *ctx, const gw_input_t *in, size_t count, gw_output_t *out)
+{
+    const stub_t *s = (const stub_t *)ctx;
+    for (size_t i = 0; i < count; i++) {
+        // FNV-1a
+        uint32_t h = 2166136261u;
+        for (size_t j = 0; j < in[i].len; j++) {
+            h = (h ^ in[i].jpg[j]) * 16777619u;
+        }
+        out[i].class_id = h % POSTURE_MAX;
+        out[i].confidence = 128 + (h >> 8) % 128;
+        out[i].decode_us = 0;
+    }
+    uint64_t sleep_us = s->call_us + (uint64_t)s->item_us * count;
+    if (sleep_us) {
+        usleep(sleep_us);
+    }
+    return true;
+}
+
+static void stub_close(void *ctx)
+{
+    free(ctx);
+}
+
+const gw_backend_t gw_backend_stub = {
+    "stub",
+    "CALL_US[,ITEM_US] simulated cost per call and per frame",
+    stub_open,
+    stub_classify,
+    stub_close,
+};
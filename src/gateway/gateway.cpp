@@ -0,0 +1,1210 @@
+// Gateway daemon for many cameras on one Linux box.
+//
+// One epoll loop holds a keep-alive connection to every camera given with
+// --camera and runs the /cycle protocol on each: the request carries the
+// result for the previous frame and the answer is the next frame, or 204
+// and X-Next-Sample while the device's schedule wants none (run_cycle() in
+// resweb.py, for one camera). Devices in push mode (uplink.cpp) connect to
+// --listen instead and get their results back on the same socket.
+//
+// Frames from all cameras go into one micro-batch, handed to an inference
+// thread when it reaches --batch-max frames or has waited --batch-wait-ms
+// and a thread is free. While every thread is busy the batch keeps growing,
+// so the batch size follows the load. Backends are in backend.h; the
+// deterministic stub stands in for a model in tests and benchmarks.
+//
+// Each result goes back with the gateway's stage times for the device's
+// latency traces (trace.h): X-Gateway-Trace on the /cycle request, an
+// UPLINK_MSG_TRACE reply ahead of the result over the uplink.
+//
+// A camera that has recorded a burst (burst.h) says so with X-Burst on its
+// /cycle answers. The gateway then pulls the whole burst from /burst, puts
+// its frames into the micro-batch like any others and posts their results
+// back to /classify as one cycle_result_t batch before cycling on.
+//
+// Cameras are asked for X-Frame-Hash (frame_hash.h) and given the hash of
+// the frame last classified. When the scene is within --skip-bits of it the
+// camera answers 304 instead of a frame, and that frame's result goes back
+// with the next request without running the model.
+//
+// Every --report-s seconds it prints each camera's sample rate and latency:
+// from sending the /cycle request to sending the result back for pulled
+// cameras, from receiving the frame to sending the reply for pushed ones.
+//
+// Build from src/ with host/build.sh, then
+//   ./gateway_daemon --camera 192.168.1.20 --camera 192.168.1.21:8080 --backend stub
+//   ./gateway_daemon --listen 9000 --backend cnn --workers 2
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "backend.h"
+#include "burst.h"
+#include "frame_hash.h"
+#include "protocol.h"
+
+#define GW_BATCH_LIMIT       256
+#define GW_SCHEDULE_POLL_MS  1000  // longest wait on X-Next-Sample, as SCHEDULE_POLL_MAX_MS in resweb.py
+#define GW_RETRY_MS          1000  // after a failed request or connection
+#define GW_IO_TIMEOUT_MS     10000 // connect, request or response taking longer fails
+#define GW_RECV_CHUNK        65536
+#define GW_HEAD_MAX          16384 // response head, longer fails
+#define GW_CHUNK_LINE_MAX    64    // chunk size line with any extensions
+#define GW_BODY_MAX          UPLINK_FRAME_MAX // one frame, as on the uplink
+#define GW_BURST_BODY_MAX    ((size_t)BURST_FRAMES * (UPLINK_FRAME_MAX + 256)) // every part with its head
+
+typedef enum {
+    CONN_CAMERA, // pulled with /cycle
+    CONN_DEVICE, // pushing frames over the uplink
+} conn_kind_t;
+
+typedef enum {
+    CAM_WAIT,     // until wake_at: retry, or the next sample is due
+    CAM_CONNECT,
+    CAM_REQUEST,  // writing the /cycle request
+    CAM_RESPONSE, // reading its response
+    CAM_INFER,    // the frame is with the batcher
+} cam_state_t;
+
+typedef enum {
+    CAM_PULL_CYCLE,         // POST /cycle
+    CAM_PULL_BURST,         // GET /burst?id=N
+    CAM_PULL_BURST_RESULTS, // POST /classify with the burst's results
+} cam_pull_t;
+
+typedef struct
+{
+    uint64_t frames; // classified
+    uint64_t unchanged; // answered 304, the previous result reused
+    uint64_t errors;
+    std::vector<int32_t> latency_us;
+} gw_stats_t;
+
+typedef struct
+{
+    conn_kind_t kind;
+    uint32_t id; // stable for cameras, one per connection for devices
+    int fd;      // -1 while a camera is disconnected
+    std::string name;
+    std::string out; // bytes waiting to be written
+    size_t out_off;
+    std::string in;  // bytes received and not consumed
+    uint32_t watching; // epoll events registered
+
+    // Cameras
+    std::string host;
+    std::string port;
+    cam_state_t state;
+    int64_t wake_at;
+    int64_t io_deadline;
+    int64_t request_at;
+    cycle_result_t result; // goes out with the next request
+    trace_gateway_t trace; // and its stage times, if has_trace
+    bool has_trace;
+    char alert[32];        // last X-Alert
+    cam_pull_t pull;       // the request in flight
+    uint32_t burst_id;     // newest burst announced by X-Burst
+    uint32_t burst_done;   // newest burst pulled, or given up on
+    size_t burst_pending;  // its frames still with the batcher
+    std::vector<cycle_result_t> burst_results;
+    std::string frame_hash; // X-Frame-Hash of the frame with the batcher
+    std::string ref_hash;   // of the frame last classified, empty if none
+    cycle_result_t ref;     // its result, reused for unchanged frames
+
+    gw_stats_t window; // since the last report
+    uint64_t total_frames;
+} gw_conn_t;
+
+typedef struct
+{
+    uint32_t conn;
+    int64_t started; // request sent or frame received, for the latency
+    int64_t received; // the whole frame is in, trace_gateway_t offsets count from here
+    int64_t frame_time;
+    std::vector<uint8_t> jpg;
+    gw_output_t out;
+    bool burst; // the result goes back with the rest of its burst
+} gw_item_t;
+
+typedef struct
+{
+    std::vector<gw_item_t> items;
+    int64_t queued_at;
+    int64_t started; // an inference thread took it
+    int64_t infer_us;
+    bool ok;
+} gw_batch_t;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Options
+static const gw_backend_t *backend = NULL;
+static const char *backend_arg = "";
+static const char *capture_mode = "model";
+static size_t batch_max = 16;
+static int64_t batch_wait_us = 5000;
+static int workers = 1;
+static uint16_t uplink_interval_ms = 0;
+static int skip_bits = FRAME_HASH_SIMILAR; // -1 classifies every frame
+
+// Event loop state
+static int epfd = -1;
+static int done_fd = -1; // eventfd the inference threads signal
+static std::unordered_map<uint32_t, gw_conn_t *> conns;
+static std::vector<gw_conn_t *> cameras;
+static uint32_t next_conn_id = 1;
+static std::vector<gw_item_t> pending;
+static int64_t pending_since = 0;
+
+// Shared with the inference threads
+static std::mutex batch_lock;
+static std::condition_variable batch_ready;
+static std::deque<gw_batch_t *> batch_queue;
+static std::deque<gw_batch_t *> batch_done;
+static int idle_workers = 0;
+
+// Batch statistics since the last report
+static uint64_t batches = 0;
+static uint64_t batched_frames = 0;
+static uint64_t bursts = 0;
+static uint64_t burst_frames = 0;
+static std::vector<int32_t> infer_us;
+static std::vector<int32_t> queue_us;
+
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void conn_watch(gw_conn_t *c, uint32_t events)
+{
+    if (c->fd < 0 || events == c->watching) {
+        return;
+    }
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.u32 = c->id;
+    epoll_ctl(epfd, c->watching ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev);
+    c->watching = events;
+}
+
+static void conn_close(gw_conn_t *c)
+{
+    if (c->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->watching = 0;
+    c->in.clear();
+    c->out.clear();
+    c->out_off = 0;
+}
+
+// Write what the socket takes. False on error.
+static bool conn_flush(gw_conn_t *c)
+{
+    while (c->out_off < c->out.size()) {
+        ssize_t n = send(c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        c->out_off += n;
+    }
+    c->out.clear();
+    c->out_off = 0;
+    return true;
+}
+
+// Read what has arrived. False when the peer closed or on error.
+static bool conn_fill(gw_conn_t *c)
+{
+    char buf[GW_RECV_CHUNK];
+    while (true) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        c->in.append(buf, n);
+    }
+}
+
+static void batch_add(gw_conn_t *c, int64_t started, int64_t frame_time, std::vector<uint8_t> &&jpg, bool burst)
+{
+    if (pending.empty()) {
+        pending_since = now_us();
+    }
+    gw_item_t item;
+    item.conn = c->id;
+    item.started = started;
+    item.received = now_us();
+    item.frame_time = frame_time;
+    item.jpg = std::move(jpg);
+    item.out = {CYCLE_NO_RESULT, 0, 0};
+    item.burst = burst;
+    pending.push_back(std::move(item));
+}
+
+// Cameras
+
+static void cam_fail(gw_conn_t *c, const char *why)
+{
+    fprintf(stderr, "%s: %s\n", c->name.c_str(), why);
+    c->window.errors++;
+    conn_close(c);
+    c->state = CAM_WAIT;
+    c->wake_at = now_us() + GW_RETRY_MS * 1000LL;
+}
+
+static void cam_connect(gw_conn_t *c)
+{
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addr = NULL;
+    if (getaddrinfo(c->host.c_str(), c->port.c_str(), &hints, &addr) != 0 || !addr) {
+        cam_fail(c, "cannot resolve");
+        return;
+    }
+    c->fd = socket(addr->ai_family, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        freeaddrinfo(addr);
+        cam_fail(c, strerror(errno));
+        return;
+    }
+    set_nonblocking(c->fd);
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int res = connect(c->fd, addr->ai_addr, addr->ai_addrlen);
+    freeaddrinfo(addr);
+    if (res < 0 && errno != EINPROGRESS) {
+        cam_fail(c, strerror(errno));
+        return;
+    }
+    c->state = CAM_CONNECT;
+    c->io_deadline = now_us() + GW_IO_TIMEOUT_MS * 1000LL;
+    conn_watch(c, EPOLLOUT);
+}
+
+static void cam_request(gw_conn_t *c)
+{
+    if (c->fd < 0) {
+        cam_connect(c);
+        return;
+    }
+    char head[320];
+    int len;
+    if (c->burst_id != c->burst_done) {
+        // The previous frame's result waits for the next /cycle
+        c->pull = CAM_PULL_BURST;
+        len = snprintf(head, sizeof(head), "GET /burst?id=%u HTTP/1.1\r\nHost: %s\r\n\r\n", c->burst_id,
+                       c->host.c_str());
+        c->out.assign(head, len);
+    } else if (!c->burst_results.empty()) {
+        c->pull = CAM_PULL_BURST_RESULTS;
+        size_t body = c->burst_results.size() * sizeof(cycle_result_t);
+        len = snprintf(head, sizeof(head),
+                       "POST /classify HTTP/1.1\r\nHost: %s\r\n"
+                       "Content-Type: application/octet-stream\r\nContent-Length: %zu\r\n\r\n",
+                       c->host.c_str(), body);
+        c->out.assign(head, len);
+        c->out.append((const char *)c->burst_results.data(), body);
+    } else {
+        char trace[64] = "";
+        if (c->has_trace) {
+            snprintf(trace, sizeof(trace), "X-Gateway-Trace: %u,%u,%u\r\n", (unsigned)c->trace.started_us,
+                     (unsigned)c->trace.decoded_us, (unsigned)c->trace.inferred_us);
+        }
+        char since[64] = "";
+        if (skip_bits >= 0) {
+            // An empty since only asks for the hash
+            snprintf(since, sizeof(since), "&since=%s&threshold=%d", c->ref_hash.c_str(), skip_bits);
+        }
+        c->pull = CAM_PULL_CYCLE;
+        len = snprintf(head, sizeof(head),
+                       "POST /cycle?schedule=1%s%s%s HTTP/1.1\r\nHost: %s\r\n%s"
+                       "Content-Type: application/octet-stream\r\nContent-Length: %zu\r\n\r\n",
+                       *capture_mode ? "&mode=" : "", capture_mode, since, c->host.c_str(), trace,
+                       sizeof(cycle_result_t));
+        c->out.assign(head, len);
+        c->out.append((const char *)&c->result, sizeof(c->result));
+    }
+    c->out_off = 0;
+    c->in.clear();
+    c->state = CAM_REQUEST;
+    c->request_at = now_us();
+    c->io_deadline = c->request_at + GW_IO_TIMEOUT_MS * 1000LL;
+    if (!conn_flush(c)) {
+        // Most likely the camera closed the idle connection, try a new one
+        conn_close(c);
+        cam_connect(c);
+        return;
+    }
+    if (c->out.empty()) {
+        c->state = CAM_RESPONSE;
+        conn_watch(c, EPOLLIN);
+    } else {
+        conn_watch(c, EPOLLOUT);
+    }
+}
+
+static void cam_wait(gw_conn_t *c, uint32_t ms)
+{
+    c->state = CAM_WAIT;
+    c->wake_at = now_us() + ms * 1000LL;
+    conn_watch(c, EPOLLIN); // to notice the camera closing the connection
+}
+
+typedef struct
+{
+    int status;
+    size_t head_len;
+    long content_length; // -1 when absent
+    bool chunked;
+    bool close;
+    int64_t timestamp;
+    long next_sample; // -1 when absent
+    std::string alert;
+    std::string boundary; // of a multipart Content-Type
+    uint32_t burst_id;    // X-Burst, 0 when absent
+    std::string frame_hash;
+} http_head_t;
+
+static bool http_parse_head(const std::string &in, http_head_t *h)
+{
+    size_t end = in.find("\r\n\r\n");
+    if (end == std::string::npos) {
+        return false;
+    }
+    h->head_len = end + 4;
+    h->status = 0;
+    h->content_length = -1;
+    h->chunked = false;
+    h->close = false;
+    h->timestamp = 0;
+    h->next_sample = -1;
+    h->alert.clear();
+    h->boundary.clear();
+    h->burst_id = 0;
+    h->frame_hash.clear();
+    sscanf(in.c_str(), "HTTP/1.%*d %d", &h->status);
+    size_t pos = in.find("\r\n") + 2;
+    while (pos < end) {
+        size_t eol = in.find("\r\n", pos);
+        std::string line = in.substr(pos, eol - pos);
+        pos = eol + 2;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string key = line.substr(0, colon);
+        std::string value = line.substr(line.find_first_not_of(' ', colon + 1) == std::string::npos
+                                            ? line.size()
+                                            : line.find_first_not_of(' ', colon + 1));
+        if (!strcasecmp(key.c_str(), "Content-Length")) {
+            h->content_length = atol(value.c_str());
+        } else if (!strcasecmp(key.c_str(), "Transfer-Encoding")) {
+            h->chunked = strcasestr(value.c_str(), "chunked") != NULL;
+        } else if (!strcasecmp(key.c_str(), "Connection")) {
+            h->close = !strcasecmp(value.c_str(), "close");
+        } else if (!strcasecmp(key.c_str(), "X-Timestamp")) {
+            // "<sec>.<usec>"
+            long long sec = 0, usec = 0;
+            sscanf(value.c_str(), "%lld.%lld", &sec, &usec);
+            h->timestamp = sec * 1000000 + usec;
+        } else if (!strcasecmp(key.c_str(), "X-Next-Sample")) {
+            h->next_sample = atol(value.c_str());
+        } else if (!strcasecmp(key.c_str(), "X-Alert")) {
+            h->alert = value;
+        } else if (!strcasecmp(key.c_str(), "X-Frame-Hash")) {
+            h->frame_hash = value;
+        } else if (!strcasecmp(key.c_str(), "X-Burst")) {
+            // "<id>,<frames>"
+            h->burst_id = strtoul(value.c_str(), NULL, 10);
+        } else if (!strcasecmp(key.c_str(), "Content-Type")) {
+            size_t at = value.find("boundary=");
+            if (at != std::string::npos) {
+                h->boundary = value.substr(at + 9);
+            }
+        }
+    }
+    return true;
+}
+
+// 1 with the whole body in body and its end in *end, 0 if more is needed,
+// -1 if malformed or longer than max. Lengths are checked against what is
+// left of in, so no size the camera sends can wrap.
+static int http_parse_body(const std::string &in, const http_head_t *h, size_t max, std::vector<uint8_t> *body,
+                           size_t *end)
+{
+    if (!h->chunked) {
+        size_t len = h->content_length > 0 ? h->content_length : 0;
+        if (len > max) {
+            return -1;
+        }
+        if (in.size() - h->head_len < len) {
+            return 0;
+        }
+        body->assign(in.begin() + h->head_len, in.begin() + h->head_len + len);
+        *end = h->head_len + len;
+        return 1;
+    }
+    body->clear();
+    size_t pos = h->head_len;
+    while (true) {
+        size_t eol = in.find("\r\n", pos);
+        if (eol == std::string::npos) {
+            return in.size() - pos > GW_CHUNK_LINE_MAX ? -1 : 0;
+        }
+        char *stop;
+        unsigned long len = strtoul(in.c_str() + pos, &stop, 16);
+        if (stop == in.c_str() + pos || len > max - body->size()) {
+            return -1;
+        }
+        if (in.size() - eol < 4 || len > in.size() - eol - 4) {
+            return 0;
+        }
+        if (!len) {
+            *end = eol + 4; // no trailers
+            return 1;
+        }
+        body->insert(body->end(), in.begin() + eol + 2, in.begin() + eol + 2 + len);
+        pos = eol + 2 + len + 2;
+    }
+}
+
+typedef struct
+{
+    int64_t frame_time;
+    std::vector<uint8_t> jpg;
+} burst_frame_t;
+
+// The parts of a /burst multipart bundle, each with Content-Length and
+// X-Timestamp. False if malformed.
+static bool burst_parse(const std::vector<uint8_t> &body, const std::string &boundary,
+                        std::vector<burst_frame_t> *frames)
+{
+    std::string data(body.begin(), body.end());
+    std::string delim = "--" + boundary;
+    size_t pos = 0;
+    while (true) {
+        if (data.compare(pos, delim.size(), delim) != 0) {
+            return false;
+        }
+        pos += delim.size();
+        if (data.compare(pos, 2, "--") == 0) {
+            return true;
+        }
+        // The part head starts with the CRLF ending the delimiter line
+        size_t head_end = data.find("\r\n\r\n", pos);
+        if (head_end == std::string::npos) {
+            return false;
+        }
+        std::string head = data.substr(pos, head_end + 2 - pos);
+        const char *length = strcasestr(head.c_str(), "\r\nContent-Length:");
+        const char *timestamp = strcasestr(head.c_str(), "\r\nX-Timestamp:");
+        if (!length) {
+            return false;
+        }
+        size_t len = strtoul(length + 17, NULL, 10);
+        long long sec = 0, usec = 0;
+        if (timestamp) {
+            sscanf(timestamp + 14, " %lld.%lld", &sec, &usec);
+        }
+        pos = head_end + 4;
+        if (len > UPLINK_FRAME_MAX || data.size() - pos < 2 || len > data.size() - pos - 2) {
+            return false;
+        }
+        burst_frame_t f;
+        f.frame_time = sec * 1000000 + usec;
+        f.jpg.assign(data.begin() + pos, data.begin() + pos + len);
+        frames->push_back(std::move(f));
+        pos += len + 2;
+    }
+}
+
+static void cam_burst_response(gw_conn_t *c, const http_head_t *h, const std::vector<uint8_t> &body)
+{
+    c->burst_done = c->burst_id;
+    std::vector<burst_frame_t> frames;
+    if (h->status != 200 || h->boundary.empty() || !burst_parse(body, h->boundary, &frames) || frames.empty()) {
+        // 404 means a newer burst replaced it, X-Burst will name that one
+        if (h->status != 404) {
+            fprintf(stderr, "%s: burst %u not pulled, HTTP status %d\n", c->name.c_str(), c->burst_id, h->status);
+            c->window.errors++;
+        }
+        cam_request(c);
+        return;
+    }
+    bursts++;
+    c->state = CAM_INFER;
+    conn_watch(c, EPOLLIN);
+    c->burst_pending = frames.size();
+    c->burst_results.clear();
+    int64_t now = now_us();
+    for (burst_frame_t &f : frames) {
+        batch_add(c, now, f.frame_time, std::move(f.jpg), true);
+    }
+}
+
+static void cam_response(gw_conn_t *c)
+{
+    http_head_t h;
+    if (!http_parse_head(c->in, &h)) {
+        if (c->in.size() > GW_HEAD_MAX) {
+            cam_fail(c, "response head too long");
+        }
+        return;
+    }
+    std::vector<uint8_t> body;
+    size_t end;
+    int res = http_parse_body(c->in, &h, c->pull == CAM_PULL_BURST ? GW_BURST_BODY_MAX : GW_BODY_MAX, &body, &end);
+    if (res < 0) {
+        cam_fail(c, "malformed or oversized response");
+        return;
+    }
+    if (!res) {
+        return;
+    }
+    c->in.erase(0, end);
+    if (!h.alert.empty()) {
+        snprintf(c->alert, sizeof(c->alert), "%s", h.alert.c_str());
+    }
+    if (h.close) {
+        conn_close(c);
+    }
+    if (c->pull == CAM_PULL_BURST) {
+        cam_burst_response(c, &h, body);
+        return;
+    }
+    if (c->pull == CAM_PULL_BURST_RESULTS) {
+        if (h.status != 200) {
+            fprintf(stderr, "%s: burst results refused, HTTP status %d\n", c->name.c_str(), h.status);
+            c->window.errors++;
+        }
+        c->burst_results.clear();
+        cam_request(c);
+        return;
+    }
+
+    // The result went out with the request
+    c->result = {CYCLE_NO_RESULT, 0, 0, 0};
+    c->has_trace = false;
+    if (h.burst_id) {
+        c->burst_id = h.burst_id;
+    }
+    if (h.status == 200) {
+        c->state = CAM_INFER;
+        conn_watch(c, EPOLLIN);
+        c->frame_hash = h.frame_hash;
+        batch_add(c, c->request_at, h.timestamp, std::move(body), false);
+    } else if (h.status == 304) {
+        // Same scene as the frame last classified, its result stands for this one
+        c->result = c->ref;
+        c->result.frame_time = h.timestamp;
+        c->window.unchanged++;
+        cam_request(c);
+    } else if (h.status == 204) {
+        long wait = h.next_sample < 0 ? GW_SCHEDULE_POLL_MS : h.next_sample;
+        if (c->burst_id != c->burst_done) {
+            cam_request(c);
+        } else {
+            cam_wait(c, std::min(wait, (long)GW_SCHEDULE_POLL_MS));
+        }
+    } else {
+        char why[32];
+        snprintf(why, sizeof(why), "HTTP status %d", h.status);
+        cam_fail(c, why);
+    }
+}
+
+static void cam_event(gw_conn_t *c, uint32_t events)
+{
+    if (c->state == CAM_CONNECT) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            cam_fail(c, strerror(err));
+            return;
+        }
+        cam_request(c);
+        return;
+    }
+    if (c->state == CAM_REQUEST) {
+        if (!conn_flush(c)) {
+            cam_fail(c, "send failed");
+            return;
+        }
+        if (c->out.empty()) {
+            c->state = CAM_RESPONSE;
+            conn_watch(c, EPOLLIN);
+        }
+        return;
+    }
+    // Reading, or checking an idle connection
+    bool open = conn_fill(c);
+    if (c->state == CAM_RESPONSE) {
+        cam_response(c);
+        if (!open && c->state == CAM_RESPONSE) {
+            cam_fail(c, "connection closed");
+        }
+    } else if (!open) {
+        conn_close(c);
+    }
+}
+
+// Devices
+
+static void dev_accept(int listen_fd)
+{
+    while (true) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept(listen_fd, (struct sockaddr *)&addr, &addr_len);
+        if (fd < 0) {
+            return;
+        }
+        set_nonblocking(fd);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        char host[64], port[8];
+        getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+
+        gw_conn_t *c = new gw_conn_t();
+        c->kind = CONN_DEVICE;
+        c->id = next_conn_id++;
+        c->fd = fd;
+        c->name = std::string(host) + ":" + port + " (push)";
+        c->out_off = 0;
+        c->watching = 0;
+        c->total_frames = 0;
+        c->alert[0] = '\0';
+        conns[c->id] = c;
+        if (uplink_interval_ms) {
+            uplink_reply_t r = {};
+            r.type = UPLINK_MSG_RATE;
+            r.interval_ms = uplink_interval_ms;
+            c->out.append((const char *)&r, sizeof(r));
+            conn_flush(c);
+        }
+        conn_watch(c, c->out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+        printf("%s connected\n", c->name.c_str());
+    }
+}
+
+static void dev_close(gw_conn_t *c)
+{
+    printf("%s disconnected\n", c->name.c_str());
+    conn_close(c);
+    conns.erase(c->id);
+    delete c;
+}
+
+static void dev_event(gw_conn_t *c, uint32_t events)
+{
+    if ((events & EPOLLOUT) && !conn_flush(c)) {
+        dev_close(c);
+        return;
+    }
+    bool open = true;
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        open = conn_fill(c);
+    }
+    size_t pos = 0;
+    while (c->in.size() - pos >= sizeof(uplink_frame_t)) {
+        uplink_frame_t f;
+        memcpy(&f, c->in.data() + pos, sizeof(f));
+        if (f.magic != UPLINK_MAGIC) {
+            fprintf(stderr, "%s: bad frame magic 0x%08x\n", c->name.c_str(), (unsigned)f.magic);
+            dev_close(c);
+            return;
+        }
+        // Nothing a camera sends is this large, don't buffer toward it
+        if (f.len > UPLINK_FRAME_MAX) {
+            fprintf(stderr, "%s: frame of %u bytes is over the %u byte limit\n", c->name.c_str(), (unsigned)f.len,
+                    (unsigned)UPLINK_FRAME_MAX);
+            dev_close(c);
+            return;
+        }
+        if (c->in.size() - pos - sizeof(f) < f.len) {
+            break;
+        }
+        const uint8_t *jpg = (const uint8_t *)c->in.data() + pos + sizeof(f);
+        batch_add(c, now_us(), f.frame_time, std::vector<uint8_t>(jpg, jpg + f.len), false);
+        pos += sizeof(f) + f.len;
+    }
+    c->in.erase(0, pos);
+    if (!open) {
+        dev_close(c);
+        return;
+    }
+    conn_watch(c, c->out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+}
+
+// Batching
+
+static void inference_thread(void)
+{
+    void *ctx = backend->open(backend_arg);
+    if (!ctx) {
+        fprintf(stderr, "Cannot open backend %s with '%s'\n", backend->name, backend_arg);
+        exit(1);
+    }
+    std::vector<gw_input_t> in;
+    std::vector<gw_output_t> out;
+    std::unique_lock<std::mutex> lock(batch_lock);
+    while (true) {
+        idle_workers++;
+        batch_ready.wait(lock, [] { return !batch_queue.empty(); });
+        idle_workers--;
+        gw_batch_t *b = batch_queue.front();
+        batch_queue.pop_front();
+        lock.unlock();
+
+        in.resize(b->items.size());
+        out.resize(b->items.size());
+        for (size_t i = 0; i < b->items.size(); i++) {
+            in[i].jpg = b->items[i].jpg.data();
+            in[i].len = b->items[i].jpg.size();
+        }
+        b->started = now_us();
+        b->ok = backend->classify(ctx, in.data(), in.size(), out.data());
+        b->infer_us = now_us() - b->started;
+        for (size_t i = 0; i < b->items.size(); i++) {
+            b->items[i].out = out[i];
+            // The event loop doesn't need the frames any more
+            std::vector<uint8_t>().swap(b->items[i].jpg);
+        }
+
+        lock.lock();
+        batch_done.push_back(b);
+        uint64_t one = 1;
+        if (write(done_fd, &one, sizeof(one)) < 0) {
+            perror("eventfd");
+        }
+    }
+}
+
+// Hand the pending frames to the inference threads when the batch is full,
+// or when it has waited long enough and a thread is free to take it
+static int64_t batch_flush(int64_t now)
+{
+    if (pending.empty()) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(batch_lock);
+    bool idle = idle_workers > (int)batch_queue.size();
+    int64_t due = pending_since + batch_wait_us;
+    if (pending.size() < batch_max && !(idle && now >= due)) {
+        // Wait for the deadline, or for a thread to finish
+        return idle ? due - now : -1;
+    }
+    gw_batch_t *b = new gw_batch_t();
+    size_t n = std::min(pending.size(), batch_max);
+    b->items.assign(std::make_move_iterator(pending.begin()), std::make_move_iterator(pending.begin() + n));
+    pending.erase(pending.begin(), pending.begin() + n);
+    pending_since = now;
+    b->queued_at = now;
+    batch_queue.push_back(b);
+    batch_ready.notify_one();
+    return pending.empty() ? -1 : 0;
+}
+
+static void batch_results(void)
+{
+    uint64_t count;
+    if (read(done_fd, &count, sizeof(count)) < 0) {
+        return;
+    }
+    std::deque<gw_batch_t *> done;
+    {
+        std::lock_guard<std::mutex> lock(batch_lock);
+        done.swap(batch_done);
+    }
+    int64_t now = now_us();
+    for (gw_batch_t *b : done) {
+        batches++;
+        batched_frames += b->items.size();
+        infer_us.push_back(b->infer_us);
+        queue_us.push_back(now - b->queued_at - b->infer_us);
+        for (gw_item_t &item : b->items) {
+            auto it = conns.find(item.conn);
+            if (it == conns.end()) {
+                continue; // the device went away
+            }
+            gw_conn_t *c = it->second;
+            cycle_result_t r = {CYCLE_NO_RESULT, 0, 0, item.frame_time};
+            trace_gateway_t trace;
+            trace.started_us = b->started - item.received;
+            trace.decoded_us = trace.started_us + item.out.decode_us;
+            trace.inferred_us = b->started + b->infer_us - item.received;
+            if (b->ok) {
+                r.class_id = item.out.class_id;
+                r.confidence = item.out.confidence;
+            } else {
+                c->window.errors++;
+            }
+            if (item.burst) {
+                c->burst_results.push_back(r);
+                burst_frames++;
+                if (!--c->burst_pending) {
+                    cam_request(c);
+                }
+                continue;
+            }
+            if (c->kind == CONN_CAMERA) {
+                if (r.class_id != CYCLE_NO_RESULT && c->frame_hash.size() == FRAME_HASH_HEX) {
+                    c->ref_hash = c->frame_hash;
+                    c->ref = r;
+                } else {
+                    c->ref_hash.clear();
+                }
+                c->result = r;
+                c->trace = trace;
+                c->has_trace = b->ok;
+                cam_request(c);
+            } else {
+                if (b->ok) {
+                    uplink_reply_t stages = {};
+                    stages.type = UPLINK_MSG_TRACE;
+                    stages.trace = trace;
+                    c->out.append((const char *)&stages, sizeof(stages));
+                }
+                uplink_reply_t reply = {};
+                reply.type = UPLINK_MSG_RESULT;
+                reply.result = r;
+                c->out.append((const char *)&reply, sizeof(reply));
+                if (!conn_flush(c)) {
+                    dev_close(c);
+                    continue;
+                }
+                conn_watch(c, c->out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+            }
+            c->window.frames++;
+            c->total_frames++;
+            c->window.latency_us.push_back(now_us() - item.started);
+        }
+        delete b;
+    }
+}
+
+// Reports
+
+static double percentile_ms(std::vector<int32_t> &v, double p)
+{
+    if (v.empty()) {
+        return 0;
+    }
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(v.size() * p))] / 1e3;
+}
+
+static void report(double seconds)
+{
+    printf("\n%-32s %8s %9s %8s %8s %7s  %s\n", "camera", "frames/s", "unchanged", "p50 ms", "p99 ms", "errors",
+           "alert");
+    std::vector<gw_conn_t *> list;
+    for (auto &kv : conns) {
+        list.push_back(kv.second);
+    }
+    std::sort(list.begin(), list.end(), [](const gw_conn_t *a, const gw_conn_t *b) { return a->id < b->id; });
+    double total = 0;
+    for (gw_conn_t *c : list) {
+        gw_stats_t &s = c->window;
+        printf("%-32s %8.2f %8.0f%% %8.1f %8.1f %7llu  %s\n", c->name.c_str(), s.frames / seconds,
+               s.frames + s.unchanged ? 100.0 * s.unchanged / (s.frames + s.unchanged) : 0.0,
+               percentile_ms(s.latency_us, 0.5), percentile_ms(s.latency_us, 0.99), (unsigned long long)s.errors,
+               c->alert);
+        total += s.frames / seconds;
+        s.frames = 0;
+        s.unchanged = 0;
+        s.errors = 0;
+        s.latency_us.clear();
+    }
+    printf("%zu cameras, %.1f frames/s. %llu batches of %.1f frames, inference p50 %.1f ms p99 %.1f ms, "
+           "queued p99 %.1f ms\n",
+           list.size(), total, (unsigned long long)batches, batches ? (double)batched_frames / batches : 0.0,
+           percentile_ms(infer_us, 0.5), percentile_ms(infer_us, 0.99), percentile_ms(queue_us, 0.99));
+    if (bursts) {
+        printf("%llu bursts pulled, %llu frames\n", (unsigned long long)bursts, (unsigned long long)burst_frames);
+    }
+    fflush(stdout);
+    batches = 0;
+    batched_frames = 0;
+    bursts = 0;
+    burst_frames = 0;
+    infer_us.clear();
+    queue_us.clear();
+}
+
+// Main
+
+static int listen_on(uint16_t port)
+{
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in6 addr = {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        fprintf(stderr, "Cannot listen on port %u: %s\n", port, strerror(errno));
+        return -1;
+    }
+    set_nonblocking(fd);
+    return fd;
+}
+
+static void add_camera(const char *spec)
+{
+    gw_conn_t *c = new gw_conn_t();
+    c->kind = CONN_CAMERA;
+    c->id = next_conn_id++;
+    c->fd = -1;
+    c->name = spec;
+    const char *colon = strrchr(spec, ':');
+    c->host = colon ? std::string(spec, colon - spec) : spec;
+    c->port = colon ? colon + 1 : "80";
+    c->out_off = 0;
+    c->watching = 0;
+    c->state = CAM_WAIT;
+    c->wake_at = 0;
+    c->result = {CYCLE_NO_RESULT, 0, 0, 0};
+    c->has_trace = false;
+    c->alert[0] = '\0';
+    c->pull = CAM_PULL_CYCLE;
+    c->burst_id = 0;
+    c->burst_done = 0;
+    c->burst_pending = 0;
+    c->ref = {CYCLE_NO_RESULT, 0, 0, 0};
+    c->total_frames = 0;
+    conns[c->id] = c;
+    cameras.push_back(c);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [--camera HOST[:PORT]]... [--listen PORT] [--backend NAME[:ARG]] [--workers N]\n"
+            "          [--batch-max N] [--batch-wait-ms N] [--mode frame|model] [--uplink-interval-ms N]\n"
+            "          [--skip-bits N] [--report-s N] [--duration S]\n"
+            "backends:\n",
+            argv0);
+    const gw_backend_t *all[] = {&gw_backend_stub, &gw_backend_cnn};
+    for (const gw_backend_t *b : all) {
+        fprintf(stderr, "  %-6s %s\n", b->name, b->help);
+    }
+}
+
+const gw_backend_t *gw_backend_find(const char *name)
+{
+    const gw_backend_t *all[] = {&gw_backend_stub, &gw_backend_cnn};
+    for (const gw_backend_t *b : all) {
+        if (b->open && !strcmp(b->name, name)) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int listen_port = 0;
+    std::string backend_spec = "stub";
+    double report_s = 10;
+    double duration_s = 0;
+
+    static const struct option options[] = {
+        {"camera", required_argument, NULL, 'c'},
+        {"listen", required_argument, NULL, 'l'},
+        {"backend", required_argument, NULL, 'b'},
+        {"workers", required_argument, NULL, 'w'},
+        {"batch-max", required_argument, NULL, 'n'},
+        {"batch-wait-ms", required_argument, NULL, 'W'},
+        {"mode", required_argument, NULL, 'm'},
+        {"uplink-interval-ms", required_argument, NULL, 'i'},
+        {"skip-bits", required_argument, NULL, 's'},
+        {"report-s", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:l:b:w:n:W:m:i:s:r:d:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            add_camera(optarg);
+            break;
+        case 'l':
+            listen_port = atoi(optarg);
+            break;
+        case 'b':
+            backend_spec = optarg;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'n':
+            batch_max = strtoul(optarg, NULL, 10);
+            break;
+        case 'W':
+            batch_wait_us = atof(optarg) * 1000;
+            break;
+        case 'm':
+            capture_mode = strcmp(optarg, "frame") ? optarg : "";
+            break;
+        case 'i':
+            uplink_interval_ms = atoi(optarg);
+            break;
+        case 's':
+            skip_bits = atoi(optarg);
+            break;
+        case 'r':
+            report_s = atof(optarg);
+            break;
+        case 'd':
+            duration_s = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    size_t colon = backend_spec.find(':');
+    static std::string backend_name = backend_spec.substr(0, colon);
+    static std::string backend_args = colon == std::string::npos ? "" : backend_spec.substr(colon + 1);
+    backend = gw_backend_find(backend_name.c_str());
+    backend_arg = backend_args.c_str();
+    if ((cameras.empty() && !listen_port) || !backend || workers < 1 || batch_max < 1 ||
+        batch_max > GW_BATCH_LIMIT || report_s <= 0 || skip_bits > 64 ||
+        (*capture_mode && strcmp(capture_mode, "model"))) {
+        usage(argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    epfd = epoll_create1(0);
+    done_fd = eventfd(0, EFD_NONBLOCK);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u32 = 0; // connection ids start at 1
+    epoll_ctl(epfd, EPOLL_CTL_ADD, done_fd, &ev);
+    int listen_fd = -1;
+    if (listen_port) {
+        listen_fd = listen_on(listen_port);
+        if (listen_fd < 0) {
+            return 1;
+        }
+        ev.data.u32 = UINT32_MAX;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    }
+    for (int i = 0; i < workers; i++) {
+        std::thread(inference_thread).detach();
+    }
+    printf("Gateway: %zu cameras%s, backend %s, %d inference threads, batches of up to %zu\n", cameras.size(),
+           listen_port ? ", push devices on the uplink port" : "", backend->name, workers, batch_max);
+
+    int64_t start = now_us();
+    int64_t last_report = start;
+    struct epoll_event events[64];
+    while (!duration_s || now_us() - start < duration_s * 1e6) {
+        int64_t now = now_us();
+        // Camera timers
+        int64_t next = last_report + (int64_t)(report_s * 1e6);
+        for (gw_conn_t *c : cameras) {
+            if (c->state == CAM_WAIT) {
+                if (c->wake_at <= now) {
+                    cam_request(c);
+                } else {
+                    next = std::min(next, c->wake_at);
+                }
+            }
+            if (c->state == CAM_CONNECT || c->state == CAM_REQUEST || c->state == CAM_RESPONSE) {
+                if (c->io_deadline <= now) {
+                    cam_fail(c, "timed out");
+                    next = std::min(next, c->wake_at);
+                } else {
+                    next = std::min(next, c->io_deadline);
+                }
+            }
+        }
+        int64_t flush_in = batch_flush(now);
+        while (flush_in == 0) {
+            flush_in = batch_flush(now);
+        }
+        if (flush_in > 0) {
+            next = std::min(next, now + flush_in);
+        }
+        if (now >= last_report + report_s * 1e6) {
+            report((now - last_report) / 1e6);
+            last_report = now;
+            continue;
+        }
+
+        int timeout_ms = (int)std::max<int64_t>(0, (next - now + 999) / 1000);
+        int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+        for (int i = 0; i < n; i++) {
+            uint32_t id = events[i].data.u32;
+            if (id == 0) {
+                batch_results();
+            } else if (id == UINT32_MAX) {
+                dev_accept(listen_fd);
+            } else {
+                auto it = conns.find(id);
+                if (it == conns.end()) {
+                    continue;
+                }
+                gw_conn_t *c = it->second;
+                if (c->kind == CONN_CAMERA) {
+                    cam_event(c, events[i].events);
+                } else {
+                    dev_event(c, events[i].events);
+                }
+            }
+        }
+    }
+    report((now_us() - last_report) / 1e6);
+    // The inference threads are still waiting on batch_ready, skip the
+    // static destructors
+    fflush(stdout);
+    _exit(0);
+}
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Build the camera web server as a Linux process (host_main.cpp) with
+# sanitizers off and optimisation on, so it can be profiled and
+# benchmarked, the model input resize benchmark (sim/resize_bench.cpp), the
+# sampling schedule simulation (sim/sampler_sim.cpp), the
+# on-device classifier benchmark (sim/cnn_bench.cpp), the alert log
+# benchmark (sim/log_bench.cpp), the serial log ring benchmark
+# (sim/log_ring_bench.cpp), the burst capture simulation
+# (sim/burst_sim.cpp), the frame hash benchmark (sim/hash_bench.cpp), the
+# RGB565 JPEG encoder benchmark (sim/jpeg_bench.cpp), the motion analysis
+# benchmark (sim/motion_bench.cpp), the buffer pool soak test
+# (sim/pool_soak.cpp) and the multi-camera gateway daemon (gateway/).
+# Needs g++ and libjpeg. Run from anywhere; extra arguments go to the
+# compiler, e.g. ./build.sh -fsanitize=thread -O1
+set -e
+cd "$(dirname "$0")/.."
+CXXFLAGS="-std=gnu++17 -O2 -g -pthread -Wall -Wno-unused-parameter -Ihost/include -Ihost -ICameraWebServer"
+g++ $CXXFLAGS \
+    CameraWebServer/*.cpp host/*.cpp \
+    -ljpeg -o camera_host "$@"
+g++ $CXXFLAGS \
+    host/sim/resize_bench.cpp host/host_jpeg.cpp CameraWebServer/img_resize.cpp \
+    -ljpeg -o resize_bench "$@"
+g++ $CXXFLAGS \
+    host/sim/sampler_sim.cpp host/host_jpeg.cpp \
+    CameraWebServer/alert.cpp CameraWebServer/motion.cpp CameraWebServer/sampler.cpp \
+    -ljpeg -o sampler_sim "$@"
+g++ $CXXFLAGS \
+    host/sim/cnn_bench.cpp host/host_jpeg.cpp \
+    CameraWebServer/alert.cpp CameraWebServer/cnn.cpp CameraWebServer/img_resize.cpp \
+    -ljpeg -o cnn_bench "$@"
+g++ $CXXFLAGS \
+    host/sim/log_bench.cpp CameraWebServer/alert_log.cpp \
+    -o log_bench "$@"
+g++ $CXXFLAGS \
+    host/sim/log_ring_bench.cpp CameraWebServer/log_ring.cpp \
+    -o log_ring_bench "$@"
+g++ $CXXFLAGS \
+    host/sim/burst_sim.cpp CameraWebServer/burst.cpp CameraWebServer/event_ring.cpp \
+    -o burst_sim "$@"
+g++ $CXXFLAGS \
+    host/sim/hash_bench.cpp host/host_jpeg.cpp \
+    CameraWebServer/frame_hash.cpp CameraWebServer/motion.cpp \
+    -ljpeg -o hash_bench "$@"
+g++ $CXXFLAGS \
+    host/sim/jpeg_bench.cpp host/host_jpeg.cpp \
+    CameraWebServer/jpeg_enc.cpp CameraWebServer/motion.cpp \
+    -ljpeg -o jpeg_bench "$@"
+g++ $CXXFLAGS \
+    host/sim/motion_bench.cpp host/host_jpeg.cpp CameraWebServer/motion.cpp \
+    -ljpeg -o motion_bench "$@"
+g++ $CXXFLAGS \
+    host/sim/pool_soak.cpp CameraWebServer/buf_pool.cpp CameraWebServer/text_out.cpp \
+    -o pool_soak "$@"
+g++ $CXXFLAGS -Igateway \
+    gateway/*.cpp host/host_jpeg.cpp \
+    CameraWebServer/cnn.cpp CameraWebServer/img_resize.cpp \
+    -ljpeg -o gateway_daemon "$@"
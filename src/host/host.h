@@ -0,0 +1,38 @@
+// Host-only hooks for running the firmware as a Linux process: configure
+// the replayed camera and the HTTP ports, and observe the outputs.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_camera.h"
+
+#define HOST_PIN_COUNT 40
+
+typedef struct
+{
+    const char *dataset;   // directory searched recursively for .jpg files
+    int fps;               // frame rate the sensor delivers at
+    int fb_count;          // frame buffers, as camera_config_t::fb_count
+    pixformat_t pixformat; // PIXFORMAT_JPEG, or PIXFORMAT_RGB565 to decode frames up front
+    int sccb_us;           // time one sensor register access takes
+} host_camera_config_t;
+
+// Load the dataset and start serving it through esp_camera_fb_get()
+esp_err_t host_camera_init(const host_camera_config_t *config);
+
+// httpd_start() serves port p on port_base + p - 80, so the firmware's
+// ports 80 and 81 need no privileges
+void host_httpd_set_port_base(uint16_t port_base);
+
+// Simulate a slow link shared by all server sockets: sends drain at kbit_s
+// through a send buffer of the given size and block while it is full, like
+// lwIP on a weak Wi-Fi link. Each socket's own send buffer is also cut to
+// that size. 0 removes the limit.
+void host_httpd_set_link(uint32_t kbit_s, size_t buffer);
+
+// Level last written to a GPIO
+uint8_t host_pin_state(uint8_t pin);
+
+// Decode a JPEG to R,G,B at 1/scale size (1, 2, 4 or 8). Returns a malloc'd
+// buffer, or NULL if the data is not a JPEG.
+uint8_t *host_jpeg_decode(const uint8_t *src, size_t len, int scale, int *width, int *height);
@@ -0,0 +1,435 @@
+// Camera driver replaying a directory of JPEG files.
+//
+// Frames come out at the configured rate from a pool of fb_count buffers,
+// like the driver with CAMERA_GRAB_LATEST: esp_camera_fb_get() waits for
+// the next frame time and for a free buffer, and gives up after 4 s. JPEG
+// frames follow the sensor's framesize and quality: once either differs
+// from the dataset, each frame is scaled and re-encoded to match.
+#include <Arduino.h>
+#include <ftw.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "host.h"
+#include "img_converters.h"
+#include "img_resize.h"
+
+#define CAMERA_FB_TIMEOUT_US 4000000
+#define CAMERA_NATIVE_QUALITY 10 // sensor quality the dataset frames stand for
+
+const resolution_info_t resolution[FRAMESIZE_INVALID] = {
+    {96, 96, 0},     // 96x96
+    {160, 120, 0},   // QQVGA
+    {176, 144, 0},   // QCIF
+    {240, 176, 0},   // HQVGA
+    {240, 240, 0},   // 240x240
+    {320, 240, 0},   // QVGA
+    {400, 296, 0},   // CIF
+    {480, 320, 0},   // HVGA
+    {640, 480, 0},   // VGA
+    {800, 600, 0},   // SVGA
+    {1024, 768, 0},  // XGA
+    {1280, 720, 0},  // HD
+    {1280, 1024, 0}, // SXGA
+    {1600, 1200, 0}, // UXGA
+};
+
+typedef struct
+{
+    std::vector<uint8_t> data;
+    int width;
+    int height;
+} host_frame_t;
+
+typedef struct
+{
+    camera_fb_t fb;
+    size_t cap;
+    bool held;
+} host_fb_t;
+
+static host_camera_config_t cam_config;
+static std::vector<host_frame_t> frames;
+static std::vector<host_fb_t> fbs;
+static size_t next_frame = 0;
+static int64_t next_frame_time = 0;
+static pthread_mutex_t cam_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cam_fb_free = PTHREAD_COND_INITIALIZER;
+
+static sensor_t sensor;
+static std::map<int, int> sensor_regs;
+static pthread_mutex_t sensor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static std::vector<std::string> dataset_files;
+
+static int collect_jpeg(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    size_t len = strlen(path);
+    if (type == FTW_F && len > 4 && !strcasecmp(path + len - 4, ".jpg")) {
+        dataset_files.push_back(path);
+    }
+    return 0;
+}
+
+static bool load_frame(const std::string &path, host_frame_t *frame)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    std::vector<uint8_t> jpg;
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        jpg.insert(jpg.end(), buf, buf + n);
+    }
+    fclose(f);
+
+    int w, h;
+    uint8_t *rgb = host_jpeg_decode(jpg.data(), jpg.size(), 1, &w, &h);
+    if (!rgb) {
+        return false;
+    }
+    frame->width = w;
+    frame->height = h;
+    if (cam_config.pixformat == PIXFORMAT_RGB565) {
+        // Big-endian RGB565, as the sensor sends it
+        frame->data.resize((size_t)w * h * 2);
+        for (size_t i = 0; i < (size_t)w * h; i++) {
+            const uint8_t *p = rgb + i * 3;
+            uint16_t px = ((p[0] & 0xF8) << 8) | ((p[1] & 0xFC) << 3) | (p[2] >> 3);
+            frame->data[i * 2] = px >> 8;
+            frame->data[i * 2 + 1] = px & 0xFF;
+        }
+    } else {
+        frame->data = jpg;
+    }
+    free(rgb);
+    return true;
+}
+
+static void sccb_delay(void)
+{
+    if (cam_config.sccb_us) {
+        usleep(cam_config.sccb_us);
+    }
+}
+
+// Status setters only record the value, apart from the SCCB write time
+#define SENSOR_SETTER(field)                          \
+    static int set_##field(sensor_t *s, int value)    \
+    {                                                 \
+        sccb_delay();                                 \
+        s->status.field = value;                      \
+        return 0;                                     \
+    }
+
+SENSOR_SETTER(quality)
+SENSOR_SETTER(contrast)
+SENSOR_SETTER(brightness)
+SENSOR_SETTER(saturation)
+SENSOR_SETTER(sharpness)
+SENSOR_SETTER(denoise)
+SENSOR_SETTER(colorbar)
+SENSOR_SETTER(hmirror)
+SENSOR_SETTER(vflip)
+SENSOR_SETTER(aec2)
+SENSOR_SETTER(awb_gain)
+SENSOR_SETTER(agc_gain)
+SENSOR_SETTER(aec_value)
+SENSOR_SETTER(special_effect)
+SENSOR_SETTER(wb_mode)
+SENSOR_SETTER(ae_level)
+SENSOR_SETTER(dcw)
+SENSOR_SETTER(bpc)
+SENSOR_SETTER(wpc)
+SENSOR_SETTER(raw_gma)
+SENSOR_SETTER(lenc)
+
+static int set_whitebal(sensor_t *s, int enable)
+{
+    sccb_delay();
+    s->status.awb = enable;
+    return 0;
+}
+
+static int set_gain_ctrl(sensor_t *s, int enable)
+{
+    sccb_delay();
+    s->status.agc = enable;
+    return 0;
+}
+
+static int set_exposure_ctrl(sensor_t *s, int enable)
+{
+    sccb_delay();
+    s->status.aec = enable;
+    return 0;
+}
+
+static int set_gainceiling(sensor_t *s, gainceiling_t gainceiling)
+{
+    sccb_delay();
+    s->status.gainceiling = gainceiling;
+    return 0;
+}
+
+// JPEG frames are scaled to the new size from the next frame on
+static int set_framesize(sensor_t *s, framesize_t framesize)
+{
+    if (framesize >= FRAMESIZE_INVALID) {
+        return -1;
+    }
+    sccb_delay();
+    s->status.framesize = framesize;
+    return 0;
+}
+
+static int set_pixformat(sensor_t *s, pixformat_t pixformat)
+{
+    return pixformat == s->pixformat ? 0 : -1;
+}
+
+static int get_reg(sensor_t *s, int reg, int mask)
+{
+    sccb_delay();
+    pthread_mutex_lock(&sensor_lock);
+    std::map<int, int>::iterator it = sensor_regs.find(reg);
+    int value = it == sensor_regs.end() ? 0 : it->second;
+    pthread_mutex_unlock(&sensor_lock);
+    return value & mask;
+}
+
+static int set_reg(sensor_t *s, int reg, int mask, int value)
+{
+    sccb_delay();
+    pthread_mutex_lock(&sensor_lock);
+    int old = sensor_regs[reg];
+    sensor_regs[reg] = (old & ~mask) | (value & mask);
+    pthread_mutex_unlock(&sensor_lock);
+    return 0;
+}
+
+static int set_xclk(sensor_t *s, int timer, int xclk)
+{
+    s->xclk_freq_hz = xclk * 1000000;
+    return 0;
+}
+
+static void sensor_init(void)
+{
+    sensor.id.PID = OV2640_PID;
+    sensor.pixformat = cam_config.pixformat;
+    sensor.xclk_freq_hz = 20000000;
+    sensor.status.framesize = FRAMESIZE_QVGA;
+    sensor.status.quality = 10;
+    sensor.status.awb = 1;
+    sensor.status.awb_gain = 1;
+    sensor.status.aec = 1;
+    sensor.status.agc = 1;
+    sensor.status.bpc = 0;
+    sensor.status.wpc = 1;
+    sensor.status.raw_gma = 1;
+    sensor.status.lenc = 1;
+    sensor.status.dcw = 1;
+    sensor.status.aec_value = 300;
+
+    sensor.set_pixformat = set_pixformat;
+    sensor.set_framesize = set_framesize;
+    sensor.set_contrast = set_contrast;
+    sensor.set_brightness = set_brightness;
+    sensor.set_saturation = set_saturation;
+    sensor.set_sharpness = set_sharpness;
+    sensor.set_denoise = set_denoise;
+    sensor.set_gainceiling = set_gainceiling;
+    sensor.set_quality = set_quality;
+    sensor.set_colorbar = set_colorbar;
+    sensor.set_whitebal = set_whitebal;
+    sensor.set_gain_ctrl = set_gain_ctrl;
+    sensor.set_exposure_ctrl = set_exposure_ctrl;
+    sensor.set_hmirror = set_hmirror;
+    sensor.set_vflip = set_vflip;
+    sensor.set_aec2 = set_aec2;
+    sensor.set_awb_gain = set_awb_gain;
+    sensor.set_agc_gain = set_agc_gain;
+    sensor.set_aec_value = set_aec_value;
+    sensor.set_special_effect = set_special_effect;
+    sensor.set_wb_mode = set_wb_mode;
+    sensor.set_ae_level = set_ae_level;
+    sensor.set_dcw = set_dcw;
+    sensor.set_bpc = set_bpc;
+    sensor.set_wpc = set_wpc;
+    sensor.set_raw_gma = set_raw_gma;
+    sensor.set_lenc = set_lenc;
+    sensor.get_reg = get_reg;
+    sensor.set_reg = set_reg;
+    sensor.set_xclk = set_xclk;
+}
+
+esp_err_t host_camera_init(const host_camera_config_t *config)
+{
+    cam_config = *config;
+    if (cam_config.fps <= 0 || cam_config.fb_count <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    dataset_files.clear();
+    if (nftw(cam_config.dataset, collect_jpeg, 16, FTW_PHYS) != 0) {
+        log_e("Cannot read dataset %s", cam_config.dataset);
+        return ESP_ERR_NOT_FOUND;
+    }
+    std::sort(dataset_files.begin(), dataset_files.end());
+
+    size_t max_len = 0;
+    for (size_t i = 0; i < dataset_files.size(); i++) {
+        host_frame_t frame;
+        if (!load_frame(dataset_files[i], &frame)) {
+            log_e("Skipping %s, not a JPEG", dataset_files[i].c_str());
+            continue;
+        }
+        max_len = std::max(max_len, frame.data.size());
+        frames.push_back(frame);
+    }
+    if (frames.empty()) {
+        log_e("No frames in %s", cam_config.dataset);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    fbs.resize(cam_config.fb_count);
+    for (size_t i = 0; i < fbs.size(); i++) {
+        fbs[i].cap = max_len;
+        fbs[i].fb.buf = (uint8_t *)malloc(max_len);
+        fbs[i].held = false;
+        if (!fbs[i].fb.buf) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    sensor_init();
+    return ESP_OK;
+}
+
+// libjpeg quality for a sensor quality value, 0..63 with lower better
+static uint8_t sensor_jpeg_quality(int quality)
+{
+    int q = 100 - quality * 3 / 2;
+    return q < 5 ? 5 : q > 95 ? 95 : q;
+}
+
+// Re-encode a dataset frame at the sensor's framesize and quality
+static bool frame_reencode(const host_frame_t &frame, host_fb_t *slot)
+{
+    framesize_t framesize = (framesize_t)sensor.status.framesize;
+    int quality = sensor.status.quality;
+    int w = resolution[framesize].width;
+    int h = resolution[framesize].height;
+    if (w == frame.width && h == frame.height && quality == CAMERA_NATIVE_QUALITY) {
+        return false;
+    }
+
+    int src_w, src_h;
+    uint8_t *rgb = host_jpeg_decode(frame.data.data(), frame.data.size(), 1, &src_w, &src_h);
+    if (!rgb) {
+        return false;
+    }
+    std::vector<uint8_t> scaled((size_t)w * h * 3);
+    img_resize_rgb888(rgb, src_w, src_h, img_crop_full(src_w, src_h), scaled.data(), w, h, true);
+    free(rgb);
+    uint8_t *jpg = NULL;
+    size_t len = 0;
+    if (!fmt2jpg(scaled.data(), scaled.size(), w, h, PIXFORMAT_RGB888, sensor_jpeg_quality(quality), &jpg, &len)) {
+        return false;
+    }
+    if (len > slot->cap) {
+        uint8_t *buf = (uint8_t *)realloc(slot->fb.buf, len);
+        if (!buf) {
+            free(jpg);
+            return false;
+        }
+        slot->fb.buf = buf;
+        slot->cap = len;
+    }
+    memcpy(slot->fb.buf, jpg, len);
+    free(jpg);
+    slot->fb.len = len;
+    slot->fb.width = w;
+    slot->fb.height = h;
+    return true;
+}
+
+camera_fb_t *esp_camera_fb_get(void)
+{
+    int64_t now = esp_timer_get_time();
+    if (next_frame_time > now) {
+        usleep(next_frame_time - now);
+    }
+
+    pthread_mutex_lock(&cam_lock);
+    int64_t deadline = esp_timer_get_time() + CAMERA_FB_TIMEOUT_US;
+    host_fb_t *slot = NULL;
+    while (!slot) {
+        for (size_t i = 0; i < fbs.size(); i++) {
+            if (!fbs[i].held) {
+                slot = &fbs[i];
+                break;
+            }
+        }
+        if (slot) {
+            break;
+        }
+        int64_t left = deadline - esp_timer_get_time();
+        if (left <= 0) {
+            pthread_mutex_unlock(&cam_lock);
+            return NULL;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += left / 1000000;
+        ts.tv_nsec += (left % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&cam_fb_free, &cam_lock, &ts);
+    }
+    slot->held = true;
+    pthread_mutex_unlock(&cam_lock);
+
+    const host_frame_t &frame = frames[next_frame];
+    next_frame = (next_frame + 1) % frames.size();
+    if (cam_config.pixformat != PIXFORMAT_JPEG || !frame_reencode(frame, slot)) {
+        memcpy(slot->fb.buf, frame.data.data(), frame.data.size());
+        slot->fb.len = frame.data.size();
+        slot->fb.width = frame.width;
+        slot->fb.height = frame.height;
+    }
+    slot->fb.format = cam_config.pixformat;
+
+    // The driver stamps frames from the esp_timer clock
+    now = esp_timer_get_time();
+    slot->fb.timestamp.tv_sec = now / 1000000;
+    slot->fb.timestamp.tv_usec = now % 1000000;
+    int64_t period = 1000000 / cam_config.fps;
+    next_frame_time = std::max(next_frame_time + period, now);
+    return &slot->fb;
+}
+
+void esp_camera_fb_return(camera_fb_t *fb)
+{
+    pthread_mutex_lock(&cam_lock);
+    for (size_t i = 0; i < fbs.size(); i++) {
+        if (&fbs[i].fb == fb) {
+            fbs[i].held = false;
+            break;
+        }
+    }
+    pthread_cond_signal(&cam_fb_free);
+    pthread_mutex_unlock(&cam_lock);
+}
+
+sensor_t *esp_camera_sensor_get(void)
+{
+    return &sensor;
+}
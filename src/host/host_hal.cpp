@@ -0,0 +1,548 @@
+// Arduino core, heap, esp_timer and FreeRTOS primitives on POSIX threads.
+//
+// Scheduling is left to the host kernel: priorities, cores and stack sizes
+// are accepted and ignored. Blocking calls use the same millisecond ticks
+// as the firmware (portTICK_PERIOD_MS is 1).
+#include <Arduino.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+
+// Clock
+
+static int64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Counted from process start, as the device counts from boot
+static const int64_t boot_time = monotonic_us();
+
+int64_t esp_timer_get_time(void)
+{
+    return monotonic_us() - boot_time;
+}
+
+// Absolute CLOCK_MONOTONIC deadline ticks from now, for pthread_cond_timedwait
+static struct timespec deadline_after(TickType_t ticks)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ticks / 1000;
+    ts.tv_nsec += (long)(ticks % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+static void cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Wait on cond, forever for portMAX_DELAY. Returns false on timeout.
+static bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *deadline)
+{
+    if (!deadline) {
+        pthread_cond_wait(cond, mutex);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, mutex, deadline) != ETIMEDOUT;
+}
+
+// Arduino core
+
+static uint8_t pin_state[HOST_PIN_COUNT];
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+    if (pin < HOST_PIN_COUNT) {
+        __atomic_store_n(&pin_state[pin], val, __ATOMIC_RELAXED);
+    }
+}
+
+int digitalRead(uint8_t pin)
+{
+    return pin < HOST_PIN_COUNT ? __atomic_load_n(&pin_state[pin], __ATOMIC_RELAXED) : LOW;
+}
+
+void delay(uint32_t ms)
+{
+    usleep((useconds_t)ms * 1000);
+}
+
+unsigned long millis(void)
+{
+    return (unsigned long)(esp_timer_get_time() / 1000);
+}
+
+unsigned long micros(void)
+{
+    return (unsigned long)esp_timer_get_time();
+}
+
+uint32_t esp_random(void)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static uint64_t state = 0;
+    pthread_mutex_lock(&lock);
+    if (!state) {
+        state = ((uint64_t)esp_timer_get_time() ^ ((uint64_t)getpid() << 32)) | 1;
+    }
+    // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    uint32_t r = (uint32_t)((state * 0x2545F4914F6CDD1DULL) >> 32);
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+bool psramFound(void)
+{
+    return true;
+}
+
+void *ps_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+HardwareSerial Serial;
+
+void HardwareSerial::begin(unsigned long baud)
+{
+}
+
+void HardwareSerial::setDebugOutput(bool enable)
+{
+}
+
+size_t HardwareSerial::print(const char *s)
+{
+    return fputs(s, stdout) < 0 ? 0 : strlen(s);
+}
+
+size_t HardwareSerial::print(int n)
+{
+    return printf("%d", n);
+}
+
+size_t HardwareSerial::print(unsigned int n)
+{
+    return printf("%u", n);
+}
+
+size_t HardwareSerial::println(void)
+{
+    return print("\n");
+}
+
+size_t HardwareSerial::println(const char *s)
+{
+    return print(s) + println();
+}
+
+size_t HardwareSerial::println(int n)
+{
+    return print(n) + println();
+}
+
+size_t HardwareSerial::println(unsigned int n)
+{
+    return print(n) + println();
+}
+
+size_t HardwareSerial::printf(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    int n = vprintf(format, ap);
+    va_end(ap);
+    return n < 0 ? 0 : n;
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t len)
+{
+    return fwrite(buf, 1, len, stdout);
+}
+
+uint8_t host_pin_state(uint8_t pin)
+{
+    return (uint8_t)digitalRead(pin);
+}
+
+// Heap: every capability is the host heap
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    return malloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+    return calloc(n, size);
+}
+
+void heap_caps_free(void *ptr)
+{
+    free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.fordblks;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    return heap_caps_get_free_size(caps);
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+    return heap_caps_get_free_size(caps);
+}
+
+// esp_timer: one thread per timer
+
+struct esp_timer
+{
+    esp_timer_create_args_t args;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    bool periodic;
+    bool quit;
+    uint64_t period;
+    int64_t next;
+};
+
+static void *esp_timer_thread(void *arg)
+{
+    esp_timer_handle_t t = (esp_timer_handle_t)arg;
+    pthread_mutex_lock(&t->lock);
+    while (!t->quit) {
+        if (!t->running) {
+            pthread_cond_wait(&t->wake, &t->lock);
+            continue;
+        }
+        int64_t now = esp_timer_get_time();
+        if (now < t->next) {
+            int64_t wait_us = t->next - now;
+            struct timespec deadline = deadline_after(0);
+            deadline.tv_sec += wait_us / 1000000;
+            deadline.tv_nsec += (wait_us % 1000000) * 1000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            cond_wait(&t->wake, &t->lock, &deadline);
+            continue;
+        }
+        if (t->periodic) {
+            t->next += t->period;
+            if (t->args.skip_unhandled_events && t->next < now) {
+                t->next = now + t->period;
+            }
+        } else {
+            t->running = false;
+        }
+        pthread_mutex_unlock(&t->lock);
+        t->args.callback(t->args.arg);
+        pthread_mutex_lock(&t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    esp_timer_handle_t t = (esp_timer_handle_t)calloc(1, sizeof(struct esp_timer));
+    if (!t) {
+        return ESP_ERR_NO_MEM;
+    }
+    t->args = *create_args;
+    pthread_mutex_init(&t->lock, NULL);
+    cond_init(&t->wake);
+    if (pthread_create(&t->thread, NULL, esp_timer_thread, t)) {
+        free(t);
+        return ESP_FAIL;
+    }
+    *out_handle = t;
+    return ESP_OK;
+}
+
+static esp_err_t esp_timer_arm(esp_timer_handle_t t, uint64_t us, bool periodic)
+{
+    pthread_mutex_lock(&t->lock);
+    if (t->running) {
+        pthread_mutex_unlock(&t->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    t->running = true;
+    t->periodic = periodic;
+    t->period = us;
+    t->next = esp_timer_get_time() + us;
+    pthread_cond_signal(&t->wake);
+    pthread_mutex_unlock(&t->lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    return esp_timer_arm(timer, period, true);
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return esp_timer_arm(timer, timeout_us, false);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&timer->lock);
+    bool was_running = timer->running;
+    timer->running = false;
+    pthread_cond_signal(&timer->wake);
+    pthread_mutex_unlock(&timer->lock);
+    return was_running ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&timer->lock);
+    timer->quit = true;
+    pthread_cond_signal(&timer->wake);
+    pthread_mutex_unlock(&timer->lock);
+    pthread_join(timer->thread, NULL);
+    free(timer);
+    return ESP_OK;
+}
+
+// FreeRTOS tasks
+
+struct host_task
+{
+    TaskFunction_t fn;
+    void *arg;
+    pthread_t thread;
+};
+
+static void *task_thread(void *arg)
+{
+    struct host_task *t = (struct host_task *)arg;
+    t->fn(t->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *created_task, BaseType_t core_id)
+{
+    struct host_task *t = (struct host_task *)calloc(1, sizeof(*t));
+    if (!t) {
+        return pdFAIL;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    if (pthread_create(&t->thread, NULL, task_thread, t)) {
+        free(t);
+        return pdFAIL;
+    }
+    pthread_detach(t->thread);
+    pthread_setname_np(t->thread, name);
+    if (created_task) {
+        *created_task = t;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *created_task)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack_depth, arg, priority, created_task, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    // Only self-deletion is supported, as the firmware uses it
+    if (!task) {
+        pthread_exit(NULL);
+    }
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    delay(ticks);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)millis();
+}
+
+// FreeRTOS semaphores. Mutexes are binary semaphores without priority
+// inheritance, which the host scheduler has no use for.
+
+struct host_sem
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    struct host_sem *s = (struct host_sem *)calloc(1, sizeof(*s));
+    if (!s) {
+        return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    cond_init(&s->cond);
+    s->count = initial_count;
+    s->max = max_count;
+    return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    struct timespec deadline = deadline_after(ticks);
+    pthread_mutex_lock(&sem->lock);
+    while (!sem->count) {
+        if (!ticks || !cond_wait(&sem->cond, &sem->lock, ticks == portMAX_DELAY ? NULL : &deadline)) {
+            if (!sem->count) {
+                pthread_mutex_unlock(&sem->lock);
+                return pdFALSE;
+            }
+        }
+    }
+    sem->count--;
+    pthread_mutex_unlock(&sem->lock);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    if (sem->count == sem->max) {
+        pthread_mutex_unlock(&sem->lock);
+        return pdFALSE;
+    }
+    sem->count++;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->lock);
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    pthread_mutex_destroy(&sem->lock);
+    pthread_cond_destroy(&sem->cond);
+    free(sem);
+}
+
+// FreeRTOS event groups. Like the kernel, setting bits releases every task
+// already waiting for them, even if the bits are cleared again straight
+// away: each set is recorded with a generation number the waiters check.
+
+struct host_event_group
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    EventBits_t bits;
+    uint32_t generation;
+    EventBits_t set_bits; // bits as of the newest set
+};
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    struct host_event_group *g = (struct host_event_group *)calloc(1, sizeof(*g));
+    if (!g) {
+        return NULL;
+    }
+    pthread_mutex_init(&g->lock, NULL);
+    cond_init(&g->cond);
+    return g;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&group->lock);
+    group->bits |= bits;
+    group->set_bits = group->bits;
+    group->generation++;
+    EventBits_t now = group->bits;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->lock);
+    return now;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&group->lock);
+    EventBits_t before = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->lock);
+    return before;
+}
+
+static bool bits_match(EventBits_t have, EventBits_t want, BaseType_t wait_for_all)
+{
+    return wait_for_all ? (have & want) == want : (have & want) != 0;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks)
+{
+    struct timespec deadline = deadline_after(ticks);
+    pthread_mutex_lock(&group->lock);
+    uint32_t generation = group->generation;
+    EventBits_t result = group->bits;
+    bool matched = bits_match(result, bits, wait_for_all);
+    while (!matched && ticks) {
+        bool woken = cond_wait(&group->cond, &group->lock, ticks == portMAX_DELAY ? NULL : &deadline);
+        if (group->generation != generation) {
+            generation = group->generation;
+            result = group->set_bits;
+            matched = bits_match(result, bits, wait_for_all);
+        }
+        if (!woken) {
+            break;
+        }
+    }
+    if (!matched) {
+        result = group->bits;
+    } else if (clear_on_exit) {
+        group->bits &= ~bits;
+    }
+    pthread_mutex_unlock(&group->lock);
+    return result;
+}
@@ -0,0 +1,1147 @@
+// esp_http_server on POSIX sockets.
+//
+// Keeps the properties of the ESP-IDF server that matter for performance
+// work: each server is a single thread that select()s over its sockets and
+// runs one handler at a time, connections are kept alive, at most
+// max_open_sockets are open, and chunked responses go out as they are
+// produced. URIs match exactly, up to the query string. URIs registered
+// with is_websocket get the WebSocket handshake, then their handler is
+// called once per frame received like on the IDF server, which answers
+// pings and closes itself unless handle_ws_control_frames is set.
+#include <Arduino.h>
+#include <ctype.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include "esp_http_server.h"
+#include "lwip/sockets.h"
+#include "host.h"
+
+#define HTTPD_HDR_MAX      8192 // request line and headers
+#define HTTPD_LINK_MSS     1460 // throttled sends go out in segments of this size
+#define HTTPD_WS_GUID      "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+typedef struct host_sess
+{
+    int fd;
+    std::string in; // received bytes not consumed yet
+    void *ctx;
+    httpd_free_ctx_fn_t free_ctx;
+    int64_t last_used;
+    bool close;
+    bool ws;           // handshake done, the session speaks WebSocket
+    httpd_uri_t ws_uri; // handler of the WebSocket URI
+} host_sess_t;
+
+typedef struct host_httpd
+{
+    httpd_config_t config;
+    std::vector<httpd_uri_t> handlers;
+    std::vector<host_sess_t *> sessions;
+    std::deque<std::pair<httpd_work_fn_t, void *> > work;
+    pthread_mutex_t lock; // sessions list and work queue
+    pthread_t thread;
+    int listen_fd;
+    int wake[2];
+    bool running;
+} host_httpd_t;
+
+typedef struct
+{
+    host_httpd_t *server;
+    host_sess_t *sess;
+    std::string query;
+    std::vector<std::pair<std::string, std::string> > req_hdrs;
+    size_t body_left;
+    std::string status;
+    std::string type;
+    std::vector<std::pair<std::string, std::string> > resp_hdrs;
+    bool headers_sent;
+    bool done;
+    // WebSocket frame being handed over, its payload is body_left
+    int ws_type;
+    bool ws_final;
+    size_t ws_len;
+    uint8_t ws_mask[4];
+} host_req_t;
+
+static uint16_t port_base = 80;
+
+void host_httpd_set_port_base(uint16_t base)
+{
+    port_base = base;
+}
+
+// Simulated link shared by all sockets, see host_httpd_set_link()
+static uint32_t link_bps = 0;
+static int64_t link_buffer_us = 0;
+static int64_t link_free_at = 0; // when the link has sent everything queued so far
+static int link_sndbuf = 0;      // SO_SNDBUF of new sockets, 0 for the system default
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void host_httpd_set_link(uint32_t kbit_s, size_t buffer)
+{
+    pthread_mutex_lock(&link_lock);
+    link_bps = kbit_s * 1000;
+    link_buffer_us = link_bps ? (int64_t)buffer * 8000000 / link_bps : 0;
+    link_sndbuf = link_bps ? buffer : 0;
+    pthread_mutex_unlock(&link_lock);
+}
+
+// Queue len bytes on the simulated link, blocking while its buffer is full
+static void link_pace(size_t len)
+{
+    pthread_mutex_lock(&link_lock);
+    if (!link_bps) {
+        pthread_mutex_unlock(&link_lock);
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    link_free_at = std::max(link_free_at, now) + (int64_t)len * 8000000 / link_bps;
+    int64_t wait = link_free_at - link_buffer_us - now;
+    pthread_mutex_unlock(&link_lock);
+    if (wait > 0) {
+        usleep(wait);
+    }
+}
+
+static host_req_t *req_aux(httpd_req_t *r)
+{
+    return (host_req_t *)r->aux;
+}
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+    while (len) {
+        size_t seg = len;
+        if (link_bps) {
+            seg = std::min(seg, (size_t)HTTPD_LINK_MSS);
+            link_pace(seg);
+        }
+        ssize_t n = send(fd, data, seg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Sessions
+
+static void sess_close(host_httpd_t *hd, host_sess_t *sess)
+{
+    if (hd->config.close_fn) {
+        hd->config.close_fn(hd, sess->fd);
+    } else {
+        close(sess->fd);
+    }
+    if (sess->ctx) {
+        if (sess->free_ctx) {
+            sess->free_ctx(sess->ctx);
+        } else {
+            free(sess->ctx);
+        }
+    }
+    pthread_mutex_lock(&hd->lock);
+    for (size_t i = 0; i < hd->sessions.size(); i++) {
+        if (hd->sessions[i] == sess) {
+            hd->sessions.erase(hd->sessions.begin() + i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hd->lock);
+    delete sess;
+}
+
+static host_sess_t *sess_find(host_httpd_t *hd, int fd)
+{
+    host_sess_t *found = NULL;
+    pthread_mutex_lock(&hd->lock);
+    for (size_t i = 0; i < hd->sessions.size(); i++) {
+        if (hd->sessions[i]->fd == fd) {
+            found = hd->sessions[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hd->lock);
+    return found;
+}
+
+static void sess_accept(host_httpd_t *hd)
+{
+    int fd = accept(hd->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+
+    if (hd->sessions.size() >= hd->config.max_open_sockets) {
+        if (!hd->config.lru_purge_enable) {
+            log_w("No free sessions, closing new connection");
+            close(fd);
+            return;
+        }
+        host_sess_t *lru = hd->sessions[0];
+        for (size_t i = 1; i < hd->sessions.size(); i++) {
+            if (hd->sessions[i]->last_used < lru->last_used) {
+                lru = hd->sessions[i];
+            }
+        }
+        sess_close(hd, lru);
+    }
+
+    struct timeval tv = {hd->config.recv_wait_timeout, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    tv.tv_sec = hd->config.send_wait_timeout;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // A reader slower than the link then blocks its own socket, as it would
+    // fill lwIP's per-connection send buffer, instead of queueing megabytes
+    // in the kernel
+    if (link_sndbuf) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &link_sndbuf, sizeof(link_sndbuf));
+    }
+
+    if (hd->config.open_fn && hd->config.open_fn(hd, fd) != ESP_OK) {
+        close(fd);
+        return;
+    }
+
+    host_sess_t *sess = new host_sess_t();
+    sess->fd = fd;
+    sess->ctx = NULL;
+    sess->free_ctx = NULL;
+    sess->last_used = esp_timer_get_time();
+    sess->close = false;
+    sess->ws = false;
+    pthread_mutex_lock(&hd->lock);
+    hd->sessions.push_back(sess);
+    pthread_mutex_unlock(&hd->lock);
+}
+
+// Requests
+
+static bool read_headers(host_sess_t *sess, size_t *end)
+{
+    while (true) {
+        size_t pos = sess->in.find("\r\n\r\n");
+        if (pos != std::string::npos) {
+            *end = pos + 4;
+            return true;
+        }
+        if (sess->in.size() > HTTPD_HDR_MAX) {
+            return false;
+        }
+        char buf[1024];
+        ssize_t n = recv(sess->fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sess->in.append(buf, n);
+    }
+}
+
+static int parse_method(const std::string &m)
+{
+    if (m == "GET") {
+        return HTTP_GET;
+    } else if (m == "POST") {
+        return HTTP_POST;
+    } else if (m == "PUT") {
+        return HTTP_PUT;
+    } else if (m == "DELETE") {
+        return HTTP_DELETE;
+    } else if (m == "HEAD") {
+        return HTTP_HEAD;
+    }
+    return -1;
+}
+
+static void send_error(host_sess_t *sess, const char *status, const char *msg)
+{
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n\r\n%s",
+                     status, strlen(msg), msg);
+    send_all(sess->fd, buf, n);
+}
+
+static const httpd_uri_t *find_handler(host_httpd_t *hd, const char *path, size_t path_len, int method,
+                                       bool *uri_matched)
+{
+    *uri_matched = false;
+    for (size_t i = 0; i < hd->handlers.size(); i++) {
+        const httpd_uri_t *h = &hd->handlers[i];
+        bool match = hd->config.uri_match_fn ? hd->config.uri_match_fn(h->uri, path, path_len)
+                                             : strlen(h->uri) == path_len && !strncmp(h->uri, path, path_len);
+        if (match) {
+            *uri_matched = true;
+            if ((int)h->method == method) {
+                return h;
+            }
+        }
+    }
+    return NULL;
+}
+
+static const std::string *aux_hdr(const host_req_t *aux, const char *field)
+{
+    for (size_t i = 0; i < aux->req_hdrs.size(); i++) {
+        if (!strcasecmp(aux->req_hdrs[i].first.c_str(), field)) {
+            return &aux->req_hdrs[i].second;
+        }
+    }
+    return NULL;
+}
+
+// Read exactly len bytes, buffered ones first
+static bool sess_read(host_sess_t *sess, uint8_t *buf, size_t len)
+{
+    size_t n = std::min(len, sess->in.size());
+    memcpy(buf, sess->in.data(), n);
+    sess->in.erase(0, n);
+    while (n < len) {
+        ssize_t got = recv(sess->fd, buf + n, len - n, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        n += got;
+    }
+    return true;
+}
+
+// WebSocket
+
+static uint32_t rol32(uint32_t x, int n)
+{
+    return x << n | x >> (32 - n);
+}
+
+// SHA-1, which the handshake needs and nothing else
+static void sha1(const uint8_t *data, size_t len, uint8_t out[20])
+{
+    std::vector<uint8_t> msg(data, data + len);
+    msg.push_back(0x80);
+    while (msg.size() % 64 != 56) {
+        msg.push_back(0);
+    }
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 7; i >= 0; i--) {
+        msg.push_back(bits >> (i * 8));
+    }
+
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    for (size_t off = 0; off < msg.size(); off += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            const uint8_t *p = &msg[off + i * 4];
+            w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = rol32(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol32(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 20; i++) {
+        out[i] = h[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+static std::string base64(const uint8_t *data, size_t len)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0) | (i + 2 < len ? data[i + 2] : 0);
+        out += digits[v >> 18 & 63];
+        out += digits[v >> 12 & 63];
+        out += i + 1 < len ? digits[v >> 6 & 63] : '=';
+        out += i + 2 < len ? digits[v & 63] : '=';
+    }
+    return out;
+}
+
+// Answer the upgrade and hand the session to the WebSocket URI. The handler
+// still runs for the handshake request, as on the IDF server.
+static bool ws_handshake(host_sess_t *sess, const httpd_uri_t *handler, const host_req_t *aux)
+{
+    const std::string *key = aux_hdr(aux, "Sec-WebSocket-Key");
+    if (!key) {
+        send_error(sess, "400 Bad Request", "No Sec-WebSocket-Key");
+        return false;
+    }
+    std::string accept = *key + HTTPD_WS_GUID;
+    uint8_t digest[20];
+    sha1((const uint8_t *)accept.data(), accept.size(), digest);
+    std::string head = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: " + base64(digest, sizeof(digest)) + "\r\n";
+    if (handler->supported_subprotocol) {
+        head += std::string("Sec-WebSocket-Protocol: ") + handler->supported_subprotocol + "\r\n";
+    }
+    head += "\r\n";
+    if (!send_all(sess->fd, head.data(), head.size())) {
+        return false;
+    }
+    sess->ws = true;
+    sess->ws_uri = *handler;
+    return true;
+}
+
+// Frames from the server go out unmasked
+static bool ws_send(int fd, const httpd_ws_frame_t *frame)
+{
+    uint8_t head[10];
+    size_t n = 0;
+    head[n++] = (!frame->fragmented || frame->final ? 0x80 : 0) | (frame->type & 0x0f);
+    if (frame->len < 126) {
+        head[n++] = frame->len;
+    } else if (frame->len <= UINT16_MAX) {
+        head[n++] = 126;
+        head[n++] = frame->len >> 8;
+        head[n++] = frame->len;
+    } else {
+        head[n++] = 127;
+        for (int i = 7; i >= 0; i--) {
+            head[n++] = (uint64_t)frame->len >> (i * 8);
+        }
+    }
+    return send_all(fd, (const char *)head, n) && send_all(fd, (const char *)frame->payload, frame->len);
+}
+
+// Run handler on a request or WebSocket frame described by aux. Returns
+// false when the session must be closed.
+static bool call_handler(host_httpd_t *hd, host_sess_t *sess, const httpd_uri_t *handler, int method,
+                         const std::string &uri, host_req_t *aux)
+{
+    // httpd_req_t has a const member, so it can only be built in raw memory
+    httpd_req_t *r = (httpd_req_t *)calloc(1, sizeof(httpd_req_t));
+    if (!r) {
+        return false;
+    }
+    httpd_req_t &req = *r;
+    req.handle = hd;
+    req.method = method;
+    snprintf((char *)req.uri, sizeof(req.uri), "%s", uri.c_str());
+    req.content_len = aux->body_left;
+    req.aux = aux;
+    req.user_ctx = handler->user_ctx;
+    req.sess_ctx = sess->ctx;
+    req.free_ctx = sess->free_ctx;
+
+    esp_err_t res = handler->handler(&req);
+
+    if (!req.ignore_sess_ctx_changes && req.sess_ctx != sess->ctx) {
+        if (sess->ctx) {
+            if (sess->free_ctx) {
+                sess->free_ctx(sess->ctx);
+            } else {
+                free(sess->ctx);
+            }
+        }
+        sess->ctx = req.sess_ctx;
+    }
+    sess->free_ctx = req.free_ctx;
+    sess->last_used = esp_timer_get_time();
+
+    // Like the IDF server, a failed handler closes the connection
+    bool keep = res == ESP_OK && !sess->close;
+    // Discard whatever of the body the handler did not read
+    while (keep && aux->body_left) {
+        char buf[512];
+        keep = httpd_req_recv(r, buf, sizeof(buf)) > 0;
+    }
+    free(r);
+    return keep;
+}
+
+// Serve one request on sess. Returns false when the session must be closed.
+static bool sess_serve(host_httpd_t *hd, host_sess_t *sess)
+{
+    size_t hdr_end;
+    if (!read_headers(sess, &hdr_end)) {
+        return false;
+    }
+    std::string head = sess->in.substr(0, hdr_end);
+    sess->in.erase(0, hdr_end);
+    sess->last_used = esp_timer_get_time();
+
+    size_t line_end = head.find("\r\n");
+    std::string line = head.substr(0, line_end);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos) {
+        send_error(sess, "400 Bad Request", "Bad Request");
+        return false;
+    }
+    std::string uri = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    if (uri.size() > HTTPD_MAX_URI_LEN) {
+        send_error(sess, "414 URI Too Long", "URI is too long");
+        return false;
+    }
+
+    host_req_t aux;
+    aux.server = hd;
+    aux.sess = sess;
+    aux.body_left = 0;
+    aux.status = "200 OK";
+    aux.type = "text/html";
+    aux.headers_sent = false;
+    aux.done = false;
+    aux.ws_type = 0;
+    aux.ws_final = true;
+    aux.ws_len = 0;
+
+    size_t pos = line_end + 2;
+    while (pos < head.size() - 2) {
+        size_t eol = head.find("\r\n", pos);
+        std::string h = head.substr(pos, eol - pos);
+        pos = eol + 2;
+        size_t colon = h.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        size_t v = colon + 1;
+        while (v < h.size() && h[v] == ' ') {
+            v++;
+        }
+        aux.req_hdrs.push_back(std::make_pair(h.substr(0, colon), h.substr(v)));
+        if (!strcasecmp(aux.req_hdrs.back().first.c_str(), "Content-Length")) {
+            aux.body_left = strtoul(aux.req_hdrs.back().second.c_str(), NULL, 10);
+        }
+    }
+
+    size_t qmark = uri.find('?');
+    size_t path_len = qmark == std::string::npos ? uri.size() : qmark;
+    if (qmark != std::string::npos) {
+        aux.query = uri.substr(qmark + 1);
+    }
+
+    int method = parse_method(line.substr(0, sp1));
+    bool uri_matched;
+    const httpd_uri_t *handler = find_handler(hd, uri.c_str(), path_len, method, &uri_matched);
+    if (!handler) {
+        if (uri_matched) {
+            send_error(sess, "405 Method Not Allowed", "Request method for this URI is not handled by server");
+        } else {
+            send_error(sess, "404 Not Found", "Nothing matches the given URI");
+        }
+        // Drop the unread body with the connection
+        return aux.body_left == 0;
+    }
+
+    if (handler->is_websocket && method == HTTP_GET) {
+        const std::string *upgrade = aux_hdr(&aux, "Upgrade");
+        if (upgrade && !strcasecmp(upgrade->c_str(), "websocket") && !ws_handshake(sess, handler, &aux)) {
+            return false;
+        }
+    }
+    return call_handler(hd, sess, handler, method, uri, &aux);
+}
+
+// Read one frame on a WebSocket session and hand it to the handler, or
+// answer it here if it is a control frame the URI leaves to the server.
+// Returns false when the session must be closed.
+static bool ws_serve(host_httpd_t *hd, host_sess_t *sess)
+{
+    uint8_t head[8];
+    if (!sess_read(sess, head, 2)) {
+        return false;
+    }
+    host_req_t aux;
+    aux.server = hd;
+    aux.sess = sess;
+    aux.status = "200 OK";
+    aux.headers_sent = true; // no HTTP responses on a WebSocket
+    aux.done = true;
+    aux.ws_type = head[0] & 0x0f;
+    aux.ws_final = head[0] & 0x80;
+    bool masked = head[1] & 0x80;
+    uint64_t len = head[1] & 0x7f;
+    int ext = len == 126 ? 2 : len == 127 ? 8 : 0;
+    if (ext) {
+        if (!sess_read(sess, head, ext)) {
+            return false;
+        }
+        len = 0;
+        for (int i = 0; i < ext; i++) {
+            len = len << 8 | head[i];
+        }
+    }
+    // Clients must mask their frames (RFC 6455 5.1)
+    if (!masked) {
+        return false;
+    }
+    if (!sess_read(sess, aux.ws_mask, sizeof(aux.ws_mask))) {
+        return false;
+    }
+    aux.ws_len = len;
+    aux.body_left = len;
+    sess->last_used = esp_timer_get_time();
+
+    if (aux.ws_type >= HTTPD_WS_TYPE_CLOSE && !sess->ws_uri.handle_ws_control_frames) {
+        uint8_t payload[125];
+        if (len > sizeof(payload) || !sess_read(sess, payload, len)) {
+            return false;
+        }
+        for (size_t i = 0; i < len; i++) {
+            payload[i] ^= aux.ws_mask[i % 4];
+        }
+        httpd_ws_frame_t reply = {};
+        reply.payload = payload;
+        reply.len = len;
+        if (aux.ws_type == HTTPD_WS_TYPE_PING) {
+            reply.type = HTTPD_WS_TYPE_PONG;
+            return ws_send(sess->fd, &reply);
+        }
+        if (aux.ws_type == HTTPD_WS_TYPE_CLOSE) {
+            // Echo the status code and close
+            reply.type = HTTPD_WS_TYPE_CLOSE;
+            reply.len = std::min(reply.len, (size_t)2);
+            ws_send(sess->fd, &reply);
+            return false;
+        }
+        return true;
+    }
+    return call_handler(hd, sess, &sess->ws_uri, 0, sess->ws_uri.uri, &aux);
+}
+
+static void run_work(host_httpd_t *hd)
+{
+    char drain[64];
+    while (read(hd->wake[0], drain, sizeof(drain)) > 0) {
+    }
+    while (true) {
+        pthread_mutex_lock(&hd->lock);
+        if (hd->work.empty()) {
+            pthread_mutex_unlock(&hd->lock);
+            return;
+        }
+        std::pair<httpd_work_fn_t, void *> w = hd->work.front();
+        hd->work.pop_front();
+        pthread_mutex_unlock(&hd->lock);
+        w.first(w.second);
+    }
+}
+
+static void *httpd_thread(void *arg)
+{
+    host_httpd_t *hd = (host_httpd_t *)arg;
+    while (hd->running) {
+        fd_set rd;
+        FD_ZERO(&rd);
+        FD_SET(hd->listen_fd, &rd);
+        FD_SET(hd->wake[0], &rd);
+        int max_fd = std::max(hd->listen_fd, hd->wake[0]);
+        for (size_t i = 0; i < hd->sessions.size(); i++) {
+            FD_SET(hd->sessions[i]->fd, &rd);
+            max_fd = std::max(max_fd, hd->sessions[i]->fd);
+        }
+        if (select(max_fd + 1, &rd, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_e("select failed: %s", strerror(errno));
+            break;
+        }
+
+        if (FD_ISSET(hd->wake[0], &rd)) {
+            run_work(hd);
+        }
+        // Sessions can be closed while serving, so walk a copy
+        std::vector<host_sess_t *> ready;
+        for (size_t i = 0; i < hd->sessions.size(); i++) {
+            host_sess_t *sess = hd->sessions[i];
+            if (sess->close || FD_ISSET(sess->fd, &rd)) {
+                ready.push_back(sess);
+            }
+        }
+        for (size_t i = 0; i < ready.size(); i++) {
+            host_sess_t *sess = ready[i];
+            bool keep = !sess->close && (sess->ws ? ws_serve(hd, sess) : sess_serve(hd, sess));
+            // Pipelined requests and frames are already buffered, select()
+            // won't report them
+            while (keep && (sess->ws ? !sess->in.empty() : sess->in.find("\r\n\r\n") != std::string::npos)) {
+                keep = sess->ws ? ws_serve(hd, sess) : sess_serve(hd, sess);
+            }
+            if (!keep) {
+                sess_close(hd, sess);
+            }
+        }
+        if (FD_ISSET(hd->listen_fd, &rd)) {
+            sess_accept(hd);
+        }
+    }
+
+    while (!hd->sessions.empty()) {
+        sess_close(hd, hd->sessions.back());
+    }
+    return NULL;
+}
+
+// Server
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    host_httpd_t *hd = new host_httpd_t();
+    hd->config = *config;
+    pthread_mutex_init(&hd->lock, NULL);
+    uint16_t port = port_base + config->server_port - 80;
+
+    hd->listen_fd = socket(AF_INET6, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(hd->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (hd->listen_fd < 0 || bind(hd->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(hd->listen_fd, config->backlog_conn) < 0) {
+        log_e("Cannot listen on port %u: %s", port, strerror(errno));
+        if (hd->listen_fd >= 0) {
+            close(hd->listen_fd);
+        }
+        delete hd;
+        return ESP_ERR_HTTPD_TASK;
+    }
+    if (pipe(hd->wake) < 0) {
+        close(hd->listen_fd);
+        delete hd;
+        return ESP_ERR_HTTPD_TASK;
+    }
+    fcntl(hd->wake[0], F_SETFL, O_NONBLOCK);
+
+    hd->running = true;
+    if (pthread_create(&hd->thread, NULL, httpd_thread, hd)) {
+        close(hd->listen_fd);
+        close(hd->wake[0]);
+        close(hd->wake[1]);
+        delete hd;
+        return ESP_ERR_HTTPD_TASK;
+    }
+    pthread_setname_np(hd->thread, "httpd");
+    Serial.printf("httpd listening on port %u\n", port);
+    *handle = hd;
+    return ESP_OK;
+}
+
+static void stop_work(void *arg)
+{
+    ((host_httpd_t *)arg)->running = false;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    host_httpd_t *hd = (host_httpd_t *)handle;
+    httpd_queue_work(hd, stop_work, hd);
+    pthread_join(hd->thread, NULL);
+    close(hd->listen_fd);
+    close(hd->wake[0]);
+    close(hd->wake[1]);
+    delete hd;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    host_httpd_t *hd = (host_httpd_t *)handle;
+    for (size_t i = 0; i < hd->handlers.size(); i++) {
+        if (!strcmp(hd->handlers[i].uri, uri_handler->uri) && hd->handlers[i].method == uri_handler->method) {
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+        }
+    }
+    if (hd->handlers.size() >= hd->config.max_uri_handlers) {
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+    }
+    hd->handlers.push_back(*uri_handler);
+    return ESP_OK;
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void *arg)
+{
+    host_httpd_t *hd = (host_httpd_t *)handle;
+    pthread_mutex_lock(&hd->lock);
+    hd->work.push_back(std::make_pair(work, arg));
+    pthread_mutex_unlock(&hd->lock);
+    char c = 0;
+    return write(hd->wake[1], &c, 1) == 1 ? ESP_OK : ESP_FAIL;
+}
+
+// Responses
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    req_aux(r)->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    req_aux(r)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value)
+{
+    host_req_t *aux = req_aux(r);
+    if (aux->resp_hdrs.size() >= aux->server->config.max_resp_headers) {
+        return ESP_ERR_HTTPD_RESP_HDR;
+    }
+    aux->resp_hdrs.push_back(std::make_pair(std::string(field), std::string(value)));
+    return ESP_OK;
+}
+
+static std::string resp_head(host_req_t *aux, const char *length_hdr)
+{
+    std::string head = "HTTP/1.1 " + aux->status + "\r\nContent-Type: " + aux->type + "\r\n" + length_hdr;
+    for (size_t i = 0; i < aux->resp_hdrs.size(); i++) {
+        head += aux->resp_hdrs[i].first + ": " + aux->resp_hdrs[i].second + "\r\n";
+    }
+    head += "\r\n";
+    return head;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    host_req_t *aux = req_aux(r);
+    if (aux->headers_sent) {
+        return ESP_ERR_HTTPD_INVALID_REQ;
+    }
+    if (buf_len == HTTPD_RESP_USE_STRLEN) {
+        buf_len = buf ? strlen(buf) : 0;
+    }
+    char length[48];
+    snprintf(length, sizeof(length), "Content-Length: %zd\r\n", buf_len);
+    std::string head = resp_head(aux, length);
+    aux->headers_sent = true;
+    aux->done = true;
+
+    if (link_bps) {
+        return send_all(aux->sess->fd, head.data(), head.size()) && send_all(aux->sess->fd, buf, buf_len)
+                   ? ESP_OK : ESP_ERR_HTTPD_RESP_SEND;
+    }
+    struct iovec iov[2] = {{(void *)head.data(), head.size()}, {(void *)buf, (size_t)buf_len}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = buf_len ? 2 : 1;
+    size_t total = head.size() + buf_len;
+    ssize_t n = sendmsg(aux->sess->fd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    // Finish a short write the simple way
+    if ((size_t)n < total) {
+        if ((size_t)n < head.size()) {
+            if (!send_all(aux->sess->fd, head.data() + n, head.size() - n)) {
+                return ESP_ERR_HTTPD_RESP_SEND;
+            }
+            n = head.size();
+        }
+        size_t off = n - head.size();
+        if (!send_all(aux->sess->fd, buf + off, buf_len - off)) {
+            return ESP_ERR_HTTPD_RESP_SEND;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    host_req_t *aux = req_aux(r);
+    if (aux->done) {
+        return ESP_ERR_HTTPD_INVALID_REQ;
+    }
+    if (buf_len == HTTPD_RESP_USE_STRLEN) {
+        buf_len = buf ? strlen(buf) : 0;
+    }
+
+    std::string out;
+    if (!aux->headers_sent) {
+        out = resp_head(aux, "Transfer-Encoding: chunked\r\n");
+        aux->headers_sent = true;
+    }
+    char size[16];
+    if (buf && buf_len) {
+        snprintf(size, sizeof(size), "%zx\r\n", buf_len);
+        out += size;
+        // Small chunks go out in one write with their framing
+        if (buf_len <= 1024) {
+            out.append(buf, buf_len);
+            out += "\r\n";
+            return send_all(aux->sess->fd, out.data(), out.size()) ? ESP_OK : ESP_ERR_HTTPD_RESP_SEND;
+        }
+        if (!send_all(aux->sess->fd, out.data(), out.size()) || !send_all(aux->sess->fd, buf, buf_len) ||
+            !send_all(aux->sess->fd, "\r\n", 2)) {
+            return ESP_ERR_HTTPD_RESP_SEND;
+        }
+        return ESP_OK;
+    }
+    out += "0\r\n\r\n";
+    aux->done = true;
+    return send_all(aux->sess->fd, out.data(), out.size()) ? ESP_OK : ESP_ERR_HTTPD_RESP_SEND;
+}
+
+static esp_err_t resp_send_err(httpd_req_t *r, const char *status, const char *msg)
+{
+    httpd_resp_set_status(r, status);
+    httpd_resp_set_type(r, "text/html");
+    httpd_resp_send(r, msg, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_404(httpd_req_t *r)
+{
+    return resp_send_err(r, "404 Not Found", "This URI does not exist");
+}
+
+esp_err_t httpd_resp_send_408(httpd_req_t *r)
+{
+    return resp_send_err(r, "408 Request Timeout", "Server closed this connection");
+}
+
+esp_err_t httpd_resp_send_500(httpd_req_t *r)
+{
+    return resp_send_err(r, "500 Internal Server Error", "Server has encountered an unexpected error");
+}
+
+// Request access
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    host_req_t *aux = req_aux(r);
+    if (!aux->body_left) {
+        return 0;
+    }
+    size_t want = std::min(buf_len, aux->body_left);
+    host_sess_t *sess = aux->sess;
+    if (!sess->in.empty()) {
+        size_t n = std::min(want, sess->in.size());
+        memcpy(buf, sess->in.data(), n);
+        sess->in.erase(0, n);
+        aux->body_left -= n;
+        return n;
+    }
+    ssize_t n;
+    do {
+        n = recv(sess->fd, buf, want, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
+    }
+    if (n == 0) {
+        return HTTPD_SOCK_ERR_FAIL;
+    }
+    aux->body_left -= n;
+    return n;
+}
+
+static const std::string *find_req_hdr(httpd_req_t *r, const char *field)
+{
+    return aux_hdr(req_aux(r), field);
+}
+
+static esp_err_t copy_out(const std::string &s, char *val, size_t val_size)
+{
+    if (!val_size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    snprintf(val, val_size, "%s", s.c_str());
+    return s.size() >= val_size ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field)
+{
+    const std::string *v = find_req_hdr(r, field);
+    return v ? v->size() : 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size)
+{
+    const std::string *v = find_req_hdr(r, field);
+    return v ? copy_out(*v, val, val_size) : ESP_ERR_NOT_FOUND;
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r)
+{
+    return req_aux(r)->query.size();
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    host_req_t *aux = req_aux(r);
+    if (strchr(r->uri, '?') == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return copy_out(aux->query, buf, buf_len);
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size)
+{
+    size_t key_len = strlen(key);
+    const char *p = qry;
+    while (p && *p) {
+        const char *end = strchr(p, '&');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len > key_len && !strncmp(p, key, key_len) && p[key_len] == '=') {
+            return copy_out(std::string(p + key_len + 1, len - key_len - 1), val, val_size);
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+// Sockets and sessions
+
+int httpd_req_to_sockfd(httpd_req_t *r)
+{
+    return req_aux(r)->sess->fd;
+}
+
+int httpd_send(httpd_req_t *r, const char *buf, size_t buf_len)
+{
+    link_pace(buf_len);
+    ssize_t n = send(req_aux(r)->sess->fd, buf, buf_len, MSG_NOSIGNAL);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
+    }
+    return n;
+}
+
+int httpd_socket_send(httpd_handle_t hd, int sockfd, const char *buf, size_t buf_len, int flags)
+{
+    link_pace(buf_len);
+    ssize_t n = send(sockfd, buf, buf_len, flags | MSG_NOSIGNAL);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
+    }
+    return n;
+}
+
+void *httpd_sess_get_ctx(httpd_handle_t handle, int sockfd)
+{
+    host_sess_t *sess = sess_find((host_httpd_t *)handle, sockfd);
+    return sess ? sess->ctx : NULL;
+}
+
+void httpd_sess_set_ctx(httpd_handle_t handle, int sockfd, void *ctx, httpd_free_ctx_fn_t free_fn)
+{
+    host_sess_t *sess = sess_find((host_httpd_t *)handle, sockfd);
+    if (sess) {
+        sess->ctx = ctx;
+        sess->free_ctx = free_fn;
+    }
+}
+
+static void trigger_close_work(void *arg)
+{
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd)
+{
+    host_httpd_t *hd = (host_httpd_t *)handle;
+    host_sess_t *sess = sess_find(hd, sockfd);
+    if (!sess) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    sess->close = true;
+    // Wake the server so it notices
+    return httpd_queue_work(hd, trigger_close_work, NULL);
+}
+
+// WebSocket frames
+
+esp_err_t httpd_ws_recv_frame(httpd_req_t *req, httpd_ws_frame_t *pkt, size_t max_len)
+{
+    host_req_t *aux = req_aux(req);
+    if (!aux->sess->ws) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pkt->type = (httpd_ws_type_t)aux->ws_type;
+    pkt->final = aux->ws_final;
+    pkt->fragmented = !aux->ws_final || aux->ws_type == HTTPD_WS_TYPE_CONTINUE;
+    pkt->len = aux->ws_len;
+    if (!max_len) {
+        return ESP_OK;
+    }
+    if (aux->ws_len > max_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (!pkt->payload || aux->body_left != aux->ws_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (size_t got = 0; got < aux->ws_len;) {
+        int n = httpd_req_recv(req, (char *)pkt->payload + got, aux->ws_len - got);
+        if (n <= 0) {
+            return ESP_FAIL;
+        }
+        got += n;
+    }
+    for (size_t i = 0; i < aux->ws_len; i++) {
+        pkt->payload[i] ^= aux->ws_mask[i % 4];
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_ws_send_frame(httpd_req_t *req, httpd_ws_frame_t *pkt)
+{
+    return ws_send(req_aux(req)->sess->fd, pkt) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd, httpd_ws_frame_t *frame)
+{
+    if (!sess_find((host_httpd_t *)hd, fd)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ws_send(fd, frame) ? ESP_OK : ESP_FAIL;
+}
+
+httpd_ws_client_info_t httpd_ws_get_fd_info(httpd_handle_t hd, int fd)
+{
+    host_sess_t *sess = sess_find((host_httpd_t *)hd, fd);
+    if (!sess) {
+        return HTTPD_WS_CLIENT_INVALID;
+    }
+    return sess->ws ? HTTPD_WS_CLIENT_WEBSOCKET : HTTPD_WS_CLIENT_HTTP;
+}
@@ -0,0 +1,200 @@
+// esp32-camera JPEG encoder and decoder entry points on libjpeg.
+//
+// Pixel formats follow the driver: RGB565 is big-endian and RGB888 is in
+// B,G,R byte order, while esp_jpg_decode() emits R,G,B.
+#include <Arduino.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include "img_converters.h"
+#include "host.h"
+
+#define JPG_OUT_CHUNK 1024 // encoder output handed to the callback at a time
+
+typedef struct
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+} jpg_error_t;
+
+static void jpg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((jpg_error_t *)cinfo->err)->jump, 1);
+}
+
+uint8_t *host_jpeg_decode(const uint8_t *src, size_t len, int scale, int *width, int *height)
+{
+    struct jpeg_decompress_struct cinfo;
+    jpg_error_t err;
+    uint8_t *out = NULL;
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpg_error_exit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(out);
+        return NULL;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, src, len);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    jpeg_start_decompress(&cinfo);
+
+    size_t stride = (size_t)cinfo.output_width * 3;
+    out = (uint8_t *)malloc(stride * cinfo.output_height);
+    if (!out) {
+        jpeg_destroy_decompress(&cinfo);
+        return NULL;
+    }
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = out + cinfo.output_scanline * stride;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return out;
+}
+
+esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void *arg)
+{
+    uint8_t *jpg = (uint8_t *)malloc(len);
+    if (!jpg) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (reader(arg, 0, jpg, len) != len) {
+        free(jpg);
+        return ESP_FAIL;
+    }
+    int w, h;
+    uint8_t *rgb = host_jpeg_decode(jpg, len, 1 << scale, &w, &h);
+    free(jpg);
+    if (!rgb) {
+        return ESP_FAIL;
+    }
+
+    // Start, the whole image as one block, end
+    bool ok = writer(arg, 0, 0, w, h, NULL) && writer(arg, 0, 0, w, h, rgb) && writer(arg, w, h, w, h, NULL);
+    free(rgb);
+    return ok ? ESP_OK : ESP_FAIL;
+}
+
+// Expand one source row to R,G,B
+static bool row_to_rgb(const uint8_t *src, int width, pixformat_t format, uint8_t *rgb)
+{
+    for (int x = 0; x < width; x++) {
+        uint8_t *o = rgb + x * 3;
+        switch (format) {
+        case PIXFORMAT_RGB565: {
+            uint16_t px = (src[x * 2] << 8) | src[x * 2 + 1];
+            o[0] = (px >> 8) & 0xF8;
+            o[1] = (px >> 3) & 0xFC;
+            o[2] = (px << 3) & 0xF8;
+            break;
+        }
+        case PIXFORMAT_RGB888:
+            o[0] = src[x * 3 + 2];
+            o[1] = src[x * 3 + 1];
+            o[2] = src[x * 3];
+            break;
+        case PIXFORMAT_GRAYSCALE:
+            o[0] = o[1] = o[2] = src[x];
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+static int format_bpp(pixformat_t format)
+{
+    switch (format) {
+    case PIXFORMAT_RGB565:
+        return 2;
+    case PIXFORMAT_RGB888:
+        return 3;
+    case PIXFORMAT_GRAYSCALE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality,
+             uint8_t **out, size_t *out_len)
+{
+    int bpp = format_bpp(format);
+    if (!bpp || src_len < (size_t)width * height * bpp) {
+        return false;
+    }
+
+    struct jpeg_compress_struct cinfo;
+    jpg_error_t err;
+    unsigned char *mem = NULL;
+    unsigned long mem_len = 0;
+    uint8_t *row = (uint8_t *)malloc((size_t)width * 3);
+    if (!row) {
+        return false;
+    }
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpg_error_exit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        free(mem);
+        free(row);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &mem, &mem_len);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        row_to_rgb(src + (size_t)cinfo.next_scanline * width * bpp, width, format, row);
+        JSAMPROW r = row;
+        jpeg_write_scanlines(&cinfo, &r, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+
+    *out = mem;
+    *out_len = mem_len;
+    return true;
+}
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality,
+                jpg_out_cb cb, void *arg)
+{
+    uint8_t *jpg;
+    size_t len;
+    if (!fmt2jpg(src, src_len, width, height, format, quality, &jpg, &len)) {
+        return false;
+    }
+    bool ok = true;
+    for (size_t index = 0; ok && index < len; index += JPG_OUT_CHUNK) {
+        size_t n = len - index < JPG_OUT_CHUNK ? len - index : JPG_OUT_CHUNK;
+        ok = cb(arg, index, jpg + index, n) == n;
+    }
+    free(jpg);
+    return ok;
+}
+
+bool frame2jpg(camera_fb_t *fb, uint8_t quality, uint8_t **out, size_t *out_len)
+{
+    return fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len);
+}
+
+bool frame2jpg_cb(camera_fb_t *fb, uint8_t quality, jpg_out_cb cb, void *arg)
+{
+    return fmt2jpg_cb(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, cb, arg);
+}
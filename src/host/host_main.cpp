@@ -0,0 +1,137 @@
+// Runs the camera web server as a Linux process: the firmware's handlers,
+// capture task and alert engine on the host HAL, with frames replayed from
+// the dataset. Stands in for setup() in CameraWebServer.ino.
+//
+// Build from src/ with host/build.sh, then for example
+//   ./camera_host --dataset ../dataset --port 8080 --fps 25
+// serves the main server on 8080 and the stream on 8081. --link-kbps puts
+// the server behind a slow link, to watch /stream adapt to it. The alert log
+// goes to --log-dir, where LittleFS would be on the board.
+#include <Arduino.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "host.h"
+
+void startCameraServer(int fb_count);
+void startFrameUplink(const char *host, uint16_t port);
+void startAlertLog(const char *dir);
+void startLogForward(const char *host, uint16_t port);
+
+static const byte ledPins[4] = {32, 33, 14, 12};
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [--dataset DIR] [--port N] [--fps N] [--fb-count N] [--rgb565] [--sccb-us N]\n"
+            "          [--gateway HOST:PORT] [--link-kbps N] [--link-buffer BYTES] [--log-dir DIR]\n"
+            "          [--log-udp HOST:PORT]\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    host_camera_config_t camera = {"../dataset", 25, 3, PIXFORMAT_JPEG, 300};
+    uint16_t port = 8080;
+    const char *gateway = NULL;
+    const char *log_dir = "alert_log";
+    const char *log_udp = NULL;
+    uint32_t link_kbps = 0;
+    size_t link_buffer = 5744; // lwIP TCP_SND_BUF in the Arduino core
+
+    static const struct option options[] = {
+        {"dataset", required_argument, NULL, 'd'},
+        {"port", required_argument, NULL, 'p'},
+        {"fps", required_argument, NULL, 'f'},
+        {"fb-count", required_argument, NULL, 'b'},
+        {"rgb565", no_argument, NULL, 'r'},
+        {"sccb-us", required_argument, NULL, 's'},
+        {"gateway", required_argument, NULL, 'g'},
+        {"link-kbps", required_argument, NULL, 'k'},
+        {"link-buffer", required_argument, NULL, 'K'},
+        {"log-dir", required_argument, NULL, 'l'},
+        {"log-udp", required_argument, NULL, 'u'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:p:f:b:rs:g:k:K:l:u:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            camera.dataset = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'f':
+            camera.fps = atoi(optarg);
+            break;
+        case 'b':
+            camera.fb_count = atoi(optarg);
+            break;
+        case 'r':
+            camera.pixformat = PIXFORMAT_RGB565;
+            break;
+        case 's':
+            camera.sccb_us = atoi(optarg);
+            break;
+        case 'g':
+            gateway = optarg;
+            break;
+        case 'k':
+            link_kbps = atoi(optarg);
+            break;
+        case 'K':
+            link_buffer = atoi(optarg);
+            break;
+        case 'l':
+            log_dir = optarg;
+            break;
+        case 'u':
+            log_udp = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    Serial.begin(115200);
+    if (host_camera_init(&camera) != ESP_OK) {
+        return 1;
+    }
+
+    for (auto ledPin : ledPins) {
+        pinMode(ledPin, OUTPUT);
+        digitalWrite(ledPin, LOW);
+    }
+
+    host_httpd_set_port_base(port);
+    host_httpd_set_link(link_kbps, link_buffer);
+    startCameraServer(camera.fb_count);
+    if (log_udp) {
+        char host[64] = {};
+        const char *colon = strrchr(log_udp, ':');
+        if (!colon || colon - log_udp >= (int)sizeof(host)) {
+            usage(argv[0]);
+            return 2;
+        }
+        memcpy(host, log_udp, colon - log_udp);
+        startLogForward(host, atoi(colon + 1));
+    }
+    startAlertLog(log_dir);
+    if (gateway) {
+        static char host[64];
+        const char *colon = strrchr(gateway, ':');
+        if (!colon || colon - gateway >= (int)sizeof(host)) {
+            usage(argv[0]);
+            return 2;
+        }
+        memcpy(host, gateway, colon - gateway);
+        startFrameUplink(host, atoi(colon + 1));
+    }
+
+    Serial.printf("Camera Ready! Use 'http://localhost:%u' to connect\n", port);
+    while (true) {
+        pause();
+    }
+}
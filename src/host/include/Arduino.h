@@ -0,0 +1,87 @@
+// Host stand-in for the parts of the Arduino-ESP32 core the firmware uses.
+// GPIO writes are recorded by host_hal.cpp instead of driving pins.
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+typedef uint8_t byte;
+
+#define LOW    0x0
+#define HIGH   0x1
+#define INPUT  0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void delay(uint32_t ms);
+unsigned long millis(void);
+unsigned long micros(void);
+uint32_t esp_random(void);
+bool psramFound(void);
+void *ps_malloc(size_t size);
+
+class HardwareSerial
+{
+public:
+    void begin(unsigned long baud);
+    void setDebugOutput(bool enable);
+    size_t print(const char *s);
+    size_t print(int n);
+    size_t print(unsigned int n);
+    size_t println(void);
+    size_t println(const char *s);
+    size_t println(int n);
+    size_t println(unsigned int n);
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    size_t write(const uint8_t *buf, size_t len);
+};
+
+extern HardwareSerial Serial;
+
+#define ARDUHAL_LOG_LEVEL_NONE    0
+#define ARDUHAL_LOG_LEVEL_ERROR   1
+#define ARDUHAL_LOG_LEVEL_WARN    2
+#define ARDUHAL_LOG_LEVEL_INFO    3
+#define ARDUHAL_LOG_LEVEL_DEBUG   4
+#define ARDUHAL_LOG_LEVEL_VERBOSE 5
+
+#ifndef ARDUHAL_LOG_LEVEL
+#define ARDUHAL_LOG_LEVEL ARDUHAL_LOG_LEVEL_ERROR
+#endif
+
+#define host_log(level, format, ...) fprintf(stderr, "[" level "] %s(): " format "\n", __func__, ##__VA_ARGS__)
+
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_ERROR
+#define log_e(format, ...) host_log("E", format, ##__VA_ARGS__)
+#else
+#define log_e(format, ...) do {} while (0)
+#endif
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_WARN
+#define log_w(format, ...) host_log("W", format, ##__VA_ARGS__)
+#else
+#define log_w(format, ...) do {} while (0)
+#endif
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+#define log_i(format, ...) host_log("I", format, ##__VA_ARGS__)
+#else
+#define log_i(format, ...) do {} while (0)
+#endif
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_DEBUG
+#define log_d(format, ...) host_log("D", format, ##__VA_ARGS__)
+#else
+#define log_d(format, ...) do {} while (0)
+#endif
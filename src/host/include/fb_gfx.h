@@ -0,0 +1,2 @@
+// Host stand-in for fb_gfx.h
+#pragma once
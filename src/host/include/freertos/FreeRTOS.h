@@ -0,0 +1,30 @@
+// Host stand-in for the FreeRTOS kernel types the firmware uses, on pthreads
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE             0
+#define pdTRUE              1
+#define pdPASS              pdTRUE
+#define pdFAIL              pdFALSE
+#define portMAX_DELAY       ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS  1
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(ms))
+#define tskIDLE_PRIORITY    0
+#define tskNO_AFFINITY      0x7fffffff
+#define configMAX_PRIORITIES 25
+
+// Critical sections map to a recursive mutex, like the nesting spinlock on
+// the ESP32
+typedef struct {
+    pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP}
+#define portENTER_CRITICAL(mux)      pthread_mutex_lock(&(mux)->mutex)
+#define portEXIT_CRITICAL(mux)       pthread_mutex_unlock(&(mux)->mutex)
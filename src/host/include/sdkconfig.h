@@ -0,0 +1,5 @@
+// Host stand-in for sdkconfig.h
+#pragma once
+
+// host_httpd.cpp speaks WebSocket
+#define CONFIG_HTTPD_WS_SUPPORT 1
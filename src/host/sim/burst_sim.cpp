@@ -0,0 +1,219 @@
+// Burst capture (burst.h) against a simulated sensor, to check how long a
+// burst takes to start and end and how much of its buffer it uses.
+//
+// Triggers arrive at random, --gap-s apart on average. burst_task in
+// app_httpd.cpp picks each one up after --wake-ms and lowers the frame size,
+// which reaches the frames after --switch-ms; until then the sensor keeps
+// delivering full-size frames at the full-size rate. When the burst ends the
+// size goes back the same way. Frame sizes vary by --jitter around the
+// configured mean. Everything runs on a simulated clock, so an hour of
+// triggers takes a moment.
+//
+// Reports entry latency (trigger to the first frame kept), burst length,
+// frames and achieved rate per burst, the peak buffer and index use against
+// their fixed capacity, and the triggers refused. Exits 1 if a burst broke
+// a bound: started later than BURST_ENTRY_MAX_US plus a frame, or ran past
+// BURST_US plus a frame.
+//
+// Build from src/ with host/build.sh, then
+//   ./burst_sim --full-fps 12 --full-kb 30 --reduced-fps 25 --reduced-kb 10 --duration-s 3600
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "burst.h"
+
+#define SIM_BURST_BYTES (512 * 1024) // BURST_BYTES in app_httpd.cpp
+
+typedef struct
+{
+    double full_fps;
+    double reduced_fps;
+    size_t full_bytes;
+    size_t reduced_bytes;
+    double jitter;      // frame size spread, fraction of the mean
+    int64_t switch_us;  // set_framesize() to the first frame at the new size
+    int64_t wake_us;    // trigger to burst_task acting on it
+    int64_t gap_us;     // mean time between triggers
+    int64_t duration_us;
+    size_t buffer;
+    unsigned seed;
+} sim_config_t;
+
+typedef struct
+{
+    uint32_t triggers;
+    std::vector<int64_t> entry;  // trigger to the first frame kept
+    std::vector<int64_t> length; // first frame to the end
+    std::vector<int64_t> frames;
+    std::vector<int64_t> fps100;
+    uint32_t cut_short;          // ended before BURST_US, the buffer was full
+    size_t peak_bytes;
+    size_t peak_index;
+    bool bound_broken;
+} sim_result_t;
+
+static void simulate(const sim_config_t *cfg, sim_result_t *r)
+{
+    std::vector<uint8_t> buf(cfg->buffer);
+    std::vector<event_frame_t> index(BURST_FRAMES);
+    burst_t b;
+    burst_init(&b, buf.data(), buf.size(), index.data(), index.size());
+
+    std::mt19937 rng(cfg->seed);
+    std::exponential_distribution<double> gap(1.0 / cfg->gap_us);
+    std::uniform_real_distribution<double> spread(1.0 - cfg->jitter, 1.0 + cfg->jitter);
+    std::vector<uint8_t> frame((size_t)(std::max(cfg->full_bytes, cfg->reduced_bytes) * (1.0 + cfg->jitter)) + 1);
+
+    int64_t next_trigger = (int64_t)gap(rng);
+    int64_t reduced_from = -1; // frames captured from here on are reduced
+    int64_t reduced_until = -1;
+    bool reduced = false;
+    uint32_t seq = 0;
+    for (int64_t now = 0; now < cfg->duration_us;) {
+        // Triggers, acted on after the task wakes up
+        while (next_trigger <= now) {
+            r->triggers++;
+            int64_t acted = next_trigger + cfg->wake_us;
+            burst_reason_t reason = r->triggers % 2 ? BURST_POSTURE : BURST_MOTION;
+            if (burst_trigger(&b, reason, next_trigger)) {
+                reduced_from = acted + cfg->switch_us;
+                reduced_until = -1;
+            }
+            next_trigger += std::max((int64_t)gap(rng), (int64_t)1);
+        }
+
+        reduced = reduced_from >= 0 && now >= reduced_from && (reduced_until < 0 || now < reduced_until);
+        size_t len = (size_t)((reduced ? cfg->reduced_bytes : cfg->full_bytes) * spread(rng));
+        if (burst_frame(&b, frame.data(), len, now, ++seq, reduced) || burst_expire(&b, now)) {
+            reduced_until = now + cfg->wake_us + cfg->switch_us;
+            if (b.state == BURST_READY) {
+                int64_t last = event_ring_at(&b.ring, b.ring.count - 1)->frame_time;
+                r->entry.push_back(b.started - b.triggered);
+                r->length.push_back(last - b.started);
+                r->frames.push_back(b.ring.count);
+                r->fps100.push_back(burst_fps100(&b));
+                r->cut_short += b.ended < b.started + BURST_US;
+                if (b.started - b.triggered > BURST_ENTRY_MAX_US + (int64_t)(1e6 / cfg->full_fps) ||
+                    last - b.started > BURST_US + BURST_FRAME_US) {
+                    r->bound_broken = true;
+                }
+            }
+        }
+        r->peak_bytes = std::max(r->peak_bytes, b.ring.used);
+        r->peak_index = std::max(r->peak_index, b.ring.count);
+        // The pulled burst is never read again, so nothing holds it
+        now += (int64_t)(1e6 / (reduced ? cfg->reduced_fps : cfg->full_fps));
+    }
+    r->bound_broken |= b.abandoned > 0;
+    printf("%u triggers, %zu bursts, %u refused, %u abandoned, %u full-size frames skipped\n", r->triggers,
+           r->frames.size(), b.refused, b.abandoned, b.skipped);
+}
+
+static void summary(const char *name, std::vector<int64_t> v, double scale, const char *unit)
+{
+    if (v.empty()) {
+        printf("  %-16s -\n", name);
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    printf("  %-16s min %8.1f  p50 %8.1f  p99 %8.1f  max %8.1f %s\n", name, v.front() / scale,
+           v[v.size() / 2] / scale, v[std::min(v.size() - 1, v.size() * 99 / 100)] / scale, v.back() / scale, unit);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [--full-fps N] [--full-kb N] [--reduced-fps N] [--reduced-kb N] [--jitter F]\n"
+            "          [--switch-ms N] [--wake-ms N] [--gap-s N] [--duration-s N] [--buffer-kb N] [--seed N]\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    sim_config_t cfg = {12, 25, 30 * 1024, 10 * 1024, 0.3, 200000, 5000, 8000000, 3600000000LL, SIM_BURST_BYTES, 1};
+
+    static const struct option options[] = {
+        {"full-fps", required_argument, NULL, 'f'},
+        {"full-kb", required_argument, NULL, 'F'},
+        {"reduced-fps", required_argument, NULL, 'r'},
+        {"reduced-kb", required_argument, NULL, 'R'},
+        {"jitter", required_argument, NULL, 'j'},
+        {"switch-ms", required_argument, NULL, 's'},
+        {"wake-ms", required_argument, NULL, 'w'},
+        {"gap-s", required_argument, NULL, 'g'},
+        {"duration-s", required_argument, NULL, 'd'},
+        {"buffer-kb", required_argument, NULL, 'b'},
+        {"seed", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:F:r:R:j:s:w:g:d:b:S:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            cfg.full_fps = atof(optarg);
+            break;
+        case 'F':
+            cfg.full_bytes = (size_t)atoi(optarg) * 1024;
+            break;
+        case 'r':
+            cfg.reduced_fps = atof(optarg);
+            break;
+        case 'R':
+            cfg.reduced_bytes = (size_t)atoi(optarg) * 1024;
+            break;
+        case 'j':
+            cfg.jitter = atof(optarg);
+            break;
+        case 's':
+            cfg.switch_us = (int64_t)atoi(optarg) * 1000;
+            break;
+        case 'w':
+            cfg.wake_us = (int64_t)atoi(optarg) * 1000;
+            break;
+        case 'g':
+            cfg.gap_us = (int64_t)(atof(optarg) * 1e6);
+            break;
+        case 'd':
+            cfg.duration_us = (int64_t)(atof(optarg) * 1e6);
+            break;
+        case 'b':
+            cfg.buffer = (size_t)atoi(optarg) * 1024;
+            break;
+        case 'S':
+            cfg.seed = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (cfg.full_fps <= 0 || cfg.reduced_fps <= 0 || cfg.jitter < 0 || cfg.jitter >= 1 || cfg.gap_us <= 0 ||
+        !cfg.buffer) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    printf("Sensor %.1f fps at %zu KB, reduced %.1f fps at %zu KB, switch %lld ms; burst %d ms at %d ms per frame, "
+           "cooldown %d s\n",
+           cfg.full_fps, cfg.full_bytes / 1024, cfg.reduced_fps, cfg.reduced_bytes / 1024,
+           (long long)(cfg.switch_us / 1000), BURST_US / 1000, BURST_FRAME_US / 1000, BURST_COOLDOWN_US / 1000000);
+    sim_result_t r = {};
+    simulate(&cfg, &r);
+    summary("entry", r.entry, 1e3, "ms");
+    summary("length", r.length, 1e3, "ms");
+    summary("frames", r.frames, 1, "");
+    summary("rate", r.fps100, 100, "fps");
+    printf("  %u bursts cut short by a full buffer\n", r.cut_short);
+    printf("Memory: buffer %zu of %zu bytes at peak (%.0f%%), index %zu of %d frames, %zu bytes fixed\n",
+           r.peak_bytes, cfg.buffer, 100.0 * r.peak_bytes / cfg.buffer, r.peak_index, BURST_FRAMES,
+           cfg.buffer + BURST_FRAMES * sizeof(event_frame_t));
+    if (r.bound_broken) {
+        printf("A burst broke its entry or length bound\n");
+        return 1;
+    }
+    return 0;
+}
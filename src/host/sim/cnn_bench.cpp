@@ -0,0 +1,378 @@
+// Benchmarks the on-device posture classifier (cnn.h) on the dataset and
+// measures how often it agrees with the gateway's ResNet101.
+//
+// Every frame goes through the firmware's path: JPEG decode at the coarsest
+// scale that covers the model input, bilinear resize, int8 inference.
+// Reports the time per frame of each step and the agreement with the
+// labels in --labels (written by export_posture_model.py --teacher), or
+// with the directory names when there is none.
+//
+// Uses CameraWebServer/posture_model.h when it has been exported. Without
+// it a model of the same shape with random weights stands in, which only
+// makes the timings meaningful.
+//
+// Build from src/ with host/build.sh, then
+//   ./cnn_bench --dataset ../dataset --repeat 5
+#include <Arduino.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "host.h"
+#include "alert.h"
+#include "cnn.h"
+#include "img_resize.h"
+
+#if __has_include("posture_model.h")
+#include "posture_model.h"
+#define HAVE_POSTURE_MODEL 1
+#else
+#define HAVE_POSTURE_MODEL 0
+#endif
+
+typedef struct
+{
+    std::string path;
+    std::vector<uint8_t> jpg;
+    posture_t label;
+} bench_frame_t;
+
+static std::vector<std::string> files;
+
+static int collect_jpeg(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    size_t len = strlen(path);
+    if (type == FTW_F && len > 4 && !strcasecmp(path + len - 4, ".jpg")) {
+        files.push_back(path);
+    }
+    return 0;
+}
+
+// Dataset directories are named in Indonesian, as are the teacher labels
+static posture_t posture_from_name(const std::string &name)
+{
+    static const char *names[POSTURE_MAX] = {"BERDIRI", "DUDUK", "TIDUR"};
+    for (int i = 0; i < POSTURE_MAX; i++) {
+        if (name == names[i]) {
+            return (posture_t)i;
+        }
+    }
+    return POSTURE_NONE;
+}
+
+// Directory of a dataset file relative to the dataset root, "BERDIRI/x.jpg"
+static std::string relative_path(const char *dataset, const std::string &path)
+{
+    size_t len = strlen(dataset);
+    std::string rel = path.compare(0, len, dataset) ? path : path.substr(len);
+    return rel.substr(rel.find_first_not_of('/'));
+}
+
+static bool load_labels(const char *csv, std::map<std::string, posture_t> *labels)
+{
+    FILE *fp = fopen(csv, "r");
+    if (!fp) {
+        return false;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        char *comma = strchr(line, ',');
+        if (!comma) {
+            continue;
+        }
+        *comma = '\0';
+        std::string label = comma + 1;
+        label.erase(label.find_last_not_of("\r\n") + 1);
+        (*labels)[line] = posture_from_name(label);
+    }
+    fclose(fp);
+    return true;
+}
+
+static bool read_file(const std::string &path, std::vector<uint8_t> *out)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        out->insert(out->end(), buf, buf + n);
+    }
+    fclose(fp);
+    return true;
+}
+
+#if !HAVE_POSTURE_MODEL
+// Same layers as ARCH in export_posture_model.py, random weights
+static const struct
+{
+    cnn_op_t op;
+    uint8_t kernel;
+    uint8_t stride;
+    uint16_t out_c;
+} random_arch[] = {
+    {CNN_CONV, 3, 2, 16}, {CNN_MAXPOOL, 0, 0, 0}, {CNN_DEPTHWISE, 3, 1, 0}, {CNN_CONV, 1, 1, 32},
+    {CNN_DEPTHWISE, 3, 2, 0}, {CNN_CONV, 1, 1, 64}, {CNN_DEPTHWISE, 3, 2, 0}, {CNN_CONV, 1, 1, 128},
+    {CNN_AVGPOOL, 0, 0, 0}, {CNN_DENSE, 0, 0, POSTURE_MAX},
+};
+
+#define RANDOM_ARCH_LAYERS (sizeof(random_arch) / sizeof(random_arch[0]))
+
+static cnn_layer_t random_layers[RANDOM_ARCH_LAYERS];
+static cnn_model_t posture_model;
+
+static void random_model(void)
+{
+    srand(1);
+    int c = 3;
+    for (size_t i = 0; i < RANDOM_ARCH_LAYERS; i++) {
+        cnn_layer_t *l = &random_layers[i];
+        memset(l, 0, sizeof(*l));
+        l->op = random_arch[i].op;
+        l->kernel = random_arch[i].kernel;
+        l->stride = random_arch[i].stride;
+        l->out_c = random_arch[i].out_c;
+        l->relu = l->op == CNN_CONV || l->op == CNN_DEPTHWISE;
+        l->in_zp = i ? -128 : 0;
+        l->out_zp = l->op == CNN_DENSE ? 0 : -128;
+        size_t weights = 0;
+        int out_c = c;
+        if (l->op == CNN_CONV) {
+            weights = (size_t)l->out_c * l->kernel * l->kernel * c;
+            out_c = l->out_c;
+        } else if (l->op == CNN_DEPTHWISE) {
+            weights = (size_t)l->kernel * l->kernel * c;
+        } else if (l->op == CNN_DENSE) {
+            weights = (size_t)l->out_c * c;
+            out_c = l->out_c;
+        }
+        if (weights) {
+            int8_t *w = new int8_t[weights];
+            for (size_t j = 0; j < weights; j++) {
+                w[j] = (int8_t)(rand() % 255 - 127);
+            }
+            int32_t *bias = new int32_t[out_c]();
+            int32_t *mult = new int32_t[out_c];
+            int8_t *shift = new int8_t[out_c];
+            for (int j = 0; j < out_c; j++) {
+                mult[j] = 1 << 30;
+                shift[j] = 8;
+            }
+            l->weights = w;
+            l->bias = bias;
+            l->mult = mult;
+            l->shift = shift;
+        }
+        c = out_c;
+    }
+    posture_model = {96, 96, 3, random_layers, (int)RANDOM_ARCH_LAYERS, 0.1f, 0};
+}
+#endif
+
+// Multiply-accumulates per inference
+static uint64_t model_macs(const cnn_model_t *m)
+{
+    uint64_t macs = 0;
+    int w = m->in_w, h = m->in_h, c = m->in_c;
+    for (int i = 0; i < m->layer_count; i++) {
+        const cnn_layer_t *l = &m->layers[i];
+        switch (l->op) {
+        case CNN_CONV:
+            w = (w + l->stride - 1) / l->stride;
+            h = (h + l->stride - 1) / l->stride;
+            macs += (uint64_t)w * h * l->out_c * l->kernel * l->kernel * c;
+            c = l->out_c;
+            break;
+        case CNN_DEPTHWISE:
+            w = (w + l->stride - 1) / l->stride;
+            h = (h + l->stride - 1) / l->stride;
+            macs += (uint64_t)w * h * c * l->kernel * l->kernel;
+            break;
+        case CNN_MAXPOOL:
+            w /= 2;
+            h /= 2;
+            break;
+        case CNN_AVGPOOL:
+            w = h = 1;
+            break;
+        case CNN_DENSE:
+            macs += (uint64_t)l->out_c * c;
+            c = l->out_c;
+            break;
+        }
+    }
+    return macs;
+}
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void print_times(const char *name, std::vector<int64_t> v)
+{
+    std::sort(v.begin(), v.end());
+    int64_t sum = 0;
+    for (size_t i = 0; i < v.size(); i++) {
+        sum += v[i];
+    }
+    printf("%-10s %9.3f %9.3f %9.3f %9.3f\n", name, sum / 1e3 / v.size(), v[v.size() / 2] / 1e3,
+           v[v.size() * 99 / 100] / 1e3, v.back() / 1e3);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--dataset DIR] [--labels CSV] [--repeat N]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dataset = "../dataset";
+    const char *labels_csv = NULL;
+    int repeat = 1;
+
+    static const struct option options[] = {
+        {"dataset", required_argument, NULL, 'd'},
+        {"labels", required_argument, NULL, 'l'},
+        {"repeat", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:l:r:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            dataset = optarg;
+            break;
+        case 'l':
+            labels_csv = optarg;
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+#if !HAVE_POSTURE_MODEL
+    random_model();
+    printf("No posture_model.h, timing a random model of the same shape, agreement is meaningless\n");
+#endif
+    const cnn_model_t *model = &posture_model;
+
+    std::string default_csv = std::string(dataset) + "/resnet_labels.csv";
+    std::map<std::string, posture_t> labels;
+    bool teacher = load_labels(labels_csv ? labels_csv : default_csv.c_str(), &labels);
+    if (labels_csv && !teacher) {
+        fprintf(stderr, "Cannot read %s\n", labels_csv);
+        return 1;
+    }
+
+    if (nftw(dataset, collect_jpeg, 16, FTW_PHYS) != 0) {
+        fprintf(stderr, "Cannot read %s\n", dataset);
+        return 1;
+    }
+    std::sort(files.begin(), files.end());
+    std::vector<bench_frame_t> frames;
+    for (size_t i = 0; i < files.size(); i++) {
+        bench_frame_t f;
+        f.path = files[i];
+        std::string rel = relative_path(dataset, f.path);
+        if (teacher) {
+            auto it = labels.find(rel);
+            f.label = it == labels.end() ? POSTURE_NONE : it->second;
+        } else {
+            f.label = posture_from_name(rel.substr(0, rel.find('/')));
+        }
+        if (f.label == POSTURE_NONE || !read_file(f.path, &f.jpg)) {
+            fprintf(stderr, "Skipping %s\n", f.path.c_str());
+            continue;
+        }
+        frames.push_back(f);
+    }
+    if (frames.empty() || repeat < 1) {
+        fprintf(stderr, "No frames in %s\n", dataset);
+        return 1;
+    }
+
+    size_t arena_len = cnn_arena_size(model);
+    int8_t *arena = (int8_t *)malloc(arena_len);
+    uint8_t *input = (uint8_t *)malloc((size_t)model->in_w * model->in_h * model->in_c);
+    std::vector<int64_t> decode_us, resize_us, infer_us;
+    uint32_t confusion[POSTURE_MAX][POSTURE_MAX] = {};
+
+    for (int r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < frames.size(); i++) {
+            const bench_frame_t &f = frames[i];
+            int64_t t0 = now_us();
+            // Coarsest decoder scale that keeps the model input covered, as
+            // jpg_scale_for() in app_httpd.cpp
+            int w, h;
+            uint8_t *rgb = NULL;
+            for (int scale = 8; scale >= 1 && !rgb; scale /= 2) {
+                rgb = host_jpeg_decode(f.jpg.data(), f.jpg.size(), scale, &w, &h);
+                if (rgb && scale > 1 && (w < model->in_w || h < model->in_h)) {
+                    free(rgb);
+                    rgb = NULL;
+                }
+            }
+            if (!rgb) {
+                fprintf(stderr, "Cannot decode %s\n", f.path.c_str());
+                return 1;
+            }
+            int64_t t1 = now_us();
+            img_resize_rgb888(rgb, w, h, img_crop_full(w, h), input, model->in_w, model->in_h, false);
+            free(rgb);
+            int64_t t2 = now_us();
+            int8_t logits[POSTURE_MAX];
+            if (!cnn_run(model, input, arena, arena_len, logits)) {
+                fprintf(stderr, "Model does not run\n");
+                return 1;
+            }
+            int64_t t3 = now_us();
+            decode_us.push_back(t1 - t0);
+            resize_us.push_back(t2 - t1);
+            infer_us.push_back(t3 - t2);
+            if (!r) {
+                confusion[f.label][cnn_argmax(model, logits, POSTURE_MAX, NULL)]++;
+            }
+        }
+    }
+
+    printf("%zu frames x %d, %dx%d input, %.2f M MACs, arena %zu bytes\n\n", frames.size(), repeat, model->in_w,
+           model->in_h, model_macs(model) / 1e6, arena_len);
+    printf("%-10s %9s %9s %9s %9s\n", "ms/frame", "mean", "p50", "p99", "max");
+    print_times("decode", decode_us);
+    print_times("resize", resize_us);
+    print_times("inference", infer_us);
+
+    uint32_t agree = 0;
+    printf("\nagreement with %s labels, rows are labels, columns predictions\n", teacher ? "ResNet101" : "directory");
+    printf("%-4s", "");
+    for (int p = 0; p < POSTURE_MAX; p++) {
+        printf(" %6s", posture_label((posture_t)p));
+    }
+    printf("\n");
+    for (int l = 0; l < POSTURE_MAX; l++) {
+        printf("%-4s", posture_label((posture_t)l));
+        for (int p = 0; p < POSTURE_MAX; p++) {
+            printf(" %6u", confusion[l][p]);
+        }
+        printf("\n");
+        agree += confusion[l][l];
+    }
+    printf("agreement %.3f (%u of %zu)\n", (double)agree / frames.size(), agree, frames.size());
+    free(arena);
+    free(input);
+    return 0;
+}
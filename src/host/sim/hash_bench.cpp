@@ -0,0 +1,215 @@
+// Conditional capture (frame_hash.h) over consecutive dataset frames: how
+// many frames a gateway would skip at each distance threshold, how many of
+// those skips would have reused a result for the wrong posture, and what
+// the hash costs.
+//
+// Frames play in name order, each class directory one sequence in capture
+// order. The gateway model is the one gateway_daemon and resweb.py use:
+// the first frame is classified, and every later frame within the threshold
+// of the last classified one is answered as unchanged and gets its result.
+// A skip is wrong when the frame's directory differs from that frame's.
+//
+// The cost is measured as the firmware pays it: decode at the coarsest
+// JPEG scale that covers the motion grid, box-filter to the grid, hash.
+// The device only hashes frames the motion analysis hasn't already reduced
+// to a grid, so decode and grid are an upper bound.
+//
+// Build from src/ with host/build.sh, then
+//   ./hash_bench --dataset ../dataset --repeat 20
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "host.h"
+#include "alert.h"
+#include "frame_hash.h"
+#include "motion.h"
+
+typedef struct
+{
+    std::string path;
+    posture_t posture;
+    std::vector<uint8_t> jpg;
+    uint64_t hash;
+} bench_frame_t;
+
+static std::vector<std::string> files;
+
+static int collect_jpeg(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    size_t len = strlen(path);
+    if (type == FTW_F && len > 4 && !strcasecmp(path + len - 4, ".jpg")) {
+        files.push_back(path);
+    }
+    return 0;
+}
+
+// Dataset directories are named in Indonesian
+static posture_t posture_from_dir(const std::string &path)
+{
+    if (path.find("/BERDIRI/") != std::string::npos) {
+        return POSTURE_BDR;
+    }
+    if (path.find("/DUDUK/") != std::string::npos) {
+        return POSTURE_DDK;
+    }
+    if (path.find("/TIDUR/") != std::string::npos) {
+        return POSTURE_TDR;
+    }
+    return POSTURE_NONE;
+}
+
+static bool read_file(const std::string &path, std::vector<uint8_t> *out)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        out->insert(out->end(), buf, buf + n);
+    }
+    fclose(fp);
+    return !out->empty();
+}
+
+static int64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Decode scale the firmware's jpg_scale_for() picks for the grid
+static int grid_scale(const std::vector<uint8_t> &jpg)
+{
+    int w, h;
+    uint8_t *rgb = host_jpeg_decode(jpg.data(), jpg.size(), 1, &w, &h);
+    if (!rgb) {
+        return 0;
+    }
+    free(rgb);
+    int scale = 8;
+    while (scale > 1 && (w / scale < MOTION_GRID_W || h / scale < MOTION_GRID_H)) {
+        scale /= 2;
+    }
+    return scale;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--dataset DIR] [--repeat N]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dataset = "../dataset";
+    int repeat = 10;
+
+    static const struct option options[] = {
+        {"dataset", required_argument, NULL, 'd'},
+        {"repeat", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:r:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            dataset = optarg;
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (repeat < 1 || nftw(dataset, collect_jpeg, 16, FTW_PHYS) != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    std::sort(files.begin(), files.end());
+
+    std::vector<bench_frame_t> frames;
+    int64_t decode_ns = 0, grid_ns = 0, hash_ns = 0;
+    uint64_t hashed = 0;
+    for (const std::string &path : files) {
+        bench_frame_t f;
+        f.path = path;
+        f.posture = posture_from_dir(path);
+        int scale;
+        if (f.posture == POSTURE_NONE || !read_file(path, &f.jpg) || !(scale = grid_scale(f.jpg))) {
+            fprintf(stderr, "Skipping %s\n", path.c_str());
+            continue;
+        }
+        for (int i = 0; i < repeat; i++) {
+            int64_t t0 = mono_ns();
+            int w, h;
+            uint8_t *rgb = host_jpeg_decode(f.jpg.data(), f.jpg.size(), scale, &w, &h);
+            int64_t t1 = mono_ns();
+            uint8_t grid[MOTION_GRID_SIZE];
+            bool ok = rgb && motion_grid_rgb888(rgb, w, h, grid);
+            free(rgb);
+            int64_t t2 = mono_ns();
+            if (!ok) {
+                break;
+            }
+            f.hash = frame_hash(grid);
+            int64_t t3 = mono_ns();
+            decode_ns += t1 - t0;
+            grid_ns += t2 - t1;
+            hash_ns += t3 - t2;
+            hashed++;
+        }
+        frames.push_back(std::move(f));
+    }
+    if (frames.empty() || !hashed) {
+        fprintf(stderr, "No frames in %s\n", dataset);
+        return 1;
+    }
+
+    printf("%zu frames. Per frame: decode %.1f us, grid %.1f us, hash %.2f us\n\n", frames.size(),
+           decode_ns / 1e3 / hashed, grid_ns / 1e3 / hashed, hash_ns / 1e3 / hashed);
+
+    // Distances between neighbours, for choosing a threshold
+    std::vector<int> same, change;
+    for (size_t i = 1; i < frames.size(); i++) {
+        int d = frame_hash_distance(frames[i - 1].hash, frames[i].hash);
+        (frames[i].posture == frames[i - 1].posture ? same : change).push_back(d);
+    }
+    std::sort(same.begin(), same.end());
+    std::sort(change.begin(), change.end());
+    if (!same.empty()) {
+        printf("Neighbour distance, same posture: p50 %d, p90 %d, max %d bits\n", same[same.size() / 2],
+               same[same.size() * 9 / 10], same.back());
+    }
+    if (!change.empty()) {
+        printf("Neighbour distance, posture change: min %d, p50 %d bits over %zu changes\n", change.front(),
+               change[change.size() / 2], change.size());
+    }
+
+    printf("\n%9s %9s %9s %11s\n", "threshold", "skipped", "skip %", "wrong skips");
+    static const int thresholds[] = {0, 2, 4, FRAME_HASH_SIMILAR, 8, 10, 12, 16};
+    for (int t : thresholds) {
+        const bench_frame_t *reference = &frames[0];
+        size_t skipped = 0, wrong = 0;
+        for (size_t i = 1; i < frames.size(); i++) {
+            if (frame_hash_distance(reference->hash, frames[i].hash) <= t) {
+                skipped++;
+                wrong += frames[i].posture != reference->posture;
+            } else {
+                reference = &frames[i];
+            }
+        }
+        printf("%9d %9zu %8.1f%% %11zu%s\n", t, skipped, 100.0 * skipped / (frames.size() - 1), wrong,
+               t == FRAME_HASH_SIMILAR ? "  (default)" : "");
+    }
+    return 0;
+}
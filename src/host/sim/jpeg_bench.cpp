@@ -0,0 +1,300 @@
+// The streaming RGB565 encoder (jpeg_enc.h) against the converter the
+// non-JPEG capture path used before, on the dataset frames: time per frame,
+// size and PSNR against the RGB565 source.
+//
+// Each dataset JPEG is decoded and packed to big-endian RGB565, as the
+// sensor delivers it with PIXFORMAT_RGB565. The reference is fmt2jpg() from
+// host_jpeg.cpp, which stands in for the esp32-camera converter with
+// libjpeg at the same quality and subsampling. libjpeg-turbo's SIMD paths
+// have no counterpart on the ESP32; JSIMD_FORCENONE=1 in the environment
+// compares against its plain C code instead. The region-of-interest run
+// takes the region the way app_httpd.cpp does, from the motion grid of the
+// previous frame in the same directory, one cell of margin around the cells
+// that changed; its PSNR is split into the region and the background.
+//
+// Build from src/ with host/build.sh, then
+//   ./jpeg_bench --dataset ../dataset --quality 80 --background 30 --repeat 5
+#include <ftw.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "host.h"
+#include "img_converters.h"
+#include "jpeg_enc.h"
+#include "motion.h"
+
+#define ROI_MARGIN 1 // grid cells, ROI_MARGIN in app_httpd.cpp
+
+static std::vector<std::string> files;
+
+static int collect_jpeg(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    size_t len = strlen(path);
+    if (type == FTW_F && len > 4 && !strcasecmp(path + len - 4, ".jpg")) {
+        files.push_back(path);
+    }
+    return 0;
+}
+
+static bool read_file(const std::string &path, std::vector<uint8_t> *out)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        out->insert(out->end(), buf, buf + n);
+    }
+    fclose(fp);
+    return !out->empty();
+}
+
+static int64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static std::string dir_of(const std::string &path)
+{
+    return path.substr(0, path.rfind('/'));
+}
+
+static size_t append_out(void *arg, size_t index, const void *data, size_t len)
+{
+    std::vector<uint8_t> *out = (std::vector<uint8_t> *)arg;
+    out->insert(out->end(), (const uint8_t *)data, (const uint8_t *)data + len);
+    return len;
+}
+
+// Squared error sums against the RGB565 source expanded as the encoders
+// expand it, inside and outside roi
+typedef struct
+{
+    double sse[2];
+    uint64_t samples[2];
+} bench_error_t;
+
+static bool compare(const std::vector<uint8_t> &jpg, const uint8_t *src565, int width, int height,
+                    const img_rect_t *roi, bench_error_t *err)
+{
+    int w, h;
+    uint8_t *rgb = host_jpeg_decode(jpg.data(), jpg.size(), 1, &w, &h);
+    if (!rgb || w != width || h != height) {
+        free(rgb);
+        return false;
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const uint8_t *s = src565 + ((size_t)y * width + x) * 2;
+            uint16_t px = (s[0] << 8) | s[1];
+            int ref[3] = {(px >> 8) & 0xF8, (px >> 3) & 0xFC, (px << 3) & 0xF8};
+            const uint8_t *d = rgb + ((size_t)y * width + x) * 3;
+            bool in = !roi || (x >= roi->x && x < roi->x + roi->w && y >= roi->y && y < roi->y + roi->h);
+            for (int c = 0; c < 3; c++) {
+                double e = d[c] - ref[c];
+                err->sse[in] += e * e;
+            }
+            err->samples[in] += 3;
+        }
+    }
+    free(rgb);
+    return true;
+}
+
+static double psnr(double sse, uint64_t samples)
+{
+    return samples && sse > 0 ? 10 * log10(255.0 * 255.0 * samples / sse) : 99;
+}
+
+typedef struct
+{
+    const char *name;
+    int64_t ns;
+    uint64_t bytes;
+    uint32_t frames;
+    bench_error_t err;
+} run_t;
+
+static void report(const run_t *r, const run_t *base)
+{
+    printf("%-22s %8.0f us %8.0f B %7.1f%% %8.2f dB", r->name, r->ns / 1e3 / r->frames, (double)r->bytes / r->frames,
+           100.0 * r->bytes / base->bytes,
+           psnr(r->err.sse[0] + r->err.sse[1], r->err.samples[0] + r->err.samples[1]));
+    if (r->err.samples[0]) {
+        printf("  region %.2f dB, background %.2f dB", psnr(r->err.sse[1], r->err.samples[1]),
+               psnr(r->err.sse[0], r->err.samples[0]));
+    }
+    printf("\n");
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--dataset DIR] [--quality N] [--background N] [--repeat N]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dataset = "../dataset";
+    int quality = 80;
+    int background = 30;
+    int repeat = 5;
+
+    static const struct option options[] = {
+        {"dataset", required_argument, NULL, 'd'},
+        {"quality", required_argument, NULL, 'q'},
+        {"background", required_argument, NULL, 'b'},
+        {"repeat", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:q:b:r:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            dataset = optarg;
+            break;
+        case 'q':
+            quality = atoi(optarg);
+            break;
+        case 'b':
+            background = atoi(optarg);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (repeat < 1 || quality < 1 || quality > 100 || background < 1 || background > 100 ||
+        nftw(dataset, collect_jpeg, 16, FTW_PHYS) != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    std::sort(files.begin(), files.end());
+
+    static jpeg_enc_t enc;
+    jpeg_enc_init(&enc);
+    run_t ref = {"fmt2jpg (libjpeg)"}, full = {"jpeg_enc"}, roi_run = {"jpeg_enc, region"};
+    run_t roi_ref = {"jpeg_enc, same frames"};
+    uint32_t with_region = 0;
+    double region_area = 0;
+    std::vector<uint8_t> src565, out;
+    uint8_t prev_grid[MOTION_GRID_SIZE];
+    std::string prev_dir;
+    int last_w = 0, last_h = 0;
+    for (const std::string &path : files) {
+        std::vector<uint8_t> jpg;
+        int w, h;
+        uint8_t *rgb = read_file(path, &jpg) ? host_jpeg_decode(jpg.data(), jpg.size(), 1, &w, &h) : NULL;
+        if (!rgb) {
+            fprintf(stderr, "Skipping %s\n", path.c_str());
+            continue;
+        }
+        src565.resize((size_t)w * h * 2);
+        for (size_t i = 0; i < (size_t)w * h; i++) {
+            uint16_t px = ((rgb[i * 3] & 0xF8) << 8) | ((rgb[i * 3 + 1] & 0xFC) << 3) | (rgb[i * 3 + 2] >> 3);
+            src565[i * 2] = px >> 8;
+            src565[i * 2 + 1] = px & 0xFF;
+        }
+        free(rgb);
+        last_w = w;
+        last_h = h;
+
+        // Reference converter
+        uint8_t *ref_jpg = NULL;
+        size_t ref_len = 0;
+        for (int i = 0; i < repeat; i++) {
+            free(ref_jpg);
+            int64_t t0 = mono_ns();
+            bool ok = fmt2jpg(src565.data(), src565.size(), w, h, PIXFORMAT_RGB565, quality, &ref_jpg, &ref_len);
+            ref.ns += mono_ns() - t0;
+            if (!ok) {
+                fprintf(stderr, "fmt2jpg failed on %s\n", path.c_str());
+                return 1;
+            }
+        }
+        out.assign(ref_jpg, ref_jpg + ref_len);
+        free(ref_jpg);
+        ref.bytes += ref_len * repeat;
+        ref.frames += repeat;
+        compare(out, src565.data(), w, h, NULL, &ref.err);
+
+        // Whole frame at the quality
+        jpeg_enc_set_quality(&enc, quality, quality);
+        for (int i = 0; i < repeat; i++) {
+            out.clear();
+            int64_t t0 = mono_ns();
+            jpeg_enc_rgb565(&enc, src565.data(), w, h, NULL, append_out, &out);
+            full.ns += mono_ns() - t0;
+        }
+        full.bytes += out.size() * repeat;
+        full.frames += repeat;
+        if (!compare(out, src565.data(), w, h, NULL, &full.err)) {
+            fprintf(stderr, "jpeg_enc output of %s doesn't decode\n", path.c_str());
+            return 1;
+        }
+        size_t full_len = out.size();
+
+        // Region from the motion since the previous frame of the sequence
+        uint8_t grid[MOTION_GRID_SIZE];
+        motion_grid_rgb565(src565.data(), w, h, grid);
+        int cx, cy, cw, ch;
+        bool region = prev_dir == dir_of(path) && motion_bounds(prev_grid, grid, &cx, &cy, &cw, &ch);
+        memcpy(prev_grid, grid, sizeof(grid));
+        prev_dir = dir_of(path);
+        if (!region) {
+            continue;
+        }
+        int x0 = std::max(cx - ROI_MARGIN, 0) * w / MOTION_GRID_W;
+        int y0 = std::max(cy - ROI_MARGIN, 0) * h / MOTION_GRID_H;
+        int x1 = std::min(cx + cw + ROI_MARGIN, MOTION_GRID_W) * w / MOTION_GRID_W;
+        int y1 = std::min(cy + ch + ROI_MARGIN, MOTION_GRID_H) * h / MOTION_GRID_H;
+        img_rect_t roi = {x0, y0, x1 - x0, y1 - y0};
+        with_region++;
+        region_area += (double)roi.w * roi.h / (w * h);
+
+        jpeg_enc_set_quality(&enc, quality, background);
+        for (int i = 0; i < repeat; i++) {
+            out.clear();
+            int64_t t0 = mono_ns();
+            jpeg_enc_rgb565(&enc, src565.data(), w, h, &roi, append_out, &out);
+            roi_run.ns += mono_ns() - t0;
+        }
+        roi_run.bytes += out.size() * repeat;
+        roi_run.frames += repeat;
+        roi_ref.bytes += full_len * repeat;
+        roi_ref.frames += repeat;
+        if (!compare(out, src565.data(), w, h, &roi, &roi_run.err)) {
+            fprintf(stderr, "jpeg_enc region output of %s doesn't decode\n", path.c_str());
+            return 1;
+        }
+    }
+    if (!ref.frames) {
+        fprintf(stderr, "No frames in %s\n", dataset);
+        return 1;
+    }
+
+    printf("%u frames of %dx%d RGB565, quality %d, %d runs each\n\n", ref.frames / repeat, last_w, last_h, quality,
+           repeat);
+    printf("%-22s %11s %10s %8s %11s\n", "encoder", "time", "size", "of ref", "PSNR");
+    report(&ref, &ref);
+    report(&full, &ref);
+    if (with_region) {
+        printf("\nBackground quality %d on the %u frames with motion, region %.0f%% of the frame on average:\n",
+               background, with_region, 100 * region_area / with_region);
+        report(&roi_run, &roi_ref);
+        printf("%-22s %19.0f B\n", "jpeg_enc, no region", (double)roi_ref.bytes / roi_ref.frames);
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+// Benchmarks the alert log (alert_log.h) on a host directory: append and
+// flush throughput, time-range query throughput, and recovery after a torn
+// write.
+//
+// Records are synthetic state changes, one every
+// --interval-ms. Queries ask for random --range-s windows inside what the
+// log still holds after old segments were dropped.
+//
+// Build from src/ with host/build.sh, then
+//   ./log_bench --dir /tmp/alert_log_bench --records 100000
+#include <dirent.h>
+#include <getopt.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include "alert_log.h"
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void clear_dir(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (e->d_name[0] != '.') {
+            unlink((std::string(dir) + "/" + e->d_name).c_str());
+        }
+    }
+    closedir(d);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--dir DIR] [--records N] [--interval-ms N] [--queries N] [--range-s N]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "/tmp/alert_log_bench";
+    uint32_t records = 100000;
+    int64_t interval_us = 1000000;
+    uint32_t queries = 1000;
+    int64_t range_us = 600 * 1000000LL;
+
+    static const struct option options[] = {
+        {"dir", required_argument, NULL, 'd'},
+        {"records", required_argument, NULL, 'n'},
+        {"interval-ms", required_argument, NULL, 'i'},
+        {"queries", required_argument, NULL, 'q'},
+        {"range-s", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:n:i:q:r:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'n':
+            records = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            interval_us = atoll(optarg) * 1000;
+            break;
+        case 'q':
+            queries = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            range_us = atoll(optarg) * 1000000;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    mkdir(dir, 0755);
+    clear_dir(dir);
+
+    static alert_log_t log;
+    if (!alert_log_open(&log, dir)) {
+        fprintf(stderr, "Cannot open a log in %s\n", dir);
+        return 1;
+    }
+
+    // Append
+    srand(1);
+    const int64_t t0 = 1700000000LL * 1000000;
+    int64_t flush_max = 0;
+    int64_t start = now_us();
+    for (uint32_t i = 0; i < records; i++) {
+        log_record_t r = {};
+        r.time_us = t0 + i * interval_us;
+        r.posture = rand() % 3;
+        r.timer = rand() % 17;
+        r.motion = rand() % 2000;
+        if (alert_log_append(&log, &r)) {
+            int64_t f = now_us();
+            if (!alert_log_flush(&log)) {
+                fprintf(stderr, "Flush failed\n");
+                return 1;
+            }
+            f = now_us() - f;
+            flush_max = f > flush_max ? f : flush_max;
+        }
+    }
+    alert_log_flush(&log);
+    int64_t write_us = now_us() - start;
+    printf("append   %u records in %.3f s: %.0f records/s, %u flushes of up to %.3f ms, %u bytes written\n", records,
+           write_us / 1e6, records / (write_us / 1e6), log.flushes, flush_max / 1e3, log.bytes_written);
+    printf("on disk  %u bytes in segments %u..%u\n", alert_log_disk_bytes(&log), log.first_seg, log.active_seg);
+
+    // Find what is still held
+    static alert_log_query_t q;
+    static log_record_t out[LOG_BLOCK_RECORDS];
+    int64_t oldest = INT64_MAX, newest = INT64_MIN;
+    uint64_t held = 0;
+    start = now_us();
+    alert_log_query_begin(&log, &q, INT64_MIN, INT64_MAX);
+    size_t n;
+    while ((n = alert_log_query_next(&log, &q, out, LOG_BLOCK_RECORDS))) {
+        for (size_t i = 0; i < n; i++) {
+            oldest = out[i].time_us < oldest ? out[i].time_us : oldest;
+            newest = out[i].time_us > newest ? out[i].time_us : newest;
+        }
+        held += n;
+    }
+    int64_t scan_us = now_us() - start;
+    printf("scan     %llu records in %.3f ms: %.0f records/s\n", (unsigned long long)held, scan_us / 1e3,
+           held / (scan_us / 1e6));
+
+    // Random windows
+    uint64_t matched = 0;
+    uint32_t wrong = 0;
+    start = now_us();
+    for (uint32_t i = 0; i < queries; i++) {
+        int64_t span = newest - oldest - range_us;
+        int64_t from = oldest + (span > 0 ? (int64_t)(rand() / (double)RAND_MAX * span) : 0);
+        alert_log_query_begin(&log, &q, from, from + range_us);
+        uint64_t got = 0;
+        while ((n = alert_log_query_next(&log, &q, out, LOG_BLOCK_RECORDS))) {
+            got += n;
+        }
+        // Records are evenly spaced, so the count is known
+        uint64_t expect = (from + range_us - t0 + interval_us - 1) / interval_us - (from - t0 + interval_us - 1) / interval_us;
+        wrong += got != expect;
+        matched += got;
+    }
+    int64_t query_us = now_us() - start;
+    printf("query    %u windows of %lld s in %.3f ms: %.0f queries/s, %.1f records each, %u wrong counts\n", queries,
+           (long long)(range_us / 1000000), query_us / 1e3, queries / (query_us / 1e6), (double)matched / queries,
+           wrong);
+
+    // Tear the active segment: half a record after the good ones. Sealing
+    // it on reopen may push the oldest segment out.
+    alert_log_close(&log);
+    uint32_t first_seg = log.first_seg;
+    uint32_t first_count = log.seg_count[first_seg % LOG_SEGMENTS_MAX];
+    char path[LOG_DIR_MAX + 16];
+    snprintf(path, sizeof(path), "%s/%08x.log", dir, (unsigned)log.active_seg);
+    FILE *f = fopen(path, "ab");
+    fwrite("torn wri", 1, 8, f);
+    fclose(f);
+    start = now_us();
+    if (!alert_log_open(&log, dir)) {
+        fprintf(stderr, "Reopen failed\n");
+        return 1;
+    }
+    int64_t open_us = now_us() - start;
+    uint64_t after = 0;
+    alert_log_query_begin(&log, &q, INT64_MIN, INT64_MAX);
+    while ((n = alert_log_query_next(&log, &q, out, LOG_BLOCK_RECORDS))) {
+        after += n;
+    }
+    uint64_t expect = held - (log.first_seg != first_seg ? first_count : 0);
+    printf("recover  reopened in %.3f ms, boot %u, %u torn slots dropped, %llu of %llu records kept\n", open_us / 1e3,
+           log.boot, log.recovered, (unsigned long long)after, (unsigned long long)expect);
+    alert_log_close(&log);
+    return wrong || after != expect || !log.recovered;
+}
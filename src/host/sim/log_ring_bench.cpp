@@ -0,0 +1,287 @@
+// Compares what a log line costs the thread that logs it: printing
+// straight to the UART, as the handlers did with Serial.print and log_i,
+// against queueing a record in the log ring (log_ring.h) for a drain
+// thread to format and print.
+//
+// The UART is simulated: a 128 byte transmit FIFO emptied at the baud
+// rate by its own thread, one writer at a time like HardwareSerial's lock.
+// A direct print blocks while the FIFO is full. --threads producers each
+// log --lines lines, one every --interval-us, and the latency of each call
+// is recorded. The ring has the firmware's SLOG_RING_RECORDS unless
+// --records says otherwise.
+//
+// Build from src/ with host/build.sh, then
+//   ./log_ring_bench --threads 4 --lines 500 --interval-us 20000
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "log_ring.h"
+#include "serial_log.h"
+
+#define UART_FIFO 128
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+typedef struct
+{
+    std::mutex lock;        // one writer at a time
+    std::mutex fifo_lock;
+    std::condition_variable space;
+    size_t fifo;            // bytes waiting to go out
+    uint64_t sent;
+    uint32_t byte_us;
+    std::atomic<bool> stop;
+} uart_t;
+
+static void uart_drain(uart_t *u)
+{
+    while (!u->stop.load()) {
+        usleep(1000);
+        std::lock_guard<std::mutex> g(u->fifo_lock);
+        size_t n = std::min(u->fifo, (size_t)(1000 / u->byte_us));
+        u->fifo -= n;
+        u->sent += n;
+        u->space.notify_all();
+    }
+}
+
+static void uart_write(uart_t *u, const char *data, size_t len)
+{
+    std::lock_guard<std::mutex> w(u->lock);
+    std::unique_lock<std::mutex> g(u->fifo_lock);
+    while (len) {
+        u->space.wait(g, [u] { return u->fifo < UART_FIFO; });
+        size_t n = std::min(len, (size_t)UART_FIFO - u->fifo);
+        u->fifo += n;
+        len -= n;
+    }
+}
+
+static const char *const formats[] = {
+    "Updated classification status: %s",
+    "[I] %s: %uB %ums",
+    "[I] %s = %d",
+};
+
+typedef struct
+{
+    const char *name;
+    std::vector<int64_t> lat;
+    uint32_t dropped;
+    int64_t wall_us;
+} result_t;
+
+static void report(result_t *r)
+{
+    std::sort(r->lat.begin(), r->lat.end());
+    double sum = 0;
+    for (int64_t l : r->lat) {
+        sum += l;
+    }
+    size_t n = r->lat.size();
+    printf("%-7s %zu calls: mean %.2f us, p50 %lld us, p99 %lld us, max %lld us, %u dropped, %.2f s wall\n", r->name, n,
+           n ? sum / n : 0, n ? (long long)r->lat[n / 2] : 0, n ? (long long)r->lat[n * 99 / 100] : 0,
+           n ? (long long)r->lat[n - 1] : 0, r->dropped, r->wall_us / 1e6);
+}
+
+static void fill_args(uint32_t i, int *fmt, intptr_t *args)
+{
+    static const char *const labels[] = {"BERDIRI", "DUDUK", "TIDUR"};
+    *fmt = i % 3;
+    args[0] = (intptr_t)(*fmt == 0 ? labels[i % 3] : *fmt == 1 ? "JPG" : "quality");
+    args[1] = 9000 + i % 2000;
+    args[2] = i % 40;
+}
+
+static void run_direct(result_t *r, int threads, uint32_t lines, int64_t interval_us, uint32_t byte_us)
+{
+    uart_t u;
+    u.fifo = 0;
+    u.sent = 0;
+    u.byte_us = byte_us;
+    u.stop = false;
+    std::thread drain(uart_drain, &u);
+    std::mutex lat_lock;
+    int64_t start = now_us();
+    std::vector<std::thread> producers;
+    for (int t = 0; t < threads; t++) {
+        producers.emplace_back([&, t] {
+            std::vector<int64_t> lat;
+            char line[160];
+            for (uint32_t i = 0; i < lines; i++) {
+                int fmt;
+                intptr_t args[LOG_RING_ARGS];
+                fill_args(i + t, &fmt, args);
+                int64_t s = now_us();
+                size_t n;
+                if (fmt == 0) {
+                    n = snprintf(line, sizeof(line), formats[0], (const char *)args[0]);
+                } else if (fmt == 1) {
+                    n = snprintf(line, sizeof(line), formats[1], (const char *)args[0], (unsigned)args[1],
+                                 (unsigned)args[2]);
+                } else {
+                    n = snprintf(line, sizeof(line), formats[2], (const char *)args[0], (int)args[1]);
+                }
+                line[n++] = '\r';
+                line[n++] = '\n';
+                uart_write(&u, line, n);
+                int64_t e = now_us();
+                lat.push_back(e - s);
+                if (e - s < interval_us) {
+                    usleep(interval_us - (e - s));
+                }
+            }
+            std::lock_guard<std::mutex> g(lat_lock);
+            r->lat.insert(r->lat.end(), lat.begin(), lat.end());
+        });
+    }
+    for (auto &p : producers) {
+        p.join();
+    }
+    r->wall_us = now_us() - start;
+    r->dropped = 0;
+    u.stop = true;
+    drain.join();
+}
+
+static void run_ring(result_t *r, int threads, uint32_t lines, int64_t interval_us, uint32_t byte_us, size_t records)
+{
+    uart_t u;
+    u.fifo = 0;
+    u.sent = 0;
+    u.byte_us = byte_us;
+    u.stop = false;
+    std::thread drain(uart_drain, &u);
+
+    static log_ring_t ring;
+    std::vector<log_ring_cell_t> cells(records);
+    log_ring_init(&ring, cells.data(), records);
+    std::atomic<bool> done(false);
+    std::thread consumer([&] {
+        char line[160];
+        log_ring_record_t rec;
+        while (true) {
+            bool any = false;
+            while (log_ring_take(&ring, &rec)) {
+                size_t n = log_ring_format(formats[rec.fmt], &rec, line, sizeof(line) - 2);
+                line[n++] = '\r';
+                line[n++] = '\n';
+                uart_write(&u, line, n);
+                any = true;
+            }
+            if (!any && done.load()) {
+                break;
+            }
+            usleep(20000); // SLOG_DRAIN_MS
+        }
+    });
+
+    std::mutex lat_lock;
+    int64_t start = now_us();
+    std::vector<std::thread> producers;
+    for (int t = 0; t < threads; t++) {
+        producers.emplace_back([&, t] {
+            std::vector<int64_t> lat;
+            for (uint32_t i = 0; i < lines; i++) {
+                int fmt;
+                intptr_t args[LOG_RING_ARGS];
+                fill_args(i + t, &fmt, args);
+                int64_t s = now_us();
+                log_ring_put(&ring, s, fmt, 3, args);
+                int64_t e = now_us();
+                lat.push_back(e - s);
+                if (e - s < interval_us) {
+                    usleep(interval_us - (e - s));
+                }
+            }
+            std::lock_guard<std::mutex> g(lat_lock);
+            r->lat.insert(r->lat.end(), lat.begin(), lat.end());
+        });
+    }
+    for (auto &p : producers) {
+        p.join();
+    }
+    r->wall_us = now_us() - start;
+    done = true;
+    consumer.join();
+    r->dropped = ring.dropped.load();
+    u.stop = true;
+    drain.join();
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--threads N] [--lines N] [--interval-us N] [--baud N] [--records N]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    int threads = 4;
+    uint32_t lines = 500;
+    int64_t interval_us = 20000;
+    uint32_t baud = 115200;
+    size_t records = SLOG_RING_RECORDS;
+
+    static const struct option options[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"lines", required_argument, NULL, 'n'},
+        {"interval-us", required_argument, NULL, 'i'},
+        {"baud", required_argument, NULL, 'b'},
+        {"records", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:n:i:b:r:", options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            lines = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            interval_us = atoll(optarg);
+            break;
+        case 'b':
+            baud = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            records = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (threads < 1 || !baud || !records || (records & (records - 1))) {
+        usage(argv[0]);
+        return 2;
+    }
+    // 10 bits a byte with start and stop bits
+    uint32_t byte_us = std::max(1u, 10000000 / baud);
+    printf("%d threads, %u lines each every %lld us, %u baud, %zu ring records\n", threads, lines,
+           (long long)interval_us, baud, records);
+
+    result_t direct = {"direct"};
+    run_direct(&direct, threads, lines, interval_us, byte_us);
+    report(&direct);
+
+    result_t ring = {"ring"};
+    run_ring(&ring, threads, lines, interval_us, byte_us, records);
+    report(&ring);
+    return 0;
+}
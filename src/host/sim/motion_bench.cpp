@@ -0,0 +1,229 @@
+// Motion analysis (motion.h) over consecutive dataset frames: what reducing
+// a frame to the grid and scoring it against the previous one costs, and
+// how the scores fall against the alert and burst thresholds.
+//
+// Frames play in name order, each class directory one sequence in capture
+// order; the score of a class's first frame is against the last frame of
+// the class before it, so those are reported apart as posture changes.
+//
+// The grid is made as motion_grid_from_fb() in app_httpd.cpp makes it: for
+// a JPEG frame, decode at the coarsest scale that still covers the grid and
+// box-filter the RGB888 result; for an RGB565 frame, box-filter the frame
+// buffer directly. motion_energy() and motion_bounds() are timed over many
+// repeats since one call is well under a microsecond. The capture task runs
+// all of this at most once per MOTION_INTERVAL_US.
+//
+// Build from src/ with host/build.sh, then
+//   ./motion_bench --dataset ../dataset --repeat 20
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "host.h"
+#include "alert.h"
+#include "burst.h"
+#include "motion.h"
+
+#define MOTION_INTERVAL_US 200000 // as in app_httpd.cpp
+#define SCORE_REPEAT       1000   // motion_energy() calls per timed pair
+
+typedef struct
+{
+    std::string dir;
+    uint8_t grid[MOTION_GRID_SIZE];
+} bench_frame_t;
+
+static std::vector<std::string> files;
+
+static int collect_jpeg(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    size_t len = strlen(path);
+    if (type == FTW_F && len > 4 && !strcasecmp(path + len - 4, ".jpg")) {
+        files.push_back(path);
+    }
+    return 0;
+}
+
+static bool read_file(const std::string &path, std::vector<uint8_t> *out)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        out->insert(out->end(), buf, buf + n);
+    }
+    fclose(fp);
+    return !out->empty();
+}
+
+static int64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// jpg_scale_for() in app_httpd.cpp, as a divisor
+static int grid_scale(int width, int height)
+{
+    int scale = 8;
+    while (scale > 1 && (width / scale < MOTION_GRID_W || height / scale < MOTION_GRID_H)) {
+        scale /= 2;
+    }
+    return scale;
+}
+
+static void report(const char *name, std::vector<uint32_t> *scores)
+{
+    if (scores->empty()) {
+        return;
+    }
+    std::sort(scores->begin(), scores->end());
+    size_t n = scores->size(), alert = 0, burst = 0;
+    for (uint32_t s : *scores) {
+        alert += s >= ALERT_MOTION_MIN;
+        burst += s >= BURST_MOTION_MIN;
+    }
+    printf("%-16s %6zu %7u %7u %7u %7u %8.1f%% %8.1f%%\n", name, n, (*scores)[0], (*scores)[n / 2],
+           (*scores)[n * 9 / 10], scores->back(), 100.0 * alert / n, 100.0 * burst / n);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--dataset DIR] [--repeat N]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dataset = "../dataset";
+    int repeat = 20;
+
+    static const struct option options[] = {
+        {"dataset", required_argument, NULL, 'd'},
+        {"repeat", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:r:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            dataset = optarg;
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (repeat < 1 || nftw(dataset, collect_jpeg, 16, FTW_PHYS) != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    std::sort(files.begin(), files.end());
+
+    std::vector<bench_frame_t> frames;
+    std::vector<uint8_t> src565;
+    int64_t decode_ns = 0, grid_ns = 0, grid565_ns = 0;
+    uint64_t runs = 0;
+    int last_w = 0, last_h = 0;
+    for (const std::string &path : files) {
+        std::vector<uint8_t> jpg;
+        int w, h;
+        uint8_t *rgb = read_file(path, &jpg) ? host_jpeg_decode(jpg.data(), jpg.size(), 1, &w, &h) : NULL;
+        if (!rgb) {
+            fprintf(stderr, "Skipping %s\n", path.c_str());
+            continue;
+        }
+        // The frame as an RGB565 sensor would hand it over, big-endian
+        src565.resize((size_t)w * h * 2);
+        for (size_t i = 0; i < (size_t)w * h; i++) {
+            uint16_t px = ((rgb[i * 3] & 0xF8) << 8) | ((rgb[i * 3 + 1] & 0xFC) << 3) | (rgb[i * 3 + 2] >> 3);
+            src565[i * 2] = px >> 8;
+            src565[i * 2 + 1] = px & 0xFF;
+        }
+        free(rgb);
+        last_w = w;
+        last_h = h;
+        int scale = grid_scale(w, h);
+
+        bench_frame_t f;
+        f.dir = path.substr(0, path.rfind('/'));
+        bool ok = true;
+        for (int i = 0; i < repeat && ok; i++) {
+            int64_t t0 = mono_ns();
+            int dw, dh;
+            uint8_t *part = host_jpeg_decode(jpg.data(), jpg.size(), scale, &dw, &dh);
+            int64_t t1 = mono_ns();
+            ok = part && motion_grid_rgb888(part, dw, dh, f.grid);
+            int64_t t2 = mono_ns();
+            free(part);
+            uint8_t grid565[MOTION_GRID_SIZE];
+            ok = ok && motion_grid_rgb565(src565.data(), w, h, grid565);
+            int64_t t3 = mono_ns();
+            decode_ns += t1 - t0;
+            grid_ns += t2 - t1;
+            grid565_ns += t3 - t2;
+            runs++;
+        }
+        if (!ok) {
+            fprintf(stderr, "No grid for %s\n", path.c_str());
+            continue;
+        }
+        frames.push_back(f);
+    }
+    if (frames.size() < 2) {
+        fprintf(stderr, "Not enough frames in %s\n", dataset);
+        return 1;
+    }
+
+    // Score every neighbour pair, timing the scoring the capture task does
+    std::vector<uint32_t> same, change;
+    int64_t energy_ns = 0, bounds_ns = 0;
+    volatile uint32_t sink = 0;
+    for (size_t i = 1; i < frames.size(); i++) {
+        const uint8_t *prev = frames[i - 1].grid, *cur = frames[i].grid;
+        int64_t t0 = mono_ns();
+        for (int k = 0; k < SCORE_REPEAT; k++) {
+            sink = sink + motion_energy(prev, cur);
+        }
+        int64_t t1 = mono_ns();
+        int x, y, w, h;
+        for (int k = 0; k < SCORE_REPEAT; k++) {
+            sink = sink + motion_bounds(prev, cur, &x, &y, &w, &h);
+        }
+        int64_t t2 = mono_ns();
+        energy_ns += t1 - t0;
+        bounds_ns += t2 - t1;
+        uint32_t score = motion_energy(prev, cur);
+        (frames[i].dir == frames[i - 1].dir ? same : change).push_back(score);
+    }
+    uint64_t pairs = (uint64_t)(frames.size() - 1) * SCORE_REPEAT;
+    double jpeg_us = (decode_ns + grid_ns) / 1e3 / runs + energy_ns / 1e3 / pairs + bounds_ns / 1e3 / pairs;
+
+    printf("%zu frames of %dx%d to a %dx%d grid, %d runs each\n\n", frames.size(), last_w, last_h, MOTION_GRID_W,
+           MOTION_GRID_H, repeat);
+    printf("JPEG frame:   decode at 1/%d %8.1f us, grid %6.2f us\n", grid_scale(last_w, last_h),
+           decode_ns / 1e3 / runs, grid_ns / 1e3 / runs);
+    printf("RGB565 frame: grid %8.1f us\n", grid565_ns / 1e3 / runs);
+    printf("Per pair:     motion_energy %.3f us, motion_bounds %.3f us\n", energy_ns / 1e3 / pairs,
+           bounds_ns / 1e3 / pairs);
+    printf("JPEG analysis %.1f us, %.3f%% of the %d ms interval\n\n", jpeg_us, 100.0 * jpeg_us / MOTION_INTERVAL_US,
+           MOTION_INTERVAL_US / 1000);
+
+    printf("%-16s %6s %7s %7s %7s %7s %9s %9s\n", "score", "pairs", "min", "p50", "p90", "max", "alert", "burst");
+    report("same directory", &same);
+    report("posture change", &change);
+    printf("\nalert: >= ALERT_MOTION_MIN (%d), burst: >= BURST_MOTION_MIN (%d)\n", ALERT_MOTION_MIN,
+           BURST_MOTION_MIN);
+    return 0;
+}
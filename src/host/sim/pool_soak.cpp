@@ -0,0 +1,317 @@
+// Soak test of the buffer pool (buf_pool.h) under the mix of buffers the
+// camera server takes from it: request bodies, compressed frames, decoded
+// frames, and now and then one larger than every class. The pool is laid
+// out as pool_start() in app_httpd.cpp lays it out, and what it can't
+// serve comes from the heap with buf_alloc()'s slack.
+//
+// Every cycle allocates or frees one buffer, holding at most --live of
+// them. Each buffer is stamped with its id at the start and the end of
+// the requested length and checked on free, and a shadow table of which
+// block each live buffer holds catches two buffers sharing one. At every
+// checkpoint the pool's counters, its largest free block and the heap in
+// use besides the live heap buffers are printed; the run fails if that
+// heap figure grew past the first checkpoint, the largest free block
+// disagrees with the shadow table or any block is still used at the end.
+//
+// Build from src/ with host/build.sh, then
+//   ./pool_soak --cycles 5000000 --live 12 --seed 1
+#include <getopt.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "buf_pool.h"
+
+// As in app_httpd.cpp
+#define POOL_REQUEST_SIZE  (4 * 1024)
+#define POOL_REQUEST_COUNT 6
+#define POOL_JPEG_SIZE     (96 * 1024)
+#define POOL_JPEG_COUNT    6
+#define POOL_FRAME_SIZE    (256 * 1024)
+#define POOL_FRAME_COUNT   3
+
+#define STAMP_LEN 8
+#define HEAP_SLACK (64 * 1024) // allocator bookkeeping allowed to come and go
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t len;
+    uint64_t id;
+    bool pooled;
+} live_t;
+
+static buf_pool_t pool;
+// Owner id + 1 of each block, 0 if free
+static std::vector<uint64_t> owner[BUF_POOL_CLASSES];
+
+static uint64_t rng_state;
+
+static uint32_t rnd(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+static size_t rnd_between(size_t lo, size_t hi)
+{
+    return lo + rnd() % (hi - lo + 1);
+}
+
+// Request, JPEG, frame and oversize buffers, mostly the small ones
+static size_t pick_len(void)
+{
+    uint32_t r = rnd() % 100;
+    if (r < 55) {
+        return rnd_between(64, POOL_REQUEST_SIZE);
+    }
+    if (r < 85) {
+        return rnd_between(POOL_REQUEST_SIZE + 1, POOL_JPEG_SIZE);
+    }
+    if (r < 99) {
+        return rnd_between(POOL_JPEG_SIZE + 1, POOL_FRAME_SIZE);
+    }
+    return rnd_between(POOL_FRAME_SIZE + 1, 2 * POOL_FRAME_SIZE);
+}
+
+static void stamp(const live_t *l, uint8_t *dst)
+{
+    for (int i = 0; i < STAMP_LEN; i++) {
+        dst[i] = (uint8_t)(l->id >> (i * 8)) ^ (uint8_t)(0xA5 + i);
+    }
+}
+
+static bool stamped(const live_t *l, const uint8_t *at)
+{
+    uint8_t want[STAMP_LEN];
+    stamp(l, want);
+    return !memcmp(at, want, STAMP_LEN);
+}
+
+// Class and block of a pooled buffer
+static bool block_of(const uint8_t *buf, int *cls, size_t *block)
+{
+    for (int i = 0; i < pool.class_count; i++) {
+        const buf_pool_class_t *c = &pool.classes[i];
+        if (buf >= c->base && buf < c->base + c->size * c->count) {
+            *cls = i;
+            *block = (buf - c->base) / c->size;
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t shadow_largest_free(void)
+{
+    for (int i = pool.class_count - 1; i >= 0; i--) {
+        for (uint64_t o : owner[i]) {
+            if (!o) {
+                return pool.classes[i].size;
+            }
+        }
+    }
+    return 0;
+}
+
+static size_t heap_in_use(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--cycles N] [--live N] [--checkpoints N] [--seed N]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t cycles = 5000000;
+    int max_live = 12;
+    int checkpoints = 10;
+    uint64_t seed = 1;
+
+    static const struct option options[] = {
+        {"cycles", required_argument, NULL, 'c'},
+        {"live", required_argument, NULL, 'l'},
+        {"checkpoints", required_argument, NULL, 'p'},
+        {"seed", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:l:p:s:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            cycles = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            max_live = atoi(optarg);
+            break;
+        case 'p':
+            checkpoints = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!cycles || max_live < 1 || checkpoints < 1 || !seed) {
+        usage(argv[0]);
+        return 2;
+    }
+    rng_state = seed;
+
+    static const struct
+    {
+        const char *name;
+        size_t size;
+        uint32_t count;
+    } classes[] = {
+        {"request", POOL_REQUEST_SIZE, POOL_REQUEST_COUNT},
+        {"jpeg", POOL_JPEG_SIZE, POOL_JPEG_COUNT},
+        {"frame", POOL_FRAME_SIZE, POOL_FRAME_COUNT},
+    };
+    buf_pool_init(&pool);
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        uint8_t *arena = (uint8_t *)malloc(buf_pool_arena_size(classes[i].size, classes[i].count));
+        if (!arena || !buf_pool_add(&pool, classes[i].name, arena, classes[i].size, classes[i].count)) {
+            fprintf(stderr, "Can't add the %s class\n", classes[i].name);
+            return 1;
+        }
+        owner[i].assign(classes[i].count, 0);
+    }
+
+    // A double free and a foreign pointer are refused and counted
+    uint8_t *probe = (uint8_t *)buf_pool_alloc(&pool, 1, NULL);
+    uint8_t foreign[16];
+    if (!probe || !buf_pool_free(&pool, probe) || buf_pool_free(&pool, probe) || buf_pool_free(&pool, foreign) ||
+        pool.bad_frees != 2) {
+        fprintf(stderr, "Bad frees weren't caught\n");
+        return 1;
+    }
+    pool.bad_frees = 0;
+
+    std::vector<live_t> live;
+    live.reserve(max_live);
+    size_t live_heap = 0;
+    uint64_t next_id = 0, heap_allocs = 0, errors = 0;
+    size_t baseline = 0;
+    uint64_t every = cycles / checkpoints ? cycles / checkpoints : 1;
+
+    printf("%12s %-26s %-26s %12s %10s %12s\n", "cycles", "used/high request,jpeg,frame", "spills/failures",
+           "largest free", "oversize", "heap in use");
+    for (uint64_t n = 1; n <= cycles; n++) {
+        bool alloc = live.empty() || ((int)live.size() < max_live && rnd() % 2);
+        if (alloc) {
+            live_t l;
+            l.len = pick_len();
+            l.id = next_id++;
+            size_t cap = 0;
+            l.buf = (uint8_t *)buf_pool_alloc(&pool, l.len, &cap);
+            l.pooled = l.buf != NULL;
+            if (l.pooled) {
+                int cls;
+                size_t block;
+                if (cap < l.len || !block_of(l.buf, &cls, &block) || owner[cls][block]) {
+                    fprintf(stderr, "cycle %llu: block handed out twice or too small\n", (unsigned long long)n);
+                    return 1;
+                }
+                owner[cls][block] = l.id + 1;
+            } else {
+                cap = l.len + l.len / 4;
+                l.buf = (uint8_t *)malloc(cap);
+                if (!l.buf) {
+                    fprintf(stderr, "Out of host memory\n");
+                    return 1;
+                }
+                live_heap += cap;
+                heap_allocs++;
+            }
+            stamp(&l, l.buf);
+            stamp(&l, l.buf + l.len - STAMP_LEN);
+            live.push_back(l);
+        } else {
+            size_t i = rnd() % live.size();
+            live_t l = live[i];
+            live[i] = live.back();
+            live.pop_back();
+            if (!stamped(&l, l.buf) || !stamped(&l, l.buf + l.len - STAMP_LEN)) {
+                fprintf(stderr, "cycle %llu: buffer %llu was overwritten\n", (unsigned long long)n,
+                        (unsigned long long)l.id);
+                errors++;
+            }
+            if (l.pooled) {
+                int cls;
+                size_t block;
+                block_of(l.buf, &cls, &block);
+                owner[cls][block] = 0;
+                if (!buf_pool_free(&pool, l.buf)) {
+                    fprintf(stderr, "cycle %llu: pool refused buffer %llu\n", (unsigned long long)n,
+                            (unsigned long long)l.id);
+                    errors++;
+                }
+            } else {
+                live_heap -= l.len + l.len / 4;
+                free(l.buf);
+            }
+        }
+
+        if (buf_pool_largest_free(&pool) != shadow_largest_free()) {
+            fprintf(stderr, "cycle %llu: largest free %zu, shadow says %zu\n", (unsigned long long)n,
+                    buf_pool_largest_free(&pool), shadow_largest_free());
+            return 1;
+        }
+        if (n % every && n != cycles) {
+            continue;
+        }
+
+        size_t heap = heap_in_use() - live_heap;
+        if (!baseline) {
+            baseline = heap;
+        }
+        char used[64], spills[64];
+        int u = 0, s = 0;
+        for (int i = 0; i < pool.class_count; i++) {
+            const buf_pool_class_t *c = &pool.classes[i];
+            u += snprintf(used + u, sizeof(used) - u, "%s%u/%u", i ? "," : "", c->used, c->high_water);
+            s += snprintf(spills + s, sizeof(spills) - s, "%s%u/%u", i ? "," : "", c->spilled, c->failed);
+        }
+        printf("%12llu %-26s %-26s %12zu %10u %12zu\n", (unsigned long long)n, used, spills,
+               buf_pool_largest_free(&pool), pool.oversize, heap);
+        if (heap > baseline + HEAP_SLACK) {
+            fprintf(stderr, "Heap in use grew from %zu to %zu bytes\n", baseline, heap);
+            errors++;
+        }
+    }
+
+    for (const live_t &l : live) {
+        if (l.pooled) {
+            buf_pool_free(&pool, l.buf);
+        } else {
+            free(l.buf);
+        }
+    }
+    uint64_t allocs = 0;
+    for (int i = 0; i < pool.class_count; i++) {
+        allocs += pool.classes[i].allocs;
+        if (pool.classes[i].used || pool.classes[i].used_mask) {
+            fprintf(stderr, "%u %s blocks still used after every buffer was freed\n", pool.classes[i].used,
+                    pool.classes[i].name);
+            errors++;
+        }
+    }
+    if (pool.bad_frees) {
+        fprintf(stderr, "%u bad frees\n", pool.bad_frees);
+        errors++;
+    }
+    printf("\n%llu buffers: %llu from the pool, %llu from the heap; %llu errors\n", (unsigned long long)next_id,
+           (unsigned long long)allocs, (unsigned long long)heap_allocs, (unsigned long long)errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,278 @@
+// The /capture model-input modes (img_resize.h) against the plain frame on
+// the dataset: bytes per frame on the wire, time spent on the device and
+// time the gateway spends turning what it got into the 224 x 224 input.
+//
+// The plain frame costs the device nothing and the gateway a full decode
+// and resize. mode=model decodes on the device at the coarsest JPEG scale
+// that still covers the model input, as model_input_from_fb() does,
+// resizes and encodes at MODEL_JPEG_QUALITY; the gateway only decodes.
+// mode=tensor skips the encode and the gateway's decode. The RGB565 row
+// resizes straight from the frame buffer, as the device does with
+// PIXFORMAT_RGB565. The model JPEG's PSNR is against the tensor.
+//
+// The dataset is QVGA. --frame WxH scales each frame up to a larger sensor
+// setting and re-encodes it at --frame-quality first; upscaled frames hold
+// less detail than the sensor would give, so the plain frame's size there
+// is a lower bound.
+//
+// Build from src/ with host/build.sh, then
+//   ./resize_bench --dataset ../dataset --repeat 5 [--center] [--frame 800x600]
+#include <ftw.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "host.h"
+#include "img_converters.h"
+#include "img_resize.h"
+
+#define MODEL_INPUT_W      224 // as in app_httpd.cpp
+#define MODEL_INPUT_H      224
+#define MODEL_JPEG_QUALITY 90
+#define MODEL_INPUT_LEN    (MODEL_INPUT_W * MODEL_INPUT_H * 3)
+
+static std::vector<std::string> files;
+
+static int collect_jpeg(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    size_t len = strlen(path);
+    if (type == FTW_F && len > 4 && !strcasecmp(path + len - 4, ".jpg")) {
+        files.push_back(path);
+    }
+    return 0;
+}
+
+static bool read_file(const std::string &path, std::vector<uint8_t> *out)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        out->insert(out->end(), buf, buf + n);
+    }
+    fclose(fp);
+    return !out->empty();
+}
+
+static int64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// jpg_scale_for() in app_httpd.cpp, as a divisor
+static int decode_scale(int width, int height)
+{
+    int scale = 8;
+    while (scale > 1 && (width / scale < MODEL_INPUT_W || height / scale < MODEL_INPUT_H)) {
+        scale /= 2;
+    }
+    return scale;
+}
+
+static img_rect_t crop_for(int width, int height, bool center)
+{
+    return center ? img_crop_center_square(width, height) : img_crop_full(width, height);
+}
+
+typedef struct
+{
+    const char *name;
+    uint64_t bytes;
+    int64_t device_ns;
+    int64_t gateway_ns;
+    uint32_t frames;
+} run_t;
+
+static void report(const run_t *r, const run_t *base)
+{
+    printf("%-24s %9.0f B %7.1f%% %9.0f us %9.0f us\n", r->name, (double)r->bytes / r->frames,
+           100.0 * r->bytes / base->bytes, r->device_ns / 1e3 / r->frames, r->gateway_ns / 1e3 / r->frames);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--dataset DIR] [--repeat N] [--center] [--frame WxH] [--frame-quality N]\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dataset = "../dataset";
+    int repeat = 5;
+    bool center = false;
+    int frame_w = 0, frame_h = 0;
+    int frame_quality = 80;
+
+    static const struct option options[] = {
+        {"dataset", required_argument, NULL, 'd'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"center", no_argument, NULL, 'c'},
+        {"frame", required_argument, NULL, 'f'},
+        {"frame-quality", required_argument, NULL, 'q'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:r:cf:q:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            dataset = optarg;
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'c':
+            center = true;
+            break;
+        case 'f':
+            if (sscanf(optarg, "%dx%d", &frame_w, &frame_h) != 2) {
+                frame_w = -1;
+            }
+            break;
+        case 'q':
+            frame_quality = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (repeat < 1 || frame_w < 0 || (frame_w && (frame_w < MODEL_INPUT_W || frame_h < MODEL_INPUT_H)) ||
+        frame_quality < 1 || frame_quality > 100 || nftw(dataset, collect_jpeg, 16, FTW_PHYS) != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    std::sort(files.begin(), files.end());
+
+    run_t frame = {"frame JPEG"}, model = {"mode=model"}, tensor = {"mode=tensor"};
+    run_t tensor565 = {"mode=tensor, RGB565"};
+    double sse = 0;
+    std::vector<uint8_t> input(MODEL_INPUT_LEN), reference(MODEL_INPUT_LEN), src565;
+    int last_w = 0, last_h = 0;
+    for (const std::string &path : files) {
+        std::vector<uint8_t> jpg;
+        int w, h;
+        uint8_t *rgb = read_file(path, &jpg) ? host_jpeg_decode(jpg.data(), jpg.size(), 1, &w, &h) : NULL;
+        if (!rgb) {
+            fprintf(stderr, "Skipping %s\n", path.c_str());
+            continue;
+        }
+        if (frame_w) {
+            // B,G,R for the encoder, then R,G,B for the rest
+            uint8_t *big = (uint8_t *)malloc((size_t)frame_w * frame_h * 3);
+            uint8_t *enc = NULL;
+            size_t enc_len = 0;
+            img_resize_rgb888(rgb, w, h, img_crop_full(w, h), big, frame_w, frame_h, true);
+            if (!fmt2jpg(big, (size_t)frame_w * frame_h * 3, frame_w, frame_h, PIXFORMAT_RGB888, frame_quality, &enc,
+                         &enc_len)) {
+                fprintf(stderr, "fmt2jpg failed on %s\n", path.c_str());
+                return 1;
+            }
+            jpg.assign(enc, enc + enc_len);
+            free(enc);
+            img_resize_rgb888(rgb, w, h, img_crop_full(w, h), big, frame_w, frame_h, false);
+            free(rgb);
+            rgb = big;
+            w = frame_w;
+            h = frame_h;
+        }
+        last_w = w;
+        last_h = h;
+        src565.resize((size_t)w * h * 2);
+        for (size_t i = 0; i < (size_t)w * h; i++) {
+            uint16_t px = ((rgb[i * 3] & 0xF8) << 8) | ((rgb[i * 3 + 1] & 0xFC) << 3) | (rgb[i * 3 + 2] >> 3);
+            src565[i * 2] = px >> 8;
+            src565[i * 2 + 1] = px & 0xFF;
+        }
+        free(rgb);
+        int scale = decode_scale(w, h);
+
+        for (int i = 0; i < repeat; i++) {
+            // Plain frame: the gateway decodes the whole frame and resizes
+            int64_t t0 = mono_ns();
+            int dw, dh;
+            uint8_t *full = host_jpeg_decode(jpg.data(), jpg.size(), 1, &dw, &dh);
+            img_resize_rgb888(full, dw, dh, crop_for(dw, dh, center), input.data(), MODEL_INPUT_W, MODEL_INPUT_H,
+                              false);
+            frame.gateway_ns += mono_ns() - t0;
+            free(full);
+            frame.bytes += jpg.size();
+            frame.frames++;
+
+            // Tensor: the device decodes at scale and resizes
+            t0 = mono_ns();
+            uint8_t *part = host_jpeg_decode(jpg.data(), jpg.size(), scale, &dw, &dh);
+            int64_t decode_ns = mono_ns() - t0;
+            t0 = mono_ns();
+            img_resize_rgb888(part, dw, dh, crop_for(dw, dh, center), reference.data(), MODEL_INPUT_W,
+                              MODEL_INPUT_H, false);
+            tensor.device_ns += decode_ns + mono_ns() - t0;
+            tensor.bytes += MODEL_INPUT_LEN;
+            tensor.frames++;
+
+            // Model JPEG: the same, encoded, and the gateway decodes it
+            // the encoder takes B,G,R like the esp32-camera one
+            uint8_t *out = NULL;
+            size_t out_len = 0;
+            t0 = mono_ns();
+            img_resize_rgb888(part, dw, dh, crop_for(dw, dh, center), input.data(), MODEL_INPUT_W, MODEL_INPUT_H,
+                              true);
+            if (!fmt2jpg(input.data(), MODEL_INPUT_LEN, MODEL_INPUT_W, MODEL_INPUT_H, PIXFORMAT_RGB888,
+                         MODEL_JPEG_QUALITY, &out, &out_len)) {
+                fprintf(stderr, "fmt2jpg failed on %s\n", path.c_str());
+                return 1;
+            }
+            model.device_ns += decode_ns + mono_ns() - t0;
+            free(part);
+            t0 = mono_ns();
+            uint8_t *back = host_jpeg_decode(out, out_len, 1, &dw, &dh);
+            model.gateway_ns += mono_ns() - t0;
+            model.bytes += out_len;
+            model.frames++;
+            free(out);
+            if (!back || dw != MODEL_INPUT_W || dh != MODEL_INPUT_H) {
+                fprintf(stderr, "Model JPEG of %s doesn't decode\n", path.c_str());
+                return 1;
+            }
+            if (!i) {
+                for (size_t k = 0; k < MODEL_INPUT_LEN; k++) {
+                    double e = back[k] - reference[k];
+                    sse += e * e;
+                }
+            }
+            free(back);
+
+            // Tensor from an RGB565 frame buffer
+            t0 = mono_ns();
+            img_resize_rgb565(src565.data(), w, h, crop_for(w, h, center), input.data(), MODEL_INPUT_W,
+                              MODEL_INPUT_H, false);
+            tensor565.device_ns += mono_ns() - t0;
+            tensor565.bytes += MODEL_INPUT_LEN;
+            tensor565.frames++;
+        }
+    }
+    if (!frame.frames) {
+        fprintf(stderr, "No frames in %s\n", dataset);
+        return 1;
+    }
+
+    printf("%u frames of %dx%d to %dx%d%s, %d runs each\n\n", frame.frames / repeat, last_w, last_h, MODEL_INPUT_W,
+           MODEL_INPUT_H, center ? ", centre crop" : "", repeat);
+    printf("%-24s %11s %8s %12s %12s\n", "output", "size", "of frame", "device", "gateway");
+    report(&frame, &frame);
+    report(&model, &frame);
+    report(&tensor, &frame);
+    report(&tensor565, &frame);
+    printf("\nmode=model against mode=tensor: %.2f dB PSNR\n",
+           10 * log10(255.0 * 255.0 * MODEL_INPUT_LEN * (frame.frames / repeat) / std::max(sse, 1.0)));
+    return 0;
+}
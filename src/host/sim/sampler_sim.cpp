@@ -0,0 +1,329 @@
+// Replays the dataset through the gateway sampling schedule (sampler.h) and
+// compares it with the old fixed 1 Hz gateway loop.
+//
+// Each class directory is one sequence, each frame held until the next
+// file's timestamp, played one after the other. The classifier is an
+// oracle answering the directory's posture after --inference-ms, so only
+// the schedule differs between the two runs. Motion, the alert engine and
+// the schedule run as on the device, on a simulated clock. Reports frames
+// uploaded (one per inference call) and bytes per hour, and how long
+// posture changes, lying down and the buzzer take to be noticed.
+//
+// Build from src/ with host/build.sh, then
+//   ./sampler_sim --dataset ../dataset --repeat 3
+#include <Arduino.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "host.h"
+#include "alert.h"
+#include "motion.h"
+#include "sampler.h"
+
+#define SIM_STEP_US        10000  // simulated clock resolution
+#define SIM_MOTION_US      200000 // MOTION_INTERVAL_US in app_httpd.cpp
+#define SIM_POLL_MAX_US    1000000 // SCHEDULE_POLL_MAX_MS in resweb.py
+#define SIM_SLACK_US       50000  // CYCLE_SCHEDULE_SLACK_MS in app_httpd.cpp
+
+typedef struct
+{
+    std::string path;
+    posture_t posture;
+    int64_t start; // when the frame appears on the simulated clock
+    size_t bytes;
+    uint8_t grid[MOTION_GRID_SIZE];
+} sim_frame_t;
+
+typedef struct
+{
+    const char *name;
+    uint32_t samples;
+    uint64_t bytes;
+    std::vector<int64_t> change_latency; // posture change to first classification of it
+    std::vector<int64_t> lying_latency;  // lying down to the alert timer starting
+    std::vector<int64_t> buzzer_latency; // lying down to the buzzer, when it fired
+} sim_result_t;
+
+static std::vector<std::string> files;
+
+static int collect_jpeg(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    size_t len = strlen(path);
+    if (type == FTW_F && len > 4 && !strcasecmp(path + len - 4, ".jpg")) {
+        files.push_back(path);
+    }
+    return 0;
+}
+
+// Dataset directories are named in Indonesian
+static posture_t posture_from_dir(const std::string &path)
+{
+    if (path.find("/BERDIRI/") != std::string::npos) {
+        return POSTURE_BDR;
+    }
+    if (path.find("/DUDUK/") != std::string::npos) {
+        return POSTURE_DDK;
+    }
+    if (path.find("/TIDUR/") != std::string::npos) {
+        return POSTURE_TDR;
+    }
+    return POSTURE_NONE;
+}
+
+// File names are capture times, YYYYMMDDhhmmss.jpg
+static int64_t time_from_name(const std::string &path)
+{
+    const char *name = strrchr(path.c_str(), '/');
+    name = name ? name + 1 : path.c_str();
+    struct tm tm = {};
+    if (!strptime(name, "%Y%m%d%H%M%S", &tm)) {
+        return -1;
+    }
+    return (int64_t)timegm(&tm) * 1000000;
+}
+
+static bool load_frame(sim_frame_t *f)
+{
+    FILE *fp = fopen(f->path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    std::vector<uint8_t> jpg;
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        jpg.insert(jpg.end(), buf, buf + n);
+    }
+    fclose(fp);
+    f->bytes = jpg.size();
+
+    // Same grid the firmware builds: the smallest JPEG scale that still
+    // covers it
+    int w, h;
+    uint8_t *rgb = host_jpeg_decode(jpg.data(), jpg.size(), 1, &w, &h);
+    if (!rgb) {
+        return false;
+    }
+    int scale = 8;
+    while (scale > 1 && (w / scale < MOTION_GRID_W || h / scale < MOTION_GRID_H)) {
+        scale /= 2;
+    }
+    free(rgb);
+    rgb = host_jpeg_decode(jpg.data(), jpg.size(), scale, &w, &h);
+    bool ok = rgb && motion_grid_rgb888(rgb, w, h, f->grid);
+    free(rgb);
+    return ok;
+}
+
+// Build the timeline: sequences back to back, gaps inside one capped
+static bool load_timeline(const char *dataset, int64_t max_gap_us, std::vector<sim_frame_t> *timeline)
+{
+    if (nftw(dataset, collect_jpeg, 16, FTW_PHYS) != 0) {
+        return false;
+    }
+    std::sort(files.begin(), files.end());
+    int64_t clock = 0;
+    int64_t prev_time = -1;
+    posture_t prev_posture = POSTURE_NONE;
+    for (size_t i = 0; i < files.size(); i++) {
+        sim_frame_t f;
+        f.path = files[i];
+        f.posture = posture_from_dir(f.path);
+        int64_t t = time_from_name(f.path);
+        if (f.posture == POSTURE_NONE || t < 0 || !load_frame(&f)) {
+            fprintf(stderr, "Skipping %s\n", f.path.c_str());
+            continue;
+        }
+        if (prev_time >= 0) {
+            int64_t gap = f.posture == prev_posture ? t - prev_time : max_gap_us;
+            clock += std::min(std::max(gap, (int64_t)SIM_STEP_US), max_gap_us);
+        }
+        f.start = clock;
+        prev_time = t;
+        prev_posture = f.posture;
+        timeline->push_back(f);
+    }
+    return !timeline->empty();
+}
+
+static void percentiles(const std::vector<int64_t> &v, char *out, size_t len)
+{
+    if (v.empty()) {
+        snprintf(out, len, "%8s %8s", "-", "-");
+        return;
+    }
+    std::vector<int64_t> s = v;
+    std::sort(s.begin(), s.end());
+    int64_t sum = 0;
+    for (size_t i = 0; i < s.size(); i++) {
+        sum += s[i];
+    }
+    snprintf(out, len, "%8.2f %8.2f", sum / 1e6 / s.size(), s.back() / 1e6);
+}
+
+// One pass over the timeline, repeated; adaptive picks the schedule or the
+// fixed loop (frame, inference, sleep 1 s)
+static void simulate(const std::vector<sim_frame_t> &timeline, int repeat, int64_t inference_us, bool adaptive,
+                     sim_result_t *r)
+{
+    alert_state_t alert;
+    sampler_t sampler;
+    alert_init(&alert);
+    sampler_init(&sampler);
+
+    int64_t length = timeline.back().start + 2 * SAMPLE_MAX_US;
+    int64_t end = length * repeat;
+    size_t idx = 0;
+    int64_t next_check = 0;     // gateway asks for a frame
+    int64_t result_at = -1;     // inference result arrives
+    int64_t sampled_frame = 0;  // frame time of the frame being classified
+    posture_t sampled_posture = POSTURE_NONE;
+
+    posture_t truth = POSTURE_NONE;
+    int64_t truth_since = 0;
+    bool change_seen = true;
+    bool lying_seen = true;
+    bool buzzer_seen = true;
+    int64_t last_alert = 0;
+    uint8_t prev_grid[MOTION_GRID_SIZE];
+    bool have_grid = false;
+
+    for (int64_t now = 0; now < end; now += SIM_STEP_US) {
+        int64_t t = now % length;
+        if (t == 0) {
+            idx = 0;
+        }
+        while (idx + 1 < timeline.size() && timeline[idx + 1].start <= t) {
+            idx++;
+        }
+        const sim_frame_t &frame = timeline[idx];
+
+        if (frame.posture != truth) {
+            truth = frame.posture;
+            truth_since = now;
+            change_seen = false;
+            lying_seen = truth != POSTURE_TDR;
+            buzzer_seen = truth != POSTURE_TDR;
+        }
+
+        if (now % SIM_MOTION_US == 0) {
+            uint32_t score = have_grid ? motion_energy(prev_grid, frame.grid) : 0;
+            memcpy(prev_grid, frame.grid, sizeof(prev_grid));
+            have_grid = true;
+            alert_motion(&alert, score, now);
+            sampler_motion(&sampler, score, now);
+        }
+        if (now % ALERT_TICK_US == 0) {
+            alert_tick(&alert, now);
+            if (alert.alert_time != last_alert) {
+                last_alert = alert.alert_time;
+                if (!buzzer_seen) {
+                    r->buzzer_latency.push_back(now - truth_since);
+                    buzzer_seen = true;
+                }
+            }
+        }
+
+        if (result_at >= 0 && now >= result_at) {
+            alert_classify(&alert, sampled_posture, 255, sampled_frame);
+            sampler_classified(&sampler, &alert, sampled_frame);
+            if (!change_seen && sampled_posture == truth && sampled_frame >= truth_since) {
+                r->change_latency.push_back(now - truth_since);
+                change_seen = true;
+            }
+            result_at = -1;
+            next_check = adaptive ? now : now + 1000000;
+        }
+        if (!lying_seen && alert.lying_since) {
+            r->lying_latency.push_back(now - truth_since);
+            lying_seen = true;
+        }
+
+        if (result_at < 0 && now >= next_check) {
+            int64_t due = adaptive ? sampler_deadline(&sampler) - now : 0;
+            if (due > SIM_SLACK_US) {
+                next_check = now + std::min(due, (int64_t)SIM_POLL_MAX_US);
+            } else {
+                r->samples++;
+                r->bytes += frame.bytes;
+                sampled_frame = now;
+                sampled_posture = frame.posture;
+                result_at = now + inference_us;
+            }
+        }
+    }
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--dataset DIR] [--repeat N] [--inference-ms N] [--max-gap-s N]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dataset = "../dataset";
+    int repeat = 1;
+    int64_t inference_us = 300000;
+    int64_t max_gap_us = 30000000;
+
+    static const struct option options[] = {
+        {"dataset", required_argument, NULL, 'd'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"inference-ms", required_argument, NULL, 'i'},
+        {"max-gap-s", required_argument, NULL, 'g'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:r:i:g:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            dataset = optarg;
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'i':
+            inference_us = (int64_t)atoi(optarg) * 1000;
+            break;
+        case 'g':
+            max_gap_us = (int64_t)atoi(optarg) * 1000000;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<sim_frame_t> timeline;
+    if (repeat < 1 || !load_timeline(dataset, max_gap_us, &timeline)) {
+        fprintf(stderr, "No frames in %s\n", dataset);
+        return 1;
+    }
+    double hours = (timeline.back().start + 2.0 * SAMPLE_MAX_US) * repeat / 3.6e9;
+    printf("%zu frames, %.1f simulated minutes, inference %lld ms\n\n", timeline.size(), hours * 60,
+           (long long)(inference_us / 1000));
+
+    sim_result_t results[2] = {{"fixed 1 Hz"}, {"adaptive"}};
+    simulate(timeline, repeat, inference_us, false, &results[0]);
+    simulate(timeline, repeat, inference_us, true, &results[1]);
+
+    printf("%-11s %9s %8s %9s | %17s | %17s | %17s\n", "", "frames/h", "MB/h", "saved/h", "posture change s",
+           "lying detected s", "buzzer s");
+    printf("%-11s %9s %8s %9s | %8s %8s | %8s %8s | %8s %8s\n", "schedule", "", "", "", "mean", "max", "mean", "max",
+           "mean", "max");
+    for (int i = 0; i < 2; i++) {
+        const sim_result_t &r = results[i];
+        char change[32], lying[32], buzzer[32];
+        percentiles(r.change_latency, change, sizeof(change));
+        percentiles(r.lying_latency, lying, sizeof(lying));
+        percentiles(r.buzzer_latency, buzzer, sizeof(buzzer));
+        printf("%-11s %9.0f %8.2f %9.0f | %s | %s | %s\n", r.name, r.samples / hours, r.bytes / hours / 1e6,
+               (results[0].samples - (double)r.samples) / hours, change, lying, buzzer);
+    }
+    printf("\nframes/h is also inference calls/h: the gateway classifies every frame it fetches\n");
+    return 0;
+}
@@ -0,0 +1,286 @@
+import os
+import sys
+import json
+import time
+import base64
+import socket
+import struct
+import argparse
+import threading
+import http.client
+
+# Load generator for the camera web server, on a board or the host build
+# (host/build.sh). Drives /capture, /classify, /timer, /stream and /ws at
+# the same time, each from its own closed-loop clients, and reports
+# throughput and latency per endpoint. A /ws client asks for the state over
+# its one socket (cmd=state) instead of polling /timer, so the two compare. Run the same command before and after a change
+# to compare; --json prints the numbers for scripts.
+#
+#   python3 loadgen.py --host localhost --port 8080 --duration 20
+#
+# --viewers runs only /stream viewers instead, once for each count given,
+# and reports the frame rate each viewer got:
+#
+#   python3 loadgen.py --port 8080 --viewers 1,2,4,6 --duration 10
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latencies = []
+        self.errors = 0
+        self.nbytes = 0
+
+    def add(self, latency, nbytes):
+        with self.lock:
+            self.latencies.append(latency)
+            self.nbytes += nbytes
+
+    def error(self):
+        with self.lock:
+            self.errors += 1
+
+def request_worker(args, stop, stats, method, path, body=None, headers=None):
+    conn = None
+    while not stop.is_set():
+        try:
+            if conn is None:
+                conn = http.client.HTTPConnection(args.host, args.port, timeout=10)
+            start = time.perf_counter()
+            conn.request(method, path, body=body, headers=headers or {})
+            response = conn.getresponse()
+            data = response.read()
+            latency = time.perf_counter() - start
+            if response.status == 200:
+                stats.add(latency, len(data))
+            else:
+                stats.error()
+        except (OSError, http.client.HTTPException):
+            stats.error()
+            if conn is not None:
+                conn.close()
+            conn = None
+            time.sleep(0.1)
+    if conn is not None:
+        conn.close()
+
+def stream_worker(args, stop, stats):
+    # Stream parts carry Content-Length, the gap between parts is recorded
+    # as the latency
+    try:
+        conn = http.client.HTTPConnection(args.host, args.port + 1, timeout=10)
+        conn.request('GET', '/stream' + ('?' + args.stream_query if args.stream_query else ''))
+        response = conn.getresponse()
+        buf = b''
+        last = time.perf_counter()
+        while not stop.is_set():
+            chunk = response.read1(65536)
+            if not chunk:
+                break
+            buf += chunk
+            while True:
+                start = buf.find(b'Content-Length: ')
+                if start < 0:
+                    break
+                end = buf.find(b'\r\n\r\n', start)
+                if end < 0:
+                    break
+                length = int(buf[start + 16:buf.index(b'\r\n', start)])
+                if len(buf) < end + 4 + length:
+                    break
+                now = time.perf_counter()
+                stats.add(now - last, length)
+                last = now
+                buf = buf[end + 4 + length:]
+        conn.close()
+    except (OSError, http.client.HTTPException, ValueError):
+        stats.error()
+
+class WebSocket:
+    # Just enough of a client for the /ws channel: text frames, masked
+    def __init__(self, host, port, path):
+        self.sock = socket.create_connection((host, port), timeout=10)
+        key = base64.b64encode(os.urandom(16)).decode()
+        self.sock.sendall((f"GET {path} HTTP/1.1\r\nHost: {host}\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                           f"Sec-WebSocket-Key: {key}\r\nSec-WebSocket-Version: 13\r\n\r\n").encode())
+        self.buf = b''
+        while b'\r\n\r\n' not in self.buf:
+            self.buf += self._recv()
+        head, self.buf = self.buf.split(b'\r\n\r\n', 1)
+        if not head.startswith(b'HTTP/1.1 101'):
+            raise OSError(head.split(b'\r\n')[0].decode())
+
+    def _recv(self):
+        data = self.sock.recv(65536)
+        if not data:
+            raise OSError("closed")
+        return data
+
+    def _take(self, n):
+        while len(self.buf) < n:
+            self.buf += self._recv()
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def send(self, text):
+        data = text.encode()
+        mask = os.urandom(4)
+        head = bytes([0x81, 0x80 | len(data)]) if len(data) < 126 else bytes([0x81, 0x80 | 126]) + struct.pack('>H', len(data))
+        self.sock.sendall(head + mask + bytes(b ^ mask[i % 4] for i, b in enumerate(data)))
+
+    def recv(self):
+        head = self._take(2)
+        n = head[1] & 0x7f
+        if n == 126:
+            n = struct.unpack('>H', self._take(2))[0]
+        elif n == 127:
+            n = struct.unpack('>Q', self._take(8))[0]
+        return self._take(n)
+
+    def close(self):
+        self.sock.close()
+
+def ws_worker(args, stop, stats):
+    # Round trip of cmd=state to its reply, with pushed events turned off
+    ws = None
+    n = 0
+    while not stop.is_set():
+        try:
+            if ws is None:
+                ws = WebSocket(args.host, args.port, '/ws')
+                ws.send('cmd=subscribe&topics=')
+            n += 1
+            start = time.perf_counter()
+            ws.send(f'cmd=state&id={n}')
+            nbytes = 0
+            while True:
+                event = ws.recv()
+                nbytes += len(event)
+                if event.startswith(b'{"t":"reply"') and f'"id":{n},'.encode() in event:
+                    break
+            stats.add(time.perf_counter() - start, nbytes)
+        except OSError:
+            stats.error()
+            if ws is not None:
+                ws.close()
+            ws = None
+            time.sleep(0.1)
+    if ws is not None:
+        ws.close()
+
+def summary(name, stats, elapsed):
+    lat = stats.latencies
+    return {
+        'endpoint': name,
+        'count': len(lat),
+        'errors': stats.errors,
+        'rate': len(lat) / elapsed,
+        'mbit_s': stats.nbytes * 8 / elapsed / 1e6,
+        'p50_ms': percentile(lat, 0.5) * 1000,
+        'p99_ms': percentile(lat, 0.99) * 1000,
+    }
+
+parser = argparse.ArgumentParser(description="HTTP load generator for the ESP32 camera server")
+parser.add_argument('--host', default='localhost')
+parser.add_argument('--port', type=int, default=80, help="main server port, the stream is on port + 1")
+parser.add_argument('--duration', type=float, default=10.0, help="seconds to run")
+parser.add_argument('--capture', type=int, default=2, help="concurrent /capture clients")
+parser.add_argument('--classify', type=int, default=1, help="concurrent /classify clients")
+parser.add_argument('--timer', type=int, default=1, help="concurrent /timer clients")
+parser.add_argument('--stream', type=int, default=1, help="concurrent /stream viewers")
+parser.add_argument('--ws', type=int, default=0, help="concurrent /ws clients, at most 4")
+parser.add_argument('--viewers', help="comma separated viewer counts for a /stream-only sweep, e.g. 1,2,4")
+parser.add_argument('--stream-query', default='', help="query string for /stream, e.g. adapt=1")
+parser.add_argument('--json', action='store_true', help="print results as JSON")
+args = parser.parse_args()
+
+def viewer_sweep(counts):
+    rows = []
+    for count in counts:
+        stop = threading.Event()
+        stats = [Stats() for _ in range(count)]
+        workers = [threading.Thread(target=stream_worker, args=(args, stop, st), daemon=True) for st in stats]
+        start = time.perf_counter()
+        for t in workers:
+            t.start()
+        time.sleep(args.duration)
+        stop.set()
+        elapsed = time.perf_counter() - start
+        for t in workers:
+            t.join(timeout=12)
+        fps = [len(st.latencies) / elapsed for st in stats]
+        gaps = [lat for st in stats for lat in st.latencies]
+        rows.append({
+            'viewers': count,
+            'errors': sum(st.errors for st in stats),
+            'total_fps': sum(fps),
+            'min_fps': min(fps),
+            'mean_fps': sum(fps) / count,
+            'mbit_s': sum(st.nbytes for st in stats) * 8 / elapsed / 1e6,
+            'p99_gap_ms': percentile(gaps, 0.99) * 1000,
+        })
+        # Let the server notice the closed connections before the next count
+        time.sleep(1)
+    return rows
+
+if args.viewers:
+    rows = viewer_sweep([int(c) for c in args.viewers.split(',')])
+    if args.json:
+        json.dump(rows, sys.stdout, indent=2)
+        print()
+    else:
+        print(f"{'viewers':>7} {'errors':>6} {'total fps':>9} {'min fps':>8} {'mean fps':>8} {'Mbit/s':>7} {'p99 gap ms':>10}")
+        for r in rows:
+            print(f"{r['viewers']:>7} {r['errors']:>6} {r['total_fps']:>9.1f} {r['min_fps']:>8.1f} {r['mean_fps']:>8.1f} "
+                  f"{r['mbit_s']:>7.2f} {r['p99_gap_ms']:>10.1f}")
+    sys.exit(0)
+
+stop = threading.Event()
+endpoints = []
+threads = []
+
+def spawn(name, count, target, *extra):
+    stats = Stats()
+    endpoints.append((name, stats))
+    for _ in range(count):
+        threads.append(threading.Thread(target=target, args=(args, stop, stats) + extra, daemon=True))
+
+if args.capture:
+    spawn('/capture', args.capture, request_worker, 'GET', '/capture')
+if args.classify:
+    spawn('/classify', args.classify, request_worker, 'POST', '/classify', 'status=TDR',
+          {'Content-Type': 'application/x-www-form-urlencoded'})
+if args.timer:
+    spawn('/timer', args.timer, request_worker, 'GET', '/timer')
+if args.stream:
+    spawn('/stream', args.stream, stream_worker)
+if args.ws:
+    spawn('/ws', args.ws, ws_worker)
+
+start = time.perf_counter()
+for t in threads:
+    t.start()
+try:
+    time.sleep(args.duration)
+except KeyboardInterrupt:
+    pass
+stop.set()
+elapsed = time.perf_counter() - start
+for t in threads:
+    t.join(timeout=12)
+
+results = [summary(name, stats, elapsed) for name, stats in endpoints]
+if args.json:
+    json.dump(results, sys.stdout, indent=2)
+    print()
+else:
+    # For /stream the rate is frames per second and the latency the gap between frames
+    print(f"{'endpoint':<10} {'count':>7} {'errors':>6} {'rate/s':>8} {'Mbit/s':>7} {'p50 ms':>8} {'p99 ms':>8}")
+    for r in results:
+        print(f"{r['endpoint']:<10} {r['count']:>7} {r['errors']:>6} {r['rate']:>8.1f} {r['mbit_s']:>7.2f} "
+              f"{r['p50_ms']:>8.1f} {r['p99_ms']:>8.1f}")
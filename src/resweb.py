@@ -1,4 +1,7 @@
 import time
+import queue
+import struct
+import threading
 import requests
 from PIL import Image
 import torch
@@ -25,8 +28,60 @@ transform = transforms.Compose([
     transforms.Normalize(mean=[0.485, 0.456, 0.406], std=[0.229, 0.224, 0.225])
 ])
 
+# Ask the ESP32 for the model input directly: 'model' returns it resized on
+# the device as a 224x224 JPEG, a fraction of the frame's bytes; 'tensor'
+# the same as raw 224x224x3 uint8 RGB, 150528 bytes but nothing to decode,
+# for a wired gateway; '' the full frame resized here
+CAPTURE_MODE = 'model'
+normalize = transforms.Normalize(mean=[0.485, 0.456, 0.406], std=[0.229, 0.224, 0.225])
+
+def tensor_from_response(response):
+    if response.headers.get('Content-Type') == 'application/octet-stream':
+        h, w, c = map(int, response.headers['X-Tensor-Shape'].split(','))
+        pixels = torch.frombuffer(bytearray(response.content), dtype=torch.uint8).view(h, w, c)
+        return normalize(pixels.permute(2, 0, 1).float() / 255)
+    return transform(Image.open(io.BytesIO(response.content)))
+
 # Class labels (adjust accordingly)
 classes = ['BDR', 'DDK', 'TDR']
+
+# Body of a POST /cycle request, see cycle_result_t in protocol.h:
+# class id, confidence (0..255), flags, frame timestamp in microseconds
+CYCLE_RESULT_FORMAT = '<BBHq'
+CYCLE_NO_RESULT = 0xFF
+CLASSIFY_BATCH_MAX = 16
+
+# The ESP32 decides when the next frame is worth classifying: with
+# schedule=1, /cycle answers 204 and X-Next-Sample (milliseconds) until then.
+# Waits are capped so motion the device sees in the meantime is not missed.
+SCHEDULE_POLL_MAX_MS = 1000
+
+def frame_time_us(response):
+    # X-Timestamp is "<sec>.<usec>"
+    sec, _, usec = response.headers.get('X-Timestamp', '0.0').partition('.')
+    return int(sec) * 1000000 + int(usec or 0)
+
+# Frames within UNCHANGED_BITS of the X-Frame-Hash of the frame last
+# classified come back as 304 and take its result instead of a model run,
+# see frame_hash.h. None classifies every frame.
+UNCHANGED_BITS = 6
+reference = {'hash': '', 'result': None}  # the frame last classified
+
+def hash_params():
+    if UNCHANGED_BITS is None:
+        return {}
+    # An empty since only asks for the hash
+    return {'since': reference['hash'] if reference['result'] else '', 'threshold': UNCHANGED_BITS}
+
+def remember(response, packed):
+    class_id, confidence = struct.unpack(CYCLE_RESULT_FORMAT, packed)[:2]
+    reference['hash'] = response.headers.get('X-Frame-Hash', '')
+    reference['result'] = None if class_id == CYCLE_NO_RESULT else (class_id, confidence)
+
+def reuse(response):
+    """The last result, for an unchanged frame answered with 304"""
+    class_id, confidence = reference['result']
+    return struct.pack(CYCLE_RESULT_FORMAT, class_id, confidence, 0, frame_time_us(response))
 '''''
 #timer and led
 timer = 0
@@ -69,50 +124,137 @@ def reset_timer_and_leds():
     print("Resetting LEDs and timer")
     requests.post(f"{esp32_ip}leds", data={'states': '0000'})
 '''
-#coba time loop
-try:
-    print("Starting real-time classification. Press Ctrl+C to stop.")
+def classify(response, received):
+    """Run the model on a captured frame that arrived at time.monotonic()
+    received. Returns a packed cycle_result_t and the X-Gateway-Trace value
+    for it, see trace_gateway_t in protocol.h"""
+    started = time.monotonic()
+    input_tensor = tensor_from_response(response).unsqueeze(0).to(device)  # Move tensor to CPU
+    decoded = time.monotonic()
+    with torch.no_grad():
+        output = model(input_tensor)  # Pass the tensor through the model
+        confidence, predicted = torch.max(torch.softmax(output, 1), 1)  # Get the predicted class
+    trace = ','.join(str(int((t - received) * 1e6)) for t in (started, decoded, time.monotonic()))
+
+    # Ensure the predicted index is valid
+    if not 0 <= predicted.item() < len(classes):
+        print(f"Error: Predicted index {predicted.item()} is out of range!")
+        return struct.pack(CYCLE_RESULT_FORMAT, CYCLE_NO_RESULT, 0, 0, 0), None
+    print(f"Classification result: {classes[predicted.item()]}")
+    # The frame's own timestamp, so the ESP32 can order and age results
+    return struct.pack(
+        CYCLE_RESULT_FORMAT, predicted.item(),
+        int(confidence.item() * 255), 0, frame_time_us(response)
+    ), trace
+
+# Frames in flight. 1 runs the /cycle loop, one round trip per frame. More
+# keeps a capture thread fetching frames while the model runs, and results
+# go back through /classify in batches, each naming its frame by timestamp.
+PIPELINE_DEPTH = 2
+
+def capture_loop(frames, stop):
+    session = requests.Session()
+    params = {'mode': CAPTURE_MODE} if CAPTURE_MODE else {}
+    seq = 0
+    while not stop.is_set():
+        try:
+            # after= never returns a frame that was already fetched
+            response = session.get(f"{esp32_ip}capture", params=dict(params, after=seq, **hash_params()), timeout=10)
+        except requests.RequestException:
+            seq = 0  # the ESP32 may have rebooted and started its count again
+            time.sleep(1)
+            continue
+        if response.status_code not in (200, 304):
+            print("Failed to capture image from ESP32")
+            seq = 0
+            time.sleep(1)
+            continue
+        latest = int(response.headers.get('X-Sequence', seq))
+        if latest < seq:
+            print("ESP32 frame count went back, it rebooted")
+        seq = latest
+        frames.put((response, time.monotonic()))  # blocks while PIPELINE_DEPTH frames wait for the model
+        wait_ms = min(int(response.headers.get('X-Next-Sample', 0)), SCHEDULE_POLL_MAX_MS)
+        if wait_ms:
+            time.sleep(wait_ms / 1000)
+
+def result_loop(results, stop):
+    session = requests.Session()
+    while not stop.is_set():
+        batch = [results.get()]
+        # Whatever else finished meanwhile goes in the same request
+        while len(batch) < CLASSIFY_BATCH_MAX and not results.empty():
+            batch.append(results.get())
+        try:
+            response = session.post(f"{esp32_ip}classify", data=b''.join(batch),
+                                    headers={'Content-Type': 'application/octet-stream'}, timeout=10)
+            print(f"Alert state from ESP32: {response.text}")
+        except requests.RequestException as e:
+            print(f"Failed to send results: {e}")
+
+def run_pipelined():
+    frames = queue.Queue(maxsize=PIPELINE_DEPTH - 1)
+    results = queue.Queue()
+    stop = threading.Event()
+    for target, q in ((capture_loop, frames), (result_loop, results)):
+        threading.Thread(target=target, args=(q, stop), daemon=True).start()
+    try:
+        while True:
+            response, received = frames.get()
+            if response.status_code == 304:
+                results.put(reuse(response))
+                continue
+            # Batched results carry no stage times
+            packed = classify(response, received)[0]
+            remember(response, packed)
+            results.put(packed)
+    finally:
+        stop.set()
+
+def run_cycle():
+    # One keep-alive connection, one /cycle round trip per frame: each request
+    # carries the result for the previous frame and returns the next one
+    session = requests.Session()
+    no_result = struct.pack(CYCLE_RESULT_FORMAT, CYCLE_NO_RESULT, 0, 0, 0)
+    previous = no_result
+    trace = None
+    params = {'schedule': 1}
+    if CAPTURE_MODE:
+        params['mode'] = CAPTURE_MODE
     while True:
-        # Send a request to capture an image
-        response = requests.get(f"{esp32_ip}capture")
+        headers = {'Content-Type': 'application/octet-stream'}
+        if trace:
+            # Our stage times for previous, for the device's latency trace
+            headers['X-Gateway-Trace'] = trace
+        response = session.post(f"{esp32_ip}cycle", data=previous, params=dict(params, **hash_params()),
+                                headers=headers)
+        received = time.monotonic()
+        if response.status_code == 204:
+            # Result delivered, no frame due yet
+            previous, trace = no_result, None
+            wait_ms = min(int(response.headers.get('X-Next-Sample', SCHEDULE_POLL_MAX_MS)), SCHEDULE_POLL_MAX_MS)
+            time.sleep(wait_ms / 1000)
+            continue
+        if response.status_code == 304:
+            # Same scene as the frame last classified
+            previous, trace = reuse(response), None
+            continue
         if response.status_code == 200:
-            # Open the image from response
-            img = Image.open(io.BytesIO(response.content))
-
-            # Process the image with the ResNet101 model
-            input_tensor = transform(img).unsqueeze(0).to(device)  # Move tensor to CPU
-            with torch.no_grad():
-                output = model(input_tensor)  # Pass the tensor through the model
-                _, predicted = torch.max(output, 1)  # Get the predicted class
-
-            # Ensure the predicted index is valid
-            if 0 <= predicted.item() < len(classes):
-                result = classes[predicted.item()]
-                print(f"Classification result: {result}")
-                ''''
-                #results is TIDUR
-                if result == "TIDUR":
-                    timer += 1
-                    updates_led_and_buzzer()
-                else:
-                    #reset timer
-                    reset_timer_and_leds
-                '''''
-                # Optionally, send classification result back to ESP32
-                classification_response = requests.post(
-                    f"{esp32_ip}classify", data={'status': result}
-                )
-                timer_response = requests.get(
-                    f"{esp32_ip}timer"
-                )
-                print(f"Response from ESP32: {classification_response.text}")
-            else:
-                print(f"Error: Predicted index {predicted.item()} is out of range!")
+            # Sent back with the next request
+            previous, trace = classify(response, received)
+            remember(response, previous)
+            print(f"Alert state from ESP32: {response.headers.get('X-Alert')}")
         else:
             print("Failed to capture image from ESP32")
+            time.sleep(1)
 
-        # Wait for 2 second before the next classification
-        time.sleep(1)
+#coba time loop
+try:
+    print("Starting real-time classification. Press Ctrl+C to stop.")
+    if PIPELINE_DEPTH > 1:
+        run_pipelined()
+    else:
+        run_cycle()
 
 except KeyboardInterrupt:
-    print("\nReal-time classification stopped.")
\ No newline at end of file
+    print("\nReal-time classification stopped.")
@@ -0,0 +1,133 @@
+import sys
+import json
+import time
+import argparse
+import http.client
+
+# Offline alert latency report from the camera's /trace endpoint (trace.h in
+# the firmware). The device keeps only its latest frames and alerts, so this
+# polls /trace, merges what it sees, and prints per-stage percentiles for
+# frames (capture to the result applied) and for alerts (capture of the
+# frame the lying period started with to the buzzer). Saved /trace JSON, or
+# a --save file from an earlier run, can be reported on instead:
+#
+#   python3 trace_report.py --host 192.168.1.20 --duration 600 --save run.json
+#   python3 trace_report.py run.json --slo-ms 16500 --detect-slo-ms 1500
+#
+# With an SLO given, the exit status is 1 if any alert or frame missed it.
+# Alert totals include the designed hold (ALERT_TIMER_MAX seconds of lying),
+# so an alert SLO is the hold plus the delay allowed on top of it.
+
+def percentile(values, p):
+    if not values:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+def fetch(host, port):
+    conn = http.client.HTTPConnection(host, port, timeout=10)
+    try:
+        conn.request('GET', '/trace')
+        response = conn.getresponse()
+        data = response.read()
+        if response.status != 200:
+            raise OSError(f"/trace answered {response.status}")
+        return json.loads(data)
+    finally:
+        conn.close()
+
+class Collector:
+    def __init__(self):
+        # Keyed by capture time, and by lying period and firing time, so
+        # repeated polls and files count every record once
+        self.frames = {}
+        self.alerts = {}
+
+    def add(self, trace):
+        for frame in trace.get('frames', []):
+            # Keep the newest copy, results fill in after the first poll
+            self.frames[frame['captured']] = frame
+        for alert in trace.get('alerts', []):
+            self.alerts[(alert['lying_since'], alert['fired'])] = alert
+
+    def dump(self):
+        return {'frames': list(self.frames.values()), 'alerts': list(self.alerts.values())}
+
+def stage_table(records, title):
+    names = []
+    for record in records:
+        for name in record['stages']:
+            if name not in names:
+                names.append(name)
+    rows = {}
+    print(f"{title}: {len(records)}")
+    print(f"  {'stage':<10} {'count':>6} {'p50 ms':>10} {'p95 ms':>10} {'p99 ms':>10} {'max ms':>10}")
+    for name in names:
+        values = [r['stages'][name] / 1000 for r in records if r['stages'].get(name) is not None]
+        rows[name] = {'count': len(values), 'p50_ms': percentile(values, 0.50), 'p95_ms': percentile(values, 0.95),
+                      'p99_ms': percentile(values, 0.99), 'max_ms': max(values) if values else 0}
+        row = rows[name]
+        print(f"  {name:<10} {row['count']:>6} {row['p50_ms']:>10.1f} {row['p95_ms']:>10.1f} "
+              f"{row['p99_ms']:>10.1f} {row['max_ms']:>10.1f}")
+    return rows
+
+def report(collector, args):
+    frames = [f for f in collector.frames.values() if f['stages'].get('detect') is not None]
+    alerts = [a for a in collector.alerts.values() if a['stages'].get('total') is not None]
+    results = {'frames': stage_table(frames, "Classified frames"), 'alerts': stage_table(alerts, "Alerts")}
+
+    for alert in sorted(alerts, key=lambda a: a['lying_since']):
+        stages = alert['stages']
+        frame = alert.get('frame')
+        detect = stages.get('detect')
+        print(f"  alert lying since {alert['lying_since'] / 1e6:.3f} s: total {stages['total'] / 1000:.1f} ms, "
+              f"detect {'-' if detect is None else f'{detect / 1000:.1f} ms'}, "
+              f"frame {frame['id'] if frame else '-'}")
+
+    failed = 0
+    if args.slo_ms is not None:
+        missed = [a for a in alerts if a['stages']['total'] / 1000 > args.slo_ms]
+        print(f"Alert SLO {args.slo_ms} ms: {len(alerts) - len(missed)}/{len(alerts)} met")
+        results['alert_slo_missed'] = len(missed)
+        failed += len(missed)
+    if args.detect_slo_ms is not None:
+        missed = [f for f in frames if f['stages']['detect'] / 1000 > args.detect_slo_ms]
+        print(f"Detect SLO {args.detect_slo_ms} ms: {len(frames) - len(missed)}/{len(frames)} met")
+        results['detect_slo_missed'] = len(missed)
+        failed += len(missed)
+    if args.json:
+        print(json.dumps(results))
+    return failed
+
+parser = argparse.ArgumentParser(description="Alert latency report from the camera's /trace endpoint")
+parser.add_argument('files', nargs='*', help="saved /trace or --save JSON to report on instead of polling")
+parser.add_argument('--host', default='localhost')
+parser.add_argument('--port', type=int, default=80)
+parser.add_argument('--duration', type=float, default=0, help="seconds to keep polling, 0 polls once")
+parser.add_argument('--interval', type=float, default=5.0, help="seconds between polls")
+parser.add_argument('--save', help="write the merged records here for a later report")
+parser.add_argument('--slo-ms', type=float, help="capture to buzzer limit for every alert")
+parser.add_argument('--detect-slo-ms', type=float, help="capture to result applied limit for every frame")
+parser.add_argument('--json', action='store_true', help="also print the stage table as JSON")
+args = parser.parse_args()
+
+collector = Collector()
+if args.files:
+    for name in args.files:
+        with open(name) as f:
+            collector.add(json.load(f))
+else:
+    end = time.monotonic() + args.duration
+    while True:
+        try:
+            collector.add(fetch(args.host, args.port))
+        except (OSError, http.client.HTTPException, ValueError) as e:
+            print(f"Failed to fetch /trace: {e}", file=sys.stderr)
+        if time.monotonic() + args.interval > end:
+            break
+        time.sleep(args.interval)
+
+if args.save:
+    with open(args.save, 'w') as f:
+        json.dump(collector.dump(), f)
+sys.exit(1 if report(collector, args) else 0)
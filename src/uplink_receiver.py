@@ -0,0 +1,94 @@
+import time
+import struct
+import socket
+import argparse
+import threading
+
+# Stand-in gateway for the push-mode uplink (uplink.cpp). Accepts device
+# connections, answers every frame with a fixed classification and prints
+# throughput and latency, so the uplink can be measured without the model.
+#
+# Device and host clocks are not synchronised. Latency is reported as the
+# device side age of a frame when it was sent (send_time - frame_time) plus
+# the network delay above the smallest one seen on the connection, which
+# removes the unknown clock offset.
+
+FRAME_FORMAT = '<IIqqI'        # uplink_frame_t
+REPLY_FORMAT = '<BBHBBHq'      # uplink_reply_t
+FRAME_SIZE = struct.calcsize(FRAME_FORMAT)
+UPLINK_MAGIC = 0x314B4E4C
+UPLINK_MSG_RESULT = 1
+UPLINK_MSG_RATE = 2
+classes = ['BDR', 'DDK', 'TDR']
+
+def read_exact(conn, n):
+    buf = bytearray()
+    while len(buf) < n:
+        chunk = conn.recv(n - len(buf))
+        if not chunk:
+            raise ConnectionError("device closed the connection")
+        buf += chunk
+    return bytes(buf)
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+def serve_device(conn, addr, args):
+    conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    if args.interval:
+        conn.sendall(struct.pack(REPLY_FORMAT, UPLINK_MSG_RATE, 0, args.interval, 0, 0, 0, 0))
+
+    class_id = classes.index(args.label)
+    min_offset = None
+    frames, nbytes, ages, delays = 0, 0, [], []
+    window_start = time.monotonic()
+    try:
+        while True:
+            magic, seq, frame_time, send_time, length = struct.unpack(FRAME_FORMAT, read_exact(conn, FRAME_SIZE))
+            if magic != UPLINK_MAGIC:
+                print(f"{addr[0]}: bad frame magic 0x{magic:08x}, closing")
+                return
+            read_exact(conn, length)
+            recv_time = int(time.monotonic() * 1000000)
+
+            offset = recv_time - send_time
+            min_offset = offset if min_offset is None else min(min_offset, offset)
+            frames += 1
+            nbytes += FRAME_SIZE + length
+            ages.append((send_time - frame_time) / 1000)
+            delays.append((offset - min_offset) / 1000)
+
+            conn.sendall(struct.pack(REPLY_FORMAT, UPLINK_MSG_RESULT, 0, 0, class_id, 255, 0, frame_time))
+
+            elapsed = time.monotonic() - window_start
+            if elapsed >= args.report:
+                print(f"{addr[0]}: seq {seq} {frames / elapsed:.1f} fps {nbytes * 8 / elapsed / 1e6:.2f} Mbit/s "
+                      f"age p50 {percentile(ages, 0.5):.1f} ms, "
+                      f"net p50 {percentile(delays, 0.5):.1f} ms p99 {percentile(delays, 0.99):.1f} ms")
+                frames, nbytes, ages, delays = 0, 0, [], []
+                window_start = time.monotonic()
+    except ConnectionError as e:
+        print(f"{addr[0]}: {e}")
+    finally:
+        conn.close()
+
+parser = argparse.ArgumentParser(description="Stand-in receiver for the ESP32 push-mode uplink")
+parser.add_argument('--port', type=int, default=9000)
+parser.add_argument('--interval', type=int, default=0, help="shortest frame interval in ms to allow, 0 keeps the device default")
+parser.add_argument('--label', choices=classes, default='BDR', help="classification sent back for every frame")
+parser.add_argument('--report', type=float, default=5.0, help="seconds between reports")
+args = parser.parse_args()
+
+server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+server.bind(('', args.port))
+server.listen()
+print(f"Waiting for devices on port {args.port}. Press Ctrl+C to stop.")
+try:
+    while True:
+        conn, addr = server.accept()
+        print(f"{addr[0]}: connected")
+        threading.Thread(target=serve_device, args=(conn, addr, args), daemon=True).start()
+except KeyboardInterrupt:
+    print("\nReceiver stopped.")